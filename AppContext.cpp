@@ -1,7 +1,6 @@
 #include "AppContext.h"
 
-AppContext::AppContext(aJsonObject **moduleCollection, PushNotify *pushNotify) :
-	pushNotify(pushNotify),
-	moduleCollection(moduleCollection)
+AppContext::AppContext(PushNotify *pushNotify) :
+	pushNotify(pushNotify)
 {
 }
\ No newline at end of file
@@ -6,15 +6,14 @@
 #define AppContext_h
 #define APPCONTEXT_MODULE_VERSION 1
 
-#include "aJSON.h"
+#include "Arduino.h"
 
 class AppContext
 {
   public:
     typedef boolean PushNotify(byte moduleId);
     PushNotify *pushNotify;
-    aJsonObject **moduleCollection;
-    AppContext(aJsonObject **moduleCollection, PushNotify *pushNotify);
+    AppContext(PushNotify *pushNotify);
 };
 
 #endif
\ No newline at end of file
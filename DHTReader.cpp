@@ -0,0 +1,299 @@
+#include "Arduino.h"
+#include "DHTReader.h"
+#include "HiveUtils.h"
+
+DHTReader * volatile DHTReader::_active = NULL;
+volatile uint16_t DHTReader::_edges[DHTREADER_EDGES];
+volatile uint8_t DHTReader::_edgeCount = 0;
+volatile uint8_t DHTReader::_level = 0;
+
+DHTReader::DHTReader(uint8_t pin, uint8_t model) :
+  _pin(pin),
+  _model(model),
+  _port(portInputRegister(digitalPinToPort(pin))),
+  _mask(digitalPinToBitMask(pin)),
+  _interruptDriven(false),
+  _pinChange(false),
+  _state(_StateIdle),
+  _status(DHTREADER_NONE),
+  _waitTime(0),
+  _temperature(NAN),
+  _humidity(NAN)
+{}
+
+boolean DHTReader::begin() {
+  // The sensor idles high
+  pinMode(_pin, INPUT_PULLUP);
+
+  int irq = digitalPinToInterrupt(_pin);
+
+  // Prefer an external interrupt, it fires on falling edges only
+  if (irq != NOT_AN_INTERRUPT) {
+    attachInterrupt(irq, &DHTReader::handleInterrupt, FALLING);
+    _interruptDriven = true;
+  } else if (digitalPinToPCICR(_pin)) {
+    // Pin change interrupt is enabled for the frame time only
+    *digitalPinToPCICR(_pin) |= (1 << digitalPinToPCICRbit(_pin));
+    _interruptDriven = true;
+    _pinChange = true;
+  }
+
+  return _interruptDriven;
+}
+
+unsigned long DHTReader::start() {
+  if (!_interruptDriven) {
+    _status = DHTREADER_TIMEOUT;
+    return 0;
+  }
+
+  if (_state != _StateIdle) {
+    return run();
+  }
+
+  return _pullLow();
+}
+
+unsigned long DHTReader::run() {
+  switch (_state) {
+    case _StateStarting:
+    {
+      unsigned long left = timeLeft(_stateTime, (_model == DHTREADER_DHT22) ? 2 : 20);
+
+      if (left > 0) {
+        return left;
+      }
+
+      // Another sensor has started sending its frame during the start pulse.
+      // Holding the line low any longer is out of the sensor spec, so let it go.
+      // The sensor answers into the void then, so give it the sampling period
+      // to get ready before the next start pulse.
+      if (_active) {
+        pinMode(_pin, INPUT_PULLUP);
+        return _wait(getMinimumSamplingPeriod());
+      }
+
+      _release();
+      return _FrameTime;
+    }
+
+    case _StateWaiting:
+      if (timeDiff(_stateTime) < _waitTime) {
+        return timeLeft(_stateTime, _waitTime);
+      }
+
+      return _pullLow();
+
+    case _StateReceiving:
+      if ((_edgeCount < DHTREADER_EDGES) && (timeDiff(_stateTime) < _FrameTime)) {
+        return timeLeft(_stateTime, _FrameTime);
+      }
+
+      _finish();
+      return 0;
+  }
+
+  return 0;
+}
+
+boolean DHTReader::isBusy() {
+  return _state != _StateIdle;
+}
+
+uint8_t DHTReader::getStatus() {
+  return _status;
+}
+
+uint8_t DHTReader::getModel() {
+  return _model;
+}
+
+float DHTReader::getTemperature() {
+  return _temperature;
+}
+
+float DHTReader::getHumidity() {
+  return _humidity;
+}
+
+uint16_t DHTReader::getMinimumSamplingPeriod() {
+  return (_model == DHTREADER_DHT11) ? 1000 : 2000;
+}
+
+int8_t DHTReader::getLowerBoundTemperature() {
+  return (_model == DHTREADER_DHT11) ? 0 : -40;
+}
+
+int8_t DHTReader::getUpperBoundTemperature() {
+  return (_model == DHTREADER_DHT11) ? 50 : 125;
+}
+
+int8_t DHTReader::getLowerBoundHumidity() {
+  return (_model == DHTREADER_DHT11) ? 20 : 0;
+}
+
+int8_t DHTReader::getUpperBoundHumidity() {
+  return (_model == DHTREADER_DHT11) ? 90 : 100;
+}
+
+float DHTReader::toFahrenheit(float celsius) {
+  return celsius * 1.8 + 32;
+}
+
+// Only timestamps a falling edge, the frame is decoded later in run()
+void DHTReader::handleInterrupt() {
+  DHTReader *reader = _active;
+
+  if (!reader) {
+    return;
+  }
+
+  uint8_t level = *reader->_port & reader->_mask;
+
+  // A pin change interrupt comes on both edges of the line and on changes
+  // of the other pins of the port, only a change from high to low is an edge
+  if (reader->_pinChange) {
+    uint8_t last = _level;
+
+    _level = level;
+
+    if (!last) {
+      return;
+    }
+  }
+
+  if (level) {
+    return;
+  }
+
+  uint8_t count = _edgeCount;
+
+  if (count < DHTREADER_EDGES) {
+    _edges[count] = micros();
+    _edgeCount = count + 1;
+  }
+}
+
+unsigned long DHTReader::_pullLow() {
+  // Another sensor is sending its frame, don't start this one meanwhile
+  if (_active) {
+    return _wait(_BusyRetryTime);
+  }
+
+  pinMode(_pin, OUTPUT);
+  digitalWrite(_pin, LOW);
+  _setState(_StateStarting);
+
+  // DHT11 needs at least 18 ms to wake up, DHT22 only 1 ms
+  return (_model == DHTREADER_DHT22) ? 2 : 20;
+}
+
+void DHTReader::_release() {
+  uint8_t sreg = SREG;
+  cli();
+
+  _edgeCount = 0;
+  _active = this;
+
+  // The line goes high when it's released, before the sensor answers
+  _level = _mask;
+
+  if (_pinChange) {
+    *digitalPinToPCMSK(_pin) |= (1 << digitalPinToPCMSKbit(_pin));
+  }
+
+  // The pullup brings the line up, then the sensor answers
+  pinMode(_pin, INPUT_PULLUP);
+
+  SREG = sreg;
+
+  _setState(_StateReceiving);
+}
+
+void DHTReader::_finish() {
+  uint8_t data[5];
+
+  uint8_t sreg = SREG;
+  cli();
+
+  if (_pinChange) {
+    *digitalPinToPCMSK(_pin) &= ~(1 << digitalPinToPCMSKbit(_pin));
+  }
+
+  _active = NULL;
+
+  SREG = sreg;
+
+  _setState(_StateIdle);
+  _status = _decode(data);
+
+  if (_status != DHTREADER_OK) {
+    _temperature = NAN;
+    _humidity = NAN;
+    return;
+  }
+
+  // DHT22 humidity is at most 1000 (tenths of a percent), so its high byte is
+  // never above 3, while DHT11 sends whole percents from 20 up in the first byte
+  if (_model == DHTREADER_AUTO) {
+    _model = (data[0] <= 3) ? DHTREADER_DHT22 : DHTREADER_DHT11;
+  }
+
+  if (_model == DHTREADER_DHT11) {
+    _humidity = data[0];
+    _temperature = data[2];
+  } else {
+    _humidity = ((data[0] << 8) | data[1]) * 0.1;
+    _temperature = (((data[2] & 0x7F) << 8) | data[3]) * 0.1;
+
+    if (data[2] & 0x80) {
+      _temperature = -_temperature;
+    }
+  }
+}
+
+// A bit is a 50 us low followed by a high, 26..28 us long for a zero
+// and 70 us long for a one. So the time between the falling edges
+// which start two bits in a row tells the value of the first one.
+uint8_t DHTReader::_decode(uint8_t *data) {
+  if (_edgeCount < DHTREADER_EDGES) {
+    return DHTREADER_TIMEOUT;
+  }
+
+  for (uint8_t i = 0; i < 5; i++) {
+    data[i] = 0;
+  }
+
+  // The first edge starts the response, the second one starts the first bit
+  for (uint8_t i = 0; i < 40; i++) {
+    uint16_t period = _edges[i + 2] - _edges[i + 1];
+
+    if ((period < _BitMin) || (period > _BitMax)) {
+      return DHTREADER_ERROR_BITS;
+    }
+
+    data[i / 8] <<= 1;
+
+    if (period > _BitThreshold) {
+      data[i / 8] |= 1;
+    }
+  }
+
+  if (((data[0] + data[1] + data[2] + data[3]) & 0xFF) != data[4]) {
+    return DHTREADER_ERROR_CHECKSUM;
+  }
+
+  return DHTREADER_OK;
+}
+
+void DHTReader::_setState(uint8_t state) {
+  _state = state;
+  _stateTime = millis();
+}
+
+unsigned long DHTReader::_wait(uint16_t time) {
+  _waitTime = time;
+  _setState(_StateWaiting);
+
+  return time;
+}
@@ -0,0 +1,98 @@
+/*
+  DHTReader.h - Non-blocking DHT11/DHT22 driver. The start pulse is timed
+  by the caller instead of a delay, and the sensor frame is captured by
+  timestamping falling edges in an interrupt, so reading a sensor doesn't
+  stop the main loop (or other interrupts) for the 5 ms the frame takes.
+*/
+
+#ifndef DHTReader_h
+#define DHTReader_h
+
+#include "Arduino.h"
+
+// Sensor models
+#define DHTREADER_AUTO 0              // Detect from the first frame
+#define DHTREADER_DHT11 11
+#define DHTREADER_DHT22 22
+
+// Read status
+#define DHTREADER_OK 0
+#define DHTREADER_NONE 1              // Nothing has been read yet
+#define DHTREADER_TIMEOUT 2           // Sensor didn't send a whole frame
+#define DHTREADER_ERROR_BITS 3        // Frame timing is off
+#define DHTREADER_ERROR_CHECKSUM 4
+
+// Falling edges in a frame: response start, data start, one per bit, frame end
+#define DHTREADER_EDGES 42
+
+class DHTReader
+{
+  public:
+    DHTReader(uint8_t pin, uint8_t model = DHTREADER_AUTO);
+
+    // Returns false if the pin has no interrupt, the sensor can't be read then
+    boolean begin();
+
+    // Start a reading by pulling the line low. Returns ms to wait before calling run().
+    // The line is held low for the start pulse only, while another reader is
+    // capturing its frame the line is left high and the pulse is sent later.
+    unsigned long start();
+
+    // Advance the reading, returns ms to wait before the next call or 0 when the reading is over
+    unsigned long run();
+
+    boolean isBusy();
+    uint8_t getStatus();
+    uint8_t getModel();
+    float getTemperature();             // Celsius, NAN if the last reading failed
+    float getHumidity();                // Percent, NAN if the last reading failed
+
+    uint16_t getMinimumSamplingPeriod(); // ms
+    int8_t getLowerBoundTemperature();
+    int8_t getUpperBoundTemperature();
+    int8_t getLowerBoundHumidity();
+    int8_t getUpperBoundHumidity();
+
+    static float toFahrenheit(float celsius);
+    static void handleInterrupt();      // Call from pin change ISRs, external interrupts are attached in begin()
+
+  private:
+    static const uint8_t _StateIdle = 0;
+    static const uint8_t _StateStarting = 1;    // Holding the line low
+    static const uint8_t _StateReceiving = 2;   // Capturing the frame
+    static const uint8_t _StateWaiting = 3;     // Line released, waiting for another reader to finish
+
+    static const uint8_t _FrameTime = 10;       // Frame timeout after the line is released (ms)
+    static const uint8_t _BusyRetryTime = 10;   // Another reader is capturing (ms)
+    static const uint8_t _BitMin = 60;          // Bit period limits (us): 50 low + 26..28 high for a zero,
+    static const uint8_t _BitThreshold = 100;   // 50 low + 70 high for a one
+    static const uint8_t _BitMax = 160;
+
+    uint8_t _pin;
+    uint8_t _model;
+    volatile uint8_t *_port;            // Input register and bit mask of the pin
+    uint8_t _mask;
+    boolean _interruptDriven;
+    boolean _pinChange;                 // The pin has a pin change interrupt rather than an external one
+    uint8_t _state;
+    uint8_t _status;
+    unsigned long _stateTime;
+    uint16_t _waitTime;                 // Time to stay in _StateWaiting (ms)
+    float _temperature;
+    float _humidity;
+
+    // Only one sensor is captured at a time, so the edge buffer is shared
+    static DHTReader * volatile _active;
+    static volatile uint16_t _edges[DHTREADER_EDGES];   // Low 16 bits of micros()
+    static volatile uint8_t _edgeCount;
+    static volatile uint8_t _level;     // Line level at the last pin change interrupt, 0 if low
+
+    unsigned long _pullLow();           // Send the start pulse when no other reader is capturing
+    void _release();                    // Let the sensor drive the line and start capturing
+    void _finish();                     // Stop capturing and decode the frame
+    uint8_t _decode(uint8_t *data);     // Decode the captured edges into 5 bytes
+    void _setState(uint8_t state);
+    unsigned long _wait(uint16_t time); // Leave the line high and try again later
+};
+
+#endif
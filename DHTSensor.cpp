@@ -1,19 +1,28 @@
 #include "Arduino.h"
 #include "HiveStorage.h"
+#include "SensorLog.h"
 #include "DHTSensor.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
 #include "MemoryFree.h"
-#include "DHT.h"
+#include "DHTReader.h"
 #include "HiveUtils.h"
 
 const char DHTSensor::_moduleType[12] = "DHTSensor";
 
+const JSONField DHTSensor::_jsonFields[] PROGMEM = {
+  JSON_FIELD("moduleType", JSONTypeString, request_t, moduleType),
+  JSON_FIELD("moduleState", JSONTypeInt, request_t, settings.moduleState),
+  JSON_FIELD("measureUnits", JSONTypeInt, request_t, settings.measureUnits),
+  JSON_FIELD("measureInterval", JSONTypeUInt, request_t, settings.measureInterval)
+};
+
 DHTSensor::DHTSensor(AppContext *context, const byte zone, byte moduleId, int storagePointer, boolean loadSettings, int8_t signalPin) :
   SensorModule(storagePointer, moduleId, zone),
   _signalPin(signalPin),
-  _context(context) {
+  _context(context),
+  _reader(signalPin) {
 
   _intervalCounter = millis();
   _stateChanged = true;
@@ -22,8 +31,11 @@ DHTSensor::DHTSensor(AppContext *context, const byte zone, byte moduleId, int st
   // DEBUG
   debugPrint(F("DHT: Init DHTSensor"));
 
-  _dht.setup(signalPin);
-  delay(_dht.getMinimumSamplingPeriod());
+  // The sensor is read in the background, see loopDo()
+  if (!_reader.begin()) {
+    // DEBUG
+    debugPrint(F("DHT: No interrupt on the signal pin"));
+  }
 
   if (loadSettings) {
     _loadSettings();
@@ -32,19 +44,8 @@ DHTSensor::DHTSensor(AppContext *context, const byte zone, byte moduleId, int st
     _saveSettings();
   }
 
-  if (_moduleState) {
-    _temperature = _dht.getTemperature();
-
-    if (isnan(_temperature) != 0) {
-      _temperature = 65535;
-    }
-
-    _humidity = _dht.getHumidity();
-
-    if (isnan(_humidity) != 0) {
-      _humidity = 65535;
-    }
-  }
+  // Take the first reading as soon as the sensor is ready
+  _intervalCounter = millis() - _measureInterval * 1000UL + _reader.getMinimumSamplingPeriod();
 
   // DEBUG
   debugPrint(F("DHT: Finished DHTSensor init"), true);
@@ -110,7 +111,7 @@ double DHTSensor::getTemperature() {
     return _temperature;
   } else {
     float f = (float) _temperature;
-    double d = (double) _dht.toFahrenheit(f);
+    double d = (double) DHTReader::toFahrenheit(f);
     return d;
   }
 }
@@ -120,71 +121,40 @@ double DHTSensor::getHumidity() {
 }
 
 int8_t DHTSensor::getLowerBoundTemperature() {
-  return _dht.getLowerBoundTemperature();
+  return _reader.getLowerBoundTemperature();
 }
 
 int8_t DHTSensor::getUpperBoundTemperature() {
-  return _dht.getUpperBoundTemperature();
+  return _reader.getUpperBoundTemperature();
 }
 
 int8_t DHTSensor::getLowerBoundHumidity() {
-  return _dht.getLowerBoundHumidity();
+  return _reader.getLowerBoundHumidity();
 }
 
 int8_t DHTSensor::getUpperBoundHumidity() {
-  return _dht.getUpperBoundHumidity();
+  return _reader.getUpperBoundHumidity();
 }
 
-void DHTSensor::getJSONSettings() {
-  // generate json settings only if something's changed
+void DHTSensor::printJSONSettings(JSONWriter *writer) {
   // TODO: mark properties with read-only and read-write types
+  // TODO: Add prefixes to param names to mark readonly fields
+  writer->addString(F("moduleType"), _moduleType);
+  writer->addNumber(F("moduleState"), _moduleState);
+  writer->addNumber(F("zoneId"), _moduleZone);
+  writer->addFloat(F("temperature"), getTemperature());
+  writer->addFloat(F("humidity"), getHumidity());
+  writer->addNumber(F("measureUnits"), _measureUnits);
+  writer->addNumber(F("measureInterval"), _measureInterval);
+  writer->addNumber(F("tUpperBound"), getUpperBoundTemperature());
+  writer->addNumber(F("tLowerBound"), getLowerBoundTemperature());
+  writer->addNumber(F("hUpperBound"), getUpperBoundHumidity());
+  writer->addNumber(F("hLowerBound"), getLowerBoundHumidity());
+}
 
-  if (_stateChanged) {
-
-    aJsonObject *moduleItem = aJson.getArrayItem(*(_context->moduleCollection), moduleId-1);
-    aJsonObject *moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
-
-    // If we have an empty JSON settings structure
-    // then fill it with values
-
-    if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
-
-      // TODO: Add prefixes to param names to mark readonly fields
-      aJson.addStringToObject(moduleItem, "moduleType", _moduleType);
-      aJson.addNumberToObject(moduleItem, "moduleState", _moduleState);
-      aJson.addNumberToObject(moduleItem, "zoneId", _moduleZone);
-      aJson.addNumberToObject(moduleItem, "temperature", _temperature);
-      aJson.addNumberToObject(moduleItem, "humidity", _humidity);
-      aJson.addNumberToObject(moduleItem, "measureUnits", _measureUnits);
-      aJson.addNumberToObject(moduleItem, "measureInterval", _measureInterval);
-      aJson.addNumberToObject(moduleItem, "tUpperBound", getUpperBoundTemperature());
-      aJson.addNumberToObject(moduleItem, "tLowerBound", getLowerBoundTemperature());
-      aJson.addNumberToObject(moduleItem, "hUpperBound", getUpperBoundHumidity());
-      aJson.addNumberToObject(moduleItem, "hLowerBound", getLowerBoundHumidity());
-    } else {
-      // If we have an already initialized settings JSON structure
-      // then just replace the values
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-      moduleItemProperty->valuebool = _moduleState;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "temperature");
-
-      moduleItemProperty->valuefloat = getTemperature();
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "humidity");
-      moduleItemProperty->valuefloat = getHumidity();
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "measureUnits");
-      moduleItemProperty->valueint = _measureUnits;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "measureInterval");
-      moduleItemProperty->valueint = _measureInterval;
-    }
-
-    _stateChanged = false;
-
-  }
+void DHTSensor::printJSONHistory(JSONWriter *writer) {
+  _temperatureHistory.printJSON(writer, F("temperature"));
+  _humidityHistory.printJSON(writer, F("humidity"));
 }
 
 // TODO: if error, return settings object with error item
@@ -197,44 +167,41 @@ boolean DHTSensor::_validateSettings(config_t *settings) {
     return false;
   }
 
-  if ((settings->measureInterval < _dht.getMinimumSamplingPeriod()) || (settings->measureInterval > 255)) {
+  // Sampling period is in ms while the interval is in seconds
+  if (settings->measureInterval * 1000UL < _reader.getMinimumSamplingPeriod()) {
     return false;
   }
 
   return true;
 }
 
-boolean DHTSensor::setJSONSettings(aJsonObject *moduleItem) {
-  config_t settings;
-  aJsonObject *moduleItemProperty;
+boolean DHTSensor::setJSONSettings(JSONReader *reader) {
+  request_t request;
+
   // Initialiaze to invalid values so the validation works
-  int8_t newMeasureUnits = -1;
-  uint8_t newMeasureInterval = 0;
-  int8_t newModuleState = -1;
+  // and a missing field fails the request
+  request.moduleType[0] = 0;
+  request.settings.moduleState = -1;
+  request.settings.measureUnits = -1;
+  request.settings.measureInterval = 0;
 
-  // Check for module type first
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
-  if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
+  if (!reader->readFields(_jsonFields, sizeof(_jsonFields) / sizeof(*_jsonFields), &request)) {
     return false;
   }
 
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-  newModuleState = moduleItemProperty->valuebool;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "measureUnits");
-  newMeasureUnits = moduleItemProperty->valueint;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "measureInterval");
-  newMeasureInterval = moduleItemProperty->valueint;
-
-  settings.measureUnits = newMeasureUnits;
-  settings.measureInterval = newMeasureInterval;
-  settings.moduleState = newModuleState;
+  // Check for module type first
+  if (strcmp(request.moduleType, _moduleType) != 0) {
+    return false;
+  }
 
-  if (!_validateSettings(&settings)) {
+  if (!_validateSettings(&request.settings)) {
     return false;
   }
 
+  int8_t newModuleState = request.settings.moduleState;
+  int8_t newMeasureUnits = request.settings.measureUnits;
+  uint8_t newMeasureInterval = request.settings.measureInterval;
+
   if (_moduleState != newModuleState) {
     newModuleState ? turnModuleOn() : turnModuleOff();
   }
@@ -256,35 +223,74 @@ void DHTSensor::turnModuleOff() {
     _moduleState = false;
     _stateChanged = true;
     _saveSettings();
+
+    // Module state is critical, don't defer writing it
+    flushStorage();
   }
 }
 
 void DHTSensor::turnModuleOn() {
   if (!_moduleState) {
+    // Read the sensor right away
+    _intervalCounter = millis() - _measureInterval * 1000UL;
 
-    _temperature = _dht.getTemperature();
+    _moduleState = true;
+    _stateChanged = true;
+    _saveSettings();
 
-    if (isnan(_temperature) != 0) {
-      _temperature = 65535;
-    }
+    // Module state is critical, don't defer writing it
+    flushStorage();
+  }
+}
 
-    _humidity = _dht.getHumidity();
+void DHTSensor::_readValues() {
+  if (_reader.getStatus() != DHTREADER_OK) {
+    // DEBUG
+    debugPrint(F("DHT: Read failed: "), false);
+    debugPrint(_reader.getStatus());
+    return;
+  }
 
-    if (isnan(_humidity) != 0) {
-      _humidity = 65535;
-    }
+  double newTemperature = _reader.getTemperature();
+  double newHumidity = _reader.getHumidity();
+
+  _temperatureHistory.add(newTemperature);
+  _humidityHistory.add(newHumidity);
+  sensorLog.append(moduleId, SENSORLOG_TEMPERATURE, newTemperature);
+  sensorLog.append(moduleId, SENSORLOG_HUMIDITY, newHumidity);
+
+  if (newTemperature != _temperature || newHumidity != _humidity) {
+    _temperature = newTemperature;
+    _humidity = newHumidity;
+
+    // DEBUG
+    debugPrint(F("DHT: Temperature: "), false);
+    debugPrint(_temperature);
+    debugPrint(F("DHT: Humidity: "), false);
+    debugPrint(_humidity);
 
-    _moduleState = true;
     _stateChanged = true;
-    _saveSettings();
   }
 }
 
-void DHTSensor::loopDo() {
+unsigned long DHTSensor::loopDo() {
+  // Finish a reading in progress, even if the module has been turned off meanwhile
+  if (_reader.isBusy()) {
+    unsigned long left = _reader.run();
+
+    if (left > 0) {
+      return left;
+    }
+
+    if (_moduleState) {
+      _readValues();
+    }
+  }
+
   // If the module is on now
   if (_moduleState) {
     // If it's time to measure
-    if (timeDiff(_intervalCounter) >= (_measureInterval * 1000)) {
+    if (timeDiff(_intervalCounter) >= (_measureInterval * 1000UL)) {
 
       // DEBUG
       debugPrint(F("DHT: Checking..."));
@@ -292,27 +298,19 @@ void DHTSensor::loopDo() {
       // Reset time interval counter
       _intervalCounter = millis();
 
-      // Get new values
-      double newTemperature = _dht.getTemperature();
-      double newHumidity = _dht.getHumidity();
-
-      if (newTemperature != _temperature || newHumidity != _humidity) {
-        if (isnan(newTemperature) == 0) {
-          _temperature = newTemperature;
-        }
-
-        if (isnan(_humidity) == 0) {
-          _humidity = newHumidity;
-        }
-
-        // DEBUG
-        debugPrint(F("DHT: Temperature: "), false);
-        debugPrint(_temperature);
-        debugPrint(F("DHT: Humidity: "), false);
-        debugPrint(_humidity);
+      // Wake the sensor up and come back when it's ready to answer
+      unsigned long left = _reader.start();
 
-        _stateChanged = true;
+      if (left > 0) {
+        return left;
       }
+
+      _readValues();
     }
+
+    // Sleep until the next measurement is due
+    return timeLeft(_intervalCounter, _measureInterval * 1000UL);
   }
+
+  return SENSORMODULE_IDLE_TIME;
 }
@@ -11,11 +11,11 @@
 
 #include "Arduino.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
 
-#define OPTIMIZE_SRAM_SIZE 1
-#include "DHT.h"
+#include "DHTReader.h"
+#include "SampleHistory.h"
     
 class DHTSensor : public SensorModule
 {
@@ -26,9 +26,10 @@ class DHTSensor : public SensorModule
     
     const char* getModuleType();
     byte getStorageSize();
-    void loopDo();
-    void getJSONSettings(); // Fill-in module settings in JSON object through _context property
-    boolean setJSONSettings(aJsonObject *moduleItem); // Update settings from JSON object through _context property
+    unsigned long loopDo();
+    void printJSONSettings(JSONWriter *writer); // Write module settings as JSON object fields
+    boolean setJSONSettings(JSONReader *reader); // Update settings from JSON object fields
+    void printJSONHistory(JSONWriter *writer);  // Write temperature and humidity history
 
     void turnModuleOff();         // Turn module off
     void turnModuleOn();          // Turn module on
@@ -47,6 +48,15 @@ class DHTSensor : public SensorModule
       int8_t moduleState;         // int8 used to store invalid values for validation purposes
       uint8_t measureInterval;    // Measuring interval (seconds, from 1 to 255)
     };
+
+    // PUT request structure, filled by JSONReader
+    typedef struct request_t
+    {
+      char moduleType[16];
+      config_t settings;
+    };
+
+    static const JSONField _jsonFields[];  // PUT request fields table (in PROGMEM)
     
     int8_t _measureUnits;         // Measurment units: 0 - Celcius, 1 - Fahrenheit
     int8_t _signalPin;            // Signal pin number
@@ -61,11 +71,14 @@ class DHTSensor : public SensorModule
                                   // e.g. when the server asks for current settings
     AppContext *_context;         // Pointer to the AppContext object
 
-    DHT _dht;                     // DHT library instance
+    DHTReader _reader;            // Sensor driver, reads the sensor in the background
+    SampleHistory _temperatureHistory;  // Celsius
+    SampleHistory _humidityHistory;
     
     void _saveSettings();         // Puts settings into storage
     void _loadSettings();         // Loads settings from storage
     void _resetSettings();        // Resets settings to default values
+    void _readValues();           // Take the values of a finished reading
     
     boolean _validateSettings(config_t *settings);
 };
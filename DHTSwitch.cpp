@@ -2,13 +2,24 @@
 #include "HiveStorage.h"
 #include "DHTSwitch.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
 #include "MemoryFree.h"
 #include "HiveUtils.h"
 
 const char DHTSwitch::_moduleType[12] = "DHTSwitch";
 
+const JSONField DHTSwitch::_jsonFields[] PROGMEM = {
+  JSON_FIELD("moduleType", JSONTypeString, request_t, moduleType),
+  JSON_FIELD("moduleState", JSONTypeInt, request_t, settings.moduleState),
+  JSON_FIELD("driveMode", JSONTypeInt, request_t, settings.driveMode),
+  JSON_FIELD("tThershold", JSONTypeFloat, request_t, settings.tThershold),
+  JSON_FIELD("hThershold", JSONTypeFloat, request_t, settings.hThershold),
+  JSON_FIELD("maxOnTime", JSONTypeInt, request_t, settings.maxOnTime),
+  JSON_FIELD("restTime", JSONTypeInt, request_t, settings.restTime),
+  JSON_FIELD("switchType", JSONTypeInt, request_t, settings.switchType)
+};
+
 DHTSwitch::DHTSwitch(
   AppContext *context,
   DHTSensor *sensor,
@@ -46,20 +57,20 @@ DHTSwitch::DHTSwitch(
     _saveSettings();
   }
 
-  pinMode(_relayPin, OUTPUT);
+  _relayIO.begin(_relayPin, OUTPUT);
 
   if (!_moduleState) {
-    digitalWrite(_relayPin, SWITCH_RELAY_OFF);
+    _relayIO.write(SWITCH_RELAY_OFF);
   } else {
 
     switch (_driveMode) {
       case 1:
         // If there's a manual "on" override
-        digitalWrite(_relayPin, SWITCH_RELAY_ON);
+        _relayIO.write(SWITCH_RELAY_ON);
         break;
       case 2:
         // If there's a manual "off" override
-        digitalWrite(_relayPin, SWITCH_RELAY_OFF);
+        _relayIO.write(SWITCH_RELAY_OFF);
         break;
     }
 
@@ -139,7 +150,7 @@ byte DHTSwitch::_readDeviceState () {
   // So we take it into account and return simple values
   // 1 if the relay is on, 0 - if it's off
 
-  if (digitalRead(_relayPin) == SWITCH_RELAY_ON) {
+  if (_relayIO.read() == SWITCH_RELAY_ON) {
     return 1;
   } else {
     return 0;
@@ -179,65 +190,20 @@ void DHTSwitch::_pushNotify() {
   _context->pushNotify(moduleId);
 }
 
-void DHTSwitch::getJSONSettings() {
-  // generate json settings only if something's changed
+void DHTSwitch::printJSONSettings(JSONWriter *writer) {
   // TODO: mark properties with read-only and read-write types
-
-  if (_stateChanged) {
-
-    aJsonObject *moduleItem = aJson.getArrayItem(*(_context->moduleCollection), moduleId-1);
-    aJsonObject *moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
-
-    // If we have an empty JSON settings structure
-    // then fill it with values
-
-    if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
-
-      // TODO: Add prefixes to param names to mark readonly fields
-      aJson.addStringToObject(moduleItem, "moduleType", _moduleType);
-      aJson.addNumberToObject(moduleItem, "moduleState", _moduleState);
-      aJson.addNumberToObject(moduleItem, "zoneId", _moduleZone);
-      aJson.addNumberToObject(moduleItem, "deviceState", _readDeviceState());
-      aJson.addNumberToObject(moduleItem, "driveMode", _driveMode);
-      aJson.addNumberToObject(moduleItem, "tThershold", _tThershold);
-      aJson.addNumberToObject(moduleItem, "hThershold", _tThershold);
-      aJson.addNumberToObject(moduleItem, "maxOnTime", _maxOnTime);
-      aJson.addNumberToObject(moduleItem, "restTime", _restTime);
-      aJson.addNumberToObject(moduleItem, "switchType", _switchType);
-      aJson.addNumberToObject(moduleItem, "sensorId", _sensor->moduleId);
-
-    } else {
-      // If we have an already initialized settings JSON structure
-      // then just replace the values
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-      moduleItemProperty->valuebool = _moduleState;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "deviceState");
-      moduleItemProperty->valueint = _readDeviceState();
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "driveMode");
-      moduleItemProperty->valueint = _driveMode;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "tThershold");
-      moduleItemProperty->valuefloat = _tThershold;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "hThershold");
-      moduleItemProperty->valuefloat = _hThershold;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "maxOnTime");
-      moduleItemProperty->valueint = _maxOnTime;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "restTime");
-      moduleItemProperty->valueint = _restTime;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "switchType");
-      moduleItemProperty->valueint = _switchType;
-    }
-
-    _stateChanged = false;
-
-  }
+  // TODO: Add prefixes to param names to mark readonly fields
+  writer->addString(F("moduleType"), _moduleType);
+  writer->addNumber(F("moduleState"), _moduleState);
+  writer->addNumber(F("zoneId"), _moduleZone);
+  writer->addNumber(F("deviceState"), _readDeviceState());
+  writer->addNumber(F("driveMode"), _driveMode);
+  writer->addFloat(F("tThershold"), _tThershold);
+  writer->addFloat(F("hThershold"), _hThershold);
+  writer->addNumber(F("maxOnTime"), _maxOnTime);
+  writer->addNumber(F("restTime"), _restTime);
+  writer->addNumber(F("switchType"), _switchType);
+  writer->addNumber(F("sensorId"), _sensor->moduleId);
 }
 
 // TODO: if error, return settings object with error item
@@ -285,63 +251,41 @@ boolean DHTSwitch::_validateSettings(config_t *settings) {
   return true;
 }
 
-boolean DHTSwitch::setJSONSettings(aJsonObject *moduleItem) {
-  config_t settings;
-  aJsonObject *moduleItemProperty;
+boolean DHTSwitch::setJSONSettings(JSONReader *reader) {
+  request_t request;
+
   // Initialiaze to invalid values so the validation works
-  int8_t newModuleState = -1;
-  int8_t newDriveMode = -1;
-  double newTThershold = -1;
-  double newHThershold = -1;
-  int newMaxOnTime = -1;
-  int newRestTime = -1;
-  int8_t newSwitchType = -1;
+  // and a missing field fails the request
+  request.moduleType[0] = 0;
+  request.settings.moduleState = -1;
+  request.settings.driveMode = -1;
+  request.settings.tThershold = -1;
+  request.settings.hThershold = -1;
+  request.settings.maxOnTime = -1;
+  request.settings.restTime = -1;
+  request.settings.switchType = -1;
+
+  if (!reader->readFields(_jsonFields, sizeof(_jsonFields) / sizeof(*_jsonFields), &request)) {
+    return false;
+  }
 
   // Check for module type first
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
-  if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
+  if (strcmp(request.moduleType, _moduleType) != 0) {
     return false;
   }
 
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-  newModuleState = moduleItemProperty->valuebool;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "driveMode");
-  newDriveMode = moduleItemProperty->valueint;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "tThershold");
-  newTThershold = moduleItemProperty->valuefloat;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "hThershold");
-  newHThershold = moduleItemProperty->valuefloat;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "maxOnTime");
-  newMaxOnTime = moduleItemProperty->valueint;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "restTime");
-  newRestTime = moduleItemProperty->valueint;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "switchType");
-  newSwitchType = moduleItemProperty->valueint;
-
-  settings.driveMode = newDriveMode;
-  settings.moduleState = newModuleState;
-  settings.tThershold = newTThershold;
-  settings.hThershold = newHThershold;
-  settings.maxOnTime = newMaxOnTime;
-  settings.restTime = newRestTime;
-  settings.switchType = newSwitchType;
-
-
-  if (!_validateSettings(&settings)) {
+  if (!_validateSettings(&request.settings)) {
     return false;
   }
 
-  _tThershold = newTThershold;
-  _hThershold = newHThershold;
-  _maxOnTime = newMaxOnTime;
-  _restTime = newRestTime;
-  _switchType = newSwitchType;
+  int8_t newModuleState = request.settings.moduleState;
+  int8_t newDriveMode = request.settings.driveMode;
+
+  _tThershold = request.settings.tThershold;
+  _hThershold = request.settings.hThershold;
+  _maxOnTime = request.settings.maxOnTime;
+  _restTime = request.settings.restTime;
+  _switchType = request.settings.switchType;
 
   if (_moduleState != newModuleState) {
     newModuleState ? turnModuleOn() : turnModuleOff();
@@ -366,10 +310,13 @@ boolean DHTSwitch::setJSONSettings(aJsonObject *moduleItem) {
 
 void DHTSwitch::turnModuleOff() {
   if (_moduleState) {
-    digitalWrite(_relayPin, SWITCH_RELAY_OFF);
+    _relayIO.write(SWITCH_RELAY_OFF);
     _moduleState = false;
     _stateChanged = true;
     _saveSettings();
+
+    // Module state is critical, don't defer writing it
+    flushStorage();
   }
 }
 
@@ -378,12 +325,15 @@ void DHTSwitch::turnModuleOn() {
 
     // Check current operation mode (auto or manual override)
     if (_driveMode > 0) {
-      _driveMode == 1 ? digitalWrite(_relayPin, SWITCH_RELAY_ON) : digitalWrite(_relayPin, SWITCH_RELAY_OFF);
+      _driveMode == 1 ? _relayIO.write(SWITCH_RELAY_ON) : _relayIO.write(SWITCH_RELAY_OFF);
     }
 
     _moduleState = true;
     _stateChanged = true;
     _saveSettings();
+
+    // Module state is critical, don't defer writing it
+    flushStorage();
   }
 }
 
@@ -412,7 +362,7 @@ boolean DHTSwitch::_checkThershold() {
   return false;
 }
 
-void DHTSwitch::loopDo() {
+unsigned long DHTSwitch::loopDo() {
   int8_t deviceState;
 
   // If the module is on now
@@ -429,7 +379,7 @@ void DHTSwitch::loopDo() {
         if (timeDiff(_restStart) > _restTime * 1000) {
           _restMode = 0;
         } else {
-          return;
+          return _PollTime;
         }
 
       } else {
@@ -438,25 +388,28 @@ void DHTSwitch::loopDo() {
         if ((deviceState == 1) && (_maxOnTime > 0) && timeDiff(_workStart) > _maxOnTime * 1000) {
           _restMode = 1;
           _restStart = millis();
-          digitalWrite(_relayPin, SWITCH_RELAY_OFF);
-          return;
+          _relayIO.write(SWITCH_RELAY_OFF);
+          return _PollTime;
         }
       }
 
       if (_checkThershold()) {
         if (deviceState == 0) {
           _workStart = millis();
-          digitalWrite(_relayPin, SWITCH_RELAY_ON);
+          _relayIO.write(SWITCH_RELAY_ON);
         }
       } else {
-        digitalWrite(_relayPin, SWITCH_RELAY_OFF);
+        _relayIO.write(SWITCH_RELAY_OFF);
       }
 
     } else if ((_driveMode == 1) && (deviceState == 0)) {
-      digitalWrite(_relayPin, SWITCH_RELAY_ON);
+      _relayIO.write(SWITCH_RELAY_ON);
     } else if ((_driveMode == 2) && (deviceState == 1)) {
-      digitalWrite(_relayPin, SWITCH_RELAY_OFF);
+      _relayIO.write(SWITCH_RELAY_OFF);
     }
+
+    return _PollTime;
   }
 
+  return SENSORMODULE_IDLE_TIME;
 }
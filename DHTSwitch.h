@@ -14,8 +14,9 @@
 
 #include "Arduino.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
+#include "FastPin.h"
 #include "DHTSensor.h"
 
 class DHTSwitch : public SensorModule
@@ -38,9 +39,9 @@ class DHTSwitch : public SensorModule
 
     const char* getModuleType();
     byte getStorageSize();
-    void loopDo();
-    void getJSONSettings();       // Fill-in module settings in JSON object through _context property
-    boolean setJSONSettings(aJsonObject *moduleItem); // Update settings from JSON object through _context property
+    unsigned long loopDo();
+    void printJSONSettings(JSONWriter *writer); // Write module settings as JSON object fields
+    boolean setJSONSettings(JSONReader *reader); // Update settings from JSON object fields
 
     void turnModuleOff();         // Turn module off
     void turnModuleOn();          // Turn module on
@@ -58,8 +59,18 @@ class DHTSwitch : public SensorModule
       int8_t switchType;
     };
 
+    // PUT request structure, filled by JSONReader
+    typedef struct request_t
+    {
+      char moduleType[16];
+      config_t settings;
+    };
+
+    static const JSONField _jsonFields[];  // PUT request fields table (in PROGMEM)
+
     int8_t _driveMode;            // Device switching mode: 0 - auto, 1 - manual on, 2 - manual off
     int8_t _relayPin;             // Pin number for device control (relay)
+    FastPin _relayIO;             // Direct port access to the relay pin
     double _tThershold;
     double _hThershold;
     int _maxOnTime;
@@ -71,6 +82,7 @@ class DHTSwitch : public SensorModule
     unsigned long _restStart;
 
     static const char _moduleType[12];   // Module type string
+    static const uint16_t _PollTime = 1000;  // Threshold and timers check interval (ms)
 
     boolean _stateChanged;        // Set to TRUE if anything (settings) - to prevent filling settings in again e.g. when the server asks for current settings
     boolean _previousDeviceState; // Save previous light state to switch only if changed
@@ -1,33 +1,83 @@
 #include "DeviceDispatch.h"
 #include "Arduino.h"
+#include "SPI.h"
+
+deviceStats_t deviceStats[DevicesCount];
+
+// CS pins output registers and bit masks, so switching doesn't go through pin tables
+volatile uint8_t *deviceCSPort[DevicesCount];
+uint8_t deviceCSMask[DevicesCount];
+
+uint8_t activeDevice = DevicesCount;   // None selected yet
+unsigned long activeDeviceTime;        // Time the active device got the bus (us)
+unsigned long activeDeviceRemainder;   // Hold time less than a millisecond, carried over (us)
 
 void useDevice(uint8_t deviceId) {
-  uint8_t deviceCount = sizeof(DevicesCSPins) / sizeof(*DevicesCSPins);
-  int8_t onIndex = -1;
-
-  for (int i = 0; i < deviceCount; i++) {
-    // Select the device we need
-    if (i == deviceId) {
-      onIndex = i;
-    } else {
-      // First disable all devices we don't need
-      digitalWrite(DevicesCSPins[i], HIGH);
-    }
+  if ((deviceId == activeDevice) || (deviceId >= DevicesCount)) {
+    return;
   }
 
-  if (onIndex >= 0) {
-    // then enable device we need
-    digitalWrite(DevicesCSPins[onIndex], LOW);
+  unsigned long now = micros();
+
+  if (activeDevice < DevicesCount) {
+    activeDeviceRemainder += now - activeDeviceTime;
+    deviceStats[activeDevice].holdTime += activeDeviceRemainder / 1000;
+    activeDeviceRemainder %= 1000;
+  }
+
+  uint8_t sreg = SREG;
+  cli();
+
+  // First disable all devices we don't need
+  for (uint8_t i = 0; i < DevicesCount; i++) {
+    if (i != deviceId) {
+      *deviceCSPort[i] |= deviceCSMask[i];
+    }
   }
 
+  // then enable device we need
+  *deviceCSPort[deviceId] &= ~deviceCSMask[deviceId];
+
+  SREG = sreg;
+
+  // Each device gets its own clock and mode
+  SPI.setClockDivider(DevicesSPIClock[deviceId]);
+  SPI.setDataMode(DevicesSPIMode[deviceId]);
+
+  activeDevice = deviceId;
+  activeDeviceTime = now;
+  deviceStats[deviceId].selections++;
 }
 
-void initPins() {
-  uint8_t deviceCount = sizeof(DevicesCSPins) / sizeof(*DevicesCSPins);
+// Libraries which set the SPI rate on their own (SdFat does it on every
+// chip select) take the divisor as a number rather than a register setting
+uint8_t getDeviceClockDivisor(uint8_t deviceId) {
+  switch (DevicesSPIClock[deviceId]) {
+    case SPI_CLOCK_DIV2:
+      return 2;
+    case SPI_CLOCK_DIV4:
+      return 4;
+    case SPI_CLOCK_DIV8:
+      return 8;
+    case SPI_CLOCK_DIV16:
+      return 16;
+    case SPI_CLOCK_DIV32:
+      return 32;
+    case SPI_CLOCK_DIV64:
+      return 64;
+    default:
+      return 128;
+  }
+}
 
-  for (int i = 0; i < deviceCount; i++) {
+void initPins() {
+  for (uint8_t i = 0; i < DevicesCount; i++) {
     // Set all CS pins to output mode so the slave selection works
     pinMode(DevicesCSPins[i], OUTPUT);
+    digitalWrite(DevicesCSPins[i], HIGH);
+
+    deviceCSPort[i] = portOutputRegister(digitalPinToPort(DevicesCSPins[i]));
+    deviceCSMask[i] = digitalPinToBitMask(DevicesCSPins[i]);
   }
 
 // If we use a W5200 chip
@@ -4,7 +4,17 @@
 #include "Arduino.h"
 #include "HiveSetup.h"
 
-void useDevice(uint8_t deviceId);
+// SPI bus usage statistics for a device
+typedef struct deviceStats_t
+{
+  unsigned long selections;       // Number of times the device got the bus
+  unsigned long holdTime;         // Total time the device has held the bus (ms)
+};
+
+extern deviceStats_t deviceStats[DevicesCount];
+
+void useDevice(uint8_t deviceId);  // Select an SPI device, does nothing if it's selected already
+uint8_t getDeviceClockDivisor(uint8_t deviceId);  // SPI clock divisor of a device as a number (2, 4, 8...), e.g. for SdFat
 void initPins();
 
-#endif
\ No newline at end of file
+#endif
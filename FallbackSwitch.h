@@ -15,8 +15,10 @@
 
 #include "Arduino.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
+#include "FastPin.h"
+#include "PinChangeListener.h"
 
 class FallbackSwitch : public SensorModule
 {
@@ -27,9 +29,9 @@ class FallbackSwitch : public SensorModule
 
     const char* getModuleType();
     byte getStorageSize();
-    void loopDo();
-    void getJSONSettings(); // Fill-in module settings in JSON object through _context property
-    boolean setJSONSettings(aJsonObject *moduleItem); // Update settings from JSON object through _context property
+    unsigned long loopDo();
+    void printJSONSettings(JSONWriter *writer); // Write module settings as JSON object fields
+    boolean setJSONSettings(JSONReader *reader); // Update settings from JSON object fields
 
     void turnModuleOff();        // Turn module off
     void turnModuleOn();         // Turn module on
@@ -45,21 +47,36 @@ class FallbackSwitch : public SensorModule
       int8_t moduleState;         // int8 used to store invalid values for validation purposes
     };
 
+    // PUT request structure, filled by JSONReader
+    typedef struct request_t
+    {
+      char moduleType[16];
+      config_t settings;
+    };
+
+    static const JSONField _jsonFields[];  // PUT request fields table (in PROGMEM)
+
     int8_t _lightMode;            // Light switching mode: 0 - auto, 1 - manual on, 2 - manual off
     int8_t _switchPin;            // Pin number for the switch
     int8_t _devicePin;            // Pin number for the light control (relay)
     int8_t _fallbackPin;
+    FastPin _switchIO;            // Direct port access to the pins
+    FastPin _deviceIO;
+    FastPin _fallbackIO;
 
     static const char _moduleType[15];   // Module type string
 
     boolean _stateChanged;        // Set to TRUE if anything (settings) - to prevent filling settings in again e.g. when the server asks for current settings
     byte _debounceTime;           // Debounce time (ms)
-    long _debounceCounter;
+    static const uint8_t _PollTime = 5;  // Polling interval for a switch pin without interrupt (ms)
+    unsigned long _debounceCounter; // Time of the last switch edge
+    boolean _debouncePending;     // The last edge hasn't held for the debounce time yet
     boolean _previousSwitchState; // Save previous state for debounce to work
     boolean _switchState;         // Current switch state. 1 = on, 0 = off relay-aware state
     boolean _previousLightState;  // Save previous light state to switch only if changed
     uint8_t _switchCount;
     boolean _usePullup;           // Use internal pullup resistors
+    PinChangeListener _switchListener;  // Switch edges captured in an interrupt
     AppContext *_context;         // Pointer to the AppContext object
 
     void _saveSettings();         // Puts settings into storage
@@ -71,6 +88,7 @@ class FallbackSwitch : public SensorModule
     void _turnLightOn();          // Turn the light on (manual override)
     void _turnLightAuto();        // Turn the light automatically (reset the override)
     void _pushNotify();           // Prepare data and call notification method from the main script
+    void _switchSettled();        // Act on a switch level which held for the debounce time
 
     boolean _validateSettings(config_t *settings);
 };
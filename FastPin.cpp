@@ -0,0 +1,3 @@
+#include "FastPin.h"
+
+volatile uint8_t FastPin::_none = 0;
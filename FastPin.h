@@ -0,0 +1,135 @@
+/*
+  FastPin.h - Direct port access for a digital pin. The pin number is
+  resolved to its port registers and bit mask once, so reads and writes
+  don't go through the pin tables like digitalRead()/digitalWrite() do.
+  StaticFastPin<pin> does the same for a pin known at build time on the
+  Mega, the registers are resolved by the compiler.
+*/
+
+#ifndef FastPin_h
+#define FastPin_h
+
+#include "Arduino.h"
+
+class FastPin
+{
+  public:
+    FastPin() :
+      _in(&_none),
+      _out(&_none),
+      _mask(0)
+    {}
+
+    // Set the pin mode and resolve the registers.
+    // A negative or invalid pin is ignored, reads return LOW then.
+    void begin(int8_t pin, uint8_t mode) {
+      if ((pin < 0) || (digitalPinToPort(pin) == NOT_A_PIN)) {
+        return;
+      }
+
+      pinMode(pin, mode);
+
+      _in = portInputRegister(digitalPinToPort(pin));
+      _out = portOutputRegister(digitalPinToPort(pin));
+      _mask = digitalPinToBitMask(pin);
+    }
+
+    inline uint8_t read() {
+      return (*_in & _mask) ? HIGH : LOW;
+    }
+
+    // Port bits are shared with other pins and interrupts may write them too,
+    // so the read-modify-write is done with interrupts disabled
+    inline void write(uint8_t level) {
+      uint8_t sreg = SREG;
+      cli();
+
+      if (level) {
+        *_out |= _mask;
+      } else {
+        *_out &= ~_mask;
+      }
+
+      SREG = sreg;
+    }
+
+  private:
+    volatile uint8_t *_in;        // Input and output registers of the pin port
+    volatile uint8_t *_out;
+    uint8_t _mask;
+
+    static volatile uint8_t _none;  // Stands in for the registers of a missing pin
+};
+
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+
+// Port and bit of each Mega pin, as in the pin tables of the core.
+// Ports are numbered A to L without I.
+constexpr uint8_t FastPinPorts[] = {
+  4, 4, 4, 4, 6, 4, 7, 7, 7, 7, 1, 1, 1, 1, 8, 8,       // 0-15
+  7, 7, 3, 3, 3, 3, 0, 0, 0, 0, 0, 0, 0, 0, 2, 2,       // 16-31
+  2, 2, 2, 2, 2, 2, 3, 6, 6, 6, 10, 10, 10, 10, 10, 10, // 32-47
+  10, 10, 1, 1, 1, 1, 5, 5, 5, 5, 5, 5, 5, 5, 9, 9,     // 48-63
+  9, 9, 9, 9, 9, 9                                      // 64-69
+};
+
+constexpr uint8_t FastPinBits[] = {
+  0, 1, 4, 5, 5, 3, 3, 4, 5, 6, 4, 5, 6, 7, 1, 0,
+  1, 0, 3, 2, 1, 0, 0, 1, 2, 3, 4, 5, 6, 7, 7, 6,
+  5, 4, 3, 2, 1, 0, 7, 2, 1, 0, 7, 6, 5, 4, 3, 2,
+  1, 0, 3, 2, 1, 0, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1,
+  2, 3, 4, 5, 6, 7
+};
+
+// Data address of the PINx register of each port, DDRx and PORTx follow it
+constexpr uint16_t FastPinPortAddresses[] = {
+  0x20, 0x23, 0x26, 0x29, 0x2C, 0x2F, 0x32, 0x100, 0x103, 0x106, 0x109
+};
+
+template <uint8_t pin>
+class StaticFastPin
+{
+  public:
+    static void begin(uint8_t mode) {
+      pinMode(pin, mode);
+    }
+
+    static inline uint8_t read() {
+      return (*(volatile uint8_t *)_In & _Mask) ? HIGH : LOW;
+    }
+
+    // Ports A to G are in the low I/O space, where a bit is set or cleared
+    // by one SBI/CBI instruction, so an interrupt can't come in between.
+    // Ports H to L need a read-modify-write with interrupts disabled.
+    static inline void write(uint8_t level) {
+      if (_Out < 0x40) {
+        if (level) {
+          *(volatile uint8_t *)_Out |= _Mask;
+        } else {
+          *(volatile uint8_t *)_Out &= ~_Mask;
+        }
+      } else {
+        uint8_t sreg = SREG;
+        cli();
+
+        if (level) {
+          *(volatile uint8_t *)_Out |= _Mask;
+        } else {
+          *(volatile uint8_t *)_Out &= ~_Mask;
+        }
+
+        SREG = sreg;
+      }
+    }
+
+  private:
+    static_assert(pin < sizeof(FastPinBits), "StaticFastPin needs a Mega digital pin");
+
+    static const uint16_t _In = FastPinPortAddresses[FastPinPorts[pin]];
+    static const uint16_t _Out = _In + 2;
+    static const uint8_t _Mask = 1 << FastPinBits[pin];
+};
+
+#endif
+
+#endif
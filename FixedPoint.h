@@ -0,0 +1,108 @@
+/*
+  FixedPoint.h - Q16.16 fixed point number. AVR has no FPU, so each float
+  operation is a library call, while fixed point adds and compares are
+  plain 32-bit integer instructions and a multiply is four 16x16 bit ones.
+  Range is -32768..32767 with 1/65536 resolution, results out of range
+  are saturated.
+*/
+
+#ifndef FixedPoint_h
+#define FixedPoint_h
+
+#include "Arduino.h"
+
+#define FIXED16_RAW_MAX 0x7FFFFFFFL
+#define FIXED16_RAW_MIN (-0x7FFFFFFFL - 1)
+
+class Fixed16
+{
+  public:
+    Fixed16() : _raw(0) {}
+    Fixed16(int value) : _raw(_saturate((int64_t)value << 16)) {}
+    Fixed16(float value) : _raw(_fromFloat(value)) {}
+    Fixed16(double value) : _raw(_fromFloat(value)) {}
+
+    static Fixed16 fromRaw(int32_t raw) {
+      Fixed16 result;
+      result._raw = raw;
+      return result;
+    }
+
+    int32_t raw() const { return _raw; }
+    float toFloat() const { return _raw / 65536.0f; }
+
+    Fixed16 operator-() const { return fromRaw(_raw == FIXED16_RAW_MIN ? FIXED16_RAW_MAX : -_raw); }
+
+    Fixed16 operator+(const Fixed16 &other) const { return fromRaw(_saturate((int64_t)_raw + other._raw)); }
+    Fixed16 operator-(const Fixed16 &other) const { return fromRaw(_saturate((int64_t)_raw - other._raw)); }
+
+    // A 64-bit multiply is a library call on AVR, so the product is
+    // put together from the 16-bit halves instead
+    Fixed16 operator*(const Fixed16 &other) const {
+      int16_t ah = _raw >> 16;
+      uint16_t al = _raw & 0xFFFF;
+      int16_t bh = other._raw >> 16;
+      uint16_t bl = other._raw & 0xFFFF;
+
+      int64_t result = ((int64_t)((int32_t)ah * bh) << 16) +
+                       (int32_t)ah * (int32_t)bl +
+                       (int32_t)al * (int32_t)bh +
+                       (((uint32_t)al * bl) >> 16);
+
+      return fromRaw(_saturate(result));
+    }
+
+    // Slow (64-bit division), meant for tuning math, not the control loop
+    Fixed16 operator/(const Fixed16 &other) const {
+      if (other._raw == 0) {
+        return fromRaw(_raw < 0 ? FIXED16_RAW_MIN : FIXED16_RAW_MAX);
+      }
+
+      return fromRaw(_saturate(((int64_t)_raw << 16) / other._raw));
+    }
+
+    Fixed16 &operator+=(const Fixed16 &other) { return *this = *this + other; }
+    Fixed16 &operator-=(const Fixed16 &other) { return *this = *this - other; }
+    Fixed16 &operator*=(const Fixed16 &other) { return *this = *this * other; }
+    Fixed16 &operator/=(const Fixed16 &other) { return *this = *this / other; }
+
+    bool operator==(const Fixed16 &other) const { return _raw == other._raw; }
+    bool operator!=(const Fixed16 &other) const { return _raw != other._raw; }
+    bool operator<(const Fixed16 &other) const { return _raw < other._raw; }
+    bool operator>(const Fixed16 &other) const { return _raw > other._raw; }
+    bool operator<=(const Fixed16 &other) const { return _raw <= other._raw; }
+    bool operator>=(const Fixed16 &other) const { return _raw >= other._raw; }
+
+  private:
+    int32_t _raw;
+
+    static int32_t _fromFloat(float value) {
+      if (value >= 32768.0f) {
+        return FIXED16_RAW_MAX;
+      }
+
+      if (value <= -32768.0f) {
+        return FIXED16_RAW_MIN;
+      }
+
+      return (int32_t)(value * 65536.0f + (value < 0 ? -0.5f : 0.5f));
+    }
+
+    static int32_t _saturate(int64_t value) {
+      if (value > FIXED16_RAW_MAX) {
+        return FIXED16_RAW_MAX;
+      }
+
+      if (value < FIXED16_RAW_MIN) {
+        return FIXED16_RAW_MIN;
+      }
+
+      return value;
+    }
+};
+
+// Let code templated on the number type convert either type to float
+inline float toFloat(float value) { return value; }
+inline float toFloat(Fixed16 value) { return value.toFloat(); }
+
+#endif
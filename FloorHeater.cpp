@@ -1,8 +1,10 @@
 #include "Arduino.h"
 #include "HiveStorage.h"
+#include "SensorLog.h"
+#include "PIDBank.h"
 #include "FloorHeater.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
 #include "MemoryFree.h"
 #include "avr/io.h"
@@ -12,6 +14,22 @@
 
 const char FloorHeater::_moduleType[15] = "FloorHeater";
 
+const JSONField FloorHeater::_jsonPeriodFields[] PROGMEM = {
+  JSON_FIELD("start", JSONTypeInt, period_t, start),
+  JSON_FIELD("end", JSONTypeInt, period_t, end),
+  JSON_FIELD("t", JSONTypeInt, period_t, t)
+};
+
+const JSONField FloorHeater::_jsonFields[] PROGMEM = {
+  JSON_FIELD("moduleType", JSONTypeString, request_t, moduleType),
+  JSON_FIELD("moduleState", JSONTypeInt, request_t, settings.moduleState),
+  JSON_FIELD("driveMode", JSONTypeInt, request_t, settings.driveMode),
+  JSON_FIELD("setpoint", JSONTypeFloat, request_t, settings.setpoint),
+  JSON_FIELD("doTuning", JSONTypeInt, request_t, doTuning),
+  JSON_FIELD("resetTuning", JSONTypeInt, request_t, resetTuning),
+  JSON_OBJECTS("schedule", request_t, settings.schedule, sizeof(period_t), 7 * 3, _jsonPeriodFields)
+};
+
 FloorHeater::FloorHeater(AppContext *context, OWTSensor *sensor, const byte zone, byte moduleId, int storagePointer, uint8_t devicePin, uint8_t timer, boolean loadSettings, float tMin, float tMax) :
   SensorModule(storagePointer, moduleId, zone),
   _tMin(tMin),
@@ -25,9 +43,13 @@ FloorHeater::FloorHeater(AppContext *context, OWTSensor *sensor, const byte zone
 
   // Throw in some defaults: kP = 400, kI = 0.001, output limits 0..10000 ms, time step = 1000 ms
   _controller = new PID(400.0, 0.001, 0, &_input, &_output, 0, 10000, &_setpoint, 1000, true);
+
+  // The control loop itself is run by the PID bank, the controller is kept for tuning
+  _lane = pidBank.addLane(&_input, &_output, &_setpoint, 0, 10000);
   _resetSettings();
 
   _windowStartTime = millis();
+  _lastControlTime = millis();
 
   for(uint8_t i = 0; i < 7; i++) {
     for (uint8_t j = 0; j < 3; j++) {
@@ -50,8 +72,8 @@ FloorHeater::FloorHeater(AppContext *context, OWTSensor *sensor, const byte zone
   // DEBUG
   debugPrint(F("FH: Settings loaded/saved"));
 
-  pinMode(_devicePin, OUTPUT);
-  digitalWrite(_devicePin, FLOORHEATER_RELAY_OFF);
+  _deviceIO.begin(_devicePin, OUTPUT);
+  _deviceIO.write(FLOORHEATER_RELAY_OFF);
 
   // DEBUG
   debugPrint(F("FH: Init ISR timer"));
@@ -145,8 +167,10 @@ void FloorHeater::_resetSettings() {
 
 void FloorHeater::_resetTuning() {
   _controller->setKs(400.0, 0.001, 0);
+  _updateLane();
   _stableTime = 500000;
   _lastTuning = 0;
+  _tuningTimedOut = false;
 }
 
 byte FloorHeater::getStorageSize() {
@@ -169,9 +193,11 @@ void FloorHeater::_loadSettings() {
     _driveMode = settings.driveMode;
     _setpoint = settings.setpoint;
     _controller->setKs(settings.kP, settings.kI, 0);
+    _updateLane();
     _stableTime = settings.stableTime;
     _moduleState = settings.moduleState;
     _lastTuning = settings.lastTuning;
+    _tuningTimedOut = settings.tuningTimedOut;
 
     for(uint8_t i = 0; i < 7; i++) {
       for (uint8_t j = 0; j < 3; j++) {
@@ -203,6 +229,7 @@ void FloorHeater::_saveSettings() {
   settings.kI = _controller->getKi();
   settings.stableTime = _stableTime;
   settings.lastTuning = _lastTuning;
+  settings.tuningTimedOut = _tuningTimedOut;
 
   for(uint8_t i = 0; i < 7; i++) {
     for (uint8_t j = 0; j < 3; j++) {
@@ -219,7 +246,7 @@ void FloorHeater::_saveSettings() {
 void FloorHeater::_turnDeviceOff() {
   _driveMode = 2;
   _deviceState = 0;
-  digitalWrite(_devicePin, FLOORHEATER_RELAY_OFF);
+  _deviceIO.write(FLOORHEATER_RELAY_OFF);
   _stateChanged = true;
   _saveSettings();
 }
@@ -240,9 +267,22 @@ void FloorHeater::_turnDeviceBySchedule() {
   _saveSettings();
 }
 
-void FloorHeater::_turnDeviceTuning() {
+// Copy the controller gains to the bank lane
+void FloorHeater::_updateLane() {
+  pidBank.setStepKs(_lane, _controller->getKp(), _controller->getKi(), _controller->getKd());
+}
+
+// SIMC takes four steady states, relay feedback a few oscillations around the setpoint
+void FloorHeater::_turnDeviceTuning(uint8_t method) {
   _deviceState = 2;
-  _controller->initPITuning(60, 0.4);
+  pidBank.setActive(_lane, false);
+
+  if (method == PID_TUNING_RELAY) {
+    _controller->initRelayTuning(_RelayTuningCycles, 0.2);
+  } else {
+    _controller->initPITuning(60, 0.4);
+  }
+
   _stateChanged = true;
 
   //DEBUG
@@ -253,99 +293,44 @@ void FloorHeater::_pushNotify() {
   _context->pushNotify(moduleId);
 }
 
-void FloorHeater::getJSONSettings() {
-  // generate json settings only if something's changed
+void FloorHeater::printJSONSettings(JSONWriter *writer) {
   // TODO: mark properties with read-only and read-write types
 
-  if (_stateChanged) {
-
-    aJsonObject *moduleItem = aJson.getArrayItem(*(_context->moduleCollection), moduleId-1);
-    aJsonObject *moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
-
-    // Buffer for UL to char conversion
-    char buffer[10];
-
-    // If we have an empty JSON settings structure
-    // then fill it with values
-
-    if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
-
-      // TODO: Add prefixes to param names to mark readonly fields
-      aJson.addStringToObject(moduleItem, "moduleType", _moduleType);
-      aJson.addNumberToObject(moduleItem, "moduleState", _moduleState);
-      aJson.addNumberToObject(moduleItem, "zoneId", _moduleZone);
-      aJson.addNumberToObject(moduleItem, "driveMode", _driveMode);
-      aJson.addNumberToObject(moduleItem, "deviceState", _deviceState);
-      aJson.addNumberToObject(moduleItem, "setpoint", _setpoint);
-      aJson.addNumberToObject(moduleItem, "t", _input);
-      aJson.addNumberToObject(moduleItem, "tMin", _tMin);
-      aJson.addNumberToObject(moduleItem, "tMax", _tMax);
-
-      itoa(_lastTuning, buffer, 10);
-      aJson.addStringToObject(moduleItem, "lastTuning", buffer);
-
-      moduleItemProperty = aJson.createArray();
-      aJsonObject *day, *period;
-
-      for(uint8_t i = 0; i < 7; i++) {
-        aJson.addItemToArray(moduleItemProperty, day = aJson.createArray());
-
-        for (uint8_t j = 0; j < 3; j++) {
-          aJson.addItemToArray(day, period = aJson.createObject());
-          aJson.addNumberToObject(period, "start", _schedule[i][j][0]);
-          aJson.addNumberToObject(period, "end", _schedule[i][j][1]);
-          aJson.addNumberToObject(period, "t", _schedule[i][j][2]);
-        }
-      }
-
-      aJson.addItemToObject(moduleItem, "schedule", moduleItemProperty);
-
-    } else {
-      // If we have an already initialized settings JSON structure
-      // then just replace the values
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-      moduleItemProperty->valuebool = _moduleState;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "driveMode");
-      moduleItemProperty->valueint = _driveMode;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "deviceState");
-      moduleItemProperty->valueint = _deviceState;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "setpoint");
-      moduleItemProperty->valuefloat = _setpoint;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "lastTuning");
+  // Buffer for UL to char conversion
+  char buffer[11];
 
-      itoa(_lastTuning, buffer, 10);
-      moduleItemProperty->valuestring = buffer;
+  // TODO: Add prefixes to param names to mark readonly fields
+  writer->addString(F("moduleType"), _moduleType);
+  writer->addNumber(F("moduleState"), _moduleState);
+  writer->addNumber(F("zoneId"), _moduleZone);
+  writer->addNumber(F("driveMode"), _driveMode);
+  writer->addNumber(F("deviceState"), _deviceState);
+  writer->addFloat(F("setpoint"), _setpoint);
+  writer->addFloat(F("t"), _input);
+  writer->addFloat(F("tMin"), _tMin);
+  writer->addFloat(F("tMax"), _tMax);
 
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "t");
-      moduleItemProperty->valuefloat = _input;
+  ultoa(_lastTuning, buffer, 10);
+  writer->addString(F("lastTuning"), buffer);
+  writer->addNumber(F("tuningTimedOut"), _tuningTimedOut);
 
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "schedule");
+  writer->beginArray(F("schedule"));
 
-      aJsonObject *day, *period, *item;
-
-      for(uint8_t i = 0; i < 7; i++) {
-        day = moduleItemProperty->next;
+  for(uint8_t i = 0; i < 7; i++) {
+    writer->beginArray();
 
-        for (uint8_t j = 0; j < 3; j++) {
-          period = day->next;
-          item = aJson.getObjectItem(period, "start");
-          _schedule[i][j][0] = item->valueint;
-          item = aJson.getObjectItem(period, "end");
-          _schedule[i][j][1] = item->valueint;
-          item = aJson.getObjectItem(period, "t");
-          _schedule[i][j][2] = item->valueint;
-        }
-      }
+    for (uint8_t j = 0; j < 3; j++) {
+      writer->beginObject();
+      writer->addNumber(F("start"), _schedule[i][j][0]);
+      writer->addNumber(F("end"), _schedule[i][j][1]);
+      writer->addNumber(F("t"), _schedule[i][j][2]);
+      writer->endObject();
     }
 
-    _stateChanged = false;
-
+    writer->endArray();
   }
+
+  writer->endArray();
 }
 
 boolean FloorHeater::_validateSettings(config_t *settings) {
@@ -372,6 +357,10 @@ boolean FloorHeater::_validateSettings(config_t *settings) {
     return false;
   }
 
+  if ((settings->tuningTimedOut < 0) || (settings->tuningTimedOut > 1)) {
+    return false;
+  }
+
   for(uint8_t i = 0; i < 7; i++) {
     for (uint8_t j = 0; j < 3; j++) {
         settings->schedule[i][j][0];
@@ -388,7 +377,7 @@ boolean FloorHeater::_validateSettings(config_t *settings) {
 
         // The heating time can't be less than an hour
         // The end time should be greater than the start
-        if (startH <= endH) {
+        if (startH >= endH) {
           return false;
         }
 
@@ -406,7 +395,7 @@ boolean FloorHeater::_validateSettings(config_t *settings) {
           return false;
         }
 
-        if ((settings->schedule[i][j][1] < _tMin) || (settings->schedule[i][j][1] > _tMax)) {
+        if ((settings->schedule[i][j][2] < _tMin) || (settings->schedule[i][j][2] > _tMax)) {
           return false;
         }
     }
@@ -415,61 +404,46 @@ boolean FloorHeater::_validateSettings(config_t *settings) {
   return true;
 }
 
-boolean FloorHeater::setJSONSettings(aJsonObject *moduleItem) {
-  config_t settings;
-  aJsonObject *moduleItemProperty;
+boolean FloorHeater::setJSONSettings(JSONReader *reader) {
+  request_t request;
+
   // Initialiaze to invalid values so the validation works
-  int8_t newModuleState = -1;
-  int8_t newDriveMode = -1;
-  int8_t newSetpoint = -1;
-  int8_t doTuning = -1;
-  int8_t resetTuning = -1;
+  // and a missing field fails the request.
+  // Tuning values and the schedule are kept if not set.
+  request.moduleType[0] = 0;
+  request.settings.moduleState = -1;
+  request.settings.driveMode = -1;
+  request.settings.setpoint = -1;
+  request.settings.kP = _controller->getKp();
+  request.settings.kI = _controller->getKi();
+  request.settings.stableTime = _stableTime;
+  request.settings.lastTuning = _lastTuning;
+  request.settings.tuningTimedOut = _tuningTimedOut;
+  memcpy(request.settings.schedule, _schedule, sizeof(_schedule));
+  request.doTuning = 0;
+  request.resetTuning = 0;
+
+  if (!reader->readFields(_jsonFields, sizeof(_jsonFields) / sizeof(*_jsonFields), &request)) {
+    return false;
+  }
 
   // Check for module type first
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
-  if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
+  if (strcmp(request.moduleType, _moduleType) != 0) {
     return false;
   }
 
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-  newModuleState = moduleItemProperty->valuebool;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "driveMode");
-  newDriveMode = moduleItemProperty->valueint;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "setpoint");
-  newSetpoint = moduleItemProperty->valuefloat;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "doTuning");
-  doTuning = moduleItemProperty->valuebool;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "resetTuning");
-  resetTuning = moduleItemProperty->valuebool;
-
-  settings.driveMode = newDriveMode;
-  settings.moduleState = newModuleState;
-  settings.setpoint = newSetpoint;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "schedule");
-
-  aJsonObject *day, *period, *item;
-
-  for(uint8_t i = 0; i < 7; i++) {
-    day = moduleItemProperty->next;
-
-    for (uint8_t j = 0; j < 3; j++) {
-      period = day->next;
-      item = aJson.getObjectItem(period, "start");
-      settings.schedule[i][j][0] = item->valueint;
-      item = aJson.getObjectItem(period, "end");
-      settings.schedule[i][j][1] = item->valueint;
-      item = aJson.getObjectItem(period, "t");
-      settings.schedule[i][j][2] = item->valueint;
-    }
+  if (!_validateSettings(&request.settings)) {
+    return false;
   }
 
-  if (!_validateSettings(&settings)) {
-    return false;
+  int8_t newModuleState = request.settings.moduleState;
+  int8_t newDriveMode = request.settings.driveMode;
+
+  if ((_setpoint != request.settings.setpoint) || (memcmp(_schedule, request.settings.schedule, sizeof(_schedule)) != 0)) {
+    _setpoint = request.settings.setpoint;
+    memcpy(_schedule, request.settings.schedule, sizeof(_schedule));
+    _stateChanged = true;
+    _saveSettings();
   }
 
   if (_moduleState != newModuleState) {
@@ -490,13 +464,14 @@ boolean FloorHeater::setJSONSettings(aJsonObject *moduleItem) {
     }
   }
 
-  if (resetTuning) {
+  if (request.resetTuning) {
     _resetTuning();
     _stateChanged = true;
+    _saveSettings();
   }
 
-  if (doTuning == 1) {
-    _turnDeviceTuning();
+  if (request.doTuning == PID_TUNING_SIMC || request.doTuning == PID_TUNING_RELAY) {
+    _turnDeviceTuning(request.doTuning);
   }
 
   return true;
@@ -504,10 +479,14 @@ boolean FloorHeater::setJSONSettings(aJsonObject *moduleItem) {
 
 void FloorHeater::turnModuleOff() {
   if (_moduleState) {
-    digitalWrite(_devicePin, FLOORHEATER_RELAY_OFF);
+    _deviceIO.write(FLOORHEATER_RELAY_OFF);
+    pidBank.setActive(_lane, false);
     _moduleState = false;
     _stateChanged = true;
     _saveSettings();
+
+    // Module state is critical, don't defer writing it
+    flushStorage();
   }
 }
 
@@ -516,6 +495,9 @@ void FloorHeater::turnModuleOn() {
     _moduleState = true;
     _stateChanged = true;
     _saveSettings();
+
+    // Module state is critical, don't defer writing it
+    flushStorage();
   }
 }
 
@@ -529,9 +511,9 @@ void FloorHeater::handleInterrupt() {
     }
 
     if ((timeDiff(_windowStartTime) < _outputTime) && (_outputTime > 150)) {
-      digitalWrite(_devicePin, FLOORHEATER_RELAY_ON);
+      _deviceIO.write(FLOORHEATER_RELAY_ON);
     } else {
-      digitalWrite(_devicePin, FLOORHEATER_RELAY_ON);
+      _deviceIO.write(FLOORHEATER_RELAY_ON);
     }
   }
 }
@@ -565,9 +547,10 @@ boolean FloorHeater::_checkSchedule() {
   return false;
 }
 
-void FloorHeater::loopDo() {
+unsigned long FloorHeater::loopDo() {
   if (_moduleState) {
-    if (timeDiff(_lastControlTime) > _ControlTime) {
+    if (timeDiff(_lastControlTime) >= _ControlTime) {
+      _lastControlTime = millis();
       _input = _sensor->getTemperature();
 
       // DEBUG
@@ -579,10 +562,23 @@ void FloorHeater::loopDo() {
         boolean finished = _controller->doPITuning();
         if (finished) {
           _deviceState = 0;
-          _stableTime = _controller->getStableTime();
+
+          // A timed out relay tuning keeps the old values
+          _tuningTimedOut = _controller->isTuningTimedOut();
+
+          if (!_tuningTimedOut) {
+            _stableTime = _controller->getStableTime();
+          }
+
+          _updateLane();
+
+          // Keep the tuned values (or the timed out status) over a reboot
+          DS3231_get(&_time);
+          _lastTuning = _time.unixtime;
           _stateChanged = true;
+          _saveSettings();
         } else {
-          return;
+          return _ControlTime;
         }
       }
 
@@ -598,11 +594,23 @@ void FloorHeater::loopDo() {
         doControl = true;
       }
 
-      // Run the controller if we need to
-      if (doControl) {
+      // The bank runs the control loop while the lane is active,
+      // fall back to the own controller if the bank was full
+      if (_lane >= 0) {
+        pidBank.setActive(_lane, doControl);
+      } else if (doControl) {
         _controller->doControl();
+      }
+
+      if (doControl) {
         _outputTime = _output;
+        sensorLog.append(moduleId, SENSORLOG_OUTPUT, _output);
       }
     }
+
+    // Sleep until the next control cycle is due
+    return timeLeft(_lastControlTime, _ControlTime);
   }
+
+  return SENSORMODULE_IDLE_TIME;
 }
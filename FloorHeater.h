@@ -12,10 +12,12 @@
 
 #include "Arduino.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
+#include "FastPin.h"
 #include "OWTSensor.h"
 #include "PID.h"
+#include "PIDBank.h"
 #include "ds3231.h"
 
 class FloorHeater : public SensorModule
@@ -36,9 +38,9 @@ class FloorHeater : public SensorModule
 
     const char* getModuleType();
     byte getStorageSize();
-    void loopDo();
-    void getJSONSettings();       // Fill-in module settings in JSON object through _context property
-    boolean setJSONSettings(aJsonObject *moduleItem); // Update settings from JSON object through _context property
+    unsigned long loopDo();
+    void printJSONSettings(JSONWriter *writer); // Write module settings as JSON object fields
+    boolean setJSONSettings(JSONReader *reader); // Update settings from JSON object fields
 
     void turnModuleOff();         // Turn module off
     void turnModuleOn();          // Turn module on
@@ -56,9 +58,31 @@ class FloorHeater : public SensorModule
       float kI;
       unsigned long stableTime;   // Time to stabilize at the setpoint
       unsigned long lastTuning;   // Timestamp of the last taining time
+      int8_t tuningTimedOut;      // 1 if the last relay tuning timed out and kept the old values
     };
 
+    // PUT request structure, filled by JSONReader
+    typedef struct request_t
+    {
+      char moduleType[16];
+      config_t settings;
+      int8_t doTuning;            // 1 - SIMC tuning, 2 - relay feedback tuning
+      int8_t resetTuning;
+    };
+
+    // Schedule period layout, matches the last dimension of config_t::schedule
+    typedef struct period_t
+    {
+      int start;
+      int end;
+      int t;
+    };
+
+    static const JSONField _jsonFields[];  // PUT request fields table (in PROGMEM)
+    static const JSONField _jsonPeriodFields[];
+
     uint8_t _devicePin;
+    FastPin _deviceIO;            // Direct port access to the SSR pin, written from the timer interrupt too
     uint8_t _timer;
     float _tMax;                  // Maximum heater temperature
     float _tMin;
@@ -73,28 +97,32 @@ class FloorHeater : public SensorModule
     int8_t _deviceState;          // 0 - idle, 1 - working, 2 - tuning
     volatile int8_t _driveMode;
     unsigned long _lastTuning;
+    boolean _tuningTimedOut;
     unsigned long _windowStartTime;
     unsigned long _lastControlTime;
     boolean _stateChanged;        // Set to TRUE if anything (settings) - to prevent filling settings in again e.g. when the server asks for current settings
     struct ts _time;              // Time structure for the DS3231 library
     OWTSensor *_sensor;
     PID *_controller;
+    int8_t _lane;                 // PID bank lane, -1 if the bank is full
     AppContext *_context;         // Pointer to the AppContext object
 
     static const char _moduleType[15];   // Module type string
     static const uint16_t _OutputWindowSize = 10000;
     static const uint8_t _DriveTime = 50;
     static const uint16_t _ControlTime = 1000;
+    static const uint8_t _RelayTuningCycles = 3;
 
     void _saveSettings();         // Puts settings into storage
     void _loadSettings();         // Loads settings from storage
     void _resetSettings();        // Resets settings to default values
     void _resetTuning();
+    void _updateLane();           // Copy the controller gains to the PID bank
     byte _readDeviceState();      // Read the relay state
     void _turnDeviceOff();        // Turn the heater off (manual off override)
     void _turnDeviceOn();         // Turn the heater on (manual temperature override)
     void _turnDeviceBySchedule(); // Heat in schedule mode (reset the override)
-    void _turnDeviceTuning();
+    void _turnDeviceTuning(uint8_t method);  // PID_TUNING_SIMC or PID_TUNING_RELAY
     void _initTimer3();
     void _initTimer4();
     void _initTimer5();
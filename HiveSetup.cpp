@@ -20,7 +20,7 @@ SensorModule *sensorModuleArray[modulesCount];
 // Settings storage file name (for SD card storage)
 char StorageFileName[16] = "settings.bin"; // 12 characters long maximum
 
-uint8_t SettingsOffset = 4;
+uint8_t SettingsOffset = SystemSettingsSize;
 
 // Init MAC adress of the Ethernet shield
 // First 3 octets are OUI (Organizationally Unique Identifier)
@@ -29,6 +29,7 @@ uint8_t SettingsOffset = 4;
 byte hivemac[6] = { 0x90, 0xA2, 0xDA, 0x00, 0x00, 0x00 };
 
 void initModules(AppContext *context, boolean loadSettings) {
+  int firstStoragePointer;
   int lastStoragePointer = SettingsOffset;
 
   // If we're using SD card, there's no need to have on offset for system settings
@@ -37,6 +38,8 @@ void initModules(AppContext *context, boolean loadSettings) {
   	lastStoragePointer = 0;
   }
 
+  firstStoragePointer = lastStoragePointer;
+
   // Create objects for all sensor modules and init each one
   sensorModuleArray[0] = new LightSwitch(context, hallZone, 1, lastStoragePointer, loadSettings, 26, 27);
   lastStoragePointer += sensorModuleArray[0]->getStorageSize();
@@ -55,6 +58,16 @@ void initModules(AppContext *context, boolean loadSettings) {
   //sensorModuleArray[3] = new DHTSwitch(context, sensor, kitchenZone, 3, lastStoragePointer, loadSettings, 65535, 50, 20, 0, 1, 6);
   //lastStoragePointer += sensorModuleArray[2]->getStorageSize();
 
+  // The storage layout is sized for HIVE_MODULES_STORAGE_SIZE bytes, settings
+  // beyond it would overlap other data. Don't go on with a wrong setup.
+  if (lastStoragePointer - firstStoragePointer > ModulesStorageSize) {
+    Serial.print(F("ERROR: Module settings take "));
+    Serial.print(lastStoragePointer - firstStoragePointer);
+    Serial.println(F(" bytes, set HIVE_MODULES_STORAGE_SIZE in HiveSetup.h to that"));
+
+    while (true);
+  }
+
   // DEBUG
   Serial.println(F("Modules array setup finished"));
 }
@@ -4,6 +4,7 @@
 #include "SensorModule.h"
 #include "AppContext.h"
 #include "Ethernet.h"
+#include "SPI.h"
 
 // Uncomment to use static ip instead of DHCP
 #ifndef HIVE_STATIC_IP
@@ -55,8 +56,15 @@ const uint8_t DeviceIdEthernet = 0;
 // Change Ethernet CS pin in accordance with Ethernet module documentation
 const uint8_t DeviceIdSD = 1;
 
+const uint8_t DevicesCount = 2;
+
 // CS pins for each SPI device according to device ids
-const uint8_t DevicesCSPins[] = { 10, 4 };
+const uint8_t DevicesCSPins[DevicesCount] = { 10, 4 };
+
+// SPI clock and mode for each device, applied when the device is selected.
+// SPI_CLOCK_DIV2 is the fastest (8 MHz on a 16 MHz board).
+const uint8_t DevicesSPIClock[DevicesCount] = { SPI_CLOCK_DIV2, SPI_CLOCK_DIV2 };
+const uint8_t DevicesSPIMode[DevicesCount] = { SPI_MODE0, SPI_MODE0 };
 
 // Storage offset - modules settings come after the offset.
 // This is the size of general settings (if any)
@@ -67,9 +75,64 @@ const uint8_t DevicesCSPins[] = { 10, 4 };
 // for storing values.
 extern uint8_t SettingsOffset;
 
+// Size of the general settings in EEPROM, the default SettingsOffset
+const uint8_t SystemSettingsSize = 4;
+
 const uint8_t EEPROMStorage = 1;
 const uint8_t SDStorage = 2;
 
+// Size of all module settings in storage, the sum of getStorageSize() of the modules
+// created in initModules(). It's checked at boot, the error tells the size needed.
+// EEPROM wear leveling slots take this plus a 4 bytes header each,
+// the rest of EEPROM after system settings is split into slots.
+#ifndef HIVE_MODULES_STORAGE_SIZE
+#define HIVE_MODULES_STORAGE_SIZE 12
+#endif
+const uint16_t ModulesStorageSize = HIVE_MODULES_STORAGE_SIZE;
+
+// Size of the settings image mirrored in RAM and of the SD card settings file:
+// whole card blocks holding the settings and the 4 bytes SD file tail
+const uint16_t StorageBlockSize = 512;
+const uint16_t StorageCacheSize = (SystemSettingsSize + ModulesStorageSize + 4 + StorageBlockSize - 1) /
+                                  StorageBlockSize * StorageBlockSize;
+// Dirty tracking granularity, the image is tracked in 32 lines
+const uint16_t StorageCacheLine = StorageCacheSize / 32;
+// Write changes back after the storage has been idle for StorageFlushDelay ms,
+// but no later than StorageFlushMaxDelay ms after the first change
+const uint16_t StorageFlushDelay = 2000;
+const uint16_t StorageFlushMaxDelay = 10000;
+
+// Web server latency budget: incoming connections are checked at least every
+// WebServerPollTime ms, provided no module task runs longer than that
+const uint8_t WebServerPollTime = 10;
+// Sensor log blocks sent in one /history response at most (512 bytes each),
+// the client asks for the rest starting from the time of the last block
+const uint8_t HistoryMaxBlocks = 64;
+// Scheduler task slots: one per module plus the web server, storage,
+// push notification, sensor log and PID bank tasks, 32 maximum
+const uint8_t SchedulerMaxTasks = modulesCount + 5;
+
+// Push notifications queue length. Notifications for the same module
+// are merged, so there's no use in making it longer than modulesCount.
+const uint8_t PushQueueSize = 8;
+// Connect and response timeout (ms)
+const uint16_t PushTimeout = 5000;
+// Time to wait for the server to close the connection (ms)
+const uint16_t PushCloseTimeout = 1000;
+// Delay before the first retry (ms), doubled on each next one
+const uint16_t PushRetryDelay = 1000;
+const uint8_t PushMaxRetries = 4;
+// Notifications sent on a connection without waiting for responses
+const uint8_t PushPipelineDepth = 4;
+// Idle keep-alive connection is closed after this time (ms)
+const uint16_t PushKeepAliveTime = 30000;
+// Connection state polling interval while sending (ms)
+const uint8_t PushPollTime = 10;
+// Queue check interval when there's nothing to send (ms)
+const uint16_t PushIdleTime = 1000;
+// First local port for notification connections
+const uint16_t PushLocalPort = 50000;
+
 // No changeable parameters below this line
 
 // Name string is assigned in cpp file
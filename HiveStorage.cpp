@@ -1,60 +1,612 @@
 #include "HiveSetup.h"
-#include "SD.h"
+#include "SdFat.h"
 #include "EEPROM.h"
 #include "HiveStorage.h"
+#include "HiveUtils.h"
+#include "util/crc16.h"
 
 uint8_t StorageType = EEPROMStorage;
 
+// SD card settings file.
+// The file is preallocated as contiguous blocks which fit all module settings
+// and is kept open, the mirror is read with one multi-block read at boot
+// and the changed blocks are written back with raw block I/O.
+// Since the file size is fixed, the length of stored settings
+// is kept in a tail at the end of the last block.
+typedef struct sdStorageTail_t
+{
+  uint16_t length;
+  uint8_t checkByte;
+};
+
+SdFat sd;
+SdBaseFile storageFile;
+// The settings file is converted into a new file under this name first
+const char StorageNewFileName[] = "settings.new";
+uint32_t storageBlock;                // Card block number of the settings file
+
+// Settings image mirrored in RAM. Writes go to the mirror and mark
+// the touched lines dirty, the dirty lines are written back later
+// by storageLoopDo() or flushStorage() in one go.
+byte storageCache[StorageCacheSize];
+int storageCacheLength = 0;           // Number of bytes present in the storage
+uint8_t storageCacheType = 0;         // Storage type the mirror was loaded from, 0 if not loaded
+uint32_t storageDirtyLines = 0;       // Dirty lines bitmap, one bit per StorageCacheLine bytes
+unsigned long storageDirtyTime;       // Time of the first write since the last flush
+unsigned long storageWriteTime;       // Time of the last write
+int storageCacheCapacity = 0;         // Number of bytes the storage can hold in the mirror
+uint8_t storageBatchLevel = 0;
+
+storageStats_t storageStats = { 0, 0, 0, 0, 0, 0, 0 };
+
+// EEPROM wear leveling.
+// Module settings are kept in a ring of slots right after the system settings.
+// Each flush writes the whole image to the next slot, so every cell is rewritten
+// only once per ring turn. A slot starts with a header with a sequence number
+// and a CRC of the slot data, the newest valid slot is used at boot.
+typedef struct eepromSlotHeader_t
+{
+  uint16_t seq;
+  uint16_t crc;
+};
+
+int16_t eepromSlot = -1;              // Current slot, -1 if settings are stored in the old plain layout
+uint16_t eepromSlotSeq = 0;           // Sequence number of the current slot
+uint16_t eepromNextSlot = 1;          // Slot the next flush goes to
+
+// The next slot is written while the current one is kept, so there have to be two at least
+static_assert((E2END + 1 - SystemSettingsSize) / (sizeof(eepromSlotHeader_t) + ModulesStorageSize) >= 2,
+              "ModulesStorageSize doesn't fit EEPROM twice");
+static_assert(SystemSettingsSize + ModulesStorageSize + sizeof(sdStorageTail_t) <= StorageCacheSize,
+              "Module settings don't fit the SD settings file");
+// The mirror is kept in RAM, a Mega has 8 KB
+static_assert(StorageCacheSize <= 4 * StorageBlockSize,
+              "HIVE_MODULES_STORAGE_SIZE takes more than 2 KB of RAM for the storage mirror");
+
+uint16_t eepromSlotCount() {
+  return (E2END + 1 - SettingsOffset) / (sizeof(eepromSlotHeader_t) + ModulesStorageSize);
+}
+
+int eepromSlotAddress(uint16_t slot) {
+  return SettingsOffset + slot * (sizeof(eepromSlotHeader_t) + ModulesStorageSize);
+}
+
+// The slot to write after the given one. The current slot is never overwritten,
+// neither is slot 0 while the settings are in the old plain layout, which it overlaps.
+uint16_t eepromSlotAfter(uint16_t slot) {
+  do {
+    slot = (slot + 1) % eepromSlotCount();
+  } while (((int16_t)slot == eepromSlot) || ((eepromSlot < 0) && (slot == 0)));
+
+  return slot;
+}
+
+// Physical EEPROM address of a settings byte
+int eepromAddress(int position) {
+  // System settings (and module settings before the first slot is written)
+  // are stored in place
+  if ((eepromSlot < 0) || (SettingsOffset == 0) || (position < SettingsOffset)) {
+    return position;
+  }
+
+  return eepromSlotAddress(eepromSlot) + sizeof(eepromSlotHeader_t) + position - SettingsOffset;
+}
+
+uint16_t eepromSlotCRC(uint16_t slot) {
+  uint16_t crc = 0xFFFF;
+  int address = eepromSlotAddress(slot) + sizeof(eepromSlotHeader_t);
+
+  for (uint16_t i = 0; i < ModulesStorageSize; i++) {
+    crc = _crc16_update(crc, EEPROM.read(address++));
+  }
+
+  return crc;
+}
+
+// Write only the bytes that differ, an EEPROM write is slow and wears the cell.
+// Returns false if a byte doesn't read back as written.
+boolean updateEEPROM(int address, const byte *data, int size) {
+  for (int i = 0; i < size; i++, address++, data++) {
+    if (EEPROM.read(address) != *data) {
+      EEPROM.write(address, *data);
+      storageStats.eepromWrites++;
+
+      if (EEPROM.read(address) != *data) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Find the newest slot with a valid CRC
+void findEEPROMSlot() {
+  eepromSlotHeader_t header;
+
+  eepromSlot = -1;
+
+  for (uint16_t slot = 0; slot < eepromSlotCount(); slot++) {
+    for (uint8_t i = 0; i < sizeof(header); i++) {
+      ((byte *)&header)[i] = EEPROM.read(eepromSlotAddress(slot) + i);
+    }
+
+    // Sequence numbers wrap around, so compare the difference
+    if (((eepromSlot < 0) || ((int16_t)(header.seq - eepromSlotSeq) > 0)) && (header.crc == eepromSlotCRC(slot))) {
+      eepromSlot = slot;
+      eepromSlotSeq = header.seq;
+    }
+  }
+
+  eepromNextSlot = eepromSlotAfter((eepromSlot < 0) ? 0 : eepromSlot);
+}
+
+// Write the module settings image to the next slot of the ring.
+// Returns false if the slot didn't take it, the current slot stays in use then
+// and the next try goes to the slot after, so a worn out slot is skipped.
+boolean writeEEPROMSlot(const byte *data) {
+  eepromSlotHeader_t header;
+  uint16_t slot = eepromNextSlot;
+  int address = eepromSlotAddress(slot);
+
+  eepromNextSlot = eepromSlotAfter(slot);
+
+  if (!updateEEPROM(address + sizeof(header), data, ModulesStorageSize)) {
+    return false;
+  }
+
+  // Header goes last, so a slot interrupted by a power loss
+  // has an invalid CRC and the previous one is used
+  header.seq = eepromSlotSeq + 1;
+  header.crc = eepromSlotCRC(slot);
+
+  if (!updateEEPROM(address, (const byte *)&header, sizeof(header))) {
+    return false;
+  }
+
+  eepromSlot = slot;
+  eepromSlotSeq = header.seq;
+  eepromNextSlot = eepromSlotAfter(slot);
+
+  return true;
+}
+
+// Raw storage access, bypassing the mirror
+int writeBackendBytes(int position, const byte *data, int size) {
+  int i = 0;
+
+  if (StorageType == EEPROMStorage) {
+    Serial.print(F("Writing to EEPROM"));
+
+    if ((eepromSlot >= 0) && (SettingsOffset > 0) && (position + size > SettingsOffset)) {
+      // Module settings are written in place of the current slot
+      if (position + size > SettingsOffset + ModulesStorageSize) {
+        return -1;
+      }
+
+      for (i = 0; i < size; i++) {
+        if (!updateEEPROM(eepromAddress(position++), data++, 1)) {
+          return -1;
+        }
+      }
+
+      // Keep the slot valid
+      eepromSlotHeader_t header = { eepromSlotSeq, eepromSlotCRC(eepromSlot) };
+
+      if (!updateEEPROM(eepromSlotAddress(eepromSlot), (const byte *)&header, sizeof(header))) {
+        return -1;
+      }
+
+      return i;
+    }
+
+    return updateEEPROM(position, data, size) ? size : -1;
+  }
+
+  if (StorageType == SDStorage) {
+
+    // DEBUG
+    Serial.print(F("Writing to SD to file "));
+    Serial.println(StorageFileName);
+
+    // Select slave SPI device
+    useDevice(DeviceIdSD);
+
+    if (!storageFile.isOpen() || (position < 0) ||
+        ((size_t)(position + size) > StorageCacheSize - sizeof(sdStorageTail_t))) {
+      return -1;
+    }
+
+    if (storageFile.seekSet(position)) {
+      i = storageFile.write(data, size);
+      storageFile.sync();
+    } else {
+      i = -1;
+    }
+
+    return i;
+  }
+
+  return -1;
+}
+
+int readBackendBytes(int position, byte *data, int size) {
+  int i = 0;
+
+  if (StorageType == EEPROMStorage) {
+    for (i = 0; i < size; i++)
+      *data++ = EEPROM.read(eepromAddress(position++));
+    return i;
+  }
+
+  if (StorageType == SDStorage) {
+
+    // DEBUG
+    Serial.println(F("Reading from SD card"));
+
+    useDevice(DeviceIdSD);
+
+    if (!storageFile.isOpen() || (position < 0)) {
+      return -1;
+    }
+
+    if ((uint32_t)(position + size) <= storageFile.fileSize()) {
+
+      if (storageFile.seekSet(position)) {
+        i = storageFile.read(data, size);
+      }
+
+    } else {
+      i = -1;
+
+      // DEBUG
+      Serial.println(F("ERROR: Value position is beyond the file size"));
+    }
+
+    return i;
+  }
+
+  return -1;
+}
+
+// Check if the value is kept in the mirror.
+// System settings are always read from EEPROM, so the mirror
+// is bypassed if the storage type has been overridden.
+boolean isCached(int position, int size) {
+  return (storageCacheType != 0) && (StorageType == storageCacheType) &&
+         (position >= 0) && (position + size <= storageCacheCapacity);
+}
+
+// Fill the mirror with the current storage contents
+void loadStorageCache() {
+  sdStorageTail_t *tail = (sdStorageTail_t *)(storageCache + StorageCacheSize - sizeof(sdStorageTail_t));
+
+  storageCacheType = 0;
+  storageDirtyLines = 0;
+  memset(storageCache, 0, sizeof(storageCache));
+
+  if (StorageType == EEPROMStorage) {
+    // Module settings can't go beyond a slot
+    storageCacheLength = SettingsOffset + ModulesStorageSize;
+    storageCacheCapacity = storageCacheLength;
+
+    if (readBackendBytes(0, storageCache, storageCacheLength) == storageCacheLength) {
+      storageCacheType = StorageType;
+    }
+  }
+
+  if (StorageType == SDStorage) {
+    storageCacheCapacity = StorageCacheSize - sizeof(sdStorageTail_t);
+
+    useDevice(DeviceIdSD);
+
+    if (!storageFile.isOpen() || !sd.card()->readStart(storageBlock)) {
+      return;
+    }
+
+    // The whole settings file is read at once, the blocks are contiguous
+    for (uint16_t i = 0; i < StorageCacheSize; i += StorageBlockSize) {
+      if (!sd.card()->readData(storageCache + i)) {
+        sd.card()->readStop();
+        return;
+      }
+    }
+
+    if (!sd.card()->readStop()) {
+      return;
+    }
+
+    // A new file has no tail yet
+    if ((tail->checkByte == StorageCheckByte) && (tail->length <= storageCacheCapacity)) {
+      storageCacheLength = tail->length;
+    } else {
+      storageCacheLength = 0;
+      memset(storageCache, 0, sizeof(storageCache));
+    }
+
+    storageCacheType = StorageType;
+  }
+}
+
+void flushStorage() {
+  int first, last;
+  sdStorageTail_t *tail;
+  unsigned long flushStart;
+  boolean written = true;
+
+  // Everything is written at the end of the batch
+  if (!storageDirtyLines || (storageBatchLevel > 0) || !isCached(0, 0)) {
+    return;
+  }
+
+  flushStart = micros();
+
+  for (first = 0; !(storageDirtyLines & (1UL << first)); first++);
+  for (last = StorageCacheSize / StorageCacheLine - 1; !(storageDirtyLines & (1UL << last)); last--);
+
+  if (StorageType == SDStorage) {
+    // The card is written by blocks anyway, so write the blocks of the dirty lines
+    uint16_t firstBlock = first * StorageCacheLine / StorageBlockSize;
+    uint16_t lastBlock = ((last + 1) * StorageCacheLine - 1) / StorageBlockSize;
+
+    tail = (sdStorageTail_t *)(storageCache + StorageCacheSize - sizeof(sdStorageTail_t));
+
+    // The tail is in the last block
+    if ((tail->length != storageCacheLength) || (tail->checkByte != StorageCheckByte)) {
+      tail->length = storageCacheLength;
+      tail->checkByte = StorageCheckByte;
+      lastBlock = StorageCacheSize / StorageBlockSize - 1;
+    }
+
+    useDevice(DeviceIdSD);
+
+    // Make sure the library cache doesn't hold an old copy of the blocks
+    written = (sd.vol()->cacheClear() != NULL);
+
+    for (uint16_t block = firstBlock; written && (block <= lastBlock); block++) {
+      written = sd.card()->writeBlock(storageBlock + block, storageCache + block * StorageBlockSize);
+    }
+  } else {
+    // System settings are kept in place
+    if (first * StorageCacheLine < SettingsOffset) {
+      written = updateEEPROM(0, storageCache, SettingsOffset);
+    }
+
+    // Module settings go to the next slot
+    if (written && ((last + 1) * StorageCacheLine > SettingsOffset)) {
+      written = writeEEPROMSlot(storageCache + SettingsOffset);
+    }
+  }
+
+  // The lines stay dirty, so the changes are written with the next flush
+  if (!written) {
+    storageStats.flushFailures++;
+
+    // DEBUG
+    Serial.println(F("ERROR: Storage write failed"));
+    return;
+  }
+
+  storageDirtyLines = 0;
+
+  storageStats.flushes++;
+  storageStats.flushTime = micros() - flushStart;
+
+  if (storageStats.flushTime > storageStats.flushTimeMax) {
+    storageStats.flushTimeMax = storageStats.flushTime;
+  }
+}
+
+// Write the changes back when there were no writes for a while
+// or when the oldest change waits for too long
+unsigned long storageLoopDo() {
+  if (!storageDirtyLines) {
+    // Nothing to write, a new change is picked up within the idle delay anyway
+    return StorageFlushDelay;
+  }
+
+  unsigned long idleLeft = timeLeft(storageWriteTime, StorageFlushDelay);
+  unsigned long maxLeft = timeLeft(storageDirtyTime, StorageFlushMaxDelay);
+
+  if ((idleLeft == 0) || (maxLeft == 0)) {
+    flushStorage();
+    return StorageFlushDelay;
+  }
+
+  return min(idleLeft, maxLeft);
+}
+
+void beginStorageBatch() {
+  storageBatchLevel++;
+}
+
+void endStorageBatch() {
+  if (storageBatchLevel == 0) {
+    return;
+  }
+
+  if (--storageBatchLevel == 0) {
+    flushStorage();
+  }
+}
+
+int writeStorageBytes(int position, const byte *data, int size) {
+  uint8_t line;
+
+  storageStats.writes++;
+
+  if (!isCached(position, size)) {
+    return writeBackendBytes(position, data, size);
+  }
+
+  // Nothing to write if the value is the same
+  if ((position + size <= storageCacheLength) && (memcmp(storageCache + position, data, size) == 0)) {
+    storageStats.writesCoalesced++;
+    return size;
+  }
+
+  memcpy(storageCache + position, data, size);
+
+  if (position + size > storageCacheLength) {
+    storageCacheLength = position + size;
+  }
+
+  if (storageDirtyLines) {
+    storageStats.writesCoalesced++;
+  } else {
+    storageDirtyTime = millis();
+  }
+
+  for (line = position / StorageCacheLine; line <= (position + size - 1) / StorageCacheLine; line++) {
+    storageDirtyLines |= (1UL << line);
+  }
+
+  storageWriteTime = millis();
+
+  return size;
+}
+
+int readStorageBytes(int position, byte *data, int size) {
+  if (!isCached(position, size)) {
+    return readBackendBytes(position, data, size);
+  }
+
+  if (position + size > storageCacheLength) {
+    // DEBUG
+    Serial.println(F("ERROR: Value position is beyond the file size"));
+
+    return -1;
+  }
+
+  memcpy(data, storageCache + position, size);
+
+  return size;
+}
+
 // Returns
 //  0 if storage isn't available
 //  1 if storage is available and empty
 //  2 if storage is available and filled
 uint8_t initSDStorage() {
-  uint8_t storageResult = 0;
-  File myFile;
+  SdBaseFile oldFile;
+  uint32_t endBlock;
+  uint32_t size;
+  int length = 0;
+  sdStorageTail_t *tail;
 
   useDevice(DeviceIdSD);
 
-  if (!SD.begin(DevicesCSPins[DeviceIdSD])) {
+  // SdFat applies its own SPI rate on every chip select, so pass it the one from the device table
+  if (!sd.begin(DevicesCSPins[DeviceIdSD], getDeviceClockDivisor(DeviceIdSD))) {
 
     Serial.println(F("Card init failed, or not present"));
     // don't do anything more:
     return 0;
   }
 
-  if (SD.exists(StorageFileName)) {
+  // The power went off during a conversion after the old file had been removed,
+  // the new file was written by then
+  if (!storageFile.open(StorageFileName, O_RDWR) && storageFile.open(StorageNewFileName, O_RDWR)) {
+    storageFile.rename(sd.vwd(), StorageFileName);
+  }
+
+  if (storageFile.isOpen()) {
     // DEBUG
     Serial.println(F("Found settings file"));
 
-    myFile = SD.open(StorageFileName, FILE_READ);
+    if ((storageFile.fileSize() == StorageCacheSize) && storageFile.contiguousRange(&storageBlock, &endBlock)) {
+      StorageType = SDStorage;
+      loadStorageCache();
 
-    if (myFile && (myFile.size() > 0)) {
-      // DEBUG
-      Serial.println(F("File size > 0"));
-      storageResult = 2;
-    } else {
-      // DEBUG
-      Serial.println(F("File is empty"));
-      storageResult = 1;
+      if (storageCacheType != SDStorage) {
+        Serial.println(F("Unable to read settings file"));
+        storageFile.close();
+        return 0;
+      }
+
+      return storageCacheLength > 0 ? 2 : 1;
     }
 
-     myFile.close();
+    // DEBUG
+    Serial.println(F("Converting settings file"));
 
+    // A file written by an older firmware, or preallocated for another
+    // module settings size. Keep its contents for the new file, the file
+    // itself is kept until the new one is written.
+    size = storageFile.fileSize();
+    length = storageFile.read(storageCache, StorageCacheSize);
+    storageFile.close();
+
+    if (length < 0) {
+      length = 0;
+    }
+
+    // A preallocated file keeps the settings length in its tail
+    if ((size % StorageBlockSize == 0) && ((uint32_t)length == size)) {
+      tail = (sdStorageTail_t *)(storageCache + size - sizeof(sdStorageTail_t));
+
+      if ((tail->checkByte == StorageCheckByte) && (tail->length <= size - sizeof(sdStorageTail_t))) {
+        length = tail->length;
+      }
+    }
   } else {
     // DEBUG
     Serial.println(F("File is missing"));
-    myFile = SD.open(StorageFileName, FILE_WRITE);
-    myFile.close();
-    storageResult = 1;
   }
 
-  return storageResult;
+  length = min(length, (int)(StorageCacheSize - sizeof(sdStorageTail_t)));
+  memset(storageCache + length, 0, StorageCacheSize - length);
+
+  // A new file left by a conversion which was cut off
+  if (storageFile.open(StorageNewFileName, O_RDWR)) {
+    storageFile.remove();
+  }
+
+  if (!storageFile.createContiguous(sd.vwd(), StorageNewFileName, StorageCacheSize) ||
+      !storageFile.contiguousRange(&storageBlock, &endBlock)) {
+
+    Serial.println(F("Unable to create settings file"));
+    storageFile.close();
+    return 0;
+  }
+
+  // Write the old contents to the new file
+  StorageType = SDStorage;
+  storageCacheCapacity = StorageCacheSize - sizeof(sdStorageTail_t);
+  storageCacheLength = length;
+  storageCacheType = SDStorage;
+  storageDirtyLines = 0xFFFFFFFFUL;
+  flushStorage();
+
+  if (storageDirtyLines) {
+    Serial.println(F("Unable to write settings file"));
+    storageFile.remove();
+    storageCacheType = 0;
+    return 0;
+  }
+
+  // Only now the old file can go. If the power goes off before the new one
+  // is renamed, it's picked up at the next boot.
+  if ((oldFile.open(StorageFileName, O_RDWR) && !oldFile.remove()) ||
+      !storageFile.rename(sd.vwd(), StorageFileName)) {
+
+    Serial.println(F("Unable to replace settings file"));
+    storageFile.close();
+    storageCacheType = 0;
+    return 0;
+  }
+
+  return length > 0 ? 2 : 1;
 }
 
 // Returns true if there are saved settings
 // otherwise returns false
 uint8_t initEEPROMStorage() {
   byte checkByte;
+
+  // Pick the newest slot of the module settings ring
+  findEEPROMSlot();
+
   checkByte = EEPROM.read(0);
   if (checkByte == StorageCheckByte) {
     return 1;
@@ -82,7 +634,11 @@ uint8_t initStorage() {
     Serial.println(initResult);
 
     // Tell if we need to load settings
-    return initEEPROMStorage();
+    initResult = initEEPROMStorage();
+
+    loadStorageCache();
+
+    return initResult;
   } else {
     // Use SD card if available
     StorageType = SDStorage;
@@ -96,6 +652,8 @@ uint8_t initStorage() {
     Serial.print(F("Init result: "));
     Serial.println(initResult);
 
+    // The mirror has been loaded by initSDStorage()
+
     // Tell if we need to load settings (0 or 1)
     return initResult - 1;
   }
@@ -141,5 +699,8 @@ void saveSystemSettings() {
 
   // TODO: Save modules count byte
 
+  // System settings are rarely changed, no need to defer
+  flushStorage();
+
   StorageType = oldStorageType;
 }
@@ -7,12 +7,13 @@
 #define HiveStorage_h
 
 #include "EEPROM.h"
-#include "SD.h"
+#include "SdFat.h"
 #include "SPI.h"
 #include "HiveSetup.h"
 #include "DeviceDispatch.h"
 
 extern uint8_t StorageType;
+extern SdFat sd;
 
 uint8_t initStorage();
 uint8_t initSDStorage();
@@ -20,103 +21,39 @@ uint8_t initEEPROMStorage();
 void saveSystemSettings();
 uint8_t loadSystemSettings();
     
-template <class T> int writeStorage(int position, const T& value) {
-  const byte *p = (const byte*)(const void*)&value;
-  int8_t i = 0;
-  File myFile;
-  
-  if (StorageType == EEPROMStorage) {
-    Serial.print(F("Writing to EEPROM"));
-    for (i = 0; i < sizeof(value); i++)
-      EEPROM.write(position++, *p++);
-    return i;
-  }
-  
-  if (StorageType == SDStorage) {
-
-    // DEBUG
-    Serial.print(F("Writing to SD to file "));
-    Serial.println(StorageFileName);
-    
-    // Select slave SPI device
-    useDevice(DeviceIdSD);
-
-    myFile = SD.open(StorageFileName, FILE_WRITE);
-    
-    if (myFile) {
-      // DEBUG
-      Serial.println(F("Opened file for writing"));
-
-      if (myFile.seek(position)) {
-        for (i = 0; i < sizeof(value); i++)
-          myFile.write(*p++);
-      } else {
-        i = -1;
-      }
-      
-      myFile.close();
-      return i;
-      
-    } else {
-      // DEBUG
-      Serial.println("Unable to open storage file fo writing");
-      
-      myFile.close();
+// Storage write-back statistics
+typedef struct storageStats_t
+{
+  unsigned long writes;           // Number of writeStorage() calls
+  unsigned long writesCoalesced;  // Writes that didn't cause a flush of their own
+  unsigned long flushes;
+  unsigned long flushTime;        // Last flush duration (us)
+  unsigned long flushTimeMax;     // Longest flush duration (us)
+  unsigned long eepromWrites;     // EEPROM bytes actually written
+  unsigned long flushFailures;    // Flushes the storage didn't take, retried later
+};
+
+extern storageStats_t storageStats;
+
+// Read and write raw bytes at the given storage position.
+// Writes are kept in a RAM mirror and written back later.
+int writeStorageBytes(int position, const byte *data, int size);
+int readStorageBytes(int position, byte *data, int size);
+
+void flushStorage();              // Write back all the pending changes now
+unsigned long storageLoopDo();    // Write back pending changes when it's time, returns ms to the next check
+
+// Defer writing back until the end of a batch of updates.
+// Calls may be nested.
+void beginStorageBatch();
+void endStorageBatch();
 
-      return -1;
-    }
-  }
-  
-  return -1;
+template <class T> int writeStorage(int position, const T& value) {
+  return writeStorageBytes(position, (const byte*)(const void*)&value, sizeof(value));
 }
-    
-template <class T> int readStorage(int position, T& value) {
-  byte *p = (byte*)(void*)&value;
-  int8_t i = 0;
-  File myFile;
-
-  if (StorageType == EEPROMStorage) {
-    for (i = 0; i < sizeof(value); i++)
-      *p++ = EEPROM.read(position++);
-    return i;
-  }
-    
-  if (StorageType == SDStorage) {
-    
-    // DEBUG
-    Serial.println(F("Reading from SD card"));
-
-    useDevice(DeviceIdSD);
-    
-    myFile = SD.open(StorageFileName);
-    
-    if (myFile) {
-      
-      // DEBUG
-      Serial.println(F("File is open"));
-
-      if ((position + sizeof(value)) <= myFile.size()) {
-
-        if (myFile.seek(position)) {
-          for (i = 0; i < sizeof(value); i++)
-            *p++ = myFile.read();
-        }
 
-      } else {
-        i = -1;
-
-        // DEBUG
-        Serial.println(F("ERROR: Value position is beyond the file size"));
-      }
-      
-      myFile.close();
-      return i;
-    }
-
-    myFile.close();
-  }
-  
-  return -1;   
+template <class T> int readStorage(int position, T& value) {
+  return readStorageBytes(position, (byte*)(void*)&value, sizeof(value));
 }
-    
+
 #endif
@@ -13,6 +13,13 @@ unsigned long timeDiff(unsigned long timeValue) {
   }
 }
 
+// Time remaining until interval has passed since timeValue, 0 if it's already over
+unsigned long timeLeft(unsigned long timeValue, unsigned long interval) {
+  unsigned long elapsed = timeDiff(timeValue);
+
+  return (elapsed < interval) ? interval - elapsed : 0;
+}
+
 // http://forum.arduino.cc/index.php?topic=158375.0
 void debugPrint(const __FlashStringHelper* pData, boolean newline) {
 #ifdef HIVE_DEBUG
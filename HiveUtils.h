@@ -9,6 +9,7 @@
 #include "HiveSetup.h"
 
 unsigned long timeDiff(unsigned long timeValue);
+unsigned long timeLeft(unsigned long timeValue, unsigned long interval);
 void debugPrint(const __FlashStringHelper *pData, boolean newline = true);
 void debugPrint(const char *pData, boolean newline = true);
 void debugPrint(double pData, boolean newline = true);
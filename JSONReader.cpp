@@ -0,0 +1,473 @@
+#include <limits.h>
+#include "Arduino.h"
+#include "JSONReader.h"
+
+JSONReader::JSONReader(Stream *in) :
+  _in(in),
+  _ahead(-2),
+  _error(false),
+  _depth(0)
+{}
+
+int JSONReader::_peek() {
+  while (true) {
+    if (_ahead == -2) {
+      _ahead = _in->read();
+    }
+
+    if ((_ahead == ' ') || (_ahead == '\t') || (_ahead == '\r') || (_ahead == '\n')) {
+      _ahead = -2;
+      continue;
+    }
+
+    return _ahead;
+  }
+}
+
+int JSONReader::_read() {
+  int ch = _ahead;
+
+  if (ch == -2) {
+    ch = _in->read();
+  }
+
+  _ahead = -2;
+  return ch;
+}
+
+boolean JSONReader::_expect(char ch) {
+  if (_peek() != ch) {
+    return false;
+  }
+
+  _read();
+  return true;
+}
+
+boolean JSONReader::beginObject() {
+  if (!_expect('{')) {
+    return false;
+  }
+
+  _depth++;
+  return true;
+}
+
+boolean JSONReader::beginArray() {
+  if (!_expect('[')) {
+    return false;
+  }
+
+  _depth++;
+  return true;
+}
+
+uint8_t JSONReader::getDepth() {
+  return _depth;
+}
+
+// Skip everything up to the end of the enclosing object or array at the given depth,
+// so the reader can go on after an invalid item
+boolean JSONReader::skipTo(uint8_t depth) {
+  int ch;
+
+  while (_depth > depth) {
+    ch = _peek();
+
+    if (ch < 0) {
+      return false;
+    }
+
+    if ((ch == '}') || (ch == ']')) {
+      _read();
+      _depth--;
+    } else if ((ch == ',') || (ch == ':')) {
+      _read();
+    } else if (!skipValue()) {
+      return false;
+    }
+  }
+
+  _error = false;
+  return true;
+}
+
+boolean JSONReader::nextKey(char *key, uint8_t size) {
+  int ch = _peek();
+
+  if (ch == ',') {
+    _read();
+    ch = _peek();
+  }
+
+  if (ch != '"') {
+    // End of the object or an error
+    if (ch == '}') {
+      _read();
+      _depth--;
+    } else {
+      _error = true;
+    }
+    return false;
+  }
+
+  if (!readString(key, size) || !_expect(':')) {
+    _error = true;
+    return false;
+  }
+
+  return true;
+}
+
+boolean JSONReader::nextItem() {
+  int ch = _peek();
+
+  if (ch == ',') {
+    _read();
+    ch = _peek();
+  }
+
+  if (ch == ']') {
+    _read();
+    _depth--;
+    return false;
+  }
+
+  if (ch < 0) {
+    _error = true;
+    return false;
+  }
+
+  return true;
+}
+
+// Read a string value. Too long strings are truncated to fit the buffer.
+boolean JSONReader::readString(char *value, uint8_t size) {
+  uint8_t length = 0;
+  int ch;
+
+  if (!_expect('"')) {
+    return false;
+  }
+
+  while (true) {
+    ch = _read();
+
+    if (ch < 0) {
+      return false;
+    }
+
+    if (ch == '"') {
+      break;
+    }
+
+    if (ch == '\\') {
+      ch = _read();
+
+      switch (ch) {
+        case 'b':
+          ch = '\b';
+          break;
+        case 'f':
+          ch = '\f';
+          break;
+        case 'n':
+          ch = '\n';
+          break;
+        case 'r':
+          ch = '\r';
+          break;
+        case 't':
+          ch = '\t';
+          break;
+        case 'u':
+        {
+          // Only ASCII code points are kept
+          char hex[5];
+          for (uint8_t i = 0; i < 4; i++) {
+            ch = _read();
+
+            // A short escape or the end of the stream
+            if (!isxdigit(ch)) {
+              return false;
+            }
+
+            hex[i] = ch;
+          }
+          hex[4] = 0;
+          ch = strtol(hex, NULL, 16);
+          if (ch > 127) {
+            ch = '?';
+          }
+          break;
+        }
+        default:
+          if (ch < 0) {
+            return false;
+          }
+      }
+    }
+
+    if (value && (length + 1 < size)) {
+      value[length++] = ch;
+    }
+  }
+
+  if (value && (size > 0)) {
+    value[length] = 0;
+  }
+
+  return true;
+}
+
+// Read a number or a literal (true, false, null) as a plain token
+boolean JSONReader::_readToken(char *token, uint8_t size) {
+  uint8_t length = 0;
+  int ch = _peek();
+
+  while ((ch >= 0) && (ch != ',') && (ch != '}') && (ch != ']') &&
+         (ch != ' ') && (ch != '\t') && (ch != '\r') && (ch != '\n')) {
+
+    if (length + 1 >= size) {
+      return false;
+    }
+
+    token[length++] = _read();
+    ch = _ahead = _in->read();
+  }
+
+  token[length] = 0;
+
+  return length > 0;
+}
+
+boolean JSONReader::readNumber(long *value) {
+  char token[JSONREADER_NUMBER_LENGTH];
+  char *end;
+
+  if (!_readToken(token, sizeof(token))) {
+    return false;
+  }
+
+  if (strcmp_P(token, PSTR("true")) == 0) {
+    *value = 1;
+    return true;
+  }
+
+  if (strcmp_P(token, PSTR("false")) == 0) {
+    *value = 0;
+    return true;
+  }
+
+  *value = strtol(token, &end, 10);
+
+  // Accept integer values written as floats, e.g. 2.0 or 2e3,
+  // but not fractions, 2.5 isn't an integer
+  if ((*end == '.') || (*end == 'e') || (*end == 'E')) {
+    double number = strtod(token, &end);
+
+    if ((*end != 0) || (number != floor(number)) || (number < LONG_MIN) || (number > LONG_MAX)) {
+      return false;
+    }
+
+    *value = (long)number;
+  }
+
+  return *end == 0;
+}
+
+boolean JSONReader::skipValue() {
+  char token[JSONREADER_NUMBER_LENGTH];
+  uint8_t depth = 0;
+  int ch;
+
+  do {
+    ch = _peek();
+
+    if (ch < 0) {
+      return false;
+    }
+
+    if (ch == '"') {
+      if (!readString(NULL, 0)) {
+        return false;
+      }
+    } else if ((ch == '{') || (ch == '[')) {
+      _read();
+      depth++;
+    } else if ((ch == '}') || (ch == ']')) {
+      if (depth == 0) {
+        return false;
+      }
+      _read();
+      depth--;
+    } else if ((ch == ',') || (ch == ':')) {
+      _read();
+    } else if (!_readToken(token, sizeof(token))) {
+      return false;
+    }
+  } while (depth > 0);
+
+  return true;
+}
+
+boolean JSONReader::readFields(const JSONField *fields, uint8_t fieldCount, void *target) {
+  char key[JSONREADER_KEY_LENGTH];
+  JSONField field;
+  uint8_t i;
+
+  while (nextKey(key, sizeof(key))) {
+
+    // Field tables are stored in flash, so compare names in place
+    // and copy only the matching entry
+    for (i = 0; i < fieldCount; i++) {
+      if (strcmp_P(key, fields[i].name) == 0) {
+        break;
+      }
+    }
+
+    if (i == fieldCount) {
+      if (!skipValue()) {
+        return false;
+      }
+      continue;
+    }
+
+    memcpy_P(&field, &fields[i], sizeof(field));
+
+    if (!_readValue(&field, (byte *)target + field.offset)) {
+      return false;
+    }
+  }
+
+  // nextKey() consumes the closing brace on a well-formed object
+  return !_error;
+}
+
+boolean JSONReader::_readValue(const JSONField *field, byte *target) {
+  long value;
+
+  // Keep the default value if there's nothing to set
+  if (_peek() == 'n') {
+    return skipValue();
+  }
+
+  switch (field->type) {
+    case JSONTypeInt:
+      if (!readNumber(&value)) {
+        return false;
+      }
+
+      switch (field->size) {
+        case 1:
+          if ((value < -128) || (value > 127)) {
+            return false;
+          }
+          *(int8_t *)target = value;
+          break;
+        case 2:
+          if ((value < -32768L) || (value > 32767L)) {
+            return false;
+          }
+          *(int16_t *)target = value;
+          break;
+        default:
+          *(int32_t *)target = value;
+      }
+      return true;
+
+    case JSONTypeUInt:
+      if (!readNumber(&value) || (value < 0)) {
+        return false;
+      }
+
+      switch (field->size) {
+        case 1:
+          if (value > 255) {
+            return false;
+          }
+          *(uint8_t *)target = value;
+          break;
+        case 2:
+          if (value > 65535L) {
+            return false;
+          }
+          *(uint16_t *)target = value;
+          break;
+        default:
+          *(uint32_t *)target = value;
+      }
+      return true;
+
+    case JSONTypeFloat:
+    {
+      char token[JSONREADER_NUMBER_LENGTH];
+      char *end;
+
+      if (!_readToken(token, sizeof(token))) {
+        return false;
+      }
+
+      double number = strtod(token, &end);
+
+      if (*end != 0) {
+        return false;
+      }
+
+      if (field->size == sizeof(float)) {
+        *(float *)target = number;
+      } else {
+        *(double *)target = number;
+      }
+      return true;
+    }
+
+    case JSONTypeString:
+      return readString((char *)target, field->size);
+
+    case JSONTypeObjects:
+    {
+      uint8_t index = 0;
+      return _readObjects(field, target, &index);
+    }
+  }
+
+  return skipValue();
+}
+
+// Objects are stored one after another in the order they come,
+// no matter how deep the arrays holding them are nested.
+// E.g. a [7][3] array of objects fills 21 consecutive items.
+boolean JSONReader::_readObjects(const JSONField *field, byte *target, uint8_t *index) {
+  int ch = _peek();
+
+  if (ch == '{') {
+    beginObject();
+
+    if (*index >= field->count) {
+      // Skip the rest of an extra object
+      while (nextKey(NULL, 0)) {
+        if (!skipValue()) {
+          return false;
+        }
+      }
+      return !_error;
+    }
+
+    return readFields(field->fields, field->fieldCount, target + field->size * (*index)++);
+  }
+
+  if (ch == '[') {
+    beginArray();
+
+    while (nextItem()) {
+      if (!_readObjects(field, target, index)) {
+        return false;
+      }
+    }
+
+    return !_error;
+  }
+
+  return skipValue();
+}
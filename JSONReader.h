@@ -0,0 +1,79 @@
+/*
+  JSONReader.h - Pull parser for JSON requests. Reads a Stream
+  in a single pass and decodes values straight into a structure
+  described by a static field table, so no heap memory is used.
+*/
+
+#ifndef JSONReader_h
+#define JSONReader_h
+
+#include "Arduino.h"
+
+// Maximum length of an object key (including the terminating zero)
+#define JSONREADER_KEY_LENGTH 16
+
+// Maximum length of a number token
+#define JSONREADER_NUMBER_LENGTH 20
+
+// Field types for the field tables.
+// Size of an Int, UInt or Float field is taken from the structure member.
+const uint8_t JSONTypeInt = 1;      // Signed integer, 1, 2 or 4 bytes
+const uint8_t JSONTypeUInt = 2;     // Unsigned integer, 1, 2 or 4 bytes
+const uint8_t JSONTypeFloat = 3;    // float or double
+const uint8_t JSONTypeString = 4;   // Zero-terminated char array, truncated to fit
+const uint8_t JSONTypeObjects = 5;  // Object or (nested) array of objects described by a sub-table
+
+// Field table entry. Tables are meant to be stored in PROGMEM.
+typedef struct JSONField
+{
+  char name[JSONREADER_KEY_LENGTH];
+  uint8_t type;
+  uint16_t offset;                  // Offset of the value in the target structure
+  uint8_t size;                     // Value size or object stride for JSONTypeObjects
+  uint8_t count;                    // Maximum number of objects for JSONTypeObjects
+  const JSONField *fields;          // Object fields table for JSONTypeObjects
+  uint8_t fieldCount;
+};
+
+// Describe a plain value of a structure member
+#define JSON_FIELD(name, type, structType, member) \
+  { name, type, offsetof(structType, member), sizeof(((structType *)0)->member), 0, NULL, 0 }
+
+// Describe a list of objects stored one after another starting from a structure member
+#define JSON_OBJECTS(name, structType, member, stride, count, fields) \
+  { name, JSONTypeObjects, offsetof(structType, member), stride, count, fields, sizeof(fields) / sizeof(*fields) }
+
+class JSONReader
+{
+  public:
+    JSONReader(Stream *in);
+
+    boolean beginObject();                      // Consume the opening brace of an object
+    boolean nextKey(char *key, uint8_t size);   // Read the next key of an object, false at the end of the object
+    boolean beginArray();                       // Consume the opening bracket of an array
+    boolean nextItem();                         // Check if the array has one more item, false at the end of the array
+    boolean readNumber(long *value);
+    boolean readString(char *value, uint8_t size);
+    boolean skipValue();                        // Skip any value including nested objects and arrays
+    uint8_t getDepth();                         // Number of objects and arrays entered so far
+    boolean skipTo(uint8_t depth);              // Skip the rest of nested objects and arrays down to depth
+
+    // Read the rest of the current object decoding known keys into target.
+    // Unknown keys are skipped. Returns false on a malformed or out of range value.
+    boolean readFields(const JSONField *fields, uint8_t fieldCount, void *target);
+
+  private:
+    Stream *_in;
+    int _ahead;                   // One character lookahead, -2 if empty
+    boolean _error;               // Set when an object or an array isn't closed properly
+    uint8_t _depth;               // Objects and arrays opened with beginObject()/beginArray()
+
+    int _peek();                  // Next non-whitespace character (not consumed)
+    int _read();                  // Consume the next character
+    boolean _expect(char ch);
+    boolean _readToken(char *token, uint8_t size);
+    boolean _readValue(const JSONField *field, byte *target);
+    boolean _readObjects(const JSONField *field, byte *target, uint8_t *index);
+};
+
+#endif
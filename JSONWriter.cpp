@@ -0,0 +1,160 @@
+#include "Arduino.h"
+#include "JSONWriter.h"
+
+JSONWriter::JSONWriter(Print *out) :
+  _out(out),
+  _depth(0),
+  _hasItems(0)
+{}
+
+void JSONWriter::beginObject(const __FlashStringHelper *name) {
+  _writeName(name);
+  _push('{');
+}
+
+void JSONWriter::endObject() {
+  _pop('}');
+}
+
+void JSONWriter::beginArray(const __FlashStringHelper *name) {
+  _writeName(name);
+  _push('[');
+}
+
+void JSONWriter::endArray() {
+  _pop(']');
+}
+
+void JSONWriter::addNumber(const __FlashStringHelper *name, long value) {
+  _writeName(name);
+  _out->print(value);
+}
+
+void JSONWriter::addFloat(const __FlashStringHelper *name, double value) {
+  _writeName(name);
+  _writeFloat(value);
+}
+
+void JSONWriter::addString(const __FlashStringHelper *name, const char *value) {
+  _writeName(name);
+  _writeString(value);
+}
+
+void JSONWriter::addString(const __FlashStringHelper *name, const __FlashStringHelper *value) {
+  _writeName(name);
+  _out->write('"');
+  _out->print(value);
+  _out->write('"');
+}
+
+void JSONWriter::addBoolean(const __FlashStringHelper *name, boolean value) {
+  _writeName(name);
+  _out->print(value ? F("true") : F("false"));
+}
+
+void JSONWriter::_push(char bracket) {
+  _out->write(bracket);
+
+  if (_depth < JSONWRITER_MAX_DEPTH - 1) {
+    _depth++;
+    _hasItems &= ~(1 << _depth);
+  }
+}
+
+void JSONWriter::_pop(char bracket) {
+  _out->write(bracket);
+
+  if (_depth > 0) {
+    _depth--;
+  }
+}
+
+void JSONWriter::_writeName(const __FlashStringHelper *name) {
+  // Items on the same level are separated with a comma
+  if (_hasItems & (1 << _depth)) {
+    _out->write(',');
+  }
+
+  _hasItems |= (1 << _depth);
+
+  if (name) {
+    _out->write('"');
+    _out->print(name);
+    _out->write('"');
+    _out->write(':');
+  }
+}
+
+// Escape rules are the same as in aJson
+void JSONWriter::_writeString(const char *value) {
+  _out->write('"');
+
+  while (value && *value) {
+    unsigned char ch = *value++;
+
+    if ((ch > 31) && (ch != '"') && (ch != '\\')) {
+      _out->write(ch);
+      continue;
+    }
+
+    _out->write('\\');
+
+    switch (ch) {
+      case '\\':
+      case '"':
+        _out->write(ch);
+        break;
+      case '\b':
+        _out->write('b');
+        break;
+      case '\f':
+        _out->write('f');
+        break;
+      case '\n':
+        _out->write('n');
+        break;
+      case '\r':
+        _out->write('r');
+        break;
+      case '\t':
+        _out->write('t');
+        break;
+      default:
+        _out->write('u');
+        _out->write('0');
+        _out->write('0');
+        _out->write("0123456789abcdef"[ch >> 4]);
+        _out->write("0123456789abcdef"[ch & 0x0F]);
+    }
+  }
+
+  _out->write('"');
+}
+
+// Same algorithm as aJson uses for printing floats,
+// so the output doesn't change for the clients
+void JSONWriter::_writeFloat(double value) {
+  if (value < 0.0) {
+    _out->write('-');
+    value = -value;
+  }
+
+  // Print the integer part
+  unsigned long integerPart = (unsigned long)value;
+  _out->print(integerPart);
+  _out->write('.');
+
+  // Print at least one fractional digit
+  // and no more than JSONWRITER_FLOAT_PRECISION digits
+  double fractionalPart = value - integerPart;
+  uint8_t n = JSONWRITER_FLOAT_PRECISION;
+  fractionalPart += 0.5 / pow(10.0, JSONWRITER_FLOAT_PRECISION);
+
+  do {
+    fractionalPart *= 10.0;
+    unsigned int digit = (unsigned int)fractionalPart;
+    _out->print(digit);
+    fractionalPart -= (double)digit;
+    n--;
+  } while ((fractionalPart != 0) && (n > 0));
+}
@@ -0,0 +1,48 @@
+/*
+  JSONWriter.h - Streaming JSON emitter. Writes values straight to
+  a Print object (e.g. WebStream or Serial) without building a tree,
+  so no heap memory is used. Output format matches aJson printing.
+*/
+
+#ifndef JSONWriter_h
+#define JSONWriter_h
+
+#include "Arduino.h"
+
+// Maximum nesting level of objects and arrays
+#define JSONWRITER_MAX_DEPTH 16
+
+// Number of digits after the decimal point for float values (same as aJson)
+#define JSONWRITER_FLOAT_PRECISION 5
+
+class JSONWriter
+{
+  public:
+    JSONWriter(Print *out);
+
+    // Names are expected as flash strings, e.g. F("moduleState").
+    // Pass NULL as a name for array items.
+    void beginObject(const __FlashStringHelper *name = NULL);
+    void endObject();
+    void beginArray(const __FlashStringHelper *name = NULL);
+    void endArray();
+
+    void addNumber(const __FlashStringHelper *name, long value);
+    void addFloat(const __FlashStringHelper *name, double value);
+    void addString(const __FlashStringHelper *name, const char *value);
+    void addString(const __FlashStringHelper *name, const __FlashStringHelper *value);  // Value is written as is, no escaping
+    void addBoolean(const __FlashStringHelper *name, boolean value);
+
+  private:
+    Print *_out;
+    uint8_t _depth;               // Current nesting level
+    uint16_t _hasItems;           // Bit per nesting level, set if the level already has items
+
+    void _writeName(const __FlashStringHelper *name); // Writes a separator and "name": prefix
+    void _writeString(const char *value);
+    void _writeFloat(double value);
+    void _push(char bracket);
+    void _pop(char bracket);
+};
+
+#endif
@@ -1,20 +1,28 @@
 #include "Arduino.h"
 #include "HiveStorage.h"
+#include "SensorLog.h"
 #include "LightSwitch.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
 #include "MemoryFree.h"
 #include "HiveUtils.h"
 
 const char LightSwitch::_moduleType[12] = "LightSwitch";
 
+const JSONField LightSwitch::_jsonFields[] PROGMEM = {
+  JSON_FIELD("moduleType", JSONTypeString, request_t, moduleType),
+  JSON_FIELD("moduleState", JSONTypeInt, request_t, settings.moduleState),
+  JSON_FIELD("lightMode", JSONTypeInt, request_t, settings.lightMode)
+};
+
 // TODO: add PULLUP or PULLDOWN resistor mode param in constructor
 
 LightSwitch::LightSwitch(AppContext *context, const byte zone, byte moduleId, int storagePointer, boolean loadSettings, int8_t switchPin, int8_t lightPin) :
   SensorModule(storagePointer, moduleId, zone),
   _switchPin(switchPin),
   _lightPin(lightPin),
+  _switchListener(switchPin, moduleId),
   _context(context) {
 
   _stateChanged = true;
@@ -23,7 +31,12 @@ LightSwitch::LightSwitch(AppContext *context, const byte zone, byte moduleId, in
   // DEBUG
   debugPrint(F("LS: Init LightSwitch"));
 
-  pinMode(_switchPin, INPUT);
+  _switchIO.begin(_switchPin, INPUT);
+
+  // Switch pins without an interrupt are polled in loopDo()
+  if (_switchPin >= 0) {
+    _switchListener.begin();
+  }
 
   if (loadSettings) {
     _loadSettings();
@@ -32,25 +45,25 @@ LightSwitch::LightSwitch(AppContext *context, const byte zone, byte moduleId, in
     _saveSettings();
   }
 
-  pinMode(_lightPin, OUTPUT);
+  _lightIO.begin(_lightPin, OUTPUT);
   _previousSwitchState = _readSwitchState();
 
   if (!_moduleState) {
-    digitalWrite(_lightPin, LIGHTSWITCH_RELAY_OFF);
+    _lightIO.write(LIGHTSWITCH_RELAY_OFF);
   } else {
 
     switch (_lightMode) {
       case 1:
         // If there's a manual "on" override
-        digitalWrite(_lightPin, LIGHTSWITCH_RELAY_ON);
+        _lightIO.write(LIGHTSWITCH_RELAY_ON);
         break;
       case 2:
         // If there's a manual "off" override
-        digitalWrite(_lightPin, LIGHTSWITCH_RELAY_OFF);
+        _lightIO.write(LIGHTSWITCH_RELAY_OFF);
         break;
       case 0:
         // If there's auto switch mode
-        _previousSwitchState ? digitalWrite(_lightPin, LIGHTSWITCH_RELAY_ON) : digitalWrite(_lightPin, LIGHTSWITCH_RELAY_OFF);
+        _previousSwitchState ? _lightIO.write(LIGHTSWITCH_RELAY_ON) : _lightIO.write(LIGHTSWITCH_RELAY_OFF);
         break;
     }
 
@@ -64,6 +77,7 @@ LightSwitch::LightSwitch(AppContext *context, const byte zone, byte moduleId, in
 void LightSwitch::_resetSettings() {
   _debounceTime = 20;
   _debounceCounter = 0;
+  _debouncePending = false;
   _previousSwitchState = 0;
   _previousLightState = 0;
   _moduleState = 1;
@@ -116,7 +130,7 @@ void LightSwitch::_saveSettings() {
 }
 
 byte LightSwitch::_readSwitchState () {
-  return digitalRead(_switchPin);
+  return _switchIO.read();
 }
 
 byte LightSwitch::_readLightState () {
@@ -125,7 +139,7 @@ byte LightSwitch::_readLightState () {
   // So we take it into account and return simple values
   // 1 if the relay is on, 0 - if it's off
 
-  if (digitalRead(_lightPin) == LIGHTSWITCH_RELAY_ON) {
+  if (_lightIO.read() == LIGHTSWITCH_RELAY_ON) {
     return 1;
   } else {
     return 0;
@@ -163,7 +177,10 @@ void LightSwitch::_turnLightAuto() {
   _previousLightState = _readLightState();
 
   if (_switchState != _previousLightState) {
-    _previousSwitchState = !_switchState;
+    // Restart the debounce so loopDo() takes the current switch state
+    _previousSwitchState = _switchState;
+    _debounceCounter = millis();
+    _debouncePending = true;
   }
 
   _stateChanged = true;
@@ -174,48 +191,15 @@ void LightSwitch::_pushNotify() {
   _context->pushNotify(moduleId);
 }
 
-void LightSwitch::getJSONSettings() {
-  // generate json settings only if something's changed
+void LightSwitch::printJSONSettings(JSONWriter *writer) {
   // TODO: mark properties with read-only and read-write types
-
-  if (_stateChanged) {
-
-    aJsonObject *moduleItem = aJson.getArrayItem(*(_context->moduleCollection), moduleId-1);
-    aJsonObject *moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
-
-    // If we have an empty JSON settings structure
-    // then fill it with values
-
-    if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
-
-      // TODO: Add prefixes to param names to mark readonly fields
-      aJson.addStringToObject(moduleItem, "moduleType", _moduleType);
-      aJson.addNumberToObject(moduleItem, "moduleState", _moduleState);
-      aJson.addNumberToObject(moduleItem, "zoneId", _moduleZone);
-      aJson.addNumberToObject(moduleItem, "switchState", _readSwitchState());
-      aJson.addNumberToObject(moduleItem, "lightState", _readLightState());
-      aJson.addNumberToObject(moduleItem, "lightMode", _lightMode);
-
-    } else {
-      // If we have an already initialized settings JSON structure
-      // then just replace the values
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-      moduleItemProperty->valuebool = _moduleState;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "switchState");
-      moduleItemProperty->valueint = _readSwitchState();
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "lightState");
-      moduleItemProperty->valueint = _readLightState();
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "lightMode");
-      moduleItemProperty->valueint = _lightMode;
-    }
-
-    _stateChanged = false;
-
-  }
+  // TODO: Add prefixes to param names to mark readonly fields
+  writer->addString(F("moduleType"), _moduleType);
+  writer->addNumber(F("moduleState"), _moduleState);
+  writer->addNumber(F("zoneId"), _moduleZone);
+  writer->addNumber(F("switchState"), _readSwitchState());
+  writer->addNumber(F("lightState"), _readLightState());
+  writer->addNumber(F("lightMode"), _lightMode);
 }
 
 // TODO: if error, return settings object with error item
@@ -231,32 +215,31 @@ boolean LightSwitch::_validateSettings(config_t *settings) {
   return true;
 }
 
-boolean LightSwitch::setJSONSettings(aJsonObject *moduleItem) {
-  config_t settings;
-  aJsonObject *moduleItemProperty;
+boolean LightSwitch::setJSONSettings(JSONReader *reader) {
+  request_t request;
+
   // Initialiaze to invalid values so the validation works
-  int8_t newModuleState = -1;
-  int8_t newLightMode = -1;
+  // and a missing field fails the request
+  request.moduleType[0] = 0;
+  request.settings.moduleState = -1;
+  request.settings.lightMode = -1;
 
-  // Check for module type first
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
-  if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
+  if (!reader->readFields(_jsonFields, sizeof(_jsonFields) / sizeof(*_jsonFields), &request)) {
     return false;
   }
 
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-  newModuleState = moduleItemProperty->valuebool;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "lightMode");
-  newLightMode = moduleItemProperty->valueint;
-
-  settings.lightMode = newLightMode;
-  settings.moduleState = newModuleState;
+  // Check for module type first
+  if (strcmp(request.moduleType, _moduleType) != 0) {
+    return false;
+  }
 
-  if (!_validateSettings(&settings)) {
+  if (!_validateSettings(&request.settings)) {
     return false;
   }
 
+  int8_t newModuleState = request.settings.moduleState;
+  int8_t newLightMode = request.settings.lightMode;
+
   if (_moduleState != newModuleState) {
     newModuleState ? turnModuleOn() : turnModuleOff();
   }
@@ -280,31 +263,69 @@ boolean LightSwitch::setJSONSettings(aJsonObject *moduleItem) {
 
 void LightSwitch::turnModuleOff() {
   if (_moduleState) {
-    digitalWrite(_lightPin, LIGHTSWITCH_RELAY_OFF);
+    _lightIO.write(LIGHTSWITCH_RELAY_OFF);
     _moduleState = false;
     _stateChanged = true;
     _saveSettings();
+
+    // Module state is critical, don't defer writing it
+    flushStorage();
   }
 }
 
 void LightSwitch::turnModuleOn() {
   if (!_moduleState) {
-    _switchState = digitalRead(_switchPin);
+    // Edges captured while the module was off aren't replayed,
+    // the current level is taken instead
+    _switchListener.flush();
+    _debouncePending = false;
+    _switchState = _switchIO.read();
 
     // Check current operation mode (auto or manual override)
     if (_lightMode == 0) {
-      _switchState ? digitalWrite(_lightPin, LIGHTSWITCH_RELAY_ON) : digitalWrite(_lightPin, LIGHTSWITCH_RELAY_OFF);
+      _switchState ? _lightIO.write(LIGHTSWITCH_RELAY_ON) : _lightIO.write(LIGHTSWITCH_RELAY_OFF);
     } else {
-      _lightMode == 1 ? digitalWrite(_lightPin, LIGHTSWITCH_RELAY_ON) : digitalWrite(_lightPin, LIGHTSWITCH_RELAY_OFF);
+      _lightMode == 1 ? _lightIO.write(LIGHTSWITCH_RELAY_ON) : _lightIO.write(LIGHTSWITCH_RELAY_OFF);
     }
 
     _moduleState = true;
     _stateChanged = true;
     _saveSettings();
+
+    // Module state is critical, don't defer writing it
+    flushStorage();
   }
 }
 
-void LightSwitch::loopDo() {
+// The switch has been stable for the debounce time
+void LightSwitch::_switchSettled() {
+  _debouncePending = false;
+
+  if (_switchState != _previousLightState) {
+    if (_lightMode >= 1) {
+      // If there's a manual override of whatever kind
+      // count switch flips while in override mode
+      _switchCount++;
+    }
+    // If we are in auto switching mode
+    if (_lightMode == 0) {
+      // switch the light if previous light state differs and switch is debounced
+      _switchState ? _lightIO.write(LIGHTSWITCH_RELAY_ON) : _lightIO.write(LIGHTSWITCH_RELAY_OFF);
+
+      _previousLightState = _readLightState();
+      sensorLog.append(moduleId, SENSORLOG_RELAY, _previousLightState);
+
+      // Notify remote server
+      _pushNotify();
+      _stateChanged = true;
+      _switchCount = 0;
+    }
+  }
+}
+
+unsigned long LightSwitch::loopDo() {
+  pinEvent_t event;
+
   // If the module is on now
   if (_moduleState) {
     // If the module is in the override mode, user can bring it back
@@ -317,48 +338,50 @@ void LightSwitch::loopDo() {
       _switchCount = 0;
     } else if (_lightMode == 1 && _previousLightState == 0) {
       // If we have manual "on" override mode
-      digitalWrite(_lightPin, LIGHTSWITCH_RELAY_ON);
+      _lightIO.write(LIGHTSWITCH_RELAY_ON);
       _previousLightState = 1;
     } else if (_lightMode == 2 && _previousLightState == 1) {
       // If we have manual "off" override mode
-      digitalWrite(_lightPin, LIGHTSWITCH_RELAY_OFF);
+      _lightIO.write(LIGHTSWITCH_RELAY_OFF);
       _previousLightState = 0;
     }
 
-    // Let's debounce the switch
+    // Let's debounce the switch.
+    // Edges come timestamped from the interrupt, so the debounce doesn't depend
+    // on how often we get here. Every edge restarts the debounce time, and
+    // edges are taken one at a time, so a level which held for the debounce
+    // time before the next edge counts even if both edges are read at once.
+
+    _switchListener.poll();
 
-    _switchState = _readSwitchState();
+    while (_switchListener.read(&event)) {
+      if (_debouncePending && (event.time - _debounceCounter) > _debounceTime) {
+        _switchSettled();
+      }
 
-    if (_previousSwitchState != _switchState) {
-      _debounceCounter = millis();
+      _switchState = event.level;
       _previousSwitchState = _switchState;
+      _debounceCounter = event.time;
+      _debouncePending = true;
     }
 
-    if ((_debounceCounter > 0) && (millis() - _debounceCounter) > _debounceTime) {
-      // we reach here if the switch is stable for the debounce time
-      _debounceCounter = 0;
-
-      if (_switchState != _previousLightState) {
-        if (_lightMode >= 1) {
-          // If there's a manual override of whatever kind
-          // count switch flips while in override mode
-           _switchCount++;
-        }
-        // If we are in auto switching mode
-        if (_lightMode == 0) {
-          // switch the light if previous light state differs and switch is debounced
-          _switchState ? digitalWrite(_lightPin, LIGHTSWITCH_RELAY_ON) : digitalWrite(_lightPin, LIGHTSWITCH_RELAY_OFF);
-
-          _previousLightState = _readLightState();
-
-          // Notify remote server
-          _pushNotify();
-          _stateChanged = true;
-          _switchCount = 0;
-        }
-      }
-      // end switch after debounce
+    if (_debouncePending && (millis() - _debounceCounter) > _debounceTime) {
+      _switchSettled();
+    }
+
+    // Handle a double flip right away
+    if (_switchCount >= 2) {
+      return 0;
+    }
+
+    // Come back when the switch has been stable for the debounce time
+    if (_debouncePending) {
+      return timeLeft(_debounceCounter, _debounceTime + 1);
     }
-    // end check if debounced
+
+    // The next edge wakes us up, a pin without interrupt has to be polled
+    return _switchListener.isInterruptDriven() ? SENSORMODULE_IDLE_TIME : _PollTime;
   }
+
+  return SENSORMODULE_IDLE_TIME;
 }
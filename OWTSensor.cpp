@@ -1,8 +1,9 @@
 #include "Arduino.h"
 #include "HiveStorage.h"
+#include "SensorLog.h"
 #include "OWTSensor.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
 #include "MemoryFree.h"
 #include "OneWire.h"
@@ -11,6 +12,12 @@
 
 const char OWTSensor::_moduleType[12] = "OWTSensor";
 
+const JSONField OWTSensor::_jsonFields[] PROGMEM = {
+  JSON_FIELD("moduleType", JSONTypeString, request_t, moduleType),
+  JSON_FIELD("moduleState", JSONTypeInt, request_t, settings.moduleState),
+  JSON_FIELD("measureUnits", JSONTypeInt, request_t, settings.measureUnits)
+};
+
 OWTSensor::OWTSensor(AppContext *context, const byte zone, byte moduleId, int storagePointer, boolean loadSettings, int8_t signalPin, int8_t resolution, uint8_t deviceIndex) :
   SensorModule(storagePointer, moduleId, zone),
   _signalPin(signalPin),
@@ -18,8 +25,9 @@ OWTSensor::OWTSensor(AppContext *context, const byte zone, byte moduleId, int st
   _context(context),
   _deviceIndex(deviceIndex) {
 
-  _oneWire = new OneWire(signalPin);
-  _dt = new DallasTemperature(_oneWire);
+  _bus = OneWireBus::get(signalPin);
+  _slot = _bus ? _bus->addSensor(_address, resolution) : -1;
+  _sample = 0;
 
   _stateChanged = true;
   _resetSettings();
@@ -34,44 +42,12 @@ OWTSensor::OWTSensor(AppContext *context, const byte zone, byte moduleId, int st
     _saveSettings();
   }
 
-  _dt->begin();
-
-  uint8_t deviceCount = _dt->getDeviceCount();
-  DeviceAddress deviceAddress;
-
-  if (deviceCount == 0) {
+  if (_moduleState && !_resolveAddress()) {
     _moduleState = 0;
     _temperature = 65535;
   }
 
-  if (deviceCount > 0) {
-    if (!_dt->getAddress(deviceAddress, _deviceIndex)) {
-      _moduleState = 0;
-      _temperature = 65535;
-    }
-  }
-
-  if (_moduleState) {
-    _dt->setResolution(deviceAddress, _resolution);
-    _dt->setWaitForConversion(false);
-    _dt->requestTemperatures();
-
-    _measureInterval = 750 / (1 << (12 - _resolution));
-    delay(_measureInterval);
-
-    _temperature = (double) _dt->getTempC(deviceAddress);
-
-    if (isnan(_temperature) != 0) {
-      _temperature = 65535;
-    }
-
-    _intervalCounter = millis();
-
-    // DEBUG
-    debugPrint(F("OWT: Temp on init: "), false);
-    debugPrint(_temperature);
-  }
-
+  // The first reading comes with the first bus sweep
   // DEBUG
   debugPrint(F("OWT: Finished OWTSensor init"));
 }
@@ -80,6 +56,7 @@ void OWTSensor::_resetSettings() {
   _moduleState = 1;
   _measureUnits = 0;
   _temperature = 65535;
+  memset(_address, 0, sizeof(_address));
 }
 
 byte OWTSensor::getStorageSize() {
@@ -104,6 +81,7 @@ void OWTSensor::_loadSettings() {
   if (isLoaded) {
     _measureUnits = settings.measureUnits;
     _moduleState = settings.moduleState;
+    memcpy(_address, settings.address, sizeof(_address));
   } else {
     // If unable to read then reset settings to default
     // and try write them back to fix the storage
@@ -123,57 +101,79 @@ void OWTSensor::_saveSettings() {
 
   settings.measureUnits = _measureUnits;
   settings.moduleState = _moduleState;
+  memcpy(settings.address, _address, sizeof(_address));
 
   writeStorage(_storagePointer, settings);
 }
 
-double OWTSensor::getTemperature() {
-  if (_measureUnits == 0) {
-    return _temperature;
-  } else {
-    float f = (float) _temperature;
-    double d = (double) DallasTemperature::toFahrenheit(f);
-    return d;
-  }
+boolean OWTSensor::_isAddressValid() {
+  return (_address[0] != 0) && (OneWire::crc8(_address, 7) == _address[7]);
 }
 
-void OWTSensor::getJSONSettings() {
-  // generate json settings only if something's changed
-  // TODO: mark properties with read-only and read-write types
+// A known sensor is checked with a single addressed scratchpad read,
+// the bus is searched only when there's no ROM code yet or the sensor has been replaced
+boolean OWTSensor::_resolveAddress() {
+  if (_slot < 0) {
+    return false;
+  }
 
-  if (_stateChanged) {
+  DallasTemperature *dt = _bus->getDallas();
 
-    aJsonObject *moduleItem = aJson.getArrayItem(*(_context->moduleCollection), moduleId-1);
-    aJsonObject *moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
+  if (!_isAddressValid() || !dt->isConnected(_address)) {
+    DeviceAddress deviceAddress;
 
-    // If we have an empty JSON settings structure
-    // then fill it with values
+    // DEBUG
+    debugPrint(F("OWT: Searching the bus"));
 
-    if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
+    dt->begin();
 
-      // TODO: Add prefixes to param names to mark readonly fields
-      aJson.addStringToObject(moduleItem, "moduleType", _moduleType);
-      aJson.addNumberToObject(moduleItem, "moduleState", _moduleState);
-      aJson.addNumberToObject(moduleItem, "zoneId", _moduleZone);
-      aJson.addNumberToObject(moduleItem, "temperature", _temperature);
-      aJson.addNumberToObject(moduleItem, "measureUnits", _measureUnits);
-    } else {
-      // If we have an already initialized settings JSON structure
-      // then just replace the values
+    if (!dt->getAddress(deviceAddress, _deviceIndex)) {
+      return false;
+    }
 
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-      moduleItemProperty->valuebool = _moduleState;
+    memcpy(_address, deviceAddress, sizeof(_address));
+    _saveSettings();
+  }
 
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "temperature");
-      moduleItemProperty->valuefloat = getTemperature();
+  dt->setResolution(_address, _resolution);
+  _bus->checkPower();
+  _bus->setActive(_slot, true);
 
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "measureUnits");
-      moduleItemProperty->valueint = _measureUnits;
-    }
+  return true;
+}
 
-    _stateChanged = false;
+double OWTSensor::getTemperature() {
+  if (_measureUnits == 0) {
+    return _temperature;
+  } else {
+    float f = (float) _temperature;
+    double d = (double) DallasTemperature::toFahrenheit(f);
+    return d;
+  }
+}
 
+void OWTSensor::printJSONSettings(JSONWriter *writer) {
+  // TODO: mark properties with read-only and read-write types
+  // TODO: Add prefixes to param names to mark readonly fields
+  writer->addString(F("moduleType"), _moduleType);
+  writer->addNumber(F("moduleState"), _moduleState);
+  writer->addNumber(F("zoneId"), _moduleZone);
+  writer->addFloat(F("temperature"), getTemperature());
+  writer->addNumber(F("measureUnits"), _measureUnits);
+
+  char address[17];
+
+  for (uint8_t i = 0; i < 8; i++) {
+    address[i * 2] = "0123456789ABCDEF"[_address[i] >> 4];
+    address[i * 2 + 1] = "0123456789ABCDEF"[_address[i] & 0x0F];
   }
+
+  address[16] = 0;
+  writer->addString(F("address"), address);
+}
+
+void OWTSensor::printJSONHistory(JSONWriter *writer) {
+  _history.printJSON(writer, F("temperature"));
 }
 
 // TODO: if error, return settings object with error item
@@ -189,32 +189,31 @@ boolean OWTSensor::_validateSettings(config_t *settings) {
   return true;
 }
 
-boolean OWTSensor::setJSONSettings(aJsonObject *moduleItem) {
-  config_t settings;
-  aJsonObject *moduleItemProperty;
+boolean OWTSensor::setJSONSettings(JSONReader *reader) {
+  request_t request;
+
   // Initialiaze to invalid values so the validation works
-  int8_t newMeasureUnits = -1;
-  int8_t newModuleState = -1;
+  // and a missing field fails the request
+  request.moduleType[0] = 0;
+  request.settings.moduleState = -1;
+  request.settings.measureUnits = -1;
 
-  // Check for module type first
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
-  if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
+  if (!reader->readFields(_jsonFields, sizeof(_jsonFields) / sizeof(*_jsonFields), &request)) {
     return false;
   }
 
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-  newModuleState = moduleItemProperty->valuebool;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "measureUnits");
-  newMeasureUnits = moduleItemProperty->valueint;
-
-  settings.measureUnits = newMeasureUnits;
-  settings.moduleState = newModuleState;
+  // Check for module type first
+  if (strcmp(request.moduleType, _moduleType) != 0) {
+    return false;
+  }
 
-  if (!_validateSettings(&settings)) {
+  if (!_validateSettings(&request.settings)) {
     return false;
   }
 
+  int8_t newModuleState = request.settings.moduleState;
+  int8_t newMeasureUnits = request.settings.measureUnits;
+
   if (_moduleState != newModuleState) {
     newModuleState ? turnModuleOn() : turnModuleOff();
   }
@@ -230,50 +229,61 @@ boolean OWTSensor::setJSONSettings(aJsonObject *moduleItem) {
 
 void OWTSensor::turnModuleOff() {
   if (_moduleState) {
+    if (_slot >= 0) {
+      _bus->setActive(_slot, false);
+    }
+
     _temperature = 65535;
     _moduleState = false;
     _stateChanged = true;
     _saveSettings();
+
+    // Module state is critical, don't defer writing it
+    flushStorage();
   }
 }
 
 void OWTSensor::turnModuleOn() {
   if (!_moduleState) {
 
-    _temperature = (double) _dt->getTempCByIndex(_deviceIndex);
-
-    if (isnan(_temperature) != 0) {
-      _temperature = 65535;
-    }
+    // The reading comes with the next bus sweep
+    _resolveAddress();
 
     _moduleState = true;
     _stateChanged = true;
     _saveSettings();
+
+    // Module state is critical, don't defer writing it
+    flushStorage();
   }
 }
 
-void OWTSensor::loopDo() {
+unsigned long OWTSensor::loopDo() {
   // If the module is on now
-  if (_moduleState) {
-
-    // If it's time to measure
-    if (timeDiff(_intervalCounter) >= _measureInterval) {
-
-      // Get new values
-      double newTemperature = (double) _dt->getTempCByIndex(_deviceIndex);
+  if (_moduleState && (_slot >= 0)) {
+    // Any sensor on the bus may drive the conversion cycle
+    unsigned long left = _bus->run();
+    float newTemperature;
+
+    // Get new values after each bus sweep
+    if (_bus->read(_slot, &_sample, &newTemperature)) {
+      if ((newTemperature != DEVICE_DISCONNECTED_C) && (isnan(newTemperature) == 0)) {
+        _history.add(newTemperature);
+        sensorLog.append(moduleId, SENSORLOG_TEMPERATURE, newTemperature);
+      }
 
-      if (newTemperature != _temperature) {
+      if ((newTemperature != _temperature) && (newTemperature != DEVICE_DISCONNECTED_C)) {
         if (isnan(newTemperature) == 0) {
           _temperature = newTemperature;
         }
 
         _stateChanged = true;
       }
-
-      // Reset time interval counter
-      _intervalCounter = millis();
-      _dt->requestTemperatures();
     }
 
+    // Sleep until the bus finishes the next conversion
+    return left;
   }
+
+  return SENSORMODULE_IDLE_TIME;
 }
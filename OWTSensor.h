@@ -11,11 +11,13 @@
 
 #include "Arduino.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
 
 #include "OneWire.h"
 #include "DallasTemperature.h"
+#include "OneWireBus.h"
+#include "SampleHistory.h"
 
 class OWTSensor : public SensorModule
 {
@@ -29,9 +31,10 @@ class OWTSensor : public SensorModule
 
     const char* getModuleType();
     byte getStorageSize();
-    void loopDo();
-    void getJSONSettings(); // Fill-in module settings in JSON object through _context property
-    boolean setJSONSettings(aJsonObject *moduleItem); // Update settings from JSON object through _context property
+    unsigned long loopDo();
+    void printJSONSettings(JSONWriter *writer); // Write module settings as JSON object fields
+    boolean setJSONSettings(JSONReader *reader); // Update settings from JSON object fields
+    void printJSONHistory(JSONWriter *writer);  // Write temperature history
 
     void turnModuleOff();         // Turn module off
     void turnModuleOn();          // Turn module on
@@ -43,26 +46,39 @@ class OWTSensor : public SensorModule
     {
       int8_t measureUnits;        // Measurment units: 0 - Celcius, 1 - Fahrenheit
       int8_t moduleState;         // int8 used to store invalid values for validation purposes
+      DeviceAddress address;      // ROM code of the sensor found last time, kept so the bus isn't searched again
     };
 
-    uint8_t _deviceIndex;         // 1-Wire device index
+    // PUT request structure, filled by JSONReader
+    typedef struct request_t
+    {
+      char moduleType[16];
+      config_t settings;
+    };
+
+    static const JSONField _jsonFields[];  // PUT request fields table (in PROGMEM)
+
+    uint8_t _deviceIndex;         // 1-Wire device index, used to find the sensor when there's no known ROM code
+    DeviceAddress _address;       // Sensor ROM code, all zeros if unknown
     int8_t _measureUnits;         // Measurment units: 0 - Celcius, 1 - Fahrenheit
     int8_t _signalPin;            // Signal pin number
-    uint8_t _measureInterval;     // Measuring interval (seconds)
     double _temperature;          // Stores last measured temperature value. Value of 65535 means no last value is known
     int8_t _resolution;
-    unsigned long _intervalCounter;        //
+    unsigned long _sample;        // Bus sample number of the last reading
+    SampleHistory _history;       // Temperature history (Celsius)
 
     static const char _moduleType[12];   // Module type string
 
     boolean _stateChanged;        // Set to TRUE if anything (settings) - to prevent filling settings in again
                                   // e.g. when the server asks for current settings
     AppContext *_context;         // Pointer to the AppContext object
-    DallasTemperature *_dt;       // Dallas library instance
-    OneWire *_oneWire;
+    OneWireBus *_bus;             // Bus shared with the other sensors on the pin
+    int8_t _slot;                 // Sensor slot on the bus, -1 if the bus has no room
     void _saveSettings();         // Puts settings into storage
     void _loadSettings();         // Loads settings from storage
     void _resetSettings();        // Resets settings to default values
+    boolean _resolveAddress();    // Verify the cached ROM code or search the bus for it, true if the sensor is there
+    boolean _isAddressValid();
 
     boolean _validateSettings(config_t *settings);
 };
@@ -0,0 +1,133 @@
+#include "Arduino.h"
+#include "OneWireBus.h"
+#include "HiveUtils.h"
+
+OneWireBus *OneWireBus::_buses[ONEWIREBUS_MAX_BUSES];
+uint8_t OneWireBus::_busCount = 0;
+
+OneWireBus *OneWireBus::get(uint8_t pin) {
+  for (uint8_t i = 0; i < _busCount; i++) {
+    if (_buses[i]->_pin == pin) {
+      return _buses[i];
+    }
+  }
+
+  if (_busCount >= ONEWIREBUS_MAX_BUSES) {
+    return NULL;
+  }
+
+  OneWireBus *bus = new OneWireBus(pin);
+  _buses[_busCount++] = bus;
+
+  return bus;
+}
+
+OneWireBus::OneWireBus(uint8_t pin) :
+  _pin(pin),
+  _oneWire(pin),
+  _dt(&_oneWire),
+  _parasite(false),
+  _converting(false),
+  _convertTime(0),
+  _sample(0),
+  _count(0)
+{}
+
+int8_t OneWireBus::addSensor(const uint8_t *address, uint8_t resolution) {
+  if (_count >= ONEWIREBUS_MAX_SENSORS) {
+    return -1;
+  }
+
+  uint8_t slot = _count++;
+
+  _addresses[slot] = address;
+  _active[slot] = false;
+  _temperatures[slot] = DEVICE_DISCONNECTED_C;
+
+  // The bus waits for the slowest sensor
+  uint16_t convertTime = 750 >> (12 - resolution);
+
+  if (convertTime > _convertTime) {
+    _convertTime = convertTime;
+  }
+
+  return slot;
+}
+
+void OneWireBus::setActive(uint8_t slot, boolean active) {
+  if (slot < _count) {
+    _active[slot] = active;
+
+    // Don't hand out a reading from before the sensor was off
+    _temperatures[slot] = DEVICE_DISCONNECTED_C;
+  }
+}
+
+// Parasite powered sensors answer Read Power Supply with a zero,
+// one of them is enough to hold the line high for everyone
+void OneWireBus::checkPower() {
+  _oneWire.reset();
+  _oneWire.skip();
+  _oneWire.write(_CommandReadPower);
+  _parasite = (_oneWire.read_bit() == 0);
+  _oneWire.reset();
+}
+
+unsigned long OneWireBus::run() {
+  if (!_converting) {
+    _startConversion();
+    return _convertTime;
+  }
+
+  unsigned long left = timeLeft(_convertStart, _convertTime);
+
+  if (left > 0) {
+    return left;
+  }
+
+  // Read everyone, then start over right away
+  _readAll();
+  _startConversion();
+
+  return _convertTime;
+}
+
+boolean OneWireBus::read(uint8_t slot, unsigned long *sample, float *temperature) {
+  if ((slot >= _count) || (*sample == _sample)) {
+    return false;
+  }
+
+  *sample = _sample;
+  *temperature = _temperatures[slot];
+
+  return true;
+}
+
+OneWire *OneWireBus::getOneWire() {
+  return &_oneWire;
+}
+
+DallasTemperature *OneWireBus::getDallas() {
+  return &_dt;
+}
+
+// All the sensors convert at once
+void OneWireBus::_startConversion() {
+  _oneWire.reset();
+  _oneWire.skip();
+  _oneWire.write(_CommandConvert, _parasite);
+
+  _convertStart = millis();
+  _converting = true;
+}
+
+// Each scratchpad read is addressed, so no search is needed
+void OneWireBus::_readAll() {
+  for (uint8_t i = 0; i < _count; i++) {
+    if (_active[i]) {
+      _temperatures[i] = _dt.getTempC(_addresses[i]);
+    }
+  }
+
+  _sample++;
+}
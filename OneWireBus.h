@@ -0,0 +1,69 @@
+/*
+  OneWireBus.h - Shared 1-Wire bus for DS18x20 temperature sensors.
+  One bus object is kept per pin. All the sensors on the bus are told
+  to convert at once with Skip ROM, and once the conversion time is out
+  their scratchpads are read in one sweep, so the whole bus refreshes
+  in a single conversion period.
+*/
+
+#ifndef OneWireBus_h
+#define OneWireBus_h
+
+#include "Arduino.h"
+#include "OneWire.h"
+#include "DallasTemperature.h"
+
+// Maximum number of buses (pins)
+#define ONEWIREBUS_MAX_BUSES 2
+
+// Maximum number of sensors on a bus
+#define ONEWIREBUS_MAX_SENSORS 8
+
+class OneWireBus
+{
+  public:
+    // Bus for the pin, created on the first call. NULL if there's no room for another bus.
+    static OneWireBus *get(uint8_t pin);
+
+    // Register a sensor, returns its slot or -1 if the bus is full.
+    // The address is kept by reference, so the owner can update it later.
+    int8_t addSensor(const uint8_t *address, uint8_t resolution);
+    void setActive(uint8_t slot, boolean active);   // Inactive sensors are not read
+
+    void checkPower();            // Find out if any sensor is powered from the data line
+    unsigned long run();          // Advance the conversion cycle, returns ms to the next call
+
+    // Last reading of the sensor, false if it hasn't changed since the given sample number
+    boolean read(uint8_t slot, unsigned long *sample, float *temperature);
+
+    OneWire *getOneWire();
+    DallasTemperature *getDallas();
+
+  private:
+    OneWireBus(uint8_t pin);
+
+    static const uint8_t _CommandConvert = 0x44;    // 1-Wire function commands
+    static const uint8_t _CommandReadPower = 0xB4;
+
+    uint8_t _pin;
+    OneWire _oneWire;
+    DallasTemperature _dt;
+    boolean _parasite;            // Keep the line powered during conversions
+    boolean _converting;
+    unsigned long _convertStart;
+    uint16_t _convertTime;        // Conversion time of the slowest sensor (ms)
+    unsigned long _sample;        // Number of completed sweeps
+
+    const uint8_t *_addresses[ONEWIREBUS_MAX_SENSORS];
+    boolean _active[ONEWIREBUS_MAX_SENSORS];
+    float _temperatures[ONEWIREBUS_MAX_SENSORS];
+    uint8_t _count;
+
+    static OneWireBus *_buses[ONEWIREBUS_MAX_BUSES];
+    static uint8_t _busCount;
+
+    void _startConversion();
+    void _readAll();
+};
+
+#endif
@@ -3,11 +3,11 @@
 
 // Parts from http://www.mstarlabs.com/apeng/techniques/pidsoftw.html
 
-PID::PID (float kP, float kI, float kD, float *input, float *output, float limitMin, float limitMax, float *setpoint, uint16_t timeStep, boolean direction) :
+template <class T> PIDController<T>::PIDController (float kP, float kI, float kD, T *input, T *output, T limitMin, T limitMax, T *setpoint, uint16_t timeStep, boolean direction) :
   _input(input),
   _output(output),
-  _limitMin(limitMin),
   _limitMax(limitMax),
+  _limitMin(limitMin),
   _setpoint(setpoint),
   _timeStep(timeStep) {
 
@@ -21,60 +21,61 @@ PID::PID (float kP, float kI, float kD, float *input, float *output, float limit
   _direction = true;
   setControlDirection(_direction);
   _useFilter = false;
+  _tuningTimedOut = false;
 }
 
 // Sets PID coefs with respect to the sample time
 // Since sample time is equal for every control loop
 // we can put it "inside" the coefs instead of integral/derivative equations
-void PID::setKs(float kP, float kI, float kD) {
+template <class T> void PIDController<T>::setKs(float kP, float kI, float kD) {
 
-  _kP = kP;
-  _kI = kI * (float)_timeStep;
-  _kD = kD / (float)_timeStep;
+  _kP = T(kP);
+  _kI = T(kI * (float)_timeStep);
+  _kD = T(kD / (float)_timeStep);
 
 }
 
-float PID::getKp() {
-  return _kP;
+template <class T> float PIDController<T>::getKp() {
+  return toFloat(_kP);
 }
 
-float PID::getKi() {
-  return _kI;
+template <class T> float PIDController<T>::getKi() {
+  return toFloat(_kI);
 }
 
-float PID::getKd() {
-  return _kD;
+template <class T> float PIDController<T>::getKd() {
+  return toFloat(_kD);
 }
 
 // Change the sample time on the go
 // keeping in mind we've built the sample time into the coefs
-void PID::setTimeStep(uint16_t timeStep) {
+template <class T> void PIDController<T>::setTimeStep(uint16_t timeStep) {
   if (timeStep > 0)
   {
     float ratio  = (float)timeStep / (float)_timeStep;
-    _kI *= ratio;
-    _kD /= ratio;
+    _kI = T(toFloat(_kI) * ratio);
+    _kD = T(toFloat(_kD) / ratio);
     _timeStep = timeStep;
   }
 }
 
 // If we're back from manual mode we need a reset
-void PID::resetCalc() {
+template <class T> void PIDController<T>::resetCalc() {
   _integralTerm = *_output;
   _previousInput = *_input;
   _integralTerm = constrain(_integralTerm, _limitMin, _limitMax);
 }
 
 // Limit the controller output so it doesn't "overrun" at limits
-void PID::setOutputLimits(float limitMin, float limitMax) {
+template <class T> void PIDController<T>::setOutputLimits(T limitMin, T limitMax) {
   _limitMax = limitMax;
   _limitMin = limitMin;
   _constrainOutput();
 }
 
 // Apply the output limits
-void PID::_constrainOutput() {
-  float old_output = *_output;
+template <class T> void PIDController<T>::_constrainOutput() {
+  T old_output = *_output;
   *_output = constrain(*_output, _limitMin, _limitMax);
 
   if (*_output != old_output) {
@@ -83,23 +84,23 @@ void PID::_constrainOutput() {
 }
 
 // https://bitbucket.org/osrf/drcsim/issue/92/request-to-provide-integral-tie-back
-void PID::_adjustIntegralTerm() {
+template <class T> void PIDController<T>::_adjustIntegralTerm() {
   // Apply a tieback if output is cut by limits
   _integralTerm = *_output - _kP * _error + _kD * (*_input - _previousInput);
 }
 
 // Reverse controller direction
-void PID::setControlDirection(boolean direction) {
+template <class T> void PIDController<T>::setControlDirection(boolean direction) {
   if (direction != _direction) {
-    _kP = 0 - _kP;
-    _kI = 0 - _kI;
-    _kD = 0 - _kD;
+    _kP = -_kP;
+    _kI = -_kI;
+    _kD = -_kD;
     _direction = direction;
   }
 }
 
 // Calculate PID output
-boolean PID::doControl() {
+template <class T> boolean PIDController<T>::doControl() {
   unsigned long now = millis();
 
   // TODO: fix millis reset at 55-th day
@@ -112,12 +113,12 @@ boolean PID::doControl() {
       _error = *_setpoint - *_input;
       _integralTerm += (_kI * _error);
       _integralTerm = constrain(_integralTerm, _limitMin, _limitMax);
-      float derivativeTerm = _kD * (*_input - _previousInput);
+      T derivativeTerm = _kD * (*_input - _previousInput);
 
       *_output = _kP * _error + _integralTerm - derivativeTerm;
 
       // DEBUG
-      debugPrint(*_output, false);
+      debugPrint(toFloat(*_output), false);
       debugPrint(";", false);
 
       _constrainOutput();
@@ -135,26 +136,29 @@ boolean PID::doControl() {
 
 // Auto-tune a PI controller with kD = 0
 // using SIMC tuning method
-void PID::initPITuning(uint16_t steadyTreshold, float noiseTreshold) {
+template <class T> void PIDController<T>::initPITuning(uint16_t steadyTreshold, T noiseTreshold) {
 
   // Set initial output 50% of maximum
-  _tuningOutput1 = _limitMin / 2 + _limitMax / 2;
+  _tuningOutput1 = _limitMin * T(0.5f) + _limitMax * T(0.5f);
 
   // DEBUG
   debugPrint("Output 1: ", false);
-  debugPrint(_tuningOutput1);
+  debugPrint(toFloat(_tuningOutput1));
 
   // Set step output 30% of initial output
-  _tuningOutput2 = 1.3f * _tuningOutput1;
+  _tuningOutput2 = _tuningOutput1 * T(1.3f);
 
   // DEBUG
   debugPrint("Output 2: ", false);
-  debugPrint(_tuningOutput2);
+  debugPrint(toFloat(_tuningOutput2));
 
   // Set tresholds
   _noiseTreshold = noiseTreshold;
   _steadyTreshold = steadyTreshold;
 
+  _tuningMethod = PID_TUNING_SIMC;
+  _tuningTimedOut = false;
+
   // Tuning state reflects experiment stages
   _tuningState = 0;
 
@@ -168,16 +172,36 @@ void PID::initPITuning(uint16_t steadyTreshold, float noiseTreshold) {
 
   // Reset input change, stabilized input before a step change
   _inputStart = *_input;
-  _inputChange = 0;
+  _inputChange = T(0);
 
   _steadyCount = 0;
 
   _startTuningTime = millis();
 }
 
+// Auto-tune a PI controller with kD = 0 by relay feedback (Astrom-Hagglund).
+// The output is switched between its limits whenever the input leaves
+// the hysteresis band around the setpoint, which makes the process
+// oscillate at its ultimate period. The first oscillation is skipped,
+// the next ones give the ultimate period and gain.
+// It takes a few oscillations instead of four steady states.
+template <class T> void PIDController<T>::initRelayTuning(uint8_t cycles, T hysteresis) {
+  _tuningMethod = PID_TUNING_RELAY;
+  _tuningTimedOut = false;
+  _noiseTreshold = hysteresis;
+  _relayCycles = cycles > 0 ? cycles : 1;
+  _relayHigh = false;
+  _relaySwitches = 0;
+  _relayPeriodSum = 0;
+  _relayAmplitudeSum = 0;
+  _inputMax = _inputMin = *_input;
+  _processTime = 0;
+  _startTuningTime = millis();
+}
+
 // Setup kalman filter for tuning
 // http://interactive-matter.eu/blog/2009/12/18/filtering-sensor-data-with-a-kalman-filter/
-void PID::initFilter(filter_t *filterState, boolean useFilter) {
+template <class T> void PIDController<T>::initFilter(filter_t *filterState, boolean useFilter) {
   _filterState = filterState;
   _useFilter = useFilter;
 
@@ -187,17 +211,21 @@ void PID::initFilter(filter_t *filterState, boolean useFilter) {
 }
 
 // Apply a Kalman filter
-void PID::_doFilter() {
+template <class T> void PIDController<T>::_doFilter() {
   if (_useFilter) {
     _filterState->p = _filterState->p + _filterState->q;
     _filterState->k = _filterState->p / (_filterState->p + _filterState->r);
-    *_input = _previousInput + _filterState->k * (*_input - _previousInput);
+    *_input = _previousInput + T(_filterState->k) * (*_input - _previousInput);
     _filterState->p = (1 - _filterState->k) * _filterState->p;
   }
 }
 
 // Run the tuning iteration
-boolean PID::doPITuning() {
+template <class T> boolean PIDController<T>::doPITuning() {
+
+  if (_tuningMethod == PID_TUNING_RELAY) {
+    return _doRelayTuning();
+  }
 
   // Tuning step 1 - stabilize at initial output, get theta value
   if (_tuningState == 0) {
@@ -210,7 +238,7 @@ boolean PID::doPITuning() {
       // DEBUG
       debugPrint("Finished step 1");
       debugPrint("Stabilized at ", false);
-      debugPrint(*_input);
+      debugPrint(toFloat(*_input));
 
       // Tuning isn't completed yet
       return false;
@@ -228,7 +256,7 @@ boolean PID::doPITuning() {
       // DEBUG
       debugPrint("Finished step 2");
       debugPrint("Stabilized at ", false);
-      debugPrint(*_input);
+      debugPrint(toFloat(*_input));
 
       return false;
     }
@@ -245,7 +273,7 @@ boolean PID::doPITuning() {
       // DEBUG
       debugPrint("Finished step 3");
       debugPrint("Stabilized at ", false);
-      debugPrint(*_input);
+      debugPrint(toFloat(*_input));
 
       return false;
     }
@@ -257,7 +285,7 @@ boolean PID::doPITuning() {
        // DEBUG
       debugPrint("Finished step 4");
       debugPrint("Stabilized at ", false);
-      debugPrint(*_input);
+      debugPrint(toFloat(*_input));
 
       _theta = (_theta1 + _theta2) / 2;
 
@@ -267,11 +295,11 @@ boolean PID::doPITuning() {
       debugPrint("Process time: ", false);
       debugPrint(_processTime);
       debugPrint("Input change: ", false);
-      debugPrint(_inputChange);
+      debugPrint(toFloat(_inputChange));
       debugPrint("Output change: ", false);
-      debugPrint(_tuningOutput2 - _tuningOutput1);
+      debugPrint(toFloat(_tuningOutput2 - _tuningOutput1));
 
-      float slope = _inputChange / ((_tuningOutput2 - _tuningOutput1) * _processTime);
+      float slope = toFloat(_inputChange) / (toFloat(_tuningOutput2 - _tuningOutput1) * _processTime);
       float tauC = _processTime > 8 * _theta ? _processTime : 8 * _theta;
 
       float kC = (1 / slope) * (1 / (_theta + tauC));
@@ -288,16 +316,20 @@ boolean PID::doPITuning() {
   return false;
 }
 
-unsigned long PID::getStableTime() {
+template <class T> unsigned long PIDController<T>::getStableTime() {
   float stepTime = _processTime * 100.0f / 63.0f;
   return (long)stepTime;
 }
 
-boolean PID::_doTuningStep1() {
+template <class T> boolean PIDController<T>::isTuningTimedOut() {
+  return _tuningTimedOut;
+}
+
+template <class T> boolean PIDController<T>::_doTuningStep1() {
 
-  float deltaPrevious = 0;
+  T deltaPrevious = T(0);
   *_output = _tuningOutput1;
-  float deltaInput = *_input - _inputStart;
+  T deltaInput = *_input - _inputStart;
   deltaInput = abs(deltaInput);
 
   if ((deltaInput >= _noiseTreshold) && (_theta1 == 0) && _steadyCount > 3) {
@@ -313,7 +345,7 @@ boolean PID::_doTuningStep1() {
     deltaPrevious = *_input - _previousInput;
     // DEBUG
     debugPrint("Delta previous: ", false);
-    debugPrint(deltaPrevious);
+    debugPrint(toFloat(deltaPrevious));
 
     if (abs(deltaPrevious) <= _noiseTreshold) {
       _steadyCount++;
@@ -335,10 +367,10 @@ boolean PID::_doTuningStep1() {
   return false;
 }
 
-boolean PID::_doTuningStep2() {
-  float deltaPrevious = 0;
+template <class T> boolean PIDController<T>::_doTuningStep2() {
+  T deltaPrevious = T(0);
   *_output = _tuningOutput2;
-  float deltaInput = *_input - _inputStart;
+  T deltaInput = *_input - _inputStart;
   deltaInput = abs(deltaInput);
 
   if ((deltaInput >= _noiseTreshold) && (_theta2 == 0) && _steadyCount > 3) {
@@ -366,10 +398,10 @@ boolean PID::_doTuningStep2() {
   return false;
 }
 
-boolean PID::_doTuningStep3() {
-  *_output = 0;
-  float deltaPrevious = _direction ? _inputStart - _inputChange : _inputStart + _inputChange;
-  float deltaInput = *_input - deltaPrevious;
+template <class T> boolean PIDController<T>::_doTuningStep3() {
+  *_output = T(0);
+  T deltaPrevious = _direction ? _inputStart - _inputChange : _inputStart + _inputChange;
+  T deltaInput = *_input - deltaPrevious;
   deltaInput = abs(deltaInput);
 
   if (deltaInput <= _noiseTreshold) {
@@ -379,11 +411,11 @@ boolean PID::_doTuningStep3() {
   return false;
 }
 
-boolean PID::_doTuningStep4() {
+template <class T> boolean PIDController<T>::_doTuningStep4() {
 
-  float inputTreshold = 63.0f * _inputChange / 100.0f;
+  T inputTreshold = _inputChange * T(0.63f);
   *_output = _tuningOutput2;
-  float deltaInput = *_input - _inputStart;
+  T deltaInput = *_input - _inputStart;
   deltaInput = abs(deltaInput);
 
   if (deltaInput >= inputTreshold) {
@@ -393,3 +425,88 @@ boolean PID::_doTuningStep4() {
 
   return false;
 }
+
+template <class T> boolean PIDController<T>::_doRelayTuning() {
+  T input = *_input;
+
+  if (input > _inputMax) {
+    _inputMax = input;
+  }
+
+  if (input < _inputMin) {
+    _inputMin = input;
+  }
+
+  // How far the input is on the side where the output has to go up
+  T error = _direction ? *_setpoint - input : input - *_setpoint;
+
+  if (!_relayHigh && error > _noiseTreshold) {
+    _relayHigh = true;
+    unsigned long now = millis();
+
+    // A full oscillation ends here, the first one is a transient
+    if (_relaySwitches >= 2) {
+      _relayPeriodSum += now - _relaySwitchTime;
+      _relayAmplitudeSum += toFloat(_inputMax - _inputMin) / 2;
+
+      // DEBUG
+      debugPrint("Relay period: ", false);
+      debugPrint(now - _relaySwitchTime);
+    }
+
+    _relaySwitches++;
+    _relaySwitchTime = now;
+    _startTuningTime = now;
+    _inputMax = _inputMin = input;
+  } else if (_relayHigh && error < -_noiseTreshold) {
+    _relayHigh = false;
+    _startTuningTime = millis();
+  }
+
+  *_output = _relayHigh ? _limitMax : _limitMin;
+
+  if (_relaySwitches > _relayCycles + 1) {
+    float relayAmplitude = toFloat(_limitMax - _limitMin) / 2;
+    float inputAmplitude = _relayAmplitudeSum / _relayCycles;
+    float hysteresis = toFloat(_noiseTreshold);
+    float periodU = (float)_relayPeriodSum / _relayCycles;
+
+    // Describing function of a relay with hysteresis
+    float amplitude = inputAmplitude > hysteresis ? sqrt(inputAmplitude * inputAmplitude - hysteresis * hysteresis) : inputAmplitude;
+    float kU = 4 * relayAmplitude / (PI * amplitude);
+
+    // Tyreus-Luyben PI settings, Ziegler-Nichols ones are too aggressive
+    // for slow lag dominated processes like a heated floor
+    float kC = kU / 3.2f;
+    float tauI = 2.2f * periodU;
+
+    // DEBUG
+    debugPrint("Ultimate gain: ", false);
+    debugPrint(kU);
+    debugPrint("Ultimate period: ", false);
+    debugPrint(periodU);
+
+    setKs(kC, kC / tauI, 0);
+
+    // Used for the stable time, a rough estimate of the process time constant
+    _processTime = periodU;
+
+    return true;
+  }
+
+  // The output can't move the input across the setpoint, keep the gains
+  if (timeDiff(_startTuningTime) > PID_RELAY_TIMEOUT) {
+    // DEBUG
+    debugPrint("Relay tuning timed out");
+
+    _tuningTimedOut = true;
+    return true;
+  }
+
+  return false;
+}
+
+// Instantiate the controller for both number types here,
+// so the implementation doesn't have to live in the header
+template class PIDController<float>;
+template class PIDController<Fixed16>;
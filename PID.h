@@ -1,9 +1,24 @@
 #include "Arduino.h"
+#include "FixedPoint.h"
 #ifndef PID_h
 #define PID_h
 #define PID_MODULE_VERSION 1
 
-class PID
+// Tuning methods
+#define PID_TUNING_SIMC 1                 // Four step experiments, see initPITuning()
+#define PID_TUNING_RELAY 2                // Relay feedback, see initRelayTuning()
+
+// Relay tuning gives up if the output isn't switched for this long (ms)
+#ifndef PID_RELAY_TIMEOUT
+#define PID_RELAY_TIMEOUT 21600000UL
+#endif
+
+// PID controller templated on its number type T, which is either float
+// or Fixed16 (Q16.16 fixed point, see FixedPoint.h). Input, output, setpoint,
+// limits, gains and the control math use T. Gains are passed as floats
+// and tuning math is done in float, it runs rarely.
+// Both types are instantiated in PID.cpp.
+template <class T> class PIDController
 {
   typedef struct filter_t // Structure for Kalman filter state
   {
@@ -14,15 +29,15 @@ class PID
   };
 
   public:
-    PID (
+    PIDController (
       float kP,
       float kI,
       float kD,
-      float *input,
-      float *output,
-      float limitMin,
-      float limitMax,
-      float *setpoint,
+      T *input,
+      T *output,
+      T limitMin,
+      T limitMax,
+      T *setpoint,
       uint16_t timeStep,
       boolean direction
     );
@@ -33,39 +48,43 @@ class PID
     float getKd();
     unsigned long getStableTime();
     void setTimeStep(uint16_t timeStep); // Sets sample time at which PID calculation is done
-    void setOutputLimits(float limitMin, float limitMax); // Limits PID output
+    void setOutputLimits(T limitMin, T limitMax); // Limits PID output
     void resetCalc();
     void setControlDirection(boolean direction);  // Changes PID direction, e.g.:
                                                   // bigger input - bigger output
                                                   // bigger input - smaller output
     boolean doControl();  // Calculates PID output
-    void initPITuning(uint16_t steadyTreshold, float noiseTreshold);  // Init SIMC PID tuning
+    void initPITuning(uint16_t steadyTreshold, T noiseTreshold);  // Init SIMC PID tuning
+    void initRelayTuning(uint8_t cycles, T hysteresis);  // Init relay feedback PI tuning around the setpoint
     void initFilter(filter_t *filterState, boolean useFilter); // Init Kalman filter
-    boolean doPITuning(); // Runs PID tuning process
+    boolean doPITuning(); // Runs PID tuning process (either method)
+    boolean isTuningTimedOut(); // The last relay tuning gave up, the gains were kept
 
   private:
 
-    float *_input;                    // Manipulated process output (controller input)
-    float *_output;                   // Controller output (process input)
-    float _limitMax;                  // Maximum controller output
-    float _limitMin;                  // Minimum controller output
-    float *_setpoint;                 // Desired process output
+    T *_input;                        // Manipulated process output (controller input)
+    T *_output;                       // Controller output (process input)
+    T _limitMax;                      // Maximum controller output
+    T _limitMin;                      // Minimum controller output
+    T *_setpoint;                     // Desired process output
     unsigned long _timeStep;          // Controller sample time
-    float _kP;                        // PID Kp (Kc) - controller gain
-    float _kI;                        // PID Ki (Kc/Tc) - intergral term coef.
-    float _kD;                        // PID Kd - derivative term coef.
+    T _kP;                            // PID Kp (Kc) - controller gain
+    T _kI;                            // PID Ki (Kc/Tc) - intergral term coef.
+    T _kD;                            // PID Kd - derivative term coef.
     unsigned long _previousCalcTime;  // Helper for the loop time tracking
-    float _error;                     // Controller error (input delta)
-    float _previousInput;             // Helper
-    float _integralTerm;              // PID integral term
-    float _outputStart;               // Output value at tuning start
-    float _inputStart;                // Input value at tuning start
-    float _inputChange;               // Input change for a tuning step
-    float _tuningOutput1;             // Tuning helper (lower step bound)
-    float _tuningOutput2;             // Tuning helper (higher step bound)
+    T _error;                         // Controller error (input delta)
+    T _previousInput;                 // Helper
+    T _integralTerm;                  // PID integral term
+    T _outputStart;                   // Output value at tuning start
+    T _inputStart;                    // Input value at tuning start
+    T _inputChange;                   // Input change for a tuning step
+    T _tuningOutput1;                 // Tuning helper (lower step bound)
+    T _tuningOutput2;                 // Tuning helper (higher step bound)
     boolean _direction;               // Controller direction (true - direct, false - reverse)
     // Tuning variables
+    uint8_t _tuningMethod;            // PID_TUNING_SIMC or PID_TUNING_RELAY
     uint8_t _tuningState;             // Wheter tuning is finished or in process
+    boolean _tuningTimedOut;          // The last tuning ended at PID_RELAY_TIMEOUT
     unsigned long _startTuningTime;   // When the tuning process started
     unsigned long _processTime;       // Process time constant (Tp)
     unsigned long _theta1, _theta2;   // Process delays
@@ -74,7 +93,15 @@ class PID
     filter_t *_filterState;           // Pointer to the filter state structure
     uint16_t _steadyCount;            // How long (in samples) the controller input is stable
     uint16_t _steadyTreshold;         // How long (in samples) it takes to mark input as stable
-    float _noiseTreshold;             // Process noise level (noise band)
+    T _noiseTreshold;                 // Process noise level (noise band), relay hysteresis
+    boolean _relayHigh;               // Relay output is at the upper limit
+    uint8_t _relaySwitches;           // Times the relay switched up
+    uint8_t _relayCycles;             // Oscillation periods to measure
+    unsigned long _relaySwitchTime;   // When the relay last switched up
+    unsigned long _relayPeriodSum;    // Sum of the measured periods (ms)
+    float _relayAmplitudeSum;         // Sum of the measured input amplitudes
+    T _inputMax;                      // Input peaks since the last switch up
+    T _inputMin;
 
     void _constrainOutput();
     void _adjustIntegralTerm();
@@ -83,6 +110,10 @@ class PID
     boolean _doTuningStep2();
     boolean _doTuningStep3();
     boolean _doTuningStep4();
+    boolean _doRelayTuning();
 };
 
+typedef PIDController<float> PID;
+typedef PIDController<Fixed16> FixedPID;
+
 #endif
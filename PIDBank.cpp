@@ -0,0 +1,133 @@
+#include "PIDBank.h"
+#include "HiveUtils.h"
+
+PIDBank pidBank(PIDBANK_TIME_STEP);
+
+template <class T> PIDControllerBank<T>::PIDControllerBank(uint16_t timeStep) :
+  _timeStep(timeStep),
+  _lastRun(0),
+  _count(0),
+  _active(0),
+  _reverse(0)
+{}
+
+template <class T> int8_t PIDControllerBank<T>::addLane(T *input, T *output, T *setpoint, T limitMin, T limitMax, boolean direction) {
+  if (_count >= PIDBANK_MAX_LANES) {
+    return -1;
+  }
+
+  uint8_t lane = _count++;
+
+  _input[lane] = input;
+  _output[lane] = output;
+  _setpoint[lane] = setpoint;
+  _limitMin[lane] = limitMin;
+  _limitMax[lane] = limitMax;
+  _kP[lane] = T(0);
+  _kI[lane] = T(0);
+  _kD[lane] = T(0);
+
+  if (!direction) {
+    _reverse |= (1UL << lane);
+  }
+
+  return lane;
+}
+
+template <class T> uint8_t PIDControllerBank<T>::getLaneCount() {
+  return _count;
+}
+
+template <class T> void PIDControllerBank<T>::setKs(uint8_t lane, float kP, float kI, float kD) {
+  setStepKs(lane, kP, kI * (float)_timeStep, kD / (float)_timeStep);
+}
+
+template <class T> void PIDControllerBank<T>::setStepKs(uint8_t lane, float kP, float kI, float kD) {
+  if (lane >= _count) {
+    return;
+  }
+
+  if (_reverse & (1UL << lane)) {
+    kP = -kP;
+    kI = -kI;
+    kD = -kD;
+  }
+
+  _kP[lane] = T(kP);
+  _kI[lane] = T(kI);
+  _kD[lane] = T(kD);
+}
+
+template <class T> void PIDControllerBank<T>::setOutputLimits(uint8_t lane, T limitMin, T limitMax) {
+  if (lane >= _count) {
+    return;
+  }
+
+  _limitMin[lane] = limitMin;
+  _limitMax[lane] = limitMax;
+}
+
+template <class T> void PIDControllerBank<T>::setActive(uint8_t lane, boolean active) {
+  if ((lane >= _count) || (active == isActive(lane))) {
+    return;
+  }
+
+  if (active) {
+    _integralTerm[lane] = constrain(*_output[lane], _limitMin[lane], _limitMax[lane]);
+    _previousInput[lane] = *_input[lane];
+    _active |= (1UL << lane);
+  } else {
+    _active &= ~(1UL << lane);
+  }
+}
+
+template <class T> boolean PIDControllerBank<T>::isActive(uint8_t lane) {
+  return (_active & (1UL << lane)) != 0;
+}
+
+// All the lanes share the time step, so one timer check covers them,
+// and each lane is a run over the arrays without calls or pointer chasing
+// except for the input, output and setpoint values
+template <class T> unsigned long PIDControllerBank<T>::run() {
+  if (timeDiff(_lastRun) < _timeStep) {
+    return timeLeft(_lastRun, _timeStep);
+  }
+
+  _lastRun = millis();
+
+  uint32_t active = _active;
+
+  for (uint8_t i = 0; active; i++, active >>= 1) {
+    if (!(active & 1)) {
+      continue;
+    }
+
+    T input = *_input[i];
+    T error = *_setpoint[i] - input;
+    T integralTerm = constrain(_integralTerm[i] + _kI[i] * error, _limitMin[i], _limitMax[i]);
+    T derivativeTerm = _kD[i] * (input - _previousInput[i]);
+    T output = _kP[i] * error + integralTerm - derivativeTerm;
+
+    // Apply the limits with the integral tie-back, see PID::_adjustIntegralTerm()
+    if (output > _limitMax[i]) {
+      output = _limitMax[i];
+      integralTerm = output - _kP[i] * error + derivativeTerm;
+    } else if (output < _limitMin[i]) {
+      output = _limitMin[i];
+      integralTerm = output - _kP[i] * error + derivativeTerm;
+    }
+
+    _integralTerm[i] = integralTerm;
+    _previousInput[i] = input;
+    *_output[i] = output;
+  }
+
+  return _timeStep;
+}
+
+template <class T> uint16_t PIDControllerBank<T>::getTimeStep() {
+  return _timeStep;
+}
+
+template class PIDControllerBank<float>;
+template class PIDControllerBank<Fixed16>;
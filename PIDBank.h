@@ -0,0 +1,74 @@
+/*
+  PIDBank.h - PID control loops updated together. Gains, integral terms,
+  previous inputs and limits of all the loops are kept in arrays, one lane
+  per loop, so a single scheduler task updates every active loop in one
+  pass instead of each module keeping a controller object and a timer.
+  The control math is the same as in PID.
+*/
+
+#ifndef PIDBank_h
+#define PIDBank_h
+
+#include "Arduino.h"
+#include "FixedPoint.h"
+
+// Number of lanes, 32 maximum
+#ifndef PIDBANK_MAX_LANES
+#define PIDBANK_MAX_LANES 8
+#endif
+
+// Active and reverse lanes are kept as bits of a uint32_t
+static_assert(PIDBANK_MAX_LANES <= 32, "PIDBANK_MAX_LANES can't be more than 32");
+
+// Sample time shared by all the lanes (ms)
+#ifndef PIDBANK_TIME_STEP
+#define PIDBANK_TIME_STEP 1000
+#endif
+
+template <class T> class PIDControllerBank
+{
+  public:
+    PIDControllerBank(uint16_t timeStep);
+
+    // Add a loop, returns the lane number or -1 if the bank is full.
+    // Input and setpoint are read and output is written in place, like with PID.
+    // A lane is inactive until setActive() is called.
+    int8_t addLane(T *input, T *output, T *setpoint, T limitMin, T limitMax, boolean direction = true);
+    uint8_t getLaneCount();
+
+    void setKs(uint8_t lane, float kP, float kI, float kD);       // Same as PID::setKs()
+    void setStepKs(uint8_t lane, float kP, float kI, float kD);   // kI and kD with the time step built in, as PID::getKi()/getKd() return them
+    void setOutputLimits(uint8_t lane, T limitMin, T limitMax);
+
+    // A lane which is turned on starts from its current output, like after PID::resetCalc()
+    void setActive(uint8_t lane, boolean active);
+    boolean isActive(uint8_t lane);
+
+    unsigned long run();          // Update the active lanes when the time step is over, returns ms to the next call
+    uint16_t getTimeStep();
+
+  private:
+    uint16_t _timeStep;
+    unsigned long _lastRun;
+    uint8_t _count;
+    uint32_t _active;             // Bit per lane
+    uint32_t _reverse;            // Bit per lane, gains are negated for reverse direction
+
+    T _kP[PIDBANK_MAX_LANES];
+    T _kI[PIDBANK_MAX_LANES];     // Time step built in
+    T _kD[PIDBANK_MAX_LANES];     // Time step built in
+    T _integralTerm[PIDBANK_MAX_LANES];
+    T _previousInput[PIDBANK_MAX_LANES];
+    T _limitMin[PIDBANK_MAX_LANES];
+    T _limitMax[PIDBANK_MAX_LANES];
+    T *_input[PIDBANK_MAX_LANES];
+    T *_output[PIDBANK_MAX_LANES];
+    T *_setpoint[PIDBANK_MAX_LANES];
+};
+
+typedef PIDControllerBank<float> PIDBank;
+typedef PIDControllerBank<Fixed16> FixedPIDBank;
+
+extern PIDBank pidBank;
+
+#endif
@@ -0,0 +1,154 @@
+#include "Arduino.h"
+#include "PinChangeListener.h"
+
+PinChangeListener *PinChangeListener::_listeners[PINCHANGE_MAX_LISTENERS];
+uint8_t PinChangeListener::_count = 0;
+PinWakeHandler PinChangeListener::_wakeHandler = NULL;
+volatile uint8_t PinChangeListener::_none = 0;
+
+// A module without the pin assigned passes -1, which comes as 255 here.
+// The pin tables are only read for a valid pin, a missing one reads LOW.
+PinChangeListener::PinChangeListener(uint8_t pin, uint8_t owner) :
+  _pin(pin),
+  _port(&_none),
+  _mask(0),
+  _owner(owner),
+  _interruptDriven(false),
+  _level(0),
+  _head(0),
+  _tail(0),
+  _overflows(0)
+{
+  if ((pin < NUM_DIGITAL_PINS) && (digitalPinToPort(pin) != NOT_A_PIN)) {
+    _port = portInputRegister(digitalPinToPort(pin));
+    _mask = digitalPinToBitMask(pin);
+  }
+}
+
+boolean PinChangeListener::begin() {
+  // Nothing to listen to
+  if (!_mask) {
+    return false;
+  }
+
+  _level = (*_port & _mask) ? HIGH : LOW;
+
+  if (_count >= PINCHANGE_MAX_LISTENERS) {
+    return false;
+  }
+
+  int irq = digitalPinToInterrupt(_pin);
+  volatile uint8_t *pcicr = digitalPinToPCICR(_pin);
+
+  if ((irq == NOT_AN_INTERRUPT) && !pcicr) {
+    return false;
+  }
+
+  // Register before enabling the interrupt so the first edge isn't missed
+  uint8_t sreg = SREG;
+  cli();
+  _interruptDriven = true;
+  _listeners[_count++] = this;
+  SREG = sreg;
+
+  // Prefer an external interrupt, it's dedicated to the pin
+  if (irq != NOT_AN_INTERRUPT) {
+    attachInterrupt(irq, &PinChangeListener::handleInterrupt, CHANGE);
+  } else {
+    *digitalPinToPCMSK(_pin) |= (1 << digitalPinToPCMSKbit(_pin));
+    *pcicr |= (1 << digitalPinToPCICRbit(_pin));
+  }
+
+  return true;
+}
+
+boolean PinChangeListener::isInterruptDriven() {
+  return _interruptDriven;
+}
+
+boolean PinChangeListener::read(pinEvent_t *event) {
+  uint8_t tail = _tail;
+
+  if (tail == _head) {
+    return false;
+  }
+
+  *event = _events[tail];
+  _tail = (tail + 1) & (PINCHANGE_QUEUE_SIZE - 1);
+
+  return true;
+}
+
+// Samples a pin without interrupt. For an interrupt driven pin
+// it catches up with an edge dropped while the ring was full.
+void PinChangeListener::poll() {
+  uint8_t sreg = SREG;
+  cli();
+
+  uint8_t level = (*_port & _mask) ? HIGH : LOW;
+
+  if (level != _level) {
+    _push(level);
+  }
+
+  SREG = sreg;
+}
+
+// Drops the queued edges and takes the current level as the last one,
+// so only edges from now on are read
+void PinChangeListener::flush() {
+  uint8_t sreg = SREG;
+  cli();
+
+  _tail = _head;
+  _level = (*_port & _mask) ? HIGH : LOW;
+
+  SREG = sreg;
+}
+
+uint16_t PinChangeListener::getOverflows() {
+  uint8_t sreg = SREG;
+  cli();
+  uint16_t overflows = _overflows;
+  SREG = sreg;
+
+  return overflows;
+}
+
+void PinChangeListener::setWakeHandler(PinWakeHandler handler) {
+  _wakeHandler = handler;
+}
+
+// Pin change interrupts are shared by a whole port,
+// so check every listened pin for a new level
+void PinChangeListener::handleInterrupt() {
+  for (uint8_t i = 0; i < _count; i++) {
+    PinChangeListener *listener = _listeners[i];
+    uint8_t level = (*listener->_port & listener->_mask) ? HIGH : LOW;
+
+    if ((level != listener->_level) && listener->_push(level) && _wakeHandler) {
+      _wakeHandler(listener->_owner);
+    }
+  }
+}
+
+boolean PinChangeListener::_push(uint8_t level) {
+  uint8_t head = _head;
+  uint8_t next = (head + 1) & (PINCHANGE_QUEUE_SIZE - 1);
+
+  // Drop the edge if the ring is full. The level isn't updated either,
+  // so queued levels still alternate and poll() queues the actual level later.
+  if (next == _tail) {
+    _overflows++;
+    return false;
+  }
+
+  _events[head].time = millis();
+  _events[head].level = level;
+  _level = level;
+
+  // Publish the event only after it's written
+  _head = next;
+
+  return true;
+}
@@ -0,0 +1,67 @@
+/*
+  PinChangeListener.h - Captures input pin edges in an interrupt.
+  Each edge is timestamped and put into a lock-free single producer
+  (interrupt) / single consumer (module loopDo()) ring, so no edge
+  is lost while the main loop is busy.
+*/
+
+#ifndef PinChangeListener_h
+#define PinChangeListener_h
+
+#include "Arduino.h"
+
+// Maximum number of listened pins
+#define PINCHANGE_MAX_LISTENERS 8
+
+// Edge events ring size, must be a power of two
+#define PINCHANGE_QUEUE_SIZE 8
+
+typedef struct pinEvent_t
+{
+  unsigned long time;           // millis() at the edge
+  uint8_t level;                // Pin level after the edge
+};
+
+// Called from the interrupt when a listener gets a new event
+typedef void (*PinWakeHandler)(uint8_t owner);
+
+class PinChangeListener
+{
+  public:
+    // Owner is passed back to the wake handler, e.g. a module id
+    PinChangeListener(uint8_t pin, uint8_t owner);
+
+    // Start listening, the pin mode must be set already.
+    // Returns false if the pin has no interrupt, poll() has to sample it then,
+    // or if no pin is assigned.
+    boolean begin();
+    boolean isInterruptDriven();
+    boolean read(pinEvent_t *event);  // Take the oldest edge event, false if there's none
+    void poll();                      // Queue an edge if the pin level differs from the last queued one
+    void flush();                     // Drop the queued edges, e.g. the ones captured while the module was off
+    uint16_t getOverflows();          // Number of edges dropped because the ring was full
+
+    static void setWakeHandler(PinWakeHandler handler);
+    static void handleInterrupt();    // Check all the listened pins, call from pin change ISRs
+
+  private:
+    uint8_t _pin;
+    volatile uint8_t *_port;          // Input register and bit mask of the pin
+    uint8_t _mask;
+    uint8_t _owner;
+    boolean _interruptDriven;
+    volatile uint8_t _level;          // Level of the last queued edge
+    volatile uint8_t _head;           // Written by the producer only
+    volatile uint8_t _tail;           // Written by the consumer only
+    volatile uint16_t _overflows;
+    pinEvent_t _events[PINCHANGE_QUEUE_SIZE];
+
+    static PinChangeListener *_listeners[PINCHANGE_MAX_LISTENERS];
+    static uint8_t _count;
+    static PinWakeHandler _wakeHandler;
+    static volatile uint8_t _none;    // Stands in for the input register of a missing pin
+
+    boolean _push(uint8_t level);     // Producer side, called with interrupts disabled
+};
+
+#endif
@@ -1,17 +1,26 @@
 #include "Arduino.h"
 #include "HiveStorage.h"
+#include "SensorLog.h"
 #include "PirSwitch.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
 #include "HiveUtils.h"
 
 const char PirSwitch::_moduleType[12] = "PirSwitch";
 
+const JSONField PirSwitch::_jsonFields[] PROGMEM = {
+  JSON_FIELD("moduleType", JSONTypeString, request_t, moduleType),
+  JSON_FIELD("moduleState", JSONTypeInt, request_t, settings.moduleState),
+  JSON_FIELD("lightMode", JSONTypeInt, request_t, settings.lightMode),
+  JSON_FIELD("pirDelay", JSONTypeUInt, request_t, settings.pirDelay)
+};
+
 PirSwitch::PirSwitch(AppContext *context, const byte zone, byte moduleId, int storagePointer, boolean loadSettings, int8_t switchPin, int8_t lightPin) :
   SensorModule(storagePointer, moduleId, zone),
   _switchPin(switchPin),
   _lightPin(lightPin),
+  _switchListener(switchPin, moduleId),
   _context(context) {
 
   _stateChanged = true;
@@ -20,7 +29,12 @@ PirSwitch::PirSwitch(AppContext *context, const byte zone, byte moduleId, int st
   // DEBUG
   debugPrint(F("PIR: Init PirSwitch"));
 
-  pinMode(_switchPin, INPUT);
+  _switchIO.begin(_switchPin, INPUT);
+
+  // Sensor pins without an interrupt are polled in loopDo()
+  if (_switchPin >= 0) {
+    _switchListener.begin();
+  }
 
   if (loadSettings) {
     _loadSettings();
@@ -29,27 +43,26 @@ PirSwitch::PirSwitch(AppContext *context, const byte zone, byte moduleId, int st
     _saveSettings();
   }
 
-  pinMode(_lightPin, OUTPUT);
+  _lightIO.begin(_lightPin, OUTPUT);
   _previousSwitchState = _readSwitchState();
-
-
+  _switchState = _previousSwitchState;
 
   if (!_moduleState) {
-    digitalWrite(_lightPin, SWITCH_RELAY_OFF);
+    _lightIO.write(SWITCH_RELAY_OFF);
   } else {
 
     switch (_lightMode) {
       case 1:
         // If there's a manual "on" override
-        digitalWrite(_lightPin, SWITCH_RELAY_ON);
+        _lightIO.write(SWITCH_RELAY_ON);
         break;
       case 2:
         // If there's a manual "off" override
-        digitalWrite(_lightPin, SWITCH_RELAY_OFF);
+        _lightIO.write(SWITCH_RELAY_OFF);
         break;
       case 0:
         // If there's auto switch mode
-        _previousSwitchState ? digitalWrite(_lightPin, SWITCH_RELAY_ON) : digitalWrite(_lightPin, SWITCH_RELAY_OFF);
+        _previousSwitchState ? _lightIO.write(SWITCH_RELAY_ON) : _lightIO.write(SWITCH_RELAY_OFF);
         break;
     }
 
@@ -114,7 +127,7 @@ void PirSwitch::_saveSettings() {
 }
 
 byte PirSwitch::_readSwitchState () {
-  return digitalRead(_switchPin);
+  return _switchIO.read();
 }
 
 byte PirSwitch::_readLightState () {
@@ -123,7 +136,7 @@ byte PirSwitch::_readLightState () {
   // So we take it into account and return simple values
   // 1 if the relay is on, 0 - if it's off
 
-  if (digitalRead(_lightPin) == SWITCH_RELAY_ON) {
+  if (_lightIO.read() == SWITCH_RELAY_ON) {
     return 1;
   } else {
     return 0;
@@ -172,53 +185,16 @@ void PirSwitch::_pushNotify() {
   _context->pushNotify(moduleId);
 }
 
-void PirSwitch::getJSONSettings() {
-  // generate json settings only if something's changed
+void PirSwitch::printJSONSettings(JSONWriter *writer) {
   // TODO: mark properties with read-only and read-write types
-
-  if (_stateChanged) {
-
-    aJsonObject *moduleItem = aJson.getArrayItem(*(_context->moduleCollection), moduleId-1);
-    aJsonObject *moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
-
-    // If we have an empty JSON settings structure
-    // then fill it with values
-
-    if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
-
-      // TODO: Add prefixes to param names to mark readonly fields
-      aJson.addStringToObject(moduleItem, "moduleType", _moduleType);
-      aJson.addNumberToObject(moduleItem, "moduleState", _moduleState);
-      aJson.addNumberToObject(moduleItem, "zoneId", _moduleZone);
-      aJson.addNumberToObject(moduleItem, "switchState", _readSwitchState());
-      aJson.addNumberToObject(moduleItem, "lightState", _readLightState());
-      aJson.addNumberToObject(moduleItem, "lightMode", _lightMode);
-
-      aJson.addNumberToObject(moduleItem, "pirDelay", _pirDelay);
-
-    } else {
-      // If we have an already initialized settings JSON structure
-      // then just replace the values
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-      moduleItemProperty->valuebool = _moduleState;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "switchState");
-      moduleItemProperty->valueint = _readSwitchState();
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "lightState");
-      moduleItemProperty->valueint = _readLightState();
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "lightMode");
-      moduleItemProperty->valueint = _lightMode;
-
-      moduleItemProperty = aJson.getObjectItem(moduleItem, "pirDelay");
-      moduleItemProperty->valueint = _pirDelay;
-    }
-
-    _stateChanged = false;
-
-  }
+  // TODO: Add prefixes to param names to mark readonly fields
+  writer->addString(F("moduleType"), _moduleType);
+  writer->addNumber(F("moduleState"), _moduleState);
+  writer->addNumber(F("zoneId"), _moduleZone);
+  writer->addNumber(F("switchState"), _readSwitchState());
+  writer->addNumber(F("lightState"), _readLightState());
+  writer->addNumber(F("lightMode"), _lightMode);
+  writer->addNumber(F("pirDelay"), _pirDelay);
 }
 
 // TODO: if error, return settings object with error item
@@ -240,37 +216,32 @@ boolean PirSwitch::_validateSettings(config_t *settings) {
   return true;
 }
 
-boolean PirSwitch::setJSONSettings(aJsonObject *moduleItem) {
-  config_t settings;
-  aJsonObject *moduleItemProperty;
+boolean PirSwitch::setJSONSettings(JSONReader *reader) {
+  request_t request;
+
   // Initialiaze to invalid values so the validation works
-  int8_t newModuleState = -1;
-  int8_t newLightMode = -1;
-  int8_t newPirDelay = -1;
+  // and a missing field fails the request
+  request.moduleType[0] = 0;
+  request.settings.moduleState = -1;
+  request.settings.lightMode = -1;
+  request.settings.pirDelay = _pirDelay;
 
-  // Check for module type first
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleType");
-  if (strcmp(moduleItemProperty->valuestring, _moduleType) != 0) {
+  if (!reader->readFields(_jsonFields, sizeof(_jsonFields) / sizeof(*_jsonFields), &request)) {
     return false;
   }
 
-  moduleItemProperty = aJson.getObjectItem(moduleItem, "moduleState");
-  newModuleState = moduleItemProperty->valuebool;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "lightMode");
-  newLightMode = moduleItemProperty->valueint;
-
-  moduleItemProperty = aJson.getObjectItem(moduleItem,  "pirDelay");
-  newPirDelay = moduleItemProperty->valueint;
-
-  settings.lightMode = newLightMode;
-  settings.moduleState = newModuleState;
-  settings.pirDelay = newPirDelay;
+  // Check for module type first
+  if (strcmp(request.moduleType, _moduleType) != 0) {
+    return false;
+  }
 
-  if (!_validateSettings(&settings)) {
+  if (!_validateSettings(&request.settings)) {
     return false;
   }
 
+  int8_t newModuleState = request.settings.moduleState;
+  int8_t newLightMode = request.settings.lightMode;
+
   if (_moduleState != newModuleState) {
     newModuleState ? turnModuleOn() : turnModuleOff();
   }
@@ -289,76 +260,120 @@ boolean PirSwitch::setJSONSettings(aJsonObject *moduleItem) {
     }
   }
 
+  if (_pirDelay != request.settings.pirDelay) {
+    _pirDelay = request.settings.pirDelay;
+    _stateChanged = true;
+    _saveSettings();
+  }
+
   return true;
 }
 
 void PirSwitch::turnModuleOff() {
   if (_moduleState) {
-    digitalWrite(_lightPin, SWITCH_RELAY_OFF);
+    _lightIO.write(SWITCH_RELAY_OFF);
     _moduleState = false;
     _stateChanged = true;
     _saveSettings();
+
+    // Module state is critical, don't defer writing it
+    flushStorage();
   }
 }
 
 void PirSwitch::turnModuleOn() {
   if (!_moduleState) {
-    _switchState = digitalRead(_switchPin);
+    // Edges captured while the module was off aren't replayed,
+    // the current level is taken instead
+    _switchListener.flush();
+    _switchState = _switchIO.read();
 
     // Check current operation mode (auto or manual override)
     if (_lightMode == 0) {
-      _switchState ? digitalWrite(_lightPin, SWITCH_RELAY_ON) : digitalWrite(_lightPin, SWITCH_RELAY_OFF);
+      _switchState ? _lightIO.write(SWITCH_RELAY_ON) : _lightIO.write(SWITCH_RELAY_OFF);
     } else {
-      _lightMode == 1 ? digitalWrite(_lightPin, SWITCH_RELAY_ON) : digitalWrite(_lightPin, SWITCH_RELAY_OFF);
+      _lightMode == 1 ? _lightIO.write(SWITCH_RELAY_ON) : _lightIO.write(SWITCH_RELAY_OFF);
     }
 
     _moduleState = true;
     _stateChanged = true;
     _saveSettings();
+
+    // Module state is critical, don't defer writing it
+    flushStorage();
+  }
+}
+
+// The sensor went on, turn the light on in auto mode
+void PirSwitch::_motionDetected() {
+  if ((_lightMode == 0) && !_previousLightState) {
+    _lightIO.write(SWITCH_RELAY_ON);
+    _previousLightState = HIGH;
+    _stateChanged = true;
+    sensorLog.append(moduleId, SENSORLOG_RELAY, 1);
+    _pushNotify();
   }
 }
 
-void PirSwitch::loopDo() {
+unsigned long PirSwitch::loopDo() {
+  pinEvent_t event;
+
   // If the module is on now
   if (_moduleState) {
 
     if (_lightMode == 1 && _previousLightState == 0) {
       // If we have manual "on" override mode
-      digitalWrite(_lightPin, SWITCH_RELAY_ON);
+      _lightIO.write(SWITCH_RELAY_ON);
       _previousLightState = 1;
     } else if (_lightMode == 2 && _previousLightState == 1) {
       // If we have manual "off" override mode
-      digitalWrite(_lightPin, SWITCH_RELAY_OFF);
+      _lightIO.write(SWITCH_RELAY_OFF);
       _previousLightState = 0;
     }
 
-    _switchState = _readSwitchState();
+    // Take PIR sensor edges captured by the interrupt one at a time,
+    // so a pulse which is over before we get here still turns the light on.
+    // The turn off delay is counted from the moment the sensor went off.
+    _switchListener.poll();
 
-    if (_switchState == HIGH) {
-      // If PIR switch is activated
+    while (_switchListener.read(&event)) {
+      _switchState = event.level;
 
-      if (!_previousLightState) {
-        digitalWrite(_lightPin, SWITCH_RELAY_ON);
-        _previousLightState = _switchState;
-        _stateChanged = true;
-        _pushNotify();
+      if (_switchState == HIGH) {
+        _motionDetected();
+      } else {
+        _delayCounter = event.time;
       }
+    }
 
-      // We start delay countdouwn only when switch is off
-      // Otherwise we update counter value
-      _delayCounter = millis();
-    } else {
-      // If PIR switch is off
-      // Check counter value vs current time
-      // _pirDelay value is in seconds so multiply it by 1000
-      if ((abs(millis() - _delayCounter) >= _pirDelay * 1000) && (_previousLightState == HIGH)) {
-        digitalWrite(_lightPin, SWITCH_RELAY_OFF);
-        _previousLightState = _switchState;
-        _delayCounter = 0;
-        _stateChanged = true;
-        _pushNotify();
+    // The sensor drives the light in auto mode only
+    if (_lightMode == 0) {
+      if (_switchState == HIGH) {
+        // If PIR switch is activated
+        _motionDetected();
+      } else {
+        // If PIR switch is off
+        // Check counter value vs current time
+        // _pirDelay value is in seconds so multiply it by 1000
+        if ((timeDiff(_delayCounter) >= _pirDelay * 1000UL) && (_previousLightState == HIGH)) {
+          _lightIO.write(SWITCH_RELAY_OFF);
+          _previousLightState = _switchState;
+          _delayCounter = 0;
+          _stateChanged = true;
+          sensorLog.append(moduleId, SENSORLOG_RELAY, 0);
+          _pushNotify();
+        }
+      }
+
+      // Come back when it's time to turn the light off
+      if ((_switchState == LOW) && _previousLightState) {
+        return timeLeft(_delayCounter, _pirDelay * 1000UL);
       }
     }
 
+    // The next edge wakes us up, a pin without interrupt has to be polled
+    return _switchListener.isInterruptDriven() ? SENSORMODULE_IDLE_TIME : _PollTime;
   }
+
+  return SENSORMODULE_IDLE_TIME;
 }
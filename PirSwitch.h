@@ -16,8 +16,10 @@
 
 #include "Arduino.h"
 #include "SensorModule.h"
-#include "aJson.h"
+#include "JSONReader.h"
 #include "AppContext.h"
+#include "FastPin.h"
+#include "PinChangeListener.h"
     
 class PirSwitch : public SensorModule
 {
@@ -28,9 +30,9 @@ class PirSwitch : public SensorModule
     
     const char* getModuleType();
     byte getStorageSize();
-    void loopDo();
-    void getJSONSettings(); // Fill-in module settings in JSON object through _context property
-    boolean setJSONSettings(aJsonObject *moduleItem); // Update settings from JSON object through _context property
+    unsigned long loopDo();
+    void printJSONSettings(JSONWriter *writer); // Write module settings as JSON object fields
+    boolean setJSONSettings(JSONReader *reader); // Update settings from JSON object fields
 
     void turnModuleOff();        // Turn module off
     void turnModuleOn();         // Turn module on
@@ -43,14 +45,27 @@ class PirSwitch : public SensorModule
       uint8_t pirDelay;            // Delay between PIR sensor state change and relay switch (in seconds)
       int8_t moduleState;         // Is module on or off
     };
+
+    // PUT request structure, filled by JSONReader
+    typedef struct request_t
+    {
+      char moduleType[16];
+      config_t settings;
+    };
+
+    static const JSONField _jsonFields[];  // PUT request fields table (in PROGMEM)
     
     int8_t _lightMode;            // Light switching mode: 0 - auto, 1 - manual on, 2 - manual off
     uint8_t _pirDelay;             // Delay between PIR sensor state change and relay switch (in seconds)
     int8_t _switchPin;            // Pin number for the PIR sensor
     int8_t _lightPin;             // Pin number for the relay
+    FastPin _switchIO;            // Direct port access to the pins
+    FastPin _lightIO;
+    PinChangeListener _switchListener;  // PIR sensor edges captured in an interrupt
     unsigned long _delayCounter;
     
     static const char _moduleType[12];   // Module type string
+    static const uint8_t _PollTime = 50; // Polling interval for a PIR sensor pin without interrupt (ms)
 
     boolean _stateChanged;        // Set to TRUE if anything (settings) changes - to prevent filling settings in again e.g. when the server asks for current settings
     boolean _switchState;         // Current switch state. 1 = on, 0 = off relay-aware state
@@ -67,6 +82,7 @@ class PirSwitch : public SensorModule
     void _turnLightOn();          // Turn the light on (manual override)
     void _turnLightAuto();        // Turn the light automatically (reset the override)
     void _pushNotify();           // Prepare data and call notification method from the main script
+    void _motionDetected();       // Turn the light on when the sensor goes on
     
     boolean _validateSettings(config_t *settings);
 };
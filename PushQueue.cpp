@@ -0,0 +1,483 @@
+#include "Arduino.h"
+#include "Ethernet.h"
+#include "utility/w5100.h"
+#include "utility/socket.h"
+#include "PushQueue.h"
+#include "DeviceDispatch.h"
+#include "HiveUtils.h"
+
+PushQueue::PushQueue() :
+  _port(80),
+  _url(NULL),
+  _host(NULL),
+  _hasServer(false),
+  _keepAlive(true),
+  _head(0),
+  _length(0),
+  _inflightCount(0),
+  _answered(0),
+  _state(_StateClosed),
+  _sock(MAX_SOCK_NUM),
+  _localPort(PushLocalPort),
+  _backoff(0)
+{
+  memset(&stats, 0, sizeof(stats));
+}
+
+void PushQueue::setServer(IPAddress ip, uint16_t port, const char *url, const char *host) {
+  _ip = ip;
+  _port = port;
+  _url = url;
+  _host = host;
+  _hasServer = true;
+  _keepAlive = true;
+  _backoff = 0;
+
+  // Reconnect to the new server with the next notification
+  if (_state == _StateReady) {
+    _close();
+  }
+}
+
+boolean PushQueue::push(byte moduleId) {
+  if (!_hasServer) {
+    return false;
+  }
+
+  // The server reads current module settings anyway,
+  // so one queued notification per module is enough
+  for (uint8_t i = 0; i < _length; i++) {
+    if (_queue[(_head + i) % PushQueueSize].moduleId == moduleId) {
+      stats.coalesced++;
+      return true;
+    }
+  }
+
+  if (_length >= PushQueueSize) {
+    stats.drops++;
+    return false;
+  }
+
+  pushItem_t *item = &_queue[(_head + _length) % PushQueueSize];
+  item->moduleId = moduleId;
+  item->retries = 0;
+  _length++;
+
+  return true;
+}
+
+uint8_t PushQueue::getDepth() {
+  return _length;
+}
+
+unsigned long PushQueue::run() {
+  unsigned long left;
+  uint8_t status;
+
+  useDevice(DeviceIdEthernet);
+
+  switch (_state) {
+    case _StateClosed:
+      if (_length == 0) {
+        // push() wakes the task up
+        return PushIdleTime;
+      }
+
+      left = _backoffLeft();
+      if (left > 0) {
+        return left;
+      }
+
+      // Connect only when there's something to send
+      _connect();
+      return PushPollTime;
+
+    case _StateConnecting:
+      status = W5100.readSnSR(_sock);
+
+      if (status == SnSR::ESTABLISHED) {
+        _setState(_StateReady);
+        return 0;
+      }
+
+      if ((status == SnSR::CLOSED) || (timeDiff(_stateTime) >= PushTimeout)) {
+        _connectionFailed();
+      }
+      return PushPollTime;
+
+    case _StateReady:
+      // The server has closed the idle connection
+      if (W5100.readSnSR(_sock) != SnSR::ESTABLISHED) {
+        _close();
+        return 0;
+      }
+
+      if (_length == 0) {
+        // Don't hold the socket forever
+        left = timeLeft(_stateTime, PushKeepAliveTime);
+        if (left == 0) {
+          _close();
+          return 0;
+        }
+        return left;
+      }
+
+      left = _backoffLeft();
+      if (left > 0) {
+        return left;
+      }
+
+      _sendRequests();
+      return PushPollTime;
+
+    case _StateReceiving:
+    {
+      EthernetClient client(_sock);
+
+      while (client.available()) {
+        if (!_parse(client.read())) {
+          continue;
+        }
+
+        boolean closing = _responseClose;
+
+        // Don't pipeline to a server which closes connections
+        if (closing) {
+          _keepAlive = false;
+        }
+
+        if (_answer(_matched == 7)) {
+          closing ? _close() : _setState(_StateReady);
+          return 0;
+        }
+
+        // Requests left unanswered are sent again
+        if (closing) {
+          _connectionFailed();
+          return 0;
+        }
+
+        _beginResponse();
+      }
+
+      status = W5100.readSnSR(_sock);
+
+      if (status != SnSR::ESTABLISHED) {
+        // A response without length ends with the connection
+        if (_response == _ResponseUntilClose) {
+          _keepAlive = false;
+
+          if (_answer(_matched == 7)) {
+            _close();
+            return 0;
+          }
+        }
+
+        _connectionFailed();
+        return 0;
+      }
+
+      if (timeDiff(_stateTime) >= PushTimeout) {
+        _connectionFailed();
+        return 0;
+      }
+
+      return PushPollTime;
+    }
+
+    case _StateClosing:
+      status = W5100.readSnSR(_sock);
+
+      if ((status != SnSR::CLOSED) && (timeDiff(_stateTime) < PushCloseTimeout)) {
+        return PushPollTime;
+      }
+
+      close(_sock);
+      _sock = MAX_SOCK_NUM;
+      _setState(_StateClosed);
+      return 0;
+  }
+
+  return PushPollTime;
+}
+
+// Wait longer after each failure in a row
+unsigned long PushQueue::_backoffLeft() {
+  if (_backoff == 0) {
+    return 0;
+  }
+
+  return timeLeft(_backoffTime, (unsigned long)PushRetryDelay << min(_backoff - 1, 5));
+}
+
+// Start connecting without waiting for the connection to be established
+void PushQueue::_connect() {
+  uint8_t addr[4];
+
+  // Take a free socket the same way EthernetClient does
+  for (_sock = 0; _sock < MAX_SOCK_NUM; _sock++) {
+    uint8_t status = W5100.readSnSR(_sock);
+    if ((status == SnSR::CLOSED) || (status == SnSR::FIN_WAIT) || (status == SnSR::CLOSE_WAIT)) {
+      break;
+    }
+  }
+
+  if (_sock == MAX_SOCK_NUM) {
+    _connectionFailed();
+    return;
+  }
+
+  if (++_localPort == 0) {
+    _localPort = PushLocalPort;
+  }
+
+  for (uint8_t i = 0; i < 4; i++) {
+    addr[i] = _ip[i];
+  }
+
+  socket(_sock, SnMR::TCP, _localPort, 0);
+
+  if (!connect(_sock, addr, _port)) {
+    _connectionFailed();
+    return;
+  }
+
+  stats.connects++;
+  _setState(_StateConnecting);
+}
+
+// Close the connection gracefully, the socket is released in _StateClosing
+void PushQueue::_close() {
+  if (_sock == MAX_SOCK_NUM) {
+    _setState(_StateClosed);
+    return;
+  }
+
+  disconnect(_sock);
+  _setState(_StateClosing);
+}
+
+// Send queued notifications back to back without waiting for the responses
+void PushQueue::_sendRequests() {
+  char request[PUSHQUEUE_REQUEST_LENGTH];
+  char number[4];
+  uint8_t depth = _keepAlive ? PushPipelineDepth : 1;
+
+  _inflightCount = 0;
+  _answered = 0;
+
+  while ((_length > 0) && (_inflightCount < depth)) {
+    pushItem_t *item = &_inflight[_inflightCount++];
+    *item = _queue[_head];
+    _head = (_head + 1) % PushQueueSize;
+    _length--;
+
+    // Send "GET clientURL/nodeId/moduleId HTTP/1.1"
+    // so the remote site knows which pcb/module settings changed
+    strcpy_P(request, PSTR("GET "));
+    strcat(request, _url);
+    strcat_P(request, PSTR("/"));
+    strcat(request, itoa(nodeId, number, 10));
+    strcat_P(request, PSTR("/"));
+    strcat(request, itoa(item->moduleId, number, 10));
+    strcat_P(request, PSTR(" HTTP/1.1\r\nHost: "));
+
+    if (_host && _host[0]) {
+      strcat(request, _host);
+    } else {
+      for (uint8_t i = 0; i < 4; i++) {
+        if (i > 0) {
+          strcat_P(request, PSTR("."));
+        }
+        strcat(request, itoa(_ip[i], number, 10));
+      }
+    }
+
+    strcat_P(request, _keepAlive ? PSTR("\r\n\r\n") : PSTR("\r\nConnection: close\r\n\r\n"));
+
+    send(_sock, (const uint8_t *)request, strlen(request));
+  }
+
+  _beginResponse();
+  _setState(_StateReceiving);
+}
+
+void PushQueue::_beginResponse() {
+  _response = _ResponseHeaders;
+  _responseLength = -1;
+  _responseChunked = false;
+  _responseClose = false;
+  _matched = 0;
+  _lineLength = 0;
+}
+
+boolean PushQueue::_parse(char ch) {
+  switch (_response) {
+    case _ResponseBody:
+      _match(ch);
+      return --_responseLength <= 0;
+
+    case _ResponseChunkData:
+      _match(ch);
+      if (--_responseLength <= 0) {
+        _response = _ResponseChunkEnd;
+      }
+      return false;
+
+    case _ResponseUntilClose:
+      _match(ch);
+      return false;
+  }
+
+  // The rest of the states take whole lines
+  if (ch == '\n') {
+    _line[_lineLength] = 0;
+    boolean complete = _lineDone();
+    _lineLength = 0;
+    return complete;
+  }
+
+  if ((ch != '\r') && (_lineLength < PUSHQUEUE_LINE_LENGTH - 1)) {
+    _line[_lineLength++] = tolower(ch);
+  }
+
+  return false;
+}
+
+// The server confirms with "success" anywhere in the response body
+void PushQueue::_match(char ch) {
+  if (_matched < 7) {
+    if (ch == "success"[_matched]) {
+      _matched++;
+    } else {
+      _matched = (ch == 's') ? 1 : 0;
+    }
+  }
+}
+
+boolean PushQueue::_lineDone() {
+  switch (_response) {
+    case _ResponseHeaders:
+      if (_lineLength > 0) {
+        if (strncmp_P(_line, PSTR("http/1.0"), 8) == 0) {
+          // HTTP/1.0 server closes the connection unless it says otherwise
+          _responseClose = true;
+        } else if (strncmp_P(_line, PSTR("content-length:"), 15) == 0) {
+          _responseLength = atol(_line + 15);
+        } else if (strncmp_P(_line, PSTR("transfer-encoding:"), 18) == 0) {
+          _responseChunked = (strstr_P(_line, PSTR("chunked")) != NULL);
+        } else if (strncmp_P(_line, PSTR("connection:"), 11) == 0) {
+          _responseClose = (strstr_P(_line, PSTR("close")) != NULL);
+        }
+        return false;
+      }
+
+      // End of the headers
+      if (_responseChunked) {
+        _response = _ResponseChunkSize;
+      } else if (_responseLength > 0) {
+        _response = _ResponseBody;
+      } else if (_responseLength == 0) {
+        return true;
+      } else {
+        _response = _ResponseUntilClose;
+      }
+      return false;
+
+    case _ResponseChunkSize:
+      _responseLength = strtol(_line, NULL, 16);
+      _response = (_responseLength > 0) ? _ResponseChunkData : _ResponseTrailers;
+      return false;
+
+    case _ResponseChunkEnd:
+      _response = _ResponseChunkSize;
+      return false;
+
+    case _ResponseTrailers:
+      return _lineLength == 0;
+  }
+
+  return false;
+}
+
+boolean PushQueue::_answer(boolean success) {
+  pushItem_t *item = &_inflight[_answered++];
+
+  if (success) {
+    stats.sent++;
+    stats.rtt = timeDiff(_stateTime);
+
+    if (stats.rtt > stats.rttMax) {
+      stats.rttMax = stats.rtt;
+    }
+
+    _backoff = 0;
+  } else {
+    _backoff++;
+    _backoffTime = millis();
+    _requeue(item);
+  }
+
+  if (_answered < _inflightCount) {
+    return false;
+  }
+
+  _inflightCount = 0;
+  _answered = 0;
+  return true;
+}
+
+// Put back the requests which haven't been answered and drop the connection
+void PushQueue::_connectionFailed() {
+  // Nothing has been sent yet, so the first queued notification takes the failure
+  if ((_inflightCount == 0) && (_length > 0)) {
+    _inflight[0] = _queue[_head];
+    _head = (_head + 1) % PushQueueSize;
+    _length--;
+    _inflightCount = 1;
+  }
+
+  // Requeue in reverse order so they keep their places
+  while (_inflightCount > _answered) {
+    _requeue(&_inflight[--_inflightCount]);
+  }
+
+  _inflightCount = 0;
+  _answered = 0;
+  _backoff++;
+  _backoffTime = millis();
+  _close();
+}
+
+void PushQueue::_requeue(pushItem_t *item) {
+  if (item->retries >= PushMaxRetries) {
+    stats.failures++;
+
+    // DEBUG
+    debugPrint(F("Push failed"));
+    return;
+  }
+
+  // A newer notification for the module is queued already
+  for (uint8_t i = 0; i < _length; i++) {
+    if (_queue[(_head + i) % PushQueueSize].moduleId == item->moduleId) {
+      return;
+    }
+  }
+
+  if (_length >= PushQueueSize) {
+    stats.drops++;
+    return;
+  }
+
+  // Put it first in line
+  _head = (_head + PushQueueSize - 1) % PushQueueSize;
+  _queue[_head].moduleId = item->moduleId;
+  _queue[_head].retries = item->retries + 1;
+  _length++;
+}
+
+void PushQueue::_setState(uint8_t state) {
+  _state = state;
+  _stateTime = millis();
+}
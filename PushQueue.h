@@ -0,0 +1,115 @@
+/*
+  PushQueue.h - Push notifications queue. Notifications are sent to the
+  server by a non-blocking state machine run by the scheduler, so a slow
+  or unreachable server doesn't hold up the modules. A single HTTP/1.1
+  keep-alive connection is reused and queued notifications are pipelined.
+*/
+
+#ifndef PushQueue_h
+#define PushQueue_h
+
+#include "Arduino.h"
+#include "Ethernet.h"
+#include "utility/w5100.h"
+#include "HiveSetup.h"
+
+// Response header line buffer, longer lines are truncated
+#define PUSHQUEUE_LINE_LENGTH 32
+
+// Request buffer, fits a 32 chars URL and host name
+#define PUSHQUEUE_REQUEST_LENGTH 128
+
+typedef struct pushStats_t
+{
+  unsigned long sent;
+  unsigned long coalesced;      // Merged with a notification for the same module already queued
+  unsigned long drops;          // Dropped because the queue was full
+  unsigned long failures;       // Dropped after all the retries have failed
+  unsigned long connects;       // Connections opened
+  unsigned long rtt;            // Last round trip time, from sending a request to its response (ms)
+  unsigned long rttMax;
+};
+
+typedef struct pushItem_t
+{
+  byte moduleId;
+  uint8_t retries;
+};
+
+class PushQueue
+{
+  public:
+    PushQueue();
+
+    // Server to notify. Host is sent in the Host header (IP address is used if it's empty),
+    // url and host are kept by reference.
+    void setServer(IPAddress ip, uint16_t port, const char *url, const char *host);
+
+    boolean push(byte moduleId);  // Queue a notification, false if there's no server or no room left
+    unsigned long run();          // Advance the state machine, returns ms to the next call
+    uint8_t getDepth();           // Notifications waiting in the queue
+
+    pushStats_t stats;
+
+  private:
+    // Connection states
+    static const uint8_t _StateClosed = 0;
+    static const uint8_t _StateConnecting = 1;
+    static const uint8_t _StateReady = 2;       // Connected, no requests in flight
+    static const uint8_t _StateReceiving = 3;
+    static const uint8_t _StateClosing = 4;
+
+    // Response parser states
+    static const uint8_t _ResponseHeaders = 0;
+    static const uint8_t _ResponseBody = 1;
+    static const uint8_t _ResponseChunkSize = 2;
+    static const uint8_t _ResponseChunkData = 3;
+    static const uint8_t _ResponseChunkEnd = 4;
+    static const uint8_t _ResponseTrailers = 5;
+    static const uint8_t _ResponseUntilClose = 6;
+
+    IPAddress _ip;
+    uint16_t _port;
+    const char *_url;
+    const char *_host;
+    boolean _hasServer;
+    boolean _keepAlive;                     // Server keeps connections open, so requests are pipelined
+
+    pushItem_t _queue[PushQueueSize];       // Notifications ring
+    uint8_t _head;
+    uint8_t _length;
+
+    pushItem_t _inflight[PushPipelineDepth];  // Requests sent on the connection
+    uint8_t _inflightCount;
+    uint8_t _answered;                      // Number of in-flight requests answered so far
+
+    uint8_t _state;
+    SOCKET _sock;
+    uint16_t _localPort;
+    unsigned long _stateTime;               // Time the current state was entered
+    uint8_t _backoff;                       // Failures in a row
+    unsigned long _backoffTime;             // Time of the last failure
+
+    uint8_t _response;                      // Response parser state
+    long _responseLength;                   // Content-Length or chunk bytes left, -1 if unknown
+    boolean _responseChunked;
+    boolean _responseClose;                 // Server closes the connection after the response
+    uint8_t _matched;                       // Number of "success" characters matched so far
+    char _line[PUSHQUEUE_LINE_LENGTH];
+    uint8_t _lineLength;
+
+    unsigned long _backoffLeft();
+    void _connect();
+    void _close();
+    void _sendRequests();
+    void _beginResponse();
+    void _match(char ch);
+    boolean _parse(char ch);                // Feed a response character, true when the response is complete
+    boolean _lineDone();                    // Process a complete line, true when the response is complete
+    boolean _answer(boolean success);       // Take a response for the oldest in-flight request, true if all answered
+    void _connectionFailed();
+    void _requeue(pushItem_t *item);
+    void _setState(uint8_t state);
+};
+
+#endif
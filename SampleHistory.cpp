@@ -0,0 +1,185 @@
+#include "Arduino.h"
+#include "SampleHistory.h"
+
+SampleHistory::SampleHistory() {
+  clear();
+}
+
+void SampleHistory::clear() {
+  unsigned long now = millis() / 1000;
+
+  _rawHead = 0;
+  _rawCount = 0;
+
+  _minuteHead = 0;
+  _minuteCount = 0;
+  _minute = now / 60;
+  _reset(&_minuteSum);
+
+  _hourHead = 0;
+  _hourCount = 0;
+  _hour = now / 3600;
+  _reset(&_hourSum);
+}
+
+void SampleHistory::add(float value) {
+  unsigned long now = millis() / 1000;
+  float scaled = value * SAMPLEHISTORY_SCALE;
+  int16_t packed;
+
+  // Out of range values are saturated
+  if (scaled >= 32767) {
+    packed = 32767;
+  } else if (scaled <= -32767) {
+    packed = -32767;
+  } else {
+    packed = (int16_t) (scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+  }
+
+  _advance(now);
+
+  _raw[_rawHead].time = now;
+  _raw[_rawHead].value = packed;
+  _rawHead = (_rawHead + 1) % SAMPLEHISTORY_RAW;
+
+  if (_rawCount < SAMPLEHISTORY_RAW) {
+    _rawCount++;
+  }
+
+  accumulator_t *sums[2] = { &_minuteSum, &_hourSum };
+
+  for (uint8_t i = 0; i < 2; i++) {
+    accumulator_t *sum = sums[i];
+
+    if ((sum->count == 0) || (packed < sum->min)) {
+      sum->min = packed;
+    }
+
+    if ((sum->count == 0) || (packed > sum->max)) {
+      sum->max = packed;
+    }
+
+    sum->sum += packed;
+    sum->count++;
+  }
+}
+
+void SampleHistory::printJSON(JSONWriter *writer, const __FlashStringHelper *name) {
+  _advance(millis() / 1000);
+
+  writer->beginObject();
+  writer->addString(F("name"), name);
+  writer->addNumber(F("scale"), SAMPLEHISTORY_SCALE);
+
+  // Raw samples as [time, value] pairs, oldest first
+  writer->beginArray(F("raw"));
+
+  for (uint8_t i = 0; i < _rawCount; i++) {
+    historySample_t *sample = &_raw[(_rawHead + SAMPLEHISTORY_RAW - _rawCount + i) % SAMPLEHISTORY_RAW];
+
+    writer->beginArray();
+    writer->addNumber(NULL, sample->time);
+    writer->addNumber(NULL, sample->value);
+    writer->endArray();
+  }
+
+  writer->endArray();
+
+  _printRollups(writer, F("minutes"), _minutes, SAMPLEHISTORY_MINUTES, _minuteHead, _minuteCount, &_minuteSum, _minute, 60);
+  _printRollups(writer, F("hours"), _hours, SAMPLEHISTORY_HOURS, _hourHead, _hourCount, &_hourSum, _hour, 3600);
+
+  writer->endObject();
+}
+
+void SampleHistory::_advance(unsigned long time) {
+  _close(_minutes, SAMPLEHISTORY_MINUTES, &_minuteHead, &_minuteCount, &_minuteSum, &_minute, time / 60);
+  _close(_hours, SAMPLEHISTORY_HOURS, &_hourHead, &_hourCount, &_hourSum, &_hour, time / 3600);
+}
+
+// Store the rollup of the finished period, and empty rollups for the periods
+// without samples after it, then start accumulating the current one
+void SampleHistory::_close(historyRollup_t *ring, uint8_t size, uint8_t *head, uint8_t *count,
+                           accumulator_t *sum, unsigned long *period, unsigned long now) {
+  if (now == *period) {
+    return;
+  }
+
+  // millis() has wrapped around if the time goes back
+  unsigned long periods = (now > *period) ? (now - *period) : 1;
+
+  // The finished period is older than the whole ring, so drop it
+  // and fill the ring with empty rollups only
+  if (periods > size) {
+    _reset(sum);
+    periods = size;
+  }
+
+  for (unsigned long i = 0; i < periods; i++) {
+    _rollup(sum, &ring[*head]);
+    _reset(sum);
+
+    *head = (*head + 1) % size;
+
+    if (*count < size) {
+      (*count)++;
+    }
+  }
+
+  *period = now;
+}
+
+void SampleHistory::_printRollups(JSONWriter *writer, const __FlashStringHelper *name, historyRollup_t *ring, uint8_t size,
+                                  uint8_t head, uint8_t count, accumulator_t *sum, unsigned long period, uint16_t length) {
+  historyRollup_t current;
+
+  writer->beginObject(name);
+  writer->addNumber(F("period"), length);
+
+  // Start of the oldest period (seconds since boot), the rest follow it back to back
+  writer->addNumber(F("start"), (period - count) * length);
+
+  // [min, max, avg] for each period, [] if there were no samples
+  writer->beginArray(F("values"));
+
+  for (uint8_t i = 0; i < count; i++) {
+    _printRollup(writer, &ring[(head + size - count + i) % size]);
+  }
+
+  _rollup(sum, &current);
+  _printRollup(writer, &current);
+
+  writer->endArray();
+  writer->endObject();
+}
+
+void SampleHistory::_reset(accumulator_t *sum) {
+  sum->min = 0;
+  sum->max = 0;
+  sum->sum = 0;
+  sum->count = 0;
+}
+
+void SampleHistory::_rollup(accumulator_t *sum, historyRollup_t *rollup) {
+  if (sum->count == 0) {
+    rollup->min = 32767;
+    rollup->max = -32768;
+    rollup->avg = 0;
+    return;
+  }
+
+  rollup->min = sum->min;
+  rollup->max = sum->max;
+  rollup->avg = sum->sum / sum->count;
+}
+
+void SampleHistory::_printRollup(JSONWriter *writer, historyRollup_t *rollup) {
+  writer->beginArray();
+
+  if (rollup->min <= rollup->max) {
+    writer->addNumber(NULL, rollup->min);
+    writer->addNumber(NULL, rollup->max);
+    writer->addNumber(NULL, rollup->avg);
+  }
+
+  writer->endArray();
+}
@@ -0,0 +1,91 @@
+/*
+  SampleHistory.h - Recent history of a sensor value. Keeps the last raw
+  samples and rolls them up into per minute and per hour min/max/avg,
+  so the server can fetch the history in one request instead of polling
+  the current value. Values are packed as fixed point 16-bit integers.
+*/
+
+#ifndef SampleHistory_h
+#define SampleHistory_h
+
+#include "Arduino.h"
+#include "JSONWriter.h"
+
+// Ring sizes, define before including SampleHistory.h to change them
+#ifndef SAMPLEHISTORY_RAW
+#define SAMPLEHISTORY_RAW 8
+#endif
+
+#ifndef SAMPLEHISTORY_MINUTES
+#define SAMPLEHISTORY_MINUTES 20
+#endif
+
+#ifndef SAMPLEHISTORY_HOURS
+#define SAMPLEHISTORY_HOURS 24
+#endif
+
+// Values are kept in hundredths, e.g. 2315 for 23.15 C
+#define SAMPLEHISTORY_SCALE 100
+
+typedef struct historySample_t
+{
+  unsigned long time;           // Seconds since boot
+  int16_t value;
+};
+
+// A period without samples has min > max
+typedef struct historyRollup_t
+{
+  int16_t min;
+  int16_t max;
+  int16_t avg;
+};
+
+class SampleHistory
+{
+  public:
+    SampleHistory();
+
+    void add(float value);        // Add a sample taken now
+    void clear();
+
+    // Write the history as an object with "raw", "minutes" and "hours" fields.
+    // Rollups are written oldest first, the last one is the current (unfinished) period.
+    void printJSON(JSONWriter *writer, const __FlashStringHelper *name);
+
+  private:
+    typedef struct accumulator_t
+    {
+      int16_t min;
+      int16_t max;
+      long sum;
+      uint16_t count;
+    };
+
+    historySample_t _raw[SAMPLEHISTORY_RAW];
+    uint8_t _rawHead;             // Next item to write
+    uint8_t _rawCount;
+
+    historyRollup_t _minutes[SAMPLEHISTORY_MINUTES];
+    uint8_t _minuteHead;
+    uint8_t _minuteCount;
+    unsigned long _minute;        // Current minute number since boot
+    accumulator_t _minuteSum;
+
+    historyRollup_t _hours[SAMPLEHISTORY_HOURS];
+    uint8_t _hourHead;
+    uint8_t _hourCount;
+    unsigned long _hour;          // Current hour number since boot
+    accumulator_t _hourSum;
+
+    void _advance(unsigned long time);  // Close the periods which are over
+    void _close(historyRollup_t *ring, uint8_t size, uint8_t *head, uint8_t *count,
+                accumulator_t *sum, unsigned long *period, unsigned long now);
+    void _printRollups(JSONWriter *writer, const __FlashStringHelper *name, historyRollup_t *ring, uint8_t size,
+                       uint8_t head, uint8_t count, accumulator_t *sum, unsigned long period, uint16_t length);
+    static void _reset(accumulator_t *sum);
+    static void _rollup(accumulator_t *sum, historyRollup_t *rollup);
+    static void _printRollup(JSONWriter *writer, historyRollup_t *rollup);
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include "Arduino.h"
+#include "Scheduler.h"
+
+Scheduler::Scheduler() :
+  _count(0),
+  _wakeRequests(0)
+{}
+
+int8_t Scheduler::addModule(SensorModule *module) {
+  return _add(module, NULL, NULL);
+}
+
+int8_t Scheduler::addTask(TaskFunction function, const __FlashStringHelper *name) {
+  return _add(NULL, function, name);
+}
+
+int8_t Scheduler::_add(SensorModule *module, TaskFunction function, const __FlashStringHelper *name) {
+  if (_count >= SchedulerMaxTasks) {
+    return -1;
+  }
+
+  uint8_t id = _count++;
+  task_t *task = &_tasks[id];
+
+  task->module = module;
+  task->function = function;
+  task->name = name;
+  task->nextRun = millis();
+  task->runs = 0;
+  task->runTimeMax = 0;
+  task->lateMax = 0;
+
+  _heap[id] = id;
+  _position[id] = id;
+  _siftUp(id);
+
+  return id;
+}
+
+void Scheduler::wake(uint8_t taskId) {
+  if (taskId >= _count) {
+    return;
+  }
+
+  unsigned long now = millis();
+
+  // Don't move a task which is already overdue
+  if ((long)(_tasks[taskId].nextRun - now) > 0) {
+    _tasks[taskId].nextRun = now;
+    _siftUp(_position[taskId]);
+  }
+}
+
+// The heap can't be touched in an interrupt,
+// so just mark the task and let run() wake it
+void Scheduler::wakeFromInterrupt(uint8_t taskId) {
+  if (taskId < SchedulerMaxTasks) {
+    _wakeRequests |= (1UL << taskId);
+  }
+}
+
+void Scheduler::run() {
+  if (_wakeRequests) {
+    uint8_t sreg = SREG;
+    cli();
+    uint32_t requests = _wakeRequests;
+    _wakeRequests = 0;
+    SREG = sreg;
+
+    for (uint8_t i = 0; i < _count; i++) {
+      if (requests & (1UL << i)) {
+        wake(i);
+      }
+    }
+  }
+
+  unsigned long now = millis();
+
+  // Run each task at most once per call,
+  // so a task which is always due can't lock out the others
+  for (uint8_t n = _count; n > 0; n--) {
+    task_t *task = &_tasks[_heap[0]];
+    unsigned long late = now - task->nextRun;
+
+    // Compare with a wrap around, the earliest task isn't due yet
+    if ((long)late < 0) {
+      break;
+    }
+
+    unsigned long start = micros();
+    unsigned long interval = task->module ? task->module->loopDo() : task->function();
+    unsigned long runTime = micros() - start;
+
+    task->runs++;
+
+    if (runTime > task->runTimeMax) {
+      task->runTimeMax = runTime;
+    }
+
+    if (late > task->lateMax) {
+      task->lateMax = late;
+    }
+
+    task->nextRun = millis() + interval;
+    _siftDown(0);
+  }
+}
+
+void Scheduler::printJSONStats(JSONWriter *writer) {
+  writer->beginArray(F("tasks"));
+
+  for (uint8_t i = 0; i < _count; i++) {
+    writer->beginObject();
+
+    if (_tasks[i].module) {
+      writer->addNumber(F("moduleId"), _tasks[i].module->moduleId);
+    } else {
+      writer->addString(F("name"), _tasks[i].name);
+    }
+
+    writer->addNumber(F("runs"), _tasks[i].runs);
+    writer->addNumber(F("runTimeMax"), _tasks[i].runTimeMax);
+    writer->addNumber(F("lateMax"), _tasks[i].lateMax);
+    writer->endObject();
+  }
+
+  writer->endArray();
+}
+
+boolean Scheduler::_before(uint8_t a, uint8_t b) {
+  return (long)(_tasks[_heap[a]].nextRun - _tasks[_heap[b]].nextRun) < 0;
+}
+
+void Scheduler::_swap(uint8_t a, uint8_t b) {
+  uint8_t id = _heap[a];
+
+  _heap[a] = _heap[b];
+  _heap[b] = id;
+  _position[_heap[a]] = a;
+  _position[_heap[b]] = b;
+}
+
+void Scheduler::_siftUp(uint8_t i) {
+  while (i > 0) {
+    uint8_t parent = (i - 1) / 2;
+
+    if (!_before(i, parent)) {
+      break;
+    }
+
+    _swap(i, parent);
+    i = parent;
+  }
+}
+
+// A task goes below the tasks due at the same time,
+// so tasks with a zero interval take turns
+void Scheduler::_siftDown(uint8_t i) {
+  while (true) {
+    uint8_t child = 2 * i + 1;
+
+    if (child >= _count) {
+      break;
+    }
+
+    if ((child + 1 < _count) && _before(child + 1, child)) {
+      child++;
+    }
+
+    if (_before(i, child)) {
+      break;
+    }
+
+    _swap(i, child);
+    i = child;
+  }
+}
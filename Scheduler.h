@@ -0,0 +1,61 @@
+/*
+  Scheduler.h - Cooperative task scheduler. Tasks are kept in a binary
+  min-heap ordered by their next run time, so loop() only runs the tasks
+  which are due instead of polling every module on every pass.
+*/
+
+#ifndef Scheduler_h
+#define Scheduler_h
+
+#include "Arduino.h"
+#include "HiveSetup.h"
+#include "SensorModule.h"
+#include "JSONWriter.h"
+
+// Task body, returns the number of milliseconds until the next run
+typedef unsigned long (*TaskFunction)();
+
+// Wake requests from interrupts are kept as bits of a uint32_t, one per task id
+static_assert(SchedulerMaxTasks <= 32, "SchedulerMaxTasks can't be more than 32");
+
+typedef struct task_t
+{
+  SensorModule *module;               // Module to run, NULL for a function task
+  TaskFunction function;
+  const __FlashStringHelper *name;    // Function task name for the stats
+  unsigned long nextRun;              // millis() value the task is due at
+  unsigned long runs;                 // Number of runs
+  unsigned long runTimeMax;           // Worst case run time (microseconds)
+  unsigned long lateMax;              // Worst case delay past the due time (milliseconds)
+};
+
+class Scheduler
+{
+  public:
+    Scheduler();
+
+    // Add a task, both return the task id or -1 if there's no room left.
+    // Tasks are due right after they are added.
+    int8_t addModule(SensorModule *module);
+    int8_t addTask(TaskFunction function, const __FlashStringHelper *name);
+
+    void wake(uint8_t taskId);                // Make a task due now (e.g. after settings change)
+    void wakeFromInterrupt(uint8_t taskId);   // Same as wake(), safe to call from an ISR
+    void run();                               // Run the due tasks, call it from loop()
+    void printJSONStats(JSONWriter *writer);  // Write per task stats as an array
+
+  private:
+    task_t _tasks[SchedulerMaxTasks];
+    uint8_t _heap[SchedulerMaxTasks];         // Task ids, the earliest due first
+    uint8_t _position[SchedulerMaxTasks];     // Heap position of each task
+    uint8_t _count;
+    volatile uint32_t _wakeRequests;          // Bit per task woken from an ISR
+
+    int8_t _add(SensorModule *module, TaskFunction function, const __FlashStringHelper *name);
+    boolean _before(uint8_t a, uint8_t b);    // Compare heap items by due time
+    void _swap(uint8_t a, uint8_t b);
+    void _siftUp(uint8_t i);
+    void _siftDown(uint8_t i);
+};
+
+#endif
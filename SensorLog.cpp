@@ -0,0 +1,513 @@
+#include "Arduino.h"
+#include "SensorLog.h"
+#include "HiveUtils.h"
+#include "CRC.h"
+
+SensorLog sensorLog;
+
+SensorLog::SensorLog() :
+  _active(false),
+  _firstBlock(0),
+  _boot(0),
+  _blocks(NULL),
+  _head(0),
+  _full(0),
+  _seq(0),
+  _dirty(false),
+  _seconds(0),
+  _millis(0),
+  _clockTime(0),
+  _wakeHandler(NULL),
+  _index(NULL)
+{
+  memset(&stats, 0, sizeof(stats));
+}
+
+boolean SensorLog::begin() {
+  SdBaseFile file;
+  uint32_t lastBlock;
+
+  _active = false;
+
+  if (StorageType != SDStorage) {
+    return false;
+  }
+
+  // About 1.3 KB with the default sizes, a node without a card doesn't need it
+  if (!_blocks) {
+    _blocks = new sensorLogBlock_t[SENSORLOG_BUFFER_BLOCKS];
+    _index = new uint32_t[SENSORLOG_INDEX_SIZE];
+
+    if (!_blocks || !_index) {
+      // DEBUG
+      debugPrint(F("Log: Not enough memory"));
+
+      delete[] _blocks;
+      delete[] _index;
+      _blocks = NULL;
+      _index = NULL;
+      return false;
+    }
+  }
+
+  useDevice(DeviceIdSD);
+
+  // The file is only used to reserve its blocks, so it's not kept open
+  if (file.open(SENSORLOG_FILE_NAME, O_RDWR)) {
+    if ((file.fileSize() == SENSORLOG_FILE_BLOCKS * 512) && file.contiguousRange(&_firstBlock, &lastBlock)) {
+      file.close();
+
+      _active = _recover();
+      return _active;
+    }
+
+    // DEBUG
+    debugPrint(F("Log: Recreating log file"));
+
+    file.remove();
+  }
+
+  if (!file.createContiguous(sd.vwd(), SENSORLOG_FILE_NAME, SENSORLOG_FILE_BLOCKS * 512) ||
+      !file.contiguousRange(&_firstBlock, &lastBlock)) {
+    // DEBUG
+    debugPrint(F("Log: Unable to create log file"));
+
+    file.close();
+    return false;
+  }
+
+  file.close();
+
+  // Blocks left from deleted files could pass for log blocks, so clear them.
+  // An erase only marks the blocks, if the card can't erase the range they are written over.
+  if (!sd.card()->erase(_firstBlock, lastBlock)) {
+    memset(_blocks, 0, sizeof(sensorLogBlock_t));
+
+    if (!sd.card()->writeStart(_firstBlock, SENSORLOG_FILE_BLOCKS)) {
+      return false;
+    }
+
+    for (uint32_t i = 0; i < SENSORLOG_FILE_BLOCKS; i++) {
+      if (!sd.card()->writeData((const uint8_t *)&_blocks[0])) {
+        sd.card()->writeStop();
+        return false;
+      }
+    }
+
+    if (!sd.card()->writeStop()) {
+      return false;
+    }
+  }
+
+  _active = _recover();
+  return _active;
+}
+
+boolean SensorLog::isActive() {
+  return _active;
+}
+
+boolean SensorLog::append(byte moduleId, uint8_t type, float value) {
+  if (!_active) {
+    return false;
+  }
+
+  _tick();
+
+  sensorLogBlock_t *block = &_blocks[_head];
+
+  if ((block->header.count >= SENSORLOG_RECORDS) ||
+      ((block->header.count > 0) && (_seconds - block->header.time > _MaxBlockTime))) {
+    if (!_close()) {
+      stats.drops++;
+      return false;
+    }
+
+    block = &_blocks[_head];
+  }
+
+  // A block gets its time with the first record
+  if (block->header.count == 0) {
+    block->header.time = _seconds;
+
+    if (block->header.seq % _IndexStep == 0) {
+      _index[(block->header.seq % SENSORLOG_FILE_BLOCKS) / _IndexStep] = _seconds;
+    }
+  }
+
+  sensorLogRecord_t *record = &block->records[block->header.count++];
+
+  record->time = (_seconds - block->header.time) * 1000UL + _millis;
+  record->moduleId = moduleId;
+  record->type = type;
+  record->reserved = 0;
+  record->value = value;
+
+  if (!_dirty) {
+    _dirty = true;
+    _dirtyTime = millis();
+  }
+
+  stats.records++;
+
+  // Hand a filled block to the writer right away. If there's no free
+  // block to close it into, run() writes it as the head block.
+  if (block->header.count == SENSORLOG_RECORDS) {
+    _close();
+
+    if (_wakeHandler) {
+      _wakeHandler();
+    }
+  }
+
+  return true;
+}
+
+unsigned long SensorLog::run() {
+  if (!_active) {
+    return SENSORLOG_FLUSH_DELAY;
+  }
+
+  // Keep the clock going while nothing is logged, millis() wraps around
+  _tick();
+
+  // The head block goes along when it's filled (and there was no room to close it)
+  // or when its records have waited for too long
+  boolean headDue = _dirty && ((_blocks[_head].header.count == SENSORLOG_RECORDS) ||
+                               (timeDiff(_dirtyTime) >= SENSORLOG_FLUSH_DELAY));
+  uint8_t count = _full + (headDue ? 1 : 0);
+
+  if (count > 0) {
+    if (!_writeBlocks(count)) {
+      stats.errors++;
+      return _RetryTime;
+    }
+
+    _full = 0;
+
+    if (headDue) {
+      _dirty = false;
+
+      if (_blocks[_head].header.count == SENSORLOG_RECORDS) {
+        _advance();
+      }
+    }
+  }
+
+  return _dirty ? timeLeft(_dirtyTime, SENSORLOG_FLUSH_DELAY) : SENSORLOG_FLUSH_DELAY;
+}
+
+void SensorLog::setWakeHandler(SensorLogWakeHandler handler) {
+  _wakeHandler = handler;
+}
+
+unsigned long SensorLog::getTime() {
+  _tick();
+  return _seconds;
+}
+
+boolean SensorLog::findBlocks(uint32_t from, uint32_t to, uint32_t *first, uint32_t *last, sensorLogBlock_t *buffer) {
+  // An empty head block doesn't count
+  uint32_t newest = _seq;
+
+  if (!_active || (from > to)) {
+    return false;
+  }
+
+  if (_blocks[_head].header.count == 0) {
+    if (_seq == 0) {
+      return false;
+    }
+
+    newest--;
+  }
+
+  // The block after the head on the card is the oldest one
+  uint32_t oldest = (_seq >= SENSORLOG_FILE_BLOCKS) ? _seq - SENSORLOG_FILE_BLOCKS + 1 : 0;
+
+  if (oldest > newest) {
+    return false;
+  }
+
+  // Block times are whole seconds, so the records from the start of the range
+  // may begin in the last block which has an earlier time
+  *first = (from > 0) ? _findBlock(from - 1, oldest, newest, buffer) : oldest;
+  *last = _findBlock(to, *first, newest, buffer);
+
+  // The range ends before the oldest record
+  return _blockTime(*last, buffer) <= to;
+}
+
+const sensorLogBlock_t *SensorLog::getBlock(uint32_t seq, sensorLogBlock_t *buffer) {
+  // Blocks waiting in RAM
+  if ((seq <= _seq) && (_seq - seq <= _full)) {
+    sensorLogBlock_t *block = &_blocks[(_head + SENSORLOG_BUFFER_BLOCKS - (_seq - seq)) % SENSORLOG_BUFFER_BLOCKS];
+
+    _seal(&block->header);
+    return block;
+  }
+
+  useDevice(DeviceIdSD);
+
+  if (!_readHeader(seq % SENSORLOG_FILE_BLOCKS, buffer) || (buffer->header.seq != seq)) {
+    return NULL;
+  }
+
+  return buffer;
+}
+
+boolean SensorLog::hasModule(const sensorLogBlock_t *block, byte moduleId) {
+  for (uint8_t i = 0; i < block->header.count; i++) {
+    if (block->records[i].moduleId == moduleId) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void SensorLog::_tick() {
+  unsigned long now = millis();
+  unsigned long elapsed = now - _clockTime + _millis;
+
+  _clockTime = now;
+
+  // Records usually come more often than once a second, so avoid the long division
+  if (elapsed < 1000) {
+    _millis = elapsed;
+  } else if (elapsed < 2000) {
+    _seconds++;
+    _millis = elapsed - 1000;
+  } else {
+    _seconds += elapsed / 1000;
+    _millis = elapsed % 1000;
+  }
+}
+
+// Blocks are written round the ring in order, so the blocks of the current
+// pass are numbered on from the first one, and the blocks left from the
+// previous pass (or never written) aren't. Binary search for the last one
+// of the current pass, then start a new block after it.
+boolean SensorLog::_recover() {
+  sensorLogBlock_t *block = &_blocks[0];
+  uint32_t low = 0;
+  uint32_t high = SENSORLOG_FILE_BLOCKS - 1;
+  uint32_t first;
+
+  _head = 0;
+  _full = 0;
+  _dirty = false;
+  _clockTime = millis();
+  _millis = 0;
+
+  if (!_readHeader(0, block)) {
+    // Nothing has been logged yet
+    _seq = 0;
+    _boot = 0;
+    _seconds = 0;
+  } else {
+    first = block->header.seq;
+
+    while (low < high) {
+      uint32_t middle = low + (high - low + 1) / 2;
+
+      if (_readHeader(middle, block) && (block->header.seq == first + middle)) {
+        low = middle;
+      } else {
+        high = middle - 1;
+      }
+    }
+
+    if (!_readHeader(low, block)) {
+      return false;
+    }
+
+    _seq = block->header.seq + 1;
+    _boot = block->header.boot + 1;
+    _seconds = block->header.time + block->records[block->header.count - 1].time / 1000 + 1;
+  }
+
+  // Rebuild the time index. A lost block gets the time of the previous
+  // entry, so the index stays ordered.
+  uint32_t time = 0;
+  uint32_t seq = (_seq >= SENSORLOG_FILE_BLOCKS) ? _seq - SENSORLOG_FILE_BLOCKS + 1 : 0;
+
+  for (seq = (seq + _IndexStep - 1) / _IndexStep * _IndexStep; seq < _seq; seq += _IndexStep) {
+    if (_readHeader(seq % SENSORLOG_FILE_BLOCKS, block) && (block->header.seq == seq)) {
+      time = block->header.time;
+    }
+
+    _index[(seq % SENSORLOG_FILE_BLOCKS) / _IndexStep] = time;
+  }
+
+  memset(block, 0, sizeof(sensorLogBlock_t));
+  block->header.seq = _seq;
+  block->header.boot = _boot;
+  block->header.magic = SENSORLOG_MAGIC;
+
+  // DEBUG
+  debugPrint(F("Log: Next block "), false);
+  debugPrint(_seq);
+
+  return true;
+}
+
+// The index is searched first, then the blocks between two index
+// entries are searched on the card, which takes a few block reads.
+uint32_t SensorLog::_findBlock(uint32_t time, uint32_t low, uint32_t high, sensorLogBlock_t *buffer) {
+  uint32_t indexLow = (low + _IndexStep - 1) / _IndexStep;
+  uint32_t indexHigh = high / _IndexStep;
+
+  if (indexLow <= indexHigh) {
+    if (_blockTime(indexLow * _IndexStep, buffer) <= time) {
+      while (indexLow < indexHigh) {
+        uint32_t middle = indexLow + (indexHigh - indexLow + 1) / 2;
+
+        if (_blockTime(middle * _IndexStep, buffer) <= time) {
+          indexLow = middle;
+        } else {
+          indexHigh = middle - 1;
+        }
+      }
+
+      low = indexLow * _IndexStep;
+
+      if (low + _IndexStep - 1 < high) {
+        high = low + _IndexStep - 1;
+      }
+    } else if (indexLow * _IndexStep > low) {
+      // The range starts in the oldest part, which has no index entry
+      high = indexLow * _IndexStep - 1;
+    } else {
+      return low;
+    }
+  }
+
+  while (low < high) {
+    uint32_t middle = low + (high - low + 1) / 2;
+
+    if (_blockTime(middle, buffer) <= time) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+
+  return low;
+}
+
+uint32_t SensorLog::_blockTime(uint32_t seq, sensorLogBlock_t *buffer) {
+  // Blocks which are written are indexed, except the head one
+  if ((seq % _IndexStep == 0) && (seq < _seq)) {
+    return _index[(seq % SENSORLOG_FILE_BLOCKS) / _IndexStep];
+  }
+
+  const sensorLogBlock_t *block = getBlock(seq, buffer);
+
+  if (!block || (block->header.count == 0)) {
+    return 0xFFFFFFFF;
+  }
+
+  return block->header.time;
+}
+
+boolean SensorLog::_readHeader(uint32_t position, sensorLogBlock_t *block) {
+  if (!sd.card()->readBlock(_firstBlock + position, (uint8_t *)block)) {
+    return false;
+  }
+
+  return (block->header.magic == SENSORLOG_MAGIC) && (block->header.count > 0) &&
+         (block->header.count <= SENSORLOG_RECORDS) &&
+         crc8Check((const uint8_t *)&block->header, sizeof(sensorLogHeader_t)) &&
+         (block->header.seq % SENSORLOG_FILE_BLOCKS == position);
+}
+
+boolean SensorLog::_close() {
+  if (_full >= SENSORLOG_BUFFER_BLOCKS - 1) {
+    return false;
+  }
+
+  _full++;
+  _advance();
+
+  return true;
+}
+
+void SensorLog::_advance() {
+  _head = (_head + 1) % SENSORLOG_BUFFER_BLOCKS;
+  _seq++;
+  _dirty = false;
+
+  sensorLogHeader_t *header = &_blocks[_head].header;
+
+  header->seq = _seq;
+  header->time = _seconds;
+  header->boot = _boot;
+  header->magic = SENSORLOG_MAGIC;
+  header->count = 0;
+  header->reserved[0] = 0;
+  header->reserved[1] = 0;
+}
+
+// Write the blocks waiting in RAM, oldest first. Blocks going one after
+// another on the card are sent in one multi-block write, which lets the
+// card program them without a command and a busy wait for each one.
+boolean SensorLog::_writeBlocks(uint8_t count) {
+  uint8_t index = (_head + SENSORLOG_BUFFER_BLOCKS - _full) % SENSORLOG_BUFFER_BLOCKS;
+  uint32_t seq = _seq - _full;
+  unsigned long writeStart = micros();
+
+  useDevice(DeviceIdSD);
+
+  while (count > 0) {
+    uint32_t position = seq % SENSORLOG_FILE_BLOCKS;
+    uint8_t length = count;
+
+    // The ring goes on from the start of the file
+    if (position + length > SENSORLOG_FILE_BLOCKS) {
+      length = SENSORLOG_FILE_BLOCKS - position;
+    }
+
+    for (uint8_t i = 0; i < length; i++) {
+      _seal(&_blocks[(index + i) % SENSORLOG_BUFFER_BLOCKS].header);
+    }
+
+    if (length == 1) {
+      if (!sd.card()->writeBlock(_firstBlock + position, (const uint8_t *)&_blocks[index])) {
+        return false;
+      }
+    } else {
+      if (!sd.card()->writeStart(_firstBlock + position, length)) {
+        return false;
+      }
+
+      for (uint8_t i = 0; i < length; i++) {
+        if (!sd.card()->writeData((const uint8_t *)&_blocks[(index + i) % SENSORLOG_BUFFER_BLOCKS])) {
+          sd.card()->writeStop();
+          return false;
+        }
+      }
+
+      if (!sd.card()->writeStop()) {
+        return false;
+      }
+    }
+
+    index = (index + length) % SENSORLOG_BUFFER_BLOCKS;
+    seq += length;
+    count -= length;
+    stats.blocks += length;
+  }
+
+  stats.writeTime = micros() - writeStart;
+
+  if (stats.writeTime > stats.writeTimeMax) {
+    stats.writeTimeMax = stats.writeTime;
+  }
+
+  return true;
+}
+
+void SensorLog::_seal(sensorLogHeader_t *header) {
+  header->check = crc8Update(0, (const uint8_t *)header, sizeof(sensorLogHeader_t) - 1);
+}
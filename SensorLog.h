@@ -0,0 +1,162 @@
+/*
+  SensorLog.h - Append-only log of sensor readings and actuator changes
+  on the SD card. The log file is preallocated as one contiguous range of
+  blocks used as a ring. Records are packed into 512 byte blocks in RAM,
+  so appending a record is only a copy, and the filled blocks are written
+  later by run() with raw card writes, bypassing the file system. The RAM
+  blocks and the time index are allocated by begin(), only when there's
+  an SD card to log to.
+*/
+
+#ifndef SensorLog_h
+#define SensorLog_h
+
+#include "Arduino.h"
+#include "HiveStorage.h"
+
+// Log file size in blocks (4 MB). The log is started over if it's changed.
+#ifndef SENSORLOG_FILE_BLOCKS
+#define SENSORLOG_FILE_BLOCKS 8192UL
+#endif
+
+// Blocks staged in RAM, records are dropped when they are all filled
+// before the card catches up. With a single block the records which come
+// after it's filled and before the log task writes it are dropped, e.g.
+// the humidity reading following a temperature one. With two, the next
+// block takes them while the filled one waits for the card.
+#ifndef SENSORLOG_BUFFER_BLOCKS
+#define SENSORLOG_BUFFER_BLOCKS 2
+#endif
+
+// A partially filled block is written this long after its first unsaved record (ms)
+#ifndef SENSORLOG_FLUSH_DELAY
+#define SENSORLOG_FLUSH_DELAY 2000
+#endif
+
+// Sparse time index entries kept in RAM, one for every SENSORLOG_FILE_BLOCKS / SENSORLOG_INDEX_SIZE blocks
+#ifndef SENSORLOG_INDEX_SIZE
+#define SENSORLOG_INDEX_SIZE 64
+#endif
+
+#define SENSORLOG_FILE_NAME "sensors.log"
+
+// Record types
+#define SENSORLOG_TEMPERATURE 1       // Celsius
+#define SENSORLOG_HUMIDITY 2          // Percent
+#define SENSORLOG_RELAY 3             // Relay state, 1 is on
+#define SENSORLOG_OUTPUT 4            // Controller output
+
+#define SENSORLOG_MAGIC 0x4C48
+#define SENSORLOG_RECORDS 41          // Records in a block
+
+// Log time is counted in seconds from the first record ever written.
+// It goes on across reboots (with a 1 s gap), so records are always
+// ordered by time even though the node has no clock.
+typedef struct sensorLogRecord_t
+{
+  uint32_t time;                // ms since the block time
+  uint8_t moduleId;
+  uint8_t type;
+  uint16_t reserved;
+  float value;
+};
+
+typedef struct sensorLogHeader_t
+{
+  uint32_t seq;                 // Block number since the log was started, the ring position is seq % SENSORLOG_FILE_BLOCKS
+  uint32_t time;                // Log time of the first record (s)
+  uint16_t boot;                // Number of restarts since the log was started
+  uint16_t magic;
+  uint8_t count;                // Number of records in the block
+  uint8_t reserved[2];
+  uint8_t check;                // CRC8 of the header bytes before it
+};
+
+typedef struct sensorLogBlock_t
+{
+  sensorLogHeader_t header;
+  sensorLogRecord_t records[SENSORLOG_RECORDS];
+  uint8_t reserved[4];
+};
+
+typedef struct sensorLogStats_t
+{
+  unsigned long records;        // Records appended
+  unsigned long drops;          // Records dropped because the RAM blocks were full
+  unsigned long blocks;         // Blocks written, a partial block is counted each time it's written
+  unsigned long errors;         // Failed card writes
+  unsigned long writeTime;      // Last write duration (us)
+  unsigned long writeTimeMax;   // Longest write duration (us)
+};
+
+// Called when a block is filled, so the log task can be woken up
+typedef void (*SensorLogWakeHandler)();
+
+class SensorLog
+{
+  public:
+    SensorLog();
+
+    // Open the log file (or create it) and find where the log ends.
+    // Needs the SD card storage, returns false if the log can't be kept.
+    boolean begin();
+    boolean isActive();
+
+    boolean append(byte moduleId, uint8_t type, float value);
+
+    unsigned long run();          // Write the filled blocks, returns ms to the next call
+    void setWakeHandler(SensorLogWakeHandler handler);
+    unsigned long getTime();      // Current log time (s)
+
+    // Find the range of block numbers holding the records from..to (log time, s).
+    // The first and the last blocks may hold records outside the range.
+    // Returns false if there are no records in the range.
+    boolean findBlocks(uint32_t from, uint32_t to, uint32_t *first, uint32_t *last, sensorLogBlock_t *buffer);
+
+    // Get a block by its number. Blocks on the card are read into the buffer,
+    // blocks not written yet are returned from RAM. Returns NULL if the block is lost.
+    const sensorLogBlock_t *getBlock(uint32_t seq, sensorLogBlock_t *buffer);
+
+    static boolean hasModule(const sensorLogBlock_t *block, byte moduleId);
+
+    sensorLogStats_t stats;
+
+  private:
+    static const unsigned long _MaxBlockTime = 4000000;   // Record times are uint32 ms offsets from the block time (s)
+    static const uint16_t _RetryTime = 1000;              // Delay after a failed write (ms)
+    static const uint16_t _IndexStep = SENSORLOG_FILE_BLOCKS / SENSORLOG_INDEX_SIZE;
+
+    boolean _active;
+    uint32_t _firstBlock;         // Card block number of the log start
+    uint16_t _boot;
+
+    sensorLogBlock_t *_blocks;    // SENSORLOG_BUFFER_BLOCKS blocks
+    uint8_t _head;                // Block being filled
+    uint8_t _full;                // Filled blocks waiting to be written, they come right before the head
+    uint32_t _seq;                // Head block number
+    boolean _dirty;               // Head block has records which are not written yet
+    unsigned long _dirtyTime;
+
+    uint32_t _seconds;            // Log time
+    uint16_t _millis;
+    unsigned long _clockTime;     // millis() of the last clock update
+
+    SensorLogWakeHandler _wakeHandler;
+
+    // Time of each block with a number divisible by _IndexStep, by its ring position
+    uint32_t *_index;
+
+    void _tick();                 // Bring the log time up to date
+    boolean _recover();           // Find the last block written
+    boolean _readHeader(uint32_t position, sensorLogBlock_t *block);
+    uint32_t _findBlock(uint32_t time, uint32_t low, uint32_t high, sensorLogBlock_t *buffer);  // Last block from low..high with time <= the given one
+    uint32_t _blockTime(uint32_t seq, sensorLogBlock_t *buffer);   // 0xFFFFFFFF if the block is lost
+    static void _seal(sensorLogHeader_t *header);   // Set the header check byte
+    boolean _close();             // Queue the head block for writing and start the next one
+    void _advance();              // Start the next block
+    boolean _writeBlocks(uint8_t count);
+};
+
+extern SensorLog sensorLog;
+
+#endif
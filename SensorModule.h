@@ -7,8 +7,12 @@
 #define SensorModule_h
 #define SENSORMODULE_MODULE_VERSION 1
 
+// Time to the next loopDo() call of a module which is off (ms)
+#define SENSORMODULE_IDLE_TIME 1000
+
 #include "Arduino.h"
-#include "aJson.h"
+#include "JSONWriter.h"
+#include "JSONReader.h"
 
 class SensorModule {
   public:
@@ -19,11 +23,12 @@ class SensorModule {
     // with vtable errors
 
     virtual byte getStorageSize() { return 0; };    // Get constant value of storage size
-    virtual void getJSONSettings() {};              // Fill-in module settings in JSON object
-    virtual boolean setJSONSettings(aJsonObject *moduleItem) { return false; }; // Update settings from JSON object
+    virtual void printJSONSettings(JSONWriter *writer) {};  // Write module settings as JSON object fields
+    virtual boolean setJSONSettings(JSONReader *reader) { return false; };  // Update settings from JSON object fields
+    virtual void printJSONHistory(JSONWriter *writer) {};  // Write sample history of each measured value as array items
     virtual void turnModuleOff() {};                // Turn module off
     virtual void turnModuleOn()  {};                // Turn module on
-    virtual void loopDo() {};                       // Main processing (called from loop() in main sketch)
+    virtual unsigned long loopDo() { return SENSORMODULE_IDLE_TIME; };  // Main processing (called by the scheduler), returns ms to the next call
     virtual void handleInterrupt() {};
 
     byte moduleId;          // Unique module ID, set on object creation
@@ -3,51 +3,144 @@
 #ifndef WebStream_h
 #define WebStream_h
 #include "WebServer.h"
-#include "aJSON.h"
+
+// Output is collected and written to the socket in blocks of this size,
+// so each character doesn't cost a separate SPI transaction.
+// Define before including WebStream.h to change it.
+#ifndef WEBSTREAM_OUTPUT_BUFFER_SIZE
+#define WEBSTREAM_OUTPUT_BUFFER_SIZE 64
+#endif
+
+// Request body is read ahead into a buffer of this size,
+// so read(), peek() and available() are served from RAM
+#ifndef WEBSTREAM_INPUT_BUFFER_SIZE
+#define WEBSTREAM_INPUT_BUFFER_SIZE 32
+#endif
 
 // DEFINITION
 
 class WebStream : public Stream {
 public:
   WebStream(WebServer *server_);
-  
+  ~WebStream();
+
   size_t write(uint8_t ch);
+  size_t write(const uint8_t *buffer, size_t size);
   int read();
   int available();
-  void flush();
+  void flush();                 // Write the buffered output to the socket
   int peek();
 
 private:
   WebServer *server_obj;
+  uint8_t out_buffer[WEBSTREAM_OUTPUT_BUFFER_SIZE];
+  uint16_t out_length;
+  uint8_t in_buffer[WEBSTREAM_INPUT_BUFFER_SIZE];
+  uint16_t in_position;
+  uint16_t in_length;
+
+  boolean fill();               // Make sure there's something to read in the input buffer
 
 };
 
 // IMPLEMENTATION
 
 WebStream::WebStream(WebServer *server_)
-    : server_obj(server_)
+    : server_obj(server_),
+      out_length(0),
+      in_position(0),
+      in_length(0)
     {}
 
+// The stream lives until the end of the request handler,
+// so the rest of the response goes out here
+WebStream::~WebStream() {
+  flush();
+}
+
 size_t WebStream::write(uint8_t ch) {
-  return server_obj->write(ch);
+  if (out_length >= WEBSTREAM_OUTPUT_BUFFER_SIZE) {
+    flush();
+  }
+
+  out_buffer[out_length++] = ch;
+  return 1;
+}
+
+size_t WebStream::write(const uint8_t *buffer, size_t size) {
+  // A block which doesn't fit goes straight to the socket
+  if (size >= WEBSTREAM_OUTPUT_BUFFER_SIZE) {
+    flush();
+    return server_obj->write(buffer, size);
+  }
+
+  if (out_length + size > WEBSTREAM_OUTPUT_BUFFER_SIZE) {
+    flush();
+  }
+
+  memcpy(out_buffer + out_length, buffer, size);
+  out_length += size;
+  return size;
+}
+
+// WebServer::read() stops at the end of the request body (Content-Length),
+// so reading ahead never takes anything from the next request
+boolean WebStream::fill() {
+  if (in_position < in_length) {
+    return true;
+  }
+
+  in_position = 0;
+  in_length = 0;
+
+  // Wait for the first character the same way WebServer::read() does,
+  // but take the rest only if it has already arrived
+  int ch = server_obj->read();
+
+  if (ch < 0) {
+    return false;
+  }
+
+  in_buffer[in_length++] = ch;
+
+  while ((in_length < WEBSTREAM_INPUT_BUFFER_SIZE) && (server_obj->available() > 0)) {
+    ch = server_obj->read();
+
+    if (ch < 0) {
+      break;
+    }
+
+    in_buffer[in_length++] = ch;
+  }
+
+  return true;
 }
 
 int WebStream::read() {
-  return server_obj->read();
+  if (!fill()) {
+    return -1;
+  }
+
+  return in_buffer[in_position++];
 }
 
 int WebStream::available() {
-  return server_obj->available();
+  return (in_length - in_position) + server_obj->available();
 }
 
 void WebStream::flush() {
-
+  if (out_length > 0) {
+    server_obj->write(out_buffer, out_length);
+    out_length = 0;
+  }
 }
 
 int WebStream::peek() {
-  int ch = server_obj->read();
-  server_obj->push(ch);
-  return ch;
+  if (!fill()) {
+    return -1;
+  }
+
+  return in_buffer[in_position];
 }
 
-#endif
\ No newline at end of file
+#endif
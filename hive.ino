@@ -9,16 +9,16 @@
 #include "EEPROM.h"
 #include "Wire.h"
 #include "SPI.h"
-#include "SD.h"
+#include "SdFat.h"
 #include "Ethernet.h"
+#include "Dns.h"
 
 // External libraries
 #include "WebServer.h"
 #include "OneWire.h"
+#include "CRC.h"
 #include "DallasTemperature.h"
-#include "aJSON.h"
 #include "ds3231.h"
-#include "DHT.h"
 
 // Hive libraries
 #include "HiveSetup.h"
@@ -27,6 +27,14 @@
 #include "HiveUtils.h"
 #include "HiveStorage.h"
 #include "WebStream.h"
+#include "JSONWriter.h"
+#include "JSONReader.h"
+#include "Scheduler.h"
+#include "PinChangeListener.h"
+#include "DHTReader.h"
+#include "PushQueue.h"
+#include "SensorLog.h"
+#include "PIDBank.h"
 #include "MemoryFree.h"
 
 char requestBuffer[RestRequestLength];
@@ -46,98 +54,104 @@ char clientURL[CommonBufferLength];
 // Store remote port
 int16_t clientPort = 80;
 
+// Discover request structure, filled by JSONReader
+typedef struct discoverIP_t
+{
+  uint8_t o1;
+  uint8_t o2;
+  uint8_t o3;
+  uint8_t o4;
+};
+
+typedef struct discover_t
+{
+  char domain[CommonBufferLength];
+  char url[CommonBufferLength];
+  discoverIP_t ip;
+  int16_t port;
+};
+
+const JSONField discoverIPFields[] PROGMEM = {
+  JSON_FIELD("o1", JSONTypeUInt, discoverIP_t, o1),
+  JSON_FIELD("o2", JSONTypeUInt, discoverIP_t, o2),
+  JSON_FIELD("o3", JSONTypeUInt, discoverIP_t, o3),
+  JSON_FIELD("o4", JSONTypeUInt, discoverIP_t, o4)
+};
+
+const JSONField discoverFields[] PROGMEM = {
+  JSON_FIELD("domain", JSONTypeString, discover_t, domain),
+  JSON_FIELD("url", JSONTypeString, discover_t, url),
+  JSON_OBJECTS("ip", discover_t, ip, sizeof(discoverIP_t), 1, discoverIPFields),
+  JSON_FIELD("port", JSONTypeInt, discover_t, port)
+};
+
 // Create a WebServer instance
 WebServer nodeWebServer("", 80);
 
 // If Ethernet is initialized and nodeWebServer is started - set it to TRUE
 boolean webServerActive = false;
 
-aJsonObject *moduleCollection;
-aJsonObject *moduleItem;
-
-AppContext context(&moduleCollection, &pushNotify);
-
-boolean pushNotify(byte moduleId) {
-  // We'll set it to true if a server has discovered our node
-  boolean isDiscovered = false;
-
-  // DEBUG
-  char host[CommonBufferLength];
+// Runs modules, the web server and storage write back when they are due.
+Scheduler scheduler;
 
-  char buffer[CommonBufferLength];
+// Task id of each module by its index in sensorModuleArray, -1 until it's added
+int8_t moduleTaskIds[modulesCount];
 
-  // Select SPI slave device - Ethernet
-  useDevice(DeviceIdEthernet);
+AppContext context(&pushNotify);
 
-  // Create an object for making HTTP requests
-  EthernetClient client;
+// Notifications for the server found by discovery
+PushQueue pushQueue;
+int8_t pushTaskId = -1;
 
-  if (webServerActive) {
-    // If we have a domain, connect with it
-    if ((clientDomain != NULL) && (strlen(clientDomain) > 0)) {
-      isDiscovered = true;
-      client.connect(clientDomain, clientPort);
-      strncpy(host, clientDomain, sizeof(host) - 1);
-      // Null-terminate the string just in case
-      if (sizeof(host) > 0)
-      {
-        host[sizeof(host)-1] = 0;
-      }
-    } else {
-      // If we have ip address only connect with it
-      if(clientIPAddress[0] > 0) {
-
-        isDiscovered = true;
+// Queue a notification, it's sent by the push task
+boolean pushNotify(byte moduleId) {
+  boolean queued = pushQueue.push(moduleId);
 
-        // DEBUG
-        for (int i = 0; i < 4; i++) {
-          itoa(clientIPAddress[i], buffer, 10);
-          strncat(host, buffer, strlen(buffer));
-          if (i < 3)
-            strncat(host, ".", 1);
-        }
-        debugPrint(F("Push IP found: "), false);
-        debugPrint(host);
+  if (queued) {
+    scheduler.wake(pushTaskId);
+  }
 
-        client.connect(clientIPAddress, clientPort);
-      }
-    }
+  return queued;
+}
 
-    if (isDiscovered && client.connected()) {
-      //DEBUG
-      debugPrint(F("Connected to server"));
+unsigned long pushQueueTask() {
+  return pushQueue.run();
+}
 
-      // Call remote URL with moduleId attached
-      // TODO: use no-cost stream operator for printing to client
+// Sensor log blocks are written to the SD card by their own task
+int8_t logTaskId = -1;
 
-      // Send "GET clientURL/nodeId/moduleId HTTP/1.0"
-      // so the remote site knows which pcb/module settings changed
+unsigned long sensorLogTask() {
+  return sensorLog.run();
+}
 
-      client.print(F("GET "));
-      client.print(clientURL);
-      client.print(F("/"));
-      client.print(nodeId);
-      client.print(F("/"));
-      client.print(moduleId);
-      client.println(F(" HTTP/1.0"));
-      client.println();
+// A log block has been filled, write it without waiting for the flush delay
+void wakeSensorLogTask() {
+  scheduler.wake(logTaskId);
+}
 
-      if (client.connected()) {
-        if (client.find("success")) {
-          // DEBUG
-          debugPrint("Success");
+// Control loops registered by the modules are updated together
+unsigned long pidBankTask() {
+  return pidBank.run();
+}
 
-          client.stop();
-          return true;
+// Write a single module settings object
+void printModuleJSON(JSONWriter *writer, uint8_t i) {
+  writer->beginObject();
+  writer->addNumber(F("id"), sensorModuleArray[i]->moduleId);
+  sensorModuleArray[i]->printJSONSettings(writer);
+  writer->endObject();
+}
 
-        }
-      }
-    }
+// Write settings of all modules as an array
+void printModuleCollectionJSON(JSONWriter *writer) {
+  writer->beginArray();
 
-    client.stop();
+  for (uint8_t i = 0; i < modulesCount; i++) {
+    printModuleJSON(writer, i);
   }
 
-  return false;
+  writer->endArray();
 }
 
 // Process a REST request for an item (module) (URL contains ID)
@@ -157,9 +171,10 @@ void webItemRequest(WebServer &server, WebServer::ConnectionType type, long *mod
     return;
   }
 
-  // aJson uses a wrapper for streams
+  // Wrap the server into a stream for the JSON reader and writer
   WebStream webStream(&server);
-  aJsonStream jsonStream(&webStream);
+  JSONReader reader(&webStream);
+  JSONWriter writer(&webStream);
 
   switch (type) {
     case WebServer::GET:
@@ -167,45 +182,31 @@ void webItemRequest(WebServer &server, WebServer::ConnectionType type, long *mod
       // Process request for a single module (item) settings
 
       server.httpSuccess("application/json");
-      sensorModuleArray[i]->getJSONSettings();
-      moduleItem = aJson.getArrayItem(moduleCollection, i);
-      aJson.print(moduleItem, &jsonStream);
+      printModuleJSON(&writer, i);
 
       break;
     case WebServer::PUT:
     {
       // Process request for settings change
 
-      // Parse request to JSON
-      // No aJson filter used here for simplicity, speed and memory usage
-      // TODO: get aJson filter from module and apply it here
-
-      aJsonObject *newModuleItem = aJson.parse(&jsonStream);
-
-      // DEBUG
-      debugPrint(F("Received data: "), false);
-      char *json1 = aJson.print(newModuleItem);
-      debugPrint(json1);
-      free(json1);
+      // The request body is parsed straight into module settings
+      // while it's being received, no JSON tree is built
 
       // Set the parsed settings
-      if (sensorModuleArray[i]->setJSONSettings(newModuleItem)) {
+      if (reader.beginObject() && sensorModuleArray[i]->setJSONSettings(&reader)) {
 
-        server.httpSuccess("application/json");
+        // Let the module act on the new settings right away
+        scheduler.wake(i);
 
-        // Refresh module settings in JSON collection
-        sensorModuleArray[i]->getJSONSettings();
-        moduleItem = aJson.getArrayItem(moduleCollection, i);
+        server.httpSuccess("application/json");
 
         // Print settings back to the client
-        aJson.print(moduleItem, &jsonStream);
+        printModuleJSON(&writer, i);
 
       } else {
         server.httpFail();
       }
 
-      aJson.deleteItem(newModuleItem);
-
       break;
     }
     default:
@@ -213,23 +214,96 @@ void webItemRequest(WebServer &server, WebServer::ConnectionType type, long *mod
   }
 }
 
+// Stream sample history of a module
+void webHistoryRequest(WebServer &server, WebServer::ConnectionType type, long *moduleId) {
+  if ((type != WebServer::GET) || (*moduleId > modulesCount) || (*moduleId < 1)) {
+    server.httpFail();
+    return;
+  }
+
+  WebStream webStream(&server);
+  JSONWriter writer(&webStream);
+
+  server.httpSuccess("application/json");
+
+  // Sample times are seconds since boot, "time" tells the current one
+  writer.beginObject();
+  writer.addNumber(F("id"), *moduleId);
+  writer.addNumber(F("time"), millis() / 1000);
+  writer.beginArray(F("series"));
+  sensorModuleArray[*moduleId - 1]->printJSONHistory(&writer);
+  writer.endArray();
+  writer.endObject();
+}
+
 // Process request for the whole items (modules) settings collection
 void webCollectionRequest(WebServer &server, WebServer::ConnectionType type) {
 
   WebStream webStream(&server);
-  aJsonStream jsonStream(&webStream);
+  JSONReader reader(&webStream);
+  JSONWriter writer(&webStream);
 
   switch (type) {
     case WebServer::GET:
     {
       server.httpSuccess("application/json");
-      // Reload JSON structures for each module
-      for (int i = 0; i < modulesCount; i++) {
-        sensorModuleArray[i]->getJSONSettings();
+
+      // Stream the whole collection
+      printModuleCollectionJSON(&writer);
+
+      break;
+    }
+    case WebServer::PUT:
+    {
+      // Process a batch of settings changes.
+      // Request is an array of module objects, "id" must be the first field of each one.
+      // Items are applied one by one as they arrive and the response
+      // is an array of {"id", "success"} objects in the same order.
+
+      if (!reader.beginArray()) {
+        server.httpFail();
+        break;
       }
 
-      // Print out the whole collection
-      aJson.print(moduleCollection, &jsonStream);
+      server.httpSuccess("application/json");
+      writer.beginArray();
+
+      // Write all the changed settings to the storage at once
+      beginStorageBatch();
+
+      char key[JSONREADER_KEY_LENGTH];
+      uint8_t depth = reader.getDepth();
+
+      while (reader.nextItem()) {
+        long id = 0;
+        boolean success = false;
+
+        if (reader.beginObject()) {
+          if (reader.nextKey(key, sizeof(key)) && (strcmp_P(key, PSTR("id")) == 0) && reader.readNumber(&id) &&
+              (id > 0) && (id <= modulesCount)) {
+            success = sensorModuleArray[id - 1]->setJSONSettings(&reader);
+          }
+
+          if (success) {
+            scheduler.wake(id - 1);
+          }
+        } else {
+          reader.skipValue();
+        }
+
+        writer.beginObject();
+        writer.addNumber(F("id"), id);
+        writer.addBoolean(F("success"), success);
+        writer.endObject();
+
+        // Skip the rest of an invalid item, stop if the request is broken
+        if (!reader.skipTo(depth)) {
+          break;
+        }
+      }
+
+      endStorageBatch();
+      writer.endArray();
 
       break;
     }
@@ -238,6 +312,73 @@ void webCollectionRequest(WebServer &server, WebServer::ConnectionType type) {
   }
 }
 
+// Handle sensor log request: /history?module=<id>&from=<time>&to=<time>
+// Times are log times in seconds (see SensorLog.h), the current one is sent
+// in the X-Log-Time header. All the parameters are optional.
+// The log blocks holding the range are sent as they are, 512 bytes each,
+// blocks without records of the module are skipped. The blocks may hold
+// records of other modules and from outside the range, the client filters them.
+void webHistoryCommand(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool tail_complete) {
+  char name[8];
+  char value[12];
+  char headers[32];
+  long moduleId = 0;
+  uint32_t now = sensorLog.getTime();
+  uint32_t from = 0;
+  uint32_t to = now;
+  uint32_t first, last;
+  sensorLogBlock_t *buffer;
+
+  // DEBUG
+  debugPrint(F("Processing history request..."));
+
+  if (!sensorLog.isActive() || ((type != WebServer::GET) && (type != WebServer::HEAD))) {
+    server.httpFail();
+    return;
+  }
+
+  while (server.nextURLparam(&url_tail, name, sizeof(name), value, sizeof(value)) != URLPARAM_EOS) {
+    if (strcmp(name, "module") == 0) {
+      moduleId = strtol(value, NULL, 10);
+    } else if (strcmp(name, "from") == 0) {
+      from = strtoul(value, NULL, 10);
+    } else if (strcmp(name, "to") == 0) {
+      to = strtoul(value, NULL, 10);
+    }
+  }
+
+  sprintf(headers, "X-Log-Time: %lu\r\n", (unsigned long)now);
+  server.httpSuccess("application/octet-stream", headers);
+
+  if (type == WebServer::HEAD) {
+    return;
+  }
+
+  // Blocks on the card are read into the SdFat block cache,
+  // it's free to use until the next file operation
+  useDevice(DeviceIdSD);
+  buffer = (sensorLogBlock_t *)sd.vol()->cacheClear();
+
+  if (buffer && sensorLog.findBlocks(from, to, &first, &last, buffer)) {
+    if (last - first >= HistoryMaxBlocks) {
+      last = first + HistoryMaxBlocks - 1;
+    }
+
+    for (uint32_t seq = first; seq <= last; seq++) {
+      const sensorLogBlock_t *block = sensorLog.getBlock(seq, buffer);
+
+      if (!block || ((moduleId > 0) && !SensorLog::hasModule(block, moduleId))) {
+        continue;
+      }
+
+      useDevice(DeviceIdEthernet);
+      server.write((const uint8_t *)block, sizeof(sensorLogBlock_t));
+    }
+  }
+
+  useDevice(DeviceIdEthernet);
+}
+
 // Routine is called by the web server when ANY request arrives.
 // Process parts of the whole url in url_path array,
 // check if it's a REST request and process it
@@ -258,10 +399,12 @@ void dispatchRESTRequest(WebServer &server, WebServer::ConnectionType type,
   // RESTful interface structure:
   // /modules
   //      GET - outputs json structure for all modules
-  //      PUT - updates settings for all modules in a batch (not supported: too large for request buffer)
+  //      PUT - updates settings for a batch of modules, takes an array of module objects with "id" field first
   // /modules/<id>
   //      GET - outputs json structure for a module with moduleId == <id>
   //      PUT - updates settings for a module with moduleId == <id>
+  // /modules/<id>/history
+  //      GET - outputs recent samples and per minute/hour rollups of the module values
 
   if (strcmp(url_path[0], "modules") == 0) {
 
@@ -274,7 +417,13 @@ void dispatchRESTRequest(WebServer &server, WebServer::ConnectionType type,
       moduleId = strtol(url_path[1], NULL, 10);
     }
 
-    if (moduleId > 0) {
+    if ((moduleId > 0) && url_path[2] && (strcmp(url_path[2], "history") == 0)) {
+
+      // We deal with a module history request
+      webHistoryRequest(server, type, &moduleId);
+      return;
+
+    } else if (moduleId > 0) {
 
       // We deal with a single module request
       webItemRequest(server, type, &moduleId);
@@ -297,12 +446,10 @@ void dispatchRESTRequest(WebServer &server, WebServer::ConnectionType type,
 // Handle discovery mode, record remote server url for push notifications,
 // respond with node information
 void webDiscoverCommand(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool tail_complete) {
-  aJsonObject *clientInfo;
-  aJsonObject *infoItem;
   WebStream webStream(&server);
-  aJsonStream jsonStream(&webStream);
-
-  byte i = 0;
+  JSONReader reader(&webStream);
+  JSONWriter writer(&webStream);
+  discover_t clientInfo;
 
   // For a HEAD request return only headers
   if (type == WebServer::HEAD) {
@@ -312,83 +459,66 @@ void webDiscoverCommand(WebServer &server, WebServer::ConnectionType type, char
 
   if (type == WebServer::POST) {
 
-    // We could use filtering, but it's memory consuming
-    // and may be omitted in merely safe environements
-
-    //char **jsonFilter = (char *[]){"domain", "url", "ip", NULL};
-    //clientInfo = aJson.parse(&jsonStream, jsonFilter);
-
-    clientInfo = aJson.parse(&jsonStream);
-
-    // DEBUG
-    debugPrint(F("Domain and url from server: "), false);
-    char *json = aJson.print(clientInfo);
-    debugPrint(json);
-    free(json);
-
     // Discover request structure
     // JSON object with fields:
     // domain - string, for POST request easy building (32 chars max)
     // ip - object, if we have no local DNS and need to talk through ip address
     //    o1, o2, o3, o4 - numbers, ip address octets so we don't need to parse the address
     // url - string, URL tail (without domain), begins with a slash (32 chars max)
-
-    // Get remote domain from json
-    infoItem = aJson.getObjectItem(clientInfo, "domain");
-
-    if (infoItem && (infoItem->type == aJson_String)) {
-      strncpy(clientDomain, infoItem->valuestring, sizeof(clientDomain) - 1);
-
-      // Null-terminate the string just in case
-      if (sizeof(clientDomain) > 0)
-      {
-        clientDomain[sizeof(clientDomain)-1] = 0;
-      }
+    // port - number
+
+    // Fields missing in the request keep their current values
+    strcpy(clientInfo.domain, clientDomain);
+    strcpy(clientInfo.url, clientURL);
+    clientInfo.ip.o1 = clientIPAddress[0];
+    clientInfo.ip.o2 = clientIPAddress[1];
+    clientInfo.ip.o3 = clientIPAddress[2];
+    clientInfo.ip.o4 = clientIPAddress[3];
+    clientInfo.port = clientPort;
+
+    if (!reader.beginObject() ||
+        !reader.readFields(discoverFields, sizeof(discoverFields) / sizeof(*discoverFields), &clientInfo)) {
+      server.httpFail();
+      return;
     }
 
-    // Get remote url
-    infoItem = aJson.getObjectItem(clientInfo, "url");
-    if (infoItem && (infoItem->type == aJson_String)) {
-      strncpy(clientURL, infoItem->valuestring, sizeof(clientURL) - 1);
-      // Null-terminate the string just in case
-      if (sizeof(clientURL) > 0)
-      {
-        clientURL[sizeof(clientURL)-1] = 0;
-      }
-    }
+    strcpy(clientDomain, clientInfo.domain);
+    strcpy(clientURL, clientInfo.url);
+    clientIPAddress = IPAddress(clientInfo.ip.o1, clientInfo.ip.o2, clientInfo.ip.o3, clientInfo.ip.o4);
+    clientPort = clientInfo.port;
 
-    infoItem = aJson.getObjectItem(clientInfo, "ip");
+    // Resolve the domain once here, so sending notifications never waits for DNS
+    IPAddress serverIP = clientIPAddress;
 
-    if (infoItem) {
-      infoItem = infoItem->child;
+    if (strlen(clientDomain) > 0) {
+      DNSClient dns;
+      dns.begin(Ethernet.dnsServerIP());
 
-      while (infoItem && (i < 4)) {
-        if (infoItem->type == aJson_Int) {
-          clientIPAddress[i] = infoItem->valueint;
-        }
-        infoItem = infoItem->next;
-        i++;
+      if (dns.getHostByName(clientDomain, serverIP) != 1) {
+        // DEBUG
+        debugPrint(F("Failed to resolve server domain"));
+
+        serverIP = clientIPAddress;
       }
     }
 
-    infoItem = aJson.getObjectItem(clientInfo, "port");
-
-    if (infoItem && (infoItem->type == aJson_Int)) {
-      clientPort = infoItem->valueint;
+    if (serverIP[0] > 0) {
+      pushQueue.setServer(serverIP, clientPort, clientURL, clientDomain);
     }
 
-    // TODO: validate the whole structure
-    server.httpSuccess("application/json");
+    // DEBUG
+    debugPrint(F("Domain and url from server: "), false);
+    debugPrint(clientDomain, false);
+    debugPrint(F(" "), false);
+    debugPrint(clientURL);
 
-    infoItem = aJson.createObject();
-    // Prepare JSON structure containing pcb id and number of sensor modules
-    aJson.addItemToObject(infoItem, "id", aJson.createItem(nodeId));
-    aJson.addItemToObject(infoItem, "modulesCount", aJson.createItem(modulesCount));
-    // Output response and delete aJson object
-    aJson.print(infoItem, &jsonStream);
+    server.httpSuccess("application/json");
 
-    aJson.deleteItem(infoItem);
-    aJson.deleteItem(clientInfo);
+    // Output pcb id and number of sensor modules
+    writer.beginObject();
+    writer.addNumber(F("id"), nodeId);
+    writer.addNumber(F("modulesCount"), modulesCount);
+    writer.endObject();
 
     return;
   }
@@ -399,8 +529,7 @@ void webDiscoverCommand(WebServer &server, WebServer::ConnectionType type, char
 // Handle system status information request
 void webInfoCommand(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool tail_complete) {
   WebStream webStream(&server);
-  aJsonStream jsonStream(&webStream);
-  aJsonObject *infoItem;
+  JSONWriter writer(&webStream);
 
   // DEBUG
   debugPrint(F("Processing info request..."));
@@ -414,15 +543,56 @@ void webInfoCommand(WebServer &server, WebServer::ConnectionType type, char *url
     case WebServer::GET:
     {
       server.httpSuccess("application/json");
-      // Reload JSON structures for each module
-
-      infoItem = aJson.createObject();
-      aJson.addItemToObject(infoItem, "memory", aJson.createItem(freeMemory()));
-      aJson.addItemToObject(infoItem, "storage", aJson.createItem(StorageType));
 
       // Print out the info object
-      aJson.print(infoItem, &jsonStream);
-      aJson.deleteItem(infoItem);
+      writer.beginObject();
+      writer.addNumber(F("memory"), freeMemory());
+      writer.addNumber(F("storage"), StorageType);
+
+      writer.beginObject(F("storageCache"));
+      writer.addNumber(F("writes"), storageStats.writes);
+      writer.addNumber(F("writesCoalesced"), storageStats.writesCoalesced);
+      writer.addNumber(F("flushes"), storageStats.flushes);
+      writer.addNumber(F("flushTime"), storageStats.flushTime);
+      writer.addNumber(F("flushTimeMax"), storageStats.flushTimeMax);
+      writer.addNumber(F("eepromWrites"), storageStats.eepromWrites);
+      writer.addNumber(F("flushFailures"), storageStats.flushFailures);
+      writer.endObject();
+
+      writer.beginObject(F("log"));
+      writer.addBoolean(F("active"), sensorLog.isActive());
+      writer.addNumber(F("records"), sensorLog.stats.records);
+      writer.addNumber(F("drops"), sensorLog.stats.drops);
+      writer.addNumber(F("blocks"), sensorLog.stats.blocks);
+      writer.addNumber(F("errors"), sensorLog.stats.errors);
+      writer.addNumber(F("writeTime"), sensorLog.stats.writeTime);
+      writer.addNumber(F("writeTimeMax"), sensorLog.stats.writeTimeMax);
+      writer.endObject();
+
+      writer.beginObject(F("push"));
+      writer.addNumber(F("depth"), pushQueue.getDepth());
+      writer.addNumber(F("sent"), pushQueue.stats.sent);
+      writer.addNumber(F("coalesced"), pushQueue.stats.coalesced);
+      writer.addNumber(F("drops"), pushQueue.stats.drops);
+      writer.addNumber(F("failures"), pushQueue.stats.failures);
+      writer.addNumber(F("connects"), pushQueue.stats.connects);
+      writer.addNumber(F("rtt"), pushQueue.stats.rtt);
+      writer.addNumber(F("rttMax"), pushQueue.stats.rttMax);
+      writer.endObject();
+
+      writer.beginArray(F("spi"));
+      for (uint8_t i = 0; i < DevicesCount; i++) {
+        writer.beginObject();
+        writer.addNumber(F("device"), i);
+        writer.addNumber(F("selections"), deviceStats[i].selections);
+        writer.addNumber(F("holdTime"), deviceStats[i].holdTime);
+        writer.endObject();
+      }
+      writer.endArray();
+
+      scheduler.printJSONStats(&writer);
+
+      writer.endObject();
 
       break;
     }
@@ -484,6 +654,7 @@ boolean setupServer() {
 
     nodeWebServer.addCommand("discover", &webDiscoverCommand);
     nodeWebServer.addCommand("info", &webInfoCommand);
+    nodeWebServer.addCommand("history", &webHistoryCommand);
     nodeWebServer.setUrlPathCommand(&dispatchRESTRequest);
     //nodeWebServer.setFailureCommand(&webFailureCommand);
     nodeWebServer.begin();
@@ -497,14 +668,6 @@ boolean setupServer() {
   return false;
 }
 
-void addToJSONCollection(byte id) {
-  //aJsonObject *moduleItem;
-  moduleItem = aJson.createObject();
-  aJson.addItemToObject(moduleItem, "id", aJson.createItem(id));
-  aJson.addItemToArray(moduleCollection, moduleItem);
-
-}
-
 void setup() {
   boolean systemSettingsLoaded = false;
   boolean moduleSettingsExist = false;
@@ -534,42 +697,72 @@ void setup() {
   // modules settings stored
   moduleSettingsExist = initStorage();
 
+  // Sensor log needs the SD card
+  if (sensorLog.begin()) {
+    sensorLog.setWakeHandler(&wakeSensorLogTask);
+  }
+
+  // Switch edges wake their modules
+  memset(moduleTaskIds, -1, sizeof(moduleTaskIds));
+  PinChangeListener::setWakeHandler(&wakeModuleFromInterrupt);
+
   // Define and init modules
   initModules(&context, moduleSettingsExist);
 
-  // Create and fill json structure for the REST interface
-  moduleCollection = aJson.createArray();
+  for (byte i = 0; i < modulesCount; i++) {
+    moduleTaskIds[i] = scheduler.addModule(sensorModuleArray[i]);
+  }
 
-  // TODO: Start cycle through SensorModuleArray
-  for (byte i = 1; i <= modulesCount; i++) {
-    // Create an empty item in json collection
-    addToJSONCollection(i);
+  if (webServerActive) {
+    scheduler.addTask(&webServerTask, F("web"));
+    pushTaskId = scheduler.addTask(&pushQueueTask, F("push"));
+  }
 
-    // Add modules settings to this item through the context object
-    sensorModuleArray[i - 1]->getJSONSettings();
+  scheduler.addTask(&storageLoopDo, F("storage"));
+
+  if (sensorLog.isActive()) {
+    logTaskId = scheduler.addTask(&sensorLogTask, F("log"));
+  }
+
+  if (pidBank.getLaneCount() > 0) {
+    scheduler.addTask(&pidBankTask, F("pid"));
   }
 
+#ifdef HIVE_DEBUG
   // DEBUG
-  debugPrint(F("Context collection: "), false);
-  char *json = aJson.print(*context.moduleCollection);
-  debugPrint(json);
-  free(json);
+  debugPrint(F("Modules collection: "), false);
+  JSONWriter writer(&Serial);
+  printModuleCollectionJSON(&writer);
+  debugPrint("");
+#endif
 
 }
 
-void loop() {
-  // Call each module loop method
-  for(byte i = 0; i < modulesCount; i++) {
-    sensorModuleArray[i]->loopDo();
-  }
+// Check for web server calls
+unsigned long webServerTask() {
+  useDevice(DeviceIdEthernet);
+  nodeWebServer.processConnection(requestBuffer, &requestLen);
 
-  // Check for web server calls
-  if (webServerActive) {
-    useDevice(DeviceIdEthernet);
-    nodeWebServer.processConnection(requestBuffer, &requestLen);
+  return WebServerPollTime;
+}
+
+// Called from pin change interrupts, see PinChangeListener. A module is only
+// looked at once it has a task, while initModules() sets its pointer an
+// interrupt could read half of it.
+void wakeModuleFromInterrupt(uint8_t moduleId) {
+  for (byte i = 0; i < modulesCount; i++) {
+    if ((moduleTaskIds[i] >= 0) && (sensorModuleArray[i]->moduleId == moduleId)) {
+      scheduler.wakeFromInterrupt(moduleTaskIds[i]);
+      return;
+    }
   }
 }
 
+void loop() {
+  // Run the modules and the web server when they are due
+  scheduler.run();
+}
+
 void handleInterrupts(uint8_t handlerIndex) {
   /*if (interruptModuleArray[handlerIndex]) {
     interruptModuleArray[handlerIndex]->handleInterrupt();
@@ -588,3 +781,20 @@ ISR(TIMER4_OVF_vect) {
 ISR(TIMER5_OVF_vect) {
   handleInterrupts(2);
 }
+
+// Pin change interrupts are shared by the pins of a port,
+// the listeners find out which pins have changed
+ISR(PCINT0_vect) {
+  PinChangeListener::handleInterrupt();
+  DHTReader::handleInterrupt();
+}
+
+ISR(PCINT1_vect) {
+  PinChangeListener::handleInterrupt();
+  DHTReader::handleInterrupt();
+}
+
+ISR(PCINT2_vect) {
+  PinChangeListener::handleInterrupt();
+  DHTReader::handleInterrupt();
+}
@@ -0,0 +1,50 @@
+// CRC library - cyclic redundancy checks used by the 1-Wire and SD card drivers.
+//
+// Each polynomial can be computed bit by bit (smallest, slowest), with a
+// 16 entry nibble table (a good middle ground) or with a full 256 entry
+// table (fastest, largest). Tables are kept in flash. Define the method
+// for a polynomial before the library is compiled (e.g. in CRC.h) to change it.
+//
+// All the functions take the CRC of the data processed so far, so data can be
+// checked in chunks as it arrives. Start with zero.
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CRC_BITWISE 0   // No table
+#define CRC_NIBBLE  1   // 16 entries: 16 bytes for 8-bit CRCs, 32 bytes for 16-bit ones
+#define CRC_TABLE   2   // 256 entries: 256 bytes for 8-bit CRCs, 512 bytes for 16-bit ones
+
+// Dallas/Maxim 1-Wire CRC8 (ROM codes and scratchpads), x^8 + x^5 + x^4 + 1
+#ifndef CRC8_METHOD
+#define CRC8_METHOD CRC_TABLE
+#endif
+
+// Dallas/Maxim 1-Wire CRC16, x^16 + x^15 + x^2 + 1
+#ifndef CRC16_METHOD
+#define CRC16_METHOD CRC_NIBBLE
+#endif
+
+// CRC-CCITT (SD card data blocks), x^16 + x^12 + x^5 + 1
+#ifndef CRC_CCITT_METHOD
+#define CRC_CCITT_METHOD CRC_TABLE
+#endif
+
+uint8_t crc8Update(uint8_t crc, const uint8_t *data, size_t len);
+uint16_t crc16Update(uint16_t crc, const uint8_t *data, size_t len);
+uint16_t crcCCITTUpdate(uint16_t crc, const uint8_t *data, size_t len);
+
+// CRC7 of SD card commands, x^7 + x^3 + 1. Commands are 5 bytes long,
+// so it's always computed bit by bit.
+uint8_t crc7Update(uint8_t crc, const uint8_t *data, size_t len);
+
+// A 1-Wire ROM code or scratchpad ends with the CRC8 of the bytes before it,
+// so the CRC8 of the whole block is zero if it's intact
+static inline bool crc8Check(const uint8_t *data, size_t len) {
+  return crc8Update(0, data, len) == 0;
+}
+
+#endif
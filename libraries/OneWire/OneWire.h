@@ -16,9 +16,9 @@
 // and -ffunction-sections when compiling, and Wl,--gc-sections
 // when linking), so most of these will not result in any code size
 // reduction.  Well, unless you try to use the missing features
-// and redesign your program to not need them!  ONEWIRE_CRC8_TABLE
-// is the exception, because it selects a fast but large algorithm
-// or a small but slow algorithm.
+// and redesign your program to not need them!  The CRC algorithms
+// themselves come from the CRC library, see CRC8_METHOD and
+// CRC16_METHOD in CRC.h to trade speed for size.
 
 // you can exclude onewire_search by defining that to 0
 #ifndef ONEWIRE_SEARCH
@@ -30,15 +30,6 @@
 #define ONEWIRE_CRC 1
 #endif
 
-// Select the table-lookup method of computing the 8-bit CRC
-// by setting this to 1.  The lookup table enlarges code size by
-// about 250 bytes.  It does NOT consume RAM (but did in very
-// old versions of OneWire).  If you disable this, a slower
-// but very compact algorithm is used.
-#ifndef ONEWIRE_CRC8_TABLE
-#define ONEWIRE_CRC8_TABLE 1
-#endif
-
 // You can allow 16-bit CRC checks by defining this to 1
 // (Note that ONEWIRE_CRC must also be 1.)
 #ifndef ONEWIRE_CRC16
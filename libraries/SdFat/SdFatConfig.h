@@ -56,9 +56,8 @@
 /**
  * To enable SD card CRC checking set USE_SD_CRC nonzero.
  *
- * Set USE_SD_CRC to 1 to use a smaller slower CRC-CCITT function.
- *
- * Set USE_SD_CRC to 2 to used a larger faster table driven CRC-CCITT function.
+ * CRC functions come from the CRC library. Set CRC_CCITT_METHOD in CRC.h
+ * to CRC_BITWISE, CRC_NIBBLE or CRC_TABLE to trade speed for size.
  */
 #define USE_SD_CRC 0
 //------------------------------------------------------------------------------
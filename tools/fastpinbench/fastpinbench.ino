@@ -0,0 +1,91 @@
+/*
+  fastpinbench.ino - Counts the CPU cycles digitalWrite()/digitalRead(),
+  FastPin and StaticFastPin take on a Mega. Timer1 runs at the CPU clock,
+  each call is timed 100 times in a row with interrupts off, and the cost
+  of an empty call is taken off. The IDE builds the files in the sketch folder
+  only, so copy FastPin.h and FastPin.cpp from the repository root here
+  first. The results are printed on Serial at 115200.
+*/
+
+#include "FastPin.h"
+
+const uint8_t OutputPin = 13;         // PB7, low I/O space
+const uint8_t ExtendedOutputPin = 8;  // PH5, extended I/O space
+const uint8_t InputPin = 2;
+const uint8_t Calls = 100;
+
+// The modules keep pins and levels in variables, so the
+// calls can't be resolved at build time here either
+volatile uint8_t outputPin = OutputPin;
+volatile uint8_t inputPin = InputPin;
+volatile uint8_t level = LOW;
+volatile uint8_t sink;
+
+FastPin output;
+FastPin input;
+
+typedef void (*benchCall_t)();
+
+void emptyCall() { sink = level; }
+void digitalWriteCall() { digitalWrite(outputPin, level); }
+void fastWriteCall() { output.write(level); }
+void digitalReadCall() { sink = digitalRead(inputPin); }
+void fastReadCall() { sink = input.read(); }
+
+// A StaticFastPin is resolved at build time, the level still comes from a variable
+void staticWriteCall() { StaticFastPin<OutputPin>::write(level); }
+void staticHighCall() { sink = level; StaticFastPin<OutputPin>::write(HIGH); }
+void staticExtendedWriteCall() { StaticFastPin<ExtendedOutputPin>::write(level); }
+void staticReadCall() { sink = StaticFastPin<InputPin>::read(); }
+
+// Timer1 cycles for Calls calls
+__attribute__((noinline)) uint16_t measure(benchCall_t call) {
+  uint8_t sreg = SREG;
+  cli();
+
+  uint16_t start = TCNT1;
+
+  for (uint8_t i = 0; i < Calls; i++) {
+    call();
+  }
+
+  uint16_t cycles = TCNT1 - start;
+
+  SREG = sreg;
+  return cycles;
+}
+
+void printCycles(const __FlashStringHelper *name, benchCall_t call) {
+  float cycles = (float)((long)measure(call) - (long)measure(emptyCall)) / Calls;
+
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print(cycles, 1);
+  Serial.println(F(" cycles"));
+}
+
+void setup() {
+  Serial.begin(115200);
+
+  pinMode(OutputPin, OUTPUT);
+  pinMode(InputPin, INPUT_PULLUP);
+  output.begin(OutputPin, OUTPUT);
+  input.begin(InputPin, INPUT_PULLUP);
+  StaticFastPin<ExtendedOutputPin>::begin(OUTPUT);
+
+  // Normal mode, no prescaler
+  TCCR1A = 0;
+  TCCR1B = (1 << CS10);
+
+  printCycles(F("digitalWrite()"), digitalWriteCall);
+  printCycles(F("FastPin::write()"), fastWriteCall);
+  printCycles(F("digitalRead()"), digitalReadCall);
+  printCycles(F("FastPin::read()"), fastReadCall);
+  printCycles(F("StaticFastPin::write()"), staticWriteCall);
+  printCycles(F("StaticFastPin::write(HIGH)"), staticHighCall);
+  printCycles(F("StaticFastPin::write(), port H"), staticExtendedWriteCall);
+  printCycles(F("StaticFastPin::read()"), staticReadCall);
+}
+
+void loop() {
+}
@@ -0,0 +1,85 @@
+/*
+  Plant.h - First order plus dead time model of a heated floor, driven
+  the way FloorHeater drives the heater: the controller output is the
+  on time (ms) in each output window of the SSR.
+*/
+
+#ifndef Plant_h
+#define Plant_h
+
+#include <math.h>
+#include <vector>
+#include <random>
+
+struct plantConfig_t
+{
+  float gain;                   // Temperature rise at full power (C)
+  float timeConstant;           // s
+  float deadTime;               // s
+  float ambient;                // Temperature with the heater off (C)
+  float noise;                  // Sensor noise, standard deviation (C)
+  float resolution;             // Sensor resolution (C), 1/16 for a DS18B20
+  unsigned long window;         // Output window (ms), FloorHeater::_OutputWindowSize
+};
+
+class Plant
+{
+  public:
+    static const unsigned long Step = 1000;   // Simulation step (ms)
+
+    Plant(const plantConfig_t &config, float temperature, unsigned long seed) :
+      _config(config),
+      _temperature(temperature),
+      _delay(config.deadTime * 1000 / Step + 1, 0),
+      _head(0),
+      _random(seed),
+      _noise(0, config.noise > 0 ? config.noise : 1) {
+
+      _decay = 1 - exp(-(float)Step / 1000 / config.timeConstant);
+    }
+
+    // Advance the plant by one step, now is the simulated time (ms)
+    // and output is the heater on time in the current window (ms)
+    void step(unsigned long now, float output) {
+      float phase = now % _config.window;
+      float power = (output - phase) / Step;
+      power = power < 0 ? 0 : (power > 1 ? 1 : power);
+
+      _delay[_head] = power;
+      _head = (_head + 1) % _delay.size();
+
+      // The oldest sample is the one from the dead time ago
+      float delayed = _delay[_head];
+      _temperature += (_config.ambient + _config.gain * delayed - _temperature) * _decay;
+    }
+
+    float getTemperature() {
+      return _temperature;
+    }
+
+    // Sensor reading: noisy and quantized
+    float read() {
+      float value = _temperature;
+
+      if (_config.noise > 0) {
+        value += _noise(_random);
+      }
+
+      if (_config.resolution > 0) {
+        value = floor(value / _config.resolution + 0.5f) * _config.resolution;
+      }
+
+      return value;
+    }
+
+  private:
+    plantConfig_t _config;
+    float _temperature;
+    float _decay;
+    std::vector<float> _delay;
+    size_t _head;
+    std::mt19937 _random;
+    std::normal_distribution<float> _noise;
+};
+
+#endif
@@ -0,0 +1,521 @@
+/*
+  pidsim.cpp - Runs PID against a simulated heated floor on Linux.
+  Every combination of the swept parameters is a job: an optional tuning
+  run (SIMC or relay feedback) followed by a closed loop run from the
+  same start, scored by overshoot, settling time and integrated absolute
+  error. Jobs run in parallel on all cores, each thread with its own
+  simulated millis() clock. --compare sums the jobs up per method, for
+  comparing tuning methods over the same plants and parameters.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+
+// Plant.h first, the Arduino abs() macro from the shim breaks the standard headers
+#include "Plant.h"
+#include "PID.h"
+
+// Tuning run length limit (days), a job which isn't tuned by then is reported as failed
+static const float TuningDaysMax = 20;
+
+struct range_t
+{
+  std::vector<float> values;
+};
+
+struct options_t
+{
+  std::vector<int> methods;     // 0 - fixed gains, PID_TUNING_SIMC or PID_TUNING_RELAY
+  boolean fixed;                // Run FixedPID instead of PID
+  boolean compare;              // Print a summary per method instead of the jobs
+  range_t kP;
+  range_t kI;                   // Same units as FloorHeater passes to setKs()
+  range_t controlTime;          // FloorHeater::_ControlTime and the PID time step (ms)
+  range_t noiseTreshold;        // SIMC noise threshold or relay hysteresis (C)
+  range_t steadyTreshold;       // SIMC steady samples
+  range_t cycles;               // Relay oscillations to measure
+  range_t gain;                 // Plant parameters, see plantConfig_t
+  range_t timeConstant;
+  range_t deadTime;
+  plantConfig_t plant;
+  float start;                  // Floor temperature at the start (C)
+  float setpoint;
+  float days;                   // Closed loop run length
+  float band;                   // Settled when the temperature stays within setpoint +- band (C)
+  unsigned int threads;
+};
+
+struct job_t
+{
+  int method;
+  plantConfig_t plant;
+  float kP;
+  float kI;
+  unsigned long controlTime;
+  float noiseTreshold;
+  uint16_t steadyTreshold;
+  uint8_t cycles;
+};
+
+struct result_t
+{
+  boolean tuned;                // False if tuning didn't finish or timed out
+  float tuningHours;
+  float kP;                     // Gains used for the closed loop run
+  float kI;
+  float overshoot;              // C
+  float settlingHours;          // Negative if it never settled
+  float iae;                    // C * h
+};
+
+// "control", "simc", "relay" or a comma separated list of them
+static boolean parseMethods(const char *text, std::vector<int> *methods) {
+  std::string list(text);
+  size_t position = 0;
+
+  methods->clear();
+
+  while (position <= list.size()) {
+    size_t end = list.find(',', position);
+    std::string item = list.substr(position, end == std::string::npos ? std::string::npos : end - position);
+
+    if (item == "control") {
+      methods->push_back(0);
+    } else if (item == "simc") {
+      methods->push_back(PID_TUNING_SIMC);
+    } else if (item == "relay") {
+      methods->push_back(PID_TUNING_RELAY);
+    } else {
+      return false;
+    }
+
+    if (end == std::string::npos) {
+      break;
+    }
+
+    position = end + 1;
+  }
+
+  return true;
+}
+
+static const char *methodName(int method) {
+  return method == PID_TUNING_SIMC ? "simc" : (method == PID_TUNING_RELAY ? "relay" : "control");
+}
+
+// "a", "a,b,c" or "from:to:step"
+static boolean parseRange(const char *text, range_t *range) {
+  range->values.clear();
+
+  if (strchr(text, ':')) {
+    float from, to, step;
+
+    if (sscanf(text, "%f:%f:%f", &from, &to, &step) != 3 || step <= 0 || to < from) {
+      return false;
+    }
+
+    for (int i = 0; from + i * step <= to + step * 1e-3f; i++) {
+      range->values.push_back(from + i * step);
+    }
+
+    return true;
+  }
+
+  std::string list(text);
+  size_t position = 0;
+
+  while (position <= list.size()) {
+    size_t end = list.find(',', position);
+    std::string item = list.substr(position, end == std::string::npos ? std::string::npos : end - position);
+    char *tail;
+    float value = strtof(item.c_str(), &tail);
+
+    if (item.empty() || *tail) {
+      return false;
+    }
+
+    range->values.push_back(value);
+
+    if (end == std::string::npos) {
+      break;
+    }
+
+    position = end + 1;
+  }
+
+  return true;
+}
+
+static void usage() {
+  fprintf(stderr,
+    "Usage: pidsim [options]\n"
+    "  --method control|simc|relay   fixed gains or a tuning run first (control),\n"
+    "                                a list like simc,relay runs every job with each\n"
+    "  --fixed                       run FixedPID (Q16.16) instead of PID\n"
+    "  --compare                     print tuning time and loop quality per method\n"
+    "Swept parameters, given as a value, a list a,b,c or a range from:to:step:\n"
+    "  --kp, --ki                    gains for the control method (400, 0.001)\n"
+    "  --control-time                control period and PID time step, ms (1000)\n"
+    "  --noise                       SIMC noise threshold or relay hysteresis, C (0.4)\n"
+    "  --steady                      SIMC steady samples (60)\n"
+    "  --cycles                      relay oscillations to measure (3)\n"
+    "  --gain, --tau, --dead         plant temperature rise at full power (C), time\n"
+    "                                constant and dead time (s) (15, 3600, 600)\n"
+    "Plant and run:\n"
+    "  --ambient, --start, --setpoint   C (18, 20, 25)\n"
+    "  --sensor-noise, --resolution  C (0.02, 0.0625)\n"
+    "  --days                        closed loop run length (2)\n"
+    "  --band                        settling band, C (0.2)\n"
+    "  --threads                     worker threads (all cores)\n");
+}
+
+static boolean parseOptions(int argc, char **argv, options_t *options) {
+  options->methods.assign(1, 0);
+  options->fixed = false;
+  options->compare = false;
+  parseRange("400", &options->kP);
+  parseRange("0.001", &options->kI);
+  parseRange("1000", &options->controlTime);
+  parseRange("0.4", &options->noiseTreshold);
+  parseRange("60", &options->steadyTreshold);
+  parseRange("3", &options->cycles);
+  parseRange("15", &options->gain);
+  parseRange("3600", &options->timeConstant);
+  parseRange("600", &options->deadTime);
+  options->plant.ambient = 18;
+  options->plant.noise = 0.02;
+  options->plant.resolution = 0.0625;
+  options->plant.window = 10000;
+  options->start = 20;
+  options->setpoint = 25;
+  options->days = 2;
+  options->band = 0.2;
+  options->threads = std::thread::hardware_concurrency();
+
+  for (int i = 1; i < argc; i++) {
+    const char *name = argv[i];
+
+    if (!strcmp(name, "--fixed")) {
+      options->fixed = true;
+      continue;
+    }
+
+    if (!strcmp(name, "--compare")) {
+      options->compare = true;
+      continue;
+    }
+
+    if (i + 1 >= argc) {
+      return false;
+    }
+
+    const char *value = argv[++i];
+    boolean valid = true;
+
+    if (!strcmp(name, "--method")) {
+      valid = parseMethods(value, &options->methods);
+    } else if (!strcmp(name, "--kp")) {
+      valid = parseRange(value, &options->kP);
+    } else if (!strcmp(name, "--ki")) {
+      valid = parseRange(value, &options->kI);
+    } else if (!strcmp(name, "--control-time")) {
+      valid = parseRange(value, &options->controlTime);
+    } else if (!strcmp(name, "--noise")) {
+      valid = parseRange(value, &options->noiseTreshold);
+    } else if (!strcmp(name, "--steady")) {
+      valid = parseRange(value, &options->steadyTreshold);
+    } else if (!strcmp(name, "--cycles")) {
+      valid = parseRange(value, &options->cycles);
+    } else if (!strcmp(name, "--gain")) {
+      valid = parseRange(value, &options->gain);
+    } else if (!strcmp(name, "--tau")) {
+      valid = parseRange(value, &options->timeConstant);
+    } else if (!strcmp(name, "--dead")) {
+      valid = parseRange(value, &options->deadTime);
+    } else if (!strcmp(name, "--ambient")) {
+      options->plant.ambient = atof(value);
+    } else if (!strcmp(name, "--sensor-noise")) {
+      options->plant.noise = atof(value);
+    } else if (!strcmp(name, "--resolution")) {
+      options->plant.resolution = atof(value);
+    } else if (!strcmp(name, "--start")) {
+      options->start = atof(value);
+    } else if (!strcmp(name, "--setpoint")) {
+      options->setpoint = atof(value);
+    } else if (!strcmp(name, "--days")) {
+      options->days = atof(value);
+    } else if (!strcmp(name, "--band")) {
+      options->band = atof(value);
+    } else if (!strcmp(name, "--threads")) {
+      options->threads = atoi(value);
+    } else {
+      valid = false;
+    }
+
+    if (!valid) {
+      return false;
+    }
+  }
+
+  if (options->threads == 0) {
+    options->threads = 1;
+  }
+
+  for (float timeConstant : options->timeConstant.values) {
+    if (timeConstant <= 0) {
+      return false;
+    }
+  }
+
+  for (float deadTime : options->deadTime.values) {
+    if (deadTime < 0) {
+      return false;
+    }
+  }
+
+  return options->days > 0;
+}
+
+// Every combination of the swept values
+static std::vector<job_t> makeJobs(const options_t &options) {
+  std::vector<job_t> jobs;
+
+  for (int method : options.methods)
+  for (float gain : options.gain.values)
+  for (float timeConstant : options.timeConstant.values)
+  for (float deadTime : options.deadTime.values)
+  for (float kP : options.kP.values)
+  for (float kI : options.kI.values)
+  for (float controlTime : options.controlTime.values)
+  for (float noiseTreshold : options.noiseTreshold.values)
+  for (float steadyTreshold : options.steadyTreshold.values)
+  for (float cycles : options.cycles.values) {
+    job_t job;
+    job.method = method;
+    job.plant = options.plant;
+    job.plant.gain = gain;
+    job.plant.timeConstant = timeConstant;
+    job.plant.deadTime = deadTime;
+    job.kP = kP;
+    job.kI = kI;
+    job.controlTime = controlTime < Plant::Step ? Plant::Step : (unsigned long)controlTime;
+    job.noiseTreshold = noiseTreshold;
+    job.steadyTreshold = steadyTreshold;
+    job.cycles = cycles;
+    jobs.push_back(job);
+  }
+
+  return jobs;
+}
+
+// Tune (if asked) and run the loop the way FloorHeater::loopDo() does,
+// the controller is called once per control period with a fresh reading
+template <class T> static result_t runJob(const options_t &options, const job_t &job, unsigned long seed) {
+  result_t result;
+  T input = T(options.start);
+  T output = T(0);
+  T setpoint = T(options.setpoint);
+  PIDController<T> controller(job.kP, job.kI, 0, &input, &output, T(0), T((int)job.plant.window), &setpoint, job.controlTime, true);
+
+  result.tuned = true;
+  result.tuningHours = 0;
+
+  if (job.method) {
+    Plant plant(job.plant, options.start, seed);
+    unsigned long stepsMax = TuningDaysMax * 86400000.0f / Plant::Step;
+    unsigned long lastControl = 0;
+    boolean finished = false;
+
+    simMillis = 0;
+
+    if (job.method == PID_TUNING_RELAY) {
+      controller.initRelayTuning(job.cycles, T(job.noiseTreshold));
+    } else {
+      controller.initPITuning(job.steadyTreshold, T(job.noiseTreshold));
+    }
+
+    for (unsigned long i = 0; i < stepsMax && !finished; i++) {
+      if (i == 0 || simMillis - lastControl >= job.controlTime) {
+        lastControl = simMillis;
+        input = T(plant.read());
+        finished = controller.doPITuning();
+      }
+
+      plant.step(simMillis, toFloat(output));
+      simMillis += Plant::Step;
+    }
+
+    // A timed out relay run keeps the initial gains, it didn't tune anything
+    result.tuned = finished && !controller.isTuningTimedOut();
+    result.tuningHours = simMillis / 3600000.0f;
+  }
+
+  result.kP = controller.getKp();
+  result.kI = controller.getKi() / job.controlTime;
+  result.overshoot = 0;
+  result.settlingHours = 0;
+  result.iae = 0;
+
+  if (!result.tuned) {
+    return result;
+  }
+
+  // Closed loop from the same start for every job, so the gains are compared fairly
+  Plant plant(job.plant, options.start, seed + 1);
+  unsigned long steps = options.days * 86400000.0f / Plant::Step;
+  unsigned long lastControl = 0;
+
+  simMillis = 0;
+  input = T(plant.read());
+  output = T(0);
+  controller.resetCalc();
+
+  for (unsigned long i = 0; i < steps; i++) {
+    if (i == 0 || simMillis - lastControl >= job.controlTime) {
+      lastControl = simMillis;
+      input = T(plant.read());
+      controller.doControl();
+    }
+
+    plant.step(simMillis, toFloat(output));
+    simMillis += Plant::Step;
+
+    float error = plant.getTemperature() - options.setpoint;
+
+    if (error > result.overshoot) {
+      result.overshoot = error;
+    }
+
+    if (fabs(error) > options.band) {
+      result.settlingHours = simMillis / 3600000.0f;
+    }
+
+    result.iae += fabs(error) * Plant::Step / 3600000.0f;
+  }
+
+  // Still outside the band at the end
+  if (result.settlingHours >= options.days * 24 - Plant::Step / 3600000.0f) {
+    result.settlingHours = -1;
+  }
+
+  return result;
+}
+
+// One row per method: how many jobs it tuned, how long tuning took
+// and how well the tuned loop did, averaged over the tuned jobs.
+// Every method runs the same jobs, so the rows compare like with like.
+static void printCompare(const options_t &options, const std::vector<job_t> &jobs, const std::vector<result_t> &results) {
+  printf("method\tjobs\ttuned\ttuningHours\ttuningHoursMax\tovershoot\tsettled\tsettlingHours\tIAE\n");
+
+  for (int method : options.methods) {
+    unsigned int count = 0, tuned = 0, settled = 0;
+    float tuningHours = 0, tuningHoursMax = 0, overshoot = 0, settlingHours = 0, iae = 0;
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+      const result_t &result = results[i];
+
+      if (jobs[i].method != method) {
+        continue;
+      }
+
+      count++;
+
+      if (!result.tuned) {
+        continue;
+      }
+
+      tuned++;
+      tuningHours += result.tuningHours;
+      tuningHoursMax = result.tuningHours > tuningHoursMax ? result.tuningHours : tuningHoursMax;
+      overshoot += result.overshoot;
+      iae += result.iae;
+
+      if (result.settlingHours >= 0) {
+        settled++;
+        settlingHours += result.settlingHours;
+      }
+    }
+
+    printf("%s\t%u\t%u\t", methodName(method), count, tuned);
+
+    if (!tuned) {
+      printf("-\t-\t-\t0\t-\t-\n");
+      continue;
+    }
+
+    printf("%.2f\t%.2f\t%.3f\t%u\t", tuningHours / tuned, tuningHoursMax, overshoot / tuned, settled);
+
+    if (settled) {
+      printf("%.2f\t", settlingHours / settled);
+    } else {
+      printf("-\t");
+    }
+
+    printf("%.3f\n", iae / tuned);
+  }
+}
+
+int main(int argc, char **argv) {
+  options_t options;
+
+  if (!parseOptions(argc, argv, &options)) {
+    usage();
+    return 1;
+  }
+
+  std::vector<job_t> jobs = makeJobs(options);
+  std::vector<result_t> results(jobs.size());
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+
+  for (unsigned int i = 0; i < options.threads; i++) {
+    workers.push_back(std::thread([&]() {
+      for (size_t j = next++; j < jobs.size(); j = next++) {
+        // Same sensor noise for every job with the same seed, so rows differ by the parameters only
+        results[j] = options.fixed ? runJob<Fixed16>(options, jobs[j], 1) : runJob<float>(options, jobs[j], 1);
+      }
+    }));
+  }
+
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+
+  if (options.compare) {
+    printCompare(options, jobs, results);
+    return 0;
+  }
+
+  printf("method\tgain\ttau\tdead\tkP\tkI\tcontrolTime\tnoise\tsteady\tcycles\ttuningHours\ttunedKp\ttunedKi\tovershoot\tsettlingHours\tIAE\n");
+
+  for (size_t i = 0; i < jobs.size(); i++) {
+    const job_t &job = jobs[i];
+    const result_t &result = results[i];
+
+    printf("%s\t%g\t%g\t%g\t", methodName(job.method), job.plant.gain, job.plant.timeConstant, job.plant.deadTime);
+    printf("%g\t%g\t%lu\t%g\t%u\t%u\t", job.kP, job.kI, job.controlTime, job.noiseTreshold, job.steadyTreshold, job.cycles);
+
+    if (!result.tuned) {
+      printf("-\t-\t-\t-\t-\t-\n");
+      continue;
+    }
+
+    printf("%.2f\t%g\t%g\t%.3f\t", result.tuningHours, result.kP, result.kI, result.overshoot);
+
+    if (result.settlingHours < 0) {
+      printf("-\t");
+    } else {
+      printf("%.2f\t", result.settlingHours);
+    }
+
+    printf("%.3f\n", result.iae);
+  }
+
+  return 0;
+}
@@ -0,0 +1,13 @@
+#include "Arduino.h"
+
+thread_local unsigned long simMillis = 0;
+unsigned long simMicros = 0;
+
+volatile uint8_t simPortInput = 1;
+volatile uint8_t simPCICR = 0;
+volatile uint8_t simPCMSK = 0;
+uint8_t simPinModes[SimPinCount];
+uint8_t simPinLevels[SimPinCount];
+uint8_t SREG = 0;
+
+HardwareSerial Serial;
@@ -0,0 +1,127 @@
+/*
+  Arduino.h - The part of the Arduino core used by the sketch files built
+  on Linux. millis() returns the simulated clock of the calling thread,
+  pins and interrupts are simulated by the variables in Arduino.cpp.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stddef.h>
+#include <ctype.h>
+#include "Print.h"
+#include "Stream.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define PI 3.1415926535897932384626433832795
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define LOW 0
+#define HIGH 1
+#define FALLING 2
+#define NOT_AN_INTERRUPT -1
+
+// Every pin reads bit 0 of simPortInput. Pins below SimInterruptPins have
+// an external interrupt, the others a pin change interrupt.
+#define SimInterruptPins 8
+
+#define digitalPinToPort(pin) (0)
+#define portInputRegister(port) (&simPortInput)
+#define digitalPinToBitMask(pin) (1)
+#define digitalPinToInterrupt(pin) ((pin) < SimInterruptPins ? (pin) : NOT_AN_INTERRUPT)
+#define digitalPinToPCICR(pin) (&simPCICR)
+#define digitalPinToPCICRbit(pin) (0)
+#define digitalPinToPCMSK(pin) (&simPCMSK)
+#define digitalPinToPCMSKbit(pin) (0)
+
+#ifdef abs
+#undef abs
+#endif
+
+#define abs(x) ((x) > 0 ? (x) : -(x))
+
+// Functions rather than the Arduino macros, so the standard headers still compile
+template <class A, class B> inline A min(A a, B b) { return (b < a) ? b : a; }
+template <class A, class B> inline A max(A a, B b) { return (a < b) ? b : a; }
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+#define SimPinCount 70
+
+// Simulated time (ms), each simulation thread runs its own clock
+extern thread_local unsigned long simMillis;
+extern unsigned long simMicros;
+
+extern volatile uint8_t simPortInput;
+extern volatile uint8_t simPCICR;
+extern volatile uint8_t simPCMSK;
+extern uint8_t simPinModes[SimPinCount];
+extern uint8_t simPinLevels[SimPinCount];
+extern uint8_t SREG;
+
+inline unsigned long millis() {
+  return simMillis;
+}
+
+inline unsigned long micros() {
+  return simMicros;
+}
+
+inline void pinMode(uint8_t pin, uint8_t mode) {
+  simPinModes[pin] = mode;
+}
+
+inline void digitalWrite(uint8_t pin, uint8_t level) {
+  simPinLevels[pin] = level;
+}
+
+inline char *ultoa(unsigned long value, char *text, int radix) {
+  char digits[33];
+  uint8_t count = 0;
+
+  do {
+    digits[count++] = "0123456789abcdefghijklmnopqrstuvwxyz"[value % radix];
+    value /= radix;
+  } while (value);
+
+  for (uint8_t i = 0; i < count; i++) {
+    text[i] = digits[count - 1 - i];
+  }
+
+  text[count] = 0;
+  return text;
+}
+
+inline char *ltoa(long value, char *text, int radix) {
+  if (value < 0 && radix == 10) {
+    text[0] = '-';
+    ultoa(-(unsigned long) value, text + 1, radix);
+    return text;
+  }
+
+  return ultoa(value, text, radix);
+}
+
+inline char *itoa(int value, char *text, int radix) {
+  return ltoa(value, text, radix);
+}
+
+// Serial output is dropped
+class HardwareSerial : public Print
+{
+  public:
+    size_t write(uint8_t ch) { return 1; }
+};
+
+extern HardwareSerial Serial;
+
+inline void attachInterrupt(int irq, void (*handler)(), int mode) {}
+inline void cli() {}
+
+#endif
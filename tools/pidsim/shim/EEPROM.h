@@ -0,0 +1,22 @@
+/*
+  EEPROM.h - EEPROM library of the Mega 2560 (4 KB) for a Linux build.
+  The cells are simulated by the program which links it.
+*/
+
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include "Arduino.h"
+
+#define E2END 0xFFF
+
+class EEPROMClass
+{
+  public:
+    uint8_t read(int address);
+    void write(int address, uint8_t value);
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,45 @@
+/*
+  Ethernet.h - The Ethernet library types used by the sketch files, for a
+  Linux build. The sockets are simulated by the program which links them,
+  see utility/w5100.h and utility/socket.h.
+*/
+
+#ifndef Ethernet_h
+#define Ethernet_h
+
+#include "Arduino.h"
+#include "utility/w5100.h"
+
+class IPAddress
+{
+  public:
+    IPAddress() { memset(_address, 0, sizeof(_address)); }
+
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+      _address[0] = a;
+      _address[1] = b;
+      _address[2] = c;
+      _address[3] = d;
+    }
+
+    uint8_t operator[](int index) const { return _address[index]; }
+    uint8_t &operator[](int index) { return _address[index]; }
+
+  private:
+    uint8_t _address[4];
+};
+
+// Received data of a socket
+class EthernetClient
+{
+  public:
+    EthernetClient(uint8_t sock) : _sock(sock) {}
+
+    int available();
+    int read();
+
+  private:
+    uint8_t _sock;
+};
+
+#endif
@@ -0,0 +1,24 @@
+/*
+  HiveUtils.h - Time helpers for a Linux build of the sketch files, debug output is dropped.
+*/
+
+#ifndef HiveUtils_h
+#define HiveUtils_h
+
+#include "Arduino.h"
+
+inline unsigned long timeDiff(unsigned long timeValue) {
+  return millis() - timeValue;
+}
+
+inline unsigned long timeLeft(unsigned long timeValue, unsigned long interval) {
+  unsigned long elapsed = timeDiff(timeValue);
+
+  return (elapsed < interval) ? interval - elapsed : 0;
+}
+
+inline void debugPrint(const char *pData, boolean newline = true) {}
+inline void debugPrint(const __FlashStringHelper *pData, boolean newline = true) {}
+inline void debugPrint(double pData, boolean newline = true) {}
+
+#endif
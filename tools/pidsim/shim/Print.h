@@ -0,0 +1,79 @@
+/*
+  Print.h - Arduino Print and flash strings for a Linux build. Flash
+  strings are plain strings, numbers are printed the way Print does.
+*/
+
+#ifndef Print_h
+#define Print_h
+
+#include <stdio.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) ((const __FlashStringHelper *) (s))
+#define strcmp_P(a, b) strcmp((a), (b))
+#define strncmp_P(a, b, n) strncmp((a), (b), (n))
+#define strcpy_P(a, b) strcpy((a), (b))
+#define strcat_P(a, b) strcat((a), (b))
+#define strstr_P(a, b) strstr((a), (b))
+#define memcpy_P(a, b, n) memcpy((a), (b), (n))
+#define pgm_read_byte(address) (*(const uint8_t *) (address))
+#define pgm_read_word(address) (*(const uint16_t *) (address))
+
+class __FlashStringHelper;
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t ch) = 0;
+
+    // Arduino cores write blocks byte by byte unless a subclass knows better
+    virtual size_t write(const uint8_t *buffer, size_t size) {
+      size_t count = 0;
+
+      while (size--) {
+        count += write(*buffer++);
+      }
+
+      return count;
+    }
+
+    size_t write(const char *text) { return write((const uint8_t *) text, strlen(text)); }
+
+    size_t print(const char *text) { return write(text); }
+
+    // Flash strings are read and written a byte at a time
+    size_t print(const __FlashStringHelper *text) {
+      const char *p = (const char *) text;
+      size_t count = 0;
+
+      while (*p) {
+        count += write((uint8_t) *p++);
+      }
+
+      return count;
+    }
+
+    size_t print(char ch) { return write((uint8_t) ch); }
+    size_t print(int value) { return print((long) value); }
+    size_t print(unsigned int value) { return print((unsigned long) value); }
+
+    size_t print(long value) {
+      char buffer[12];
+      snprintf(buffer, sizeof(buffer), "%ld", value);
+      return write(buffer);
+    }
+
+    size_t print(unsigned long value) {
+      char buffer[12];
+      snprintf(buffer, sizeof(buffer), "%lu", value);
+      return write(buffer);
+    }
+
+    size_t println() { return write("\r\n"); }
+    template <class T> size_t println(T value) { return print(value) + println(); }
+};
+
+#endif
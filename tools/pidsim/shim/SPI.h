@@ -0,0 +1,22 @@
+/*
+  SPI.h - Nothing is sent over SPI in a Linux build, the clock
+  dividers and modes are here for the settings which name them.
+*/
+
+#ifndef SPI_h
+#define SPI_h
+
+#define SPI_CLOCK_DIV2 4
+#define SPI_CLOCK_DIV4 0
+#define SPI_CLOCK_DIV8 5
+#define SPI_CLOCK_DIV16 1
+#define SPI_CLOCK_DIV32 6
+#define SPI_CLOCK_DIV64 2
+#define SPI_CLOCK_DIV128 3
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+#endif
@@ -0,0 +1,74 @@
+/*
+  SdFat.h - The part of SdFat used by the sketch files, for a Linux build.
+  The card and its files are simulated by the program which links it.
+*/
+
+#ifndef SdFat_h
+#define SdFat_h
+
+#include "Arduino.h"
+
+#define O_READ 0x01
+#define O_RDWR 0x02
+#define O_WRITE O_RDWR
+#define O_CREAT 0x10
+
+class Sd2Card
+{
+  public:
+    bool readBlock(uint32_t block, uint8_t *dst);
+    bool readStart(uint32_t blockNumber);
+    bool readData(uint8_t *dst);
+    bool readStop();
+    bool writeBlock(uint32_t block, const uint8_t *src);
+    bool writeStart(uint32_t blockNumber, uint32_t eraseCount);
+    bool writeData(const uint8_t *src);
+    bool writeStop();
+    bool erase(uint32_t firstBlock, uint32_t lastBlock);
+};
+
+class SdVolume
+{
+  public:
+    uint8_t *cacheClear();
+};
+
+class SdBaseFile
+{
+  public:
+    SdBaseFile() : _open(false), _file(0) {}
+
+    bool open(const char *path, uint8_t oflag = O_READ);
+    bool close();
+    bool isOpen() const { return _open; }
+    bool remove();
+    bool rename(SdBaseFile *dirFile, const char *newPath);
+    uint32_t fileSize() const;
+    bool seekSet(uint32_t pos);
+    int read(void *buf, size_t nbyte);
+    int write(const void *buf, size_t nbyte);
+    bool sync();
+    bool contiguousRange(uint32_t *bgnBlock, uint32_t *endBlock);
+    bool createContiguous(SdBaseFile *dirFile, const char *path, uint32_t size);
+
+  private:
+    bool _open;
+    int _file;                  // Entry of the simulated card
+    uint32_t _position;
+};
+
+class SdFat
+{
+  public:
+    bool begin(uint8_t chipSelectPin, uint8_t sckRateID);
+    Sd2Card *card() { return &_card; }
+    SdVolume *vol() { return &_vol; }
+    SdBaseFile *vwd() { return &_vwd; }
+
+  private:
+    Sd2Card _card;
+    SdVolume _vol;
+    SdBaseFile _vwd;
+};
+
+#endif
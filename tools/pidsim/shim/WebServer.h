@@ -0,0 +1,51 @@
+/*
+  WebServer.h - Stand-in for the Webduino server in a Linux build. The
+  response is kept in a buffer and the socket writes are counted, the
+  request body is read from a string up to its end like Content-Length.
+*/
+
+#ifndef WebServer_h
+#define WebServer_h
+
+#include "Arduino.h"
+
+#define WEBSERVER_OUTPUT_SIZE 8192
+
+class WebServer : public Print
+{
+  public:
+    WebServer() : writes(0), length(0), _body(""), _position(0) {}
+
+    // Each write is a send() on the socket
+    size_t write(uint8_t ch) { return write(&ch, 1); }
+
+    size_t write(const uint8_t *buffer, size_t size) {
+      writes++;
+
+      if (length + size > WEBSERVER_OUTPUT_SIZE) {
+        size = WEBSERVER_OUTPUT_SIZE - length;
+      }
+
+      memcpy(output + length, buffer, size);
+      length += size;
+      return size;
+    }
+
+    int read() { return _body[_position] ? (unsigned char) _body[_position++] : -1; }
+    int available() { return strlen(_body + _position); }
+
+    void setBody(const char *body) {
+      _body = body;
+      _position = 0;
+    }
+
+    unsigned long writes;
+    size_t length;
+    char output[WEBSERVER_OUTPUT_SIZE];
+
+  private:
+    const char *_body;
+    size_t _position;
+};
+
+#endif
@@ -0,0 +1,21 @@
+/*
+  crc16.h - avr-libc CRC-16 update (polynomial 0xA001), the same
+  result as the assembler version.
+*/
+
+#ifndef crc16_h
+#define crc16_h
+
+#include <stdint.h>
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t data) {
+  crc ^= data;
+
+  for (uint8_t i = 0; i < 8; i++) {
+    crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+  }
+
+  return crc;
+}
+
+#endif
@@ -0,0 +1,17 @@
+/*
+  socket.h - Ethernet library socket calls, implemented by the program
+  which links them.
+*/
+
+#ifndef socket_h
+#define socket_h
+
+#include "utility/w5100.h"
+
+uint8_t socket(SOCKET sock, uint8_t protocol, uint16_t port, uint8_t flag);
+void close(SOCKET sock);
+uint8_t connect(SOCKET sock, uint8_t *addr, uint16_t port);
+void disconnect(SOCKET sock);
+uint16_t send(SOCKET sock, const uint8_t *buffer, uint16_t length);
+
+#endif
@@ -0,0 +1,41 @@
+/*
+  w5100.h - W5100/W5200 socket registers, the status register is all the
+  sketch reads directly. Implemented by the program which links it.
+*/
+
+#ifndef W5100_h
+#define W5100_h
+
+#include "Arduino.h"
+
+typedef uint8_t SOCKET;
+
+#define MAX_SOCK_NUM 8
+
+class SnMR
+{
+  public:
+    static const uint8_t TCP = 0x01;
+};
+
+class SnSR
+{
+  public:
+    static const uint8_t CLOSED = 0x00;
+    static const uint8_t INIT = 0x13;
+    static const uint8_t SYNSENT = 0x15;
+    static const uint8_t ESTABLISHED = 0x17;
+    static const uint8_t FIN_WAIT = 0x18;
+    static const uint8_t CLOSE_WAIT = 0x1C;
+    static const uint8_t LAST_ACK = 0x1D;
+};
+
+class W5100Class
+{
+  public:
+    uint8_t readSnSR(SOCKET sock);
+};
+
+extern W5100Class W5100;
+
+#endif
@@ -0,0 +1,174 @@
+/*
+  CRCTest.cpp - Checks the CRC library against the standard check values
+  and against plain bit by bit references, one byte at a time and in
+  random chunks (the drivers feed it a block as it arrives). The Makefile
+  builds it once per method, CRC_BITWISE, CRC_NIBBLE and CRC_TABLE.
+  With --bench it reports the throughput on this machine instead, only
+  the ratios between the methods carry over to the AVR.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Check.h"
+#include "CRC.h"
+
+static const char *methodNames[] = { "bitwise", "nibble", "table" };
+
+// Flash used by the tables of the 8- and the 16-bit CRCs
+static const unsigned int tableSizes[][2] = { { 0, 0 }, { 16, 32 }, { 256, 512 } };
+
+// References: the polynomial division written out, a bit at a time
+
+static uint8_t refCRC8(const uint8_t *data, size_t len) {
+  uint8_t crc = 0;
+
+  for (size_t i = 0; i < len * 8; i++) {
+    uint8_t bit = (data[i / 8] >> (i % 8)) & 1;
+    uint8_t top = (crc & 1) ^ bit;
+    crc >>= 1;
+    if (top) crc ^= 0x8C;
+  }
+
+  return crc;
+}
+
+static uint16_t refCRC16(const uint8_t *data, size_t len) {
+  uint16_t crc = 0;
+
+  for (size_t i = 0; i < len * 8; i++) {
+    uint8_t bit = (data[i / 8] >> (i % 8)) & 1;
+    uint8_t top = (crc & 1) ^ bit;
+    crc >>= 1;
+    if (top) crc ^= 0xA001;
+  }
+
+  return crc;
+}
+
+static uint16_t refCCITT(const uint8_t *data, size_t len) {
+  uint16_t crc = 0;
+
+  for (size_t i = 0; i < len * 8; i++) {
+    uint8_t bit = (data[i / 8] >> (7 - i % 8)) & 1;
+    uint8_t top = ((crc >> 15) & 1) ^ bit;
+    crc <<= 1;
+    if (top) crc ^= 0x1021;
+  }
+
+  return crc;
+}
+
+static uint8_t refCRC7(const uint8_t *data, size_t len) {
+  uint8_t crc = 0;
+
+  for (size_t i = 0; i < len * 8; i++) {
+    uint8_t bit = (data[i / 8] >> (7 - i % 8)) & 1;
+    uint8_t top = ((crc >> 6) & 1) ^ bit;
+    crc = (crc << 1) & 0x7F;
+    if (top) crc ^= 0x09;
+  }
+
+  return crc;
+}
+
+static void testCheckValues() {
+  const uint8_t check[] = "123456789";
+  const uint8_t cmd0[] = { 0x40, 0x00, 0x00, 0x00, 0x00 };
+  const uint8_t cmd8[] = { 0x48, 0x00, 0x00, 0x01, 0xAA };
+
+  // CRC-8/MAXIM, CRC-16/ARC and CRC-16/XMODEM check values
+  CHECK(crc8Update(0, check, 9) == 0xA1);
+  CHECK(crc16Update(0, check, 9) == 0xBB3D);
+  CHECK(crcCCITTUpdate(0, check, 9) == 0x31C3);
+
+  // The CRC bytes the SD spec gives for CMD0 and CMD8 are 0x95 and 0x87
+  CHECK(((crc7Update(0, cmd0, 5) << 1) | 1) == 0x95);
+  CHECK(((crc7Update(0, cmd8, 5) << 1) | 1) == 0x87);
+
+  // A 1-Wire ROM code ends with its CRC8
+  uint8_t rom[8] = { 0x28, 0xFF, 0x4B, 0x1D, 0x64, 0x15, 0x01, 0 };
+  rom[7] = crc8Update(0, rom, 7);
+  CHECK(crc8Check(rom, 8));
+  rom[3] ^= 0x10;
+  CHECK(!crc8Check(rom, 8));
+}
+
+static void testChunks() {
+  uint8_t data[1024];
+
+  srand(1);
+
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = rand();
+  }
+
+  for (int round = 0; round < 200; round++) {
+    size_t len = round < 10 ? round : rand() % sizeof(data) + 1;
+    uint8_t crc8 = 0, crc7 = 0;
+    uint16_t crc16 = 0, ccitt = 0;
+    size_t done = 0;
+
+    // Empty chunks included
+    while (done < len) {
+      size_t chunk = rand() % 70;
+
+      if (chunk > len - done) {
+        chunk = len - done;
+      }
+
+      crc8 = crc8Update(crc8, data + done, chunk);
+      crc16 = crc16Update(crc16, data + done, chunk);
+      ccitt = crcCCITTUpdate(ccitt, data + done, chunk);
+      crc7 = crc7Update(crc7, data + done, chunk);
+      done += chunk;
+    }
+
+    CHECK(crc8 == refCRC8(data, len));
+    CHECK(crc16 == refCRC16(data, len));
+    CHECK(ccitt == refCCITT(data, len));
+    CHECK(crc7 == refCRC7(data, len));
+
+    CHECK(crc8 == crc8Update(0, data, len));
+    CHECK(ccitt == crcCCITTUpdate(0, data, len));
+  }
+}
+
+// MB/s of a CRC over SD sized blocks
+template <class C, class F> static double bench(F update) {
+  static uint8_t block[512];
+  volatile C sink = 0;
+  const int rounds = 20000;
+
+  for (size_t i = 0; i < sizeof(block); i++) {
+    block[i] = i * 7;
+  }
+
+  clock_t start = clock();
+
+  for (int i = 0; i < rounds; i++) {
+    sink = update(sink, block, sizeof(block));
+  }
+
+  double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  return seconds > 0 ? rounds * sizeof(block) / seconds / 1e6 : 0;
+}
+
+int main(int argc, char **argv) {
+  int method = CRC_TEST_METHOD;
+
+  if (argc > 1 && !strcmp(argv[1], "--bench")) {
+    printf("%s\tCRC8 %.1f MB/s\tCRC16 %.1f MB/s\tCCITT %.1f MB/s\ttables %u + %u + %u bytes\n", methodNames[method],
+           bench<uint8_t>(crc8Update), bench<uint16_t>(crc16Update), bench<uint16_t>(crcCCITTUpdate),
+           tableSizes[method][0], tableSizes[method][1], tableSizes[method][1]);
+    return 0;
+  }
+
+  printf("%s\n", methodNames[method]);
+
+  testCheckValues();
+  testChunks();
+
+  return checkResult();
+}
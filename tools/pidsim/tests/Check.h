@@ -0,0 +1,37 @@
+/*
+  Check.h - Assertions for the host tests. A failed check prints its
+  location and the test carries on, checkResult() gives the exit code.
+*/
+
+#ifndef Check_h
+#define Check_h
+
+#include <stdio.h>
+#include <math.h>
+
+static int checkCount = 0;
+static int checkFailures = 0;
+
+#define CHECK(condition) \
+  checkAssert((condition), #condition, __FILE__, __LINE__)
+
+#define CHECK_NEAR(value, expected, tolerance) \
+  checkAssert(fabs((double) (value) - (double) (expected)) <= (tolerance), \
+              #value " == " #expected " +- " #tolerance, __FILE__, __LINE__)
+
+static inline void checkAssert(bool passed, const char *text, const char *file, int line) {
+  checkCount++;
+
+  if (!passed) {
+    checkFailures++;
+    printf("%s:%d: failed: %s\n", file, line, text);
+  }
+}
+
+static inline int checkResult() {
+  printf("%d checks, %d failed\n", checkCount, checkFailures);
+
+  return checkFailures ? 1 : 0;
+}
+
+#endif
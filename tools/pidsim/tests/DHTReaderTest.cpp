@@ -0,0 +1,251 @@
+/*
+  DHTReaderTest.cpp - Feeds simulated sensor frames to DHTReader through
+  its interrupt handler and checks the decoded values, the failure
+  statuses and the line handling when two sensors are read at once.
+  A sensor on a pin change interrupt gets the rising edges and the
+  changes of the other pins of its port too.
+*/
+
+#include "Check.h"
+#include "DHTReader.h"
+
+static const uint8_t PinA = 2;
+static const uint8_t PinB = 3;
+static const uint8_t PinC = SimInterruptPins + 2;   // Pin change interrupt only
+
+// Another pin of the port changes while the line is low and while it's high
+static boolean portNoise = false;
+
+// Falling edge on the active reader's line at the given time (us),
+// the line goes back up 50 us later
+static void edge(unsigned long time) {
+  simMicros = time;
+  simPortInput = 0;
+  DHTReader::handleInterrupt();
+
+  if (portNoise) {
+    simMicros = time + 20;
+    DHTReader::handleInterrupt();
+  }
+
+  simMicros = time + 50;
+  simPortInput = 1;
+  DHTReader::handleInterrupt();
+
+  if (portNoise) {
+    simMicros = time + 60;
+    DHTReader::handleInterrupt();
+  }
+}
+
+// Sends the sensor response and the 5 bytes, bits take their nominal
+// length plus skew (us). Returns the number of edges sent.
+static uint8_t sendFrame(const uint8_t *data, int skew = 0, uint8_t edges = DHTREADER_EDGES) {
+  unsigned long time = 65500;   // The 16 bit timestamps wrap within the frame
+  uint8_t count = 0;
+
+  // Response: 80 us low, 80 us high
+  if (count < edges) { edge(time); count++; }
+  time += 160;
+
+  for (uint8_t i = 0; i < 40; i++) {
+    if (count < edges) { edge(time); count++; }
+    time += ((data[i / 8] >> (7 - i % 8)) & 1) ? 120 : 77;
+    time += skew;
+  }
+
+  // The last bit ends with a 50 us low
+  if (count < edges) { edge(time); count++; }
+
+  return count;
+}
+
+static void makeFrame(uint8_t *data, uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3) {
+  data[0] = b0;
+  data[1] = b1;
+  data[2] = b2;
+  data[3] = b3;
+  data[4] = b0 + b1 + b2 + b3;
+}
+
+// Runs a whole reading, returns the status
+static uint8_t readFrame(DHTReader *reader, const uint8_t *data, int skew = 0, uint8_t edges = DHTREADER_EDGES) {
+  simMillis += reader->start();
+  CHECK(reader->run() == 10);
+
+  sendFrame(data, skew, edges);
+
+  unsigned long left;
+
+  while ((left = reader->run()) > 0) {
+    simMillis += left;
+  }
+
+  CHECK(!reader->isBusy());
+
+  return reader->getStatus();
+}
+
+static void testDecode() {
+  DHTReader reader(PinA);
+  uint8_t data[5];
+
+  CHECK(reader.begin());
+  CHECK(reader.getStatus() == DHTREADER_NONE);
+
+  // DHT22: 65.2 %, -10.1 C, the model is detected from the frame
+  makeFrame(data, 0x02, 0x8C, 0x80, 0x65);
+  CHECK(readFrame(&reader, data) == DHTREADER_OK);
+  CHECK(reader.getModel() == DHTREADER_DHT22);
+  CHECK_NEAR(reader.getHumidity(), 65.2, 0.01);
+  CHECK_NEAR(reader.getTemperature(), -10.1, 0.01);
+
+  // 0xFF bytes and a checksum which overflows
+  makeFrame(data, 0x03, 0xE8, 0x04, 0xFF);
+  CHECK(readFrame(&reader, data) == DHTREADER_OK);
+  CHECK_NEAR(reader.getHumidity(), 100.0, 0.01);
+  CHECK_NEAR(reader.getTemperature(), 127.9, 0.01);
+
+  // Slow and fast bits within the limits
+  makeFrame(data, 0x01, 0x55, 0x00, 0xAA);
+  CHECK(readFrame(&reader, data, 20) == DHTREADER_OK);
+  CHECK(readFrame(&reader, data, -15) == DHTREADER_OK);
+  CHECK_NEAR(reader.getTemperature(), 17.0, 0.01);
+
+  // DHT11: whole numbers in the first and the third byte
+  DHTReader dht11(PinB);
+
+  CHECK(dht11.begin());
+  makeFrame(data, 45, 0, 23, 0);
+  CHECK(readFrame(&dht11, data) == DHTREADER_OK);
+  CHECK(dht11.getModel() == DHTREADER_DHT11);
+  CHECK_NEAR(dht11.getHumidity(), 45, 0.01);
+  CHECK_NEAR(dht11.getTemperature(), 23, 0.01);
+}
+
+static void testErrors() {
+  DHTReader reader(PinA, DHTREADER_DHT22);
+  uint8_t data[5];
+
+  reader.begin();
+
+  makeFrame(data, 0x02, 0x8C, 0x00, 0xE1);
+  data[4]++;
+  CHECK(readFrame(&reader, data) == DHTREADER_ERROR_CHECKSUM);
+  CHECK(isnan(reader.getTemperature()));
+
+  makeFrame(data, 0x02, 0x8C, 0x00, 0xE1);
+  CHECK(readFrame(&reader, data, 50) == DHTREADER_ERROR_BITS);
+  CHECK(readFrame(&reader, data, -20) == DHTREADER_ERROR_BITS);
+
+  // A frame cut short ends at the frame timeout
+  CHECK(readFrame(&reader, data, 0, 30) == DHTREADER_TIMEOUT);
+  CHECK(isnan(reader.getHumidity()));
+
+  CHECK(readFrame(&reader, data) == DHTREADER_OK);
+  CHECK_NEAR(reader.getTemperature(), 22.5, 0.01);
+}
+
+static void testTwoReaders() {
+  DHTReader a(PinA, DHTREADER_DHT22);
+  DHTReader b(PinB, DHTREADER_DHT22);
+  uint8_t data[5];
+
+  a.begin();
+  b.begin();
+  makeFrame(data, 0x02, 0x8C, 0x00, 0xE1);
+
+  // B doesn't pull its line low while A is capturing
+  simMillis += a.start();
+  CHECK(a.run() == 10);
+
+  CHECK(b.start() > 0);
+  CHECK(b.isBusy());
+  CHECK(simPinModes[PinB] == INPUT_PULLUP);
+
+  sendFrame(data);
+  CHECK(a.run() == 0);
+  CHECK(a.getStatus() == DHTREADER_OK);
+
+  // Then B gets its turn
+  simMillis += b.run();
+  CHECK(b.run() > 0);
+  CHECK(simPinModes[PinB] == OUTPUT && simPinLevels[PinB] == LOW);
+
+  simMillis += b.run();
+  CHECK(b.run() == 10);
+  sendFrame(data);
+  CHECK(b.run() == 0);
+  CHECK(b.getStatus() == DHTREADER_OK);
+
+  // Both start pulses at once: A is captured, B lets its line go
+  // at the end of its pulse and starts over a sampling period later
+  simMillis += 5000;
+  a.start();
+  b.start();
+  CHECK(simPinModes[PinB] == OUTPUT);
+
+  simMillis += 2;
+  CHECK(a.run() == 10);
+  CHECK(b.run() == b.getMinimumSamplingPeriod());
+  CHECK(simPinModes[PinB] == INPUT_PULLUP);
+
+  sendFrame(data);
+  CHECK(a.run() == 0);
+
+  simMillis += 1000;
+  CHECK(b.run() == 1000);
+  CHECK(simPinModes[PinB] == INPUT_PULLUP);
+
+  simMillis += 1000;
+  CHECK(b.run() == 2);
+  CHECK(simPinModes[PinB] == OUTPUT);
+  CHECK(readFrame(&b, data) == DHTREADER_OK);
+}
+
+// The pin change interrupt is enabled for the frame only, and the other
+// pins of the port don't add edges
+static void testPinChange() {
+  DHTReader reader(PinC, DHTREADER_DHT22);
+  uint8_t data[5];
+
+  CHECK(reader.begin());
+  CHECK(simPCICR == 1);
+
+  portNoise = true;
+  makeFrame(data, 0x02, 0x8C, 0x80, 0x65);
+  simMillis += reader.start();
+  CHECK(reader.run() == 10);
+  CHECK(simPCMSK == 1);
+
+  // Releasing the line is a change from low to high
+  DHTReader::handleInterrupt();
+  sendFrame(data);
+
+  unsigned long left;
+
+  while ((left = reader.run()) > 0) {
+    simMillis += left;
+  }
+
+  CHECK(reader.getStatus() == DHTREADER_OK);
+  CHECK_NEAR(reader.getHumidity(), 65.2, 0.01);
+  CHECK_NEAR(reader.getTemperature(), -10.1, 0.01);
+  CHECK(simPCMSK == 0);
+
+  makeFrame(data, 0x01, 0x55, 0x00, 0xAA);
+  CHECK(readFrame(&reader, data, 20) == DHTREADER_OK);
+  CHECK(readFrame(&reader, data, -15) == DHTREADER_OK);
+  CHECK_NEAR(reader.getTemperature(), 17.0, 0.01);
+
+  portNoise = false;
+}
+
+int main() {
+  testDecode();
+  testErrors();
+  testTwoReaders();
+  testPinChange();
+
+  return checkResult();
+}
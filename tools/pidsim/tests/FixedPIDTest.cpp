@@ -0,0 +1,170 @@
+/*
+  FixedPIDTest.cpp - Runs FixedPID (Q16.16) and PID (float) side by side
+  on the heated floor model and checks that the fixed point controller
+  stays within a stated bound of the float one:
+  - fed the same readings, the outputs differ by at most OutputBound ms
+    of the 10 s output window
+  - each driving its own plant, the floor temperatures differ by at most
+    TemperatureBound C. The outputs of the two loops aren't bounded, a
+    reading which rounds to the other 1/16 C step moves one of them by
+    a whole proportional step (~50..90 ms here).
+  --bench times doControl() of both on the same readings.
+*/
+
+#include <chrono>
+#include <vector>
+#include "Check.h"
+#include "Plant.h"
+#include "PID.h"
+
+static const unsigned long ControlTime = 1000;
+static const unsigned long Days = 2;
+
+// Worst case differences over the runs below are 2.1 ms and 0.001 C,
+// gains which are exact in Q16.16 (400, 1000 * 0.001) give no difference at all
+static const float OutputBound = 10;
+static const float TemperatureBound = 0.01;
+
+static plantConfig_t floorPlant(float gain, float timeConstant, float deadTime) {
+  plantConfig_t config;
+
+  config.gain = gain;
+  config.timeConstant = timeConstant;
+  config.deadTime = deadTime;
+  config.ambient = 18;
+  config.noise = 0.02;
+  config.resolution = 0.0625;
+  config.window = 10000;
+
+  return config;
+}
+
+static void runSideBySide(const plantConfig_t &config, float kP, float kI, float setpoint) {
+  float input = 20, output = 0, target = setpoint;
+  Fixed16 fixedInput = 20, fixedOutput = 0, fixedTarget = setpoint;
+  PID controller(kP, kI, 0, &input, &output, 0, 10000, &target, ControlTime, true);
+  FixedPID fixedController(kP, kI, 0, &fixedInput, &fixedOutput, 0, 10000, &fixedTarget, ControlTime, true);
+
+  // The same sensor noise for both, the fixed point loop only drives its own plant
+  Plant plant(config, 20, 1);
+  Plant fixedPlant(config, 20, 1);
+  float outputDiff = 0, temperatureDiff = 0, sharedOutputDiff = 0;
+
+  // Fed the same readings, the outputs are compared directly
+  float sharedInput = 20, sharedOutput = 0;
+  Fixed16 sharedFixedInput = 20, sharedFixedOutput = 0;
+  PID shared(kP, kI, 0, &sharedInput, &sharedOutput, 0, 10000, &target, ControlTime, true);
+  FixedPID sharedFixed(kP, kI, 0, &sharedFixedInput, &sharedFixedOutput, 0, 10000, &fixedTarget, ControlTime, true);
+
+  simMillis = 0;
+
+  for (unsigned long i = 0; i < Days * 86400000UL / Plant::Step; i++) {
+    if (simMillis % ControlTime == 0) {
+      input = plant.read();
+      fixedInput = fixedPlant.read();
+      controller.doControl();
+      fixedController.doControl();
+
+      sharedInput = input;
+      sharedFixedInput = input;
+      shared.doControl();
+      sharedFixed.doControl();
+
+      float diff = fabs(sharedOutput - toFloat(sharedFixedOutput));
+      sharedOutputDiff = diff > sharedOutputDiff ? diff : sharedOutputDiff;
+
+      diff = fabs(output - toFloat(fixedOutput));
+      outputDiff = diff > outputDiff ? diff : outputDiff;
+    }
+
+    plant.step(simMillis, output);
+    fixedPlant.step(simMillis, toFloat(fixedOutput));
+    simMillis += Plant::Step;
+
+    float diff = fabs(plant.getTemperature() - fixedPlant.getTemperature());
+    temperatureDiff = diff > temperatureDiff ? diff : temperatureDiff;
+  }
+
+  printf("gain %g tau %g dead %g kP %g kI %g: output %.3f ms, closed loop output %.3f ms, temperature %.5f C\n",
+         config.gain, config.timeConstant, config.deadTime, kP, kI, sharedOutputDiff, outputDiff, temperatureDiff);
+
+  CHECK(sharedOutputDiff <= OutputBound);
+  CHECK(temperatureDiff <= TemperatureBound);
+}
+
+// Readings of the floor driven by the float loop, converted to T up front
+template <class T> static std::vector<T> recordReadings(unsigned long count) {
+  float input = 20, output = 0, target = 25;
+  PID controller(400, 0.001, 0, &input, &output, 0, 10000, &target, ControlTime, true);
+  Plant plant(floorPlant(15, 3600, 600), 20, 1);
+  std::vector<T> readings;
+
+  simMillis = 0;
+
+  while (readings.size() < count) {
+    if (simMillis % ControlTime == 0) {
+      input = plant.read();
+      controller.doControl();
+      readings.push_back(T(input));
+    }
+
+    plant.step(simMillis, output);
+    simMillis += Plant::Step;
+  }
+
+  return readings;
+}
+
+// Nanoseconds per doControl() call
+template <class T> static double timeControl(const std::vector<T> &readings, unsigned long rounds) {
+  T input = readings[0], output = 0, target = 25;
+  PIDController<T> controller(400, 0.001, 0, &input, &output, 0, 10000, &target, ControlTime, true);
+  float sum = 0;
+
+  simMillis = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (unsigned long round = 0; round < rounds; round++) {
+    for (size_t i = 0; i < readings.size(); i++) {
+      simMillis += ControlTime;
+      input = readings[i];
+      controller.doControl();
+    }
+
+    sum += toFloat(output);
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // Keeps the loop from being optimized out
+  CHECK(sum >= 0);
+
+  return seconds * 1e9 / (rounds * readings.size());
+}
+
+// The PC has an FPU, so this is the cost of the fixed point math against
+// hardware float. On the AVR float is emulated in software.
+static void bench() {
+  const unsigned long count = 10000, rounds = 100;
+  double floatTime = timeControl(recordReadings<float>(count), rounds);
+  double fixedTime = timeControl(recordReadings<Fixed16>(count), rounds);
+
+  printf("doControl()\tPID (float) %.1f ns\tFixedPID (Q16.16) %.1f ns\t%.1f million calls/s against %.1f\n",
+         floatTime, fixedTime, 1000 / floatTime, 1000 / fixedTime);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && !strcmp(argv[1], "--bench")) {
+    bench();
+    return 0;
+  }
+
+  // FloorHeater defaults and a few tuned gains over slow and fast floors
+  runSideBySide(floorPlant(15, 3600, 600), 400, 0.001, 25);
+  runSideBySide(floorPlant(15, 3600, 600), 1376, 0.000217, 25);
+  runSideBySide(floorPlant(10, 1800, 300), 2000, 0.002, 24);
+  runSideBySide(floorPlant(25, 7200, 1200), 800, 0.0001, 28);
+
+  return checkResult();
+}
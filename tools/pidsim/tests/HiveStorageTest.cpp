@@ -0,0 +1,676 @@
+/*
+  HiveStorageTest.cpp - Runs HiveStorage on a simulated EEPROM which
+  counts the writes of each cell. A year of light switching is written
+  through the storage mirror, and the most worn cell is compared with the
+  old layout, which rewrote the same cell on every change. Settings in the
+  old plain layout, power losses in the middle of a flush and cells which
+  don't take writes any more have to leave the last saved settings intact.
+  Then the same runs on a stand-in SD card which counts the card commands:
+  the settings file has to be read with one multi-block read at boot, and
+  files of older firmwares have to be converted. Built once per module
+  count, the boot time is modelled from the commands and blocks.
+*/
+
+#include <vector>
+#include "Check.h"
+#include "HiveStorage.h"
+
+#ifndef STORAGE_TEST_MODULES
+#define STORAGE_TEST_MODULES 2
+#endif
+
+// A cell lasts 100000 writes
+static const unsigned long CellEndurance = 100000;
+
+// Module settings positions after the system settings: the light switch
+// mode and state, then the temperature sensor state and ROM code
+static const int LightModePosition = SystemSettingsSize;
+static const int SensorPosition = SystemSettingsSize + 2;
+
+static uint8_t cells[E2END + 1];
+static unsigned long cellWrites[E2END + 1];
+static long writesLeft = -1;        // Writes until the power is lost, -1 never
+static int worn = -1;               // A cell which doesn't take writes any more
+
+EEPROMClass EEPROM;
+
+uint8_t EEPROMClass::read(int address) {
+  return cells[address];
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+  if (writesLeft == 0) {
+    return;
+  }
+
+  if (writesLeft > 0) {
+    writesLeft--;
+  }
+
+  cellWrites[address]++;
+
+  if (address != worn) {
+    cells[address] = value;
+  }
+}
+
+// The card holds two files at most: the settings file, and the new one while
+// the settings file is converted. Each has room for 16 blocks. An older
+// firmware wrote the settings as a plain file, which isn't contiguous.
+static const uint16_t CardBlocks = 64;
+static const uint8_t CardFiles = 2;
+static const uint32_t FileBlocks = 16;
+
+struct cardFile_t
+{
+  char name[16];                // Empty if the entry is free
+  boolean contiguous;
+  uint32_t size;
+};
+
+struct card_t
+{
+  boolean present;
+  cardFile_t files[CardFiles];
+  uint8_t blocks[CardBlocks][512];
+  boolean failReads;            // Data blocks don't come, the card is broken
+  boolean full;                 // No room for a new file
+  boolean failRename;           // The power goes off before a file is renamed
+  uint32_t readBlock;           // Next block of a multi-block read, 0 if none
+  unsigned long commands;
+  unsigned long reads;          // Read commands, each waits for the card to find the block
+  unsigned long blocksRead;
+  unsigned long blocksWritten;
+};
+
+static card_t sdCard;
+
+static uint32_t firstBlock(int file) {
+  return 8 + file * FileBlocks;
+}
+
+static int findFile(const char *name) {
+  for (int i = 0; i < CardFiles; i++) {
+    if (!strcmp(sdCard.files[i].name, name)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// The settings file, NULL if there's none
+static cardFile_t *settingsFile() {
+  int file = findFile(StorageFileName);
+
+  return (file < 0) ? NULL : &sdCard.files[file];
+}
+
+// Puts a settings file on the card, returns its first block
+static uint8_t *putSettingsFile(uint32_t size, boolean contiguous) {
+  cardFile_t *file = &sdCard.files[0];
+
+  strcpy(file->name, StorageFileName);
+  file->contiguous = contiguous;
+  file->size = size;
+  return sdCard.blocks[firstBlock(0)];
+}
+
+// A command takes 6 bytes and a few more polling for the response,
+// a block 512 bytes, the data token and the CRC. The card takes
+// a while to find the first block of a read (us).
+static const unsigned CommandBytes = 8;
+static const unsigned BlockBytes = 515;
+static const double SPIByteTime = 2.0;
+static const double CardAccessTime = 500;
+
+// The settings length kept at the end of the settings file, as HiveStorage.cpp writes it
+struct sdStorageTail_t
+{
+  uint16_t length;
+  uint8_t checkByte;
+};
+
+static double cardTime(unsigned long commands, unsigned long reads, unsigned long blocks) {
+  return ((commands * CommandBytes + blocks * BlockBytes) * SPIByteTime + reads * CardAccessTime) / 1000;
+}
+
+static void cardRead(uint32_t block, uint8_t *dst) {
+  sdCard.commands++;
+  sdCard.reads++;
+  sdCard.blocksRead++;
+  memcpy(dst, sdCard.blocks[block], 512);
+}
+
+bool SdFat::begin(uint8_t chipSelectPin, uint8_t sckRateID) { return sdCard.present; }
+
+bool Sd2Card::readBlock(uint32_t block, uint8_t *dst) {
+  cardRead(block, dst);
+  return !sdCard.failReads;
+}
+
+bool Sd2Card::readStart(uint32_t blockNumber) {
+  CHECK(sdCard.readBlock == 0);
+  sdCard.commands++;
+  sdCard.reads++;
+  sdCard.readBlock = blockNumber;
+  return true;
+}
+
+bool Sd2Card::readData(uint8_t *dst) {
+  CHECK(sdCard.readBlock > 0);
+  sdCard.blocksRead++;
+  memcpy(dst, sdCard.blocks[sdCard.readBlock++], 512);
+  return !sdCard.failReads;
+}
+
+bool Sd2Card::readStop() {
+  sdCard.commands++;
+  sdCard.readBlock = 0;
+  return true;
+}
+
+bool Sd2Card::writeBlock(uint32_t block, const uint8_t *src) {
+  boolean inFile = false;
+
+  for (int i = 0; i < CardFiles; i++) {
+    if (sdCard.files[i].name[0] && (block >= firstBlock(i)) &&
+        (block < firstBlock(i) + (sdCard.files[i].size + 511) / 512)) {
+      inFile = true;
+    }
+  }
+
+  CHECK(inFile);
+  sdCard.commands++;
+  sdCard.blocksWritten++;
+  memcpy(sdCard.blocks[block], src, 512);
+  return true;
+}
+
+uint8_t *SdVolume::cacheClear() { return sdCard.blocks[0]; }
+
+// Opening a file looks it up in the directory block
+bool SdBaseFile::open(const char *path, uint8_t oflag) {
+  uint8_t directory[512];
+
+  cardRead(0, directory);
+
+  _file = findFile(path);
+  _open = (_file >= 0);
+  _position = 0;
+  return _open;
+}
+
+bool SdBaseFile::close() {
+  _open = false;
+  return true;
+}
+
+bool SdBaseFile::remove() {
+  CHECK(_open);
+  sdCard.files[_file].name[0] = 0;
+  _open = false;
+  return true;
+}
+
+bool SdBaseFile::rename(SdBaseFile *dirFile, const char *newPath) {
+  CHECK(_open && (findFile(newPath) < 0));
+
+  if (sdCard.failRename) {
+    return false;
+  }
+
+  strcpy(sdCard.files[_file].name, newPath);
+  return true;
+}
+
+uint32_t SdBaseFile::fileSize() const { return sdCard.files[_file].size; }
+
+bool SdBaseFile::seekSet(uint32_t pos) {
+  _position = pos;
+  return pos <= fileSize();
+}
+
+int SdBaseFile::read(void *buf, size_t nbyte) {
+  size_t i;
+
+  for (i = 0; (i < nbyte) && (_position < fileSize()); i++, _position++) {
+    ((uint8_t *)buf)[i] = sdCard.blocks[firstBlock(_file) + _position / 512][_position % 512];
+  }
+
+  sdCard.blocksRead += (i + 511) / 512;
+  return i;
+}
+
+int SdBaseFile::write(const void *buf, size_t nbyte) { return -1; }
+bool SdBaseFile::sync() { return true; }
+
+bool SdBaseFile::contiguousRange(uint32_t *bgnBlock, uint32_t *endBlock) {
+  *bgnBlock = firstBlock(_file);
+  *endBlock = firstBlock(_file) + (fileSize() + 511) / 512 - 1;
+  return _open && sdCard.files[_file].contiguous;
+}
+
+bool SdBaseFile::createContiguous(SdBaseFile *dirFile, const char *path, uint32_t size) {
+  CHECK(findFile(path) < 0);
+  CHECK(size / 512 <= FileBlocks);
+
+  _file = findFile("");
+
+  if (sdCard.full || (_file < 0)) {
+    return false;
+  }
+
+  strcpy(sdCard.files[_file].name, path);
+  sdCard.files[_file].contiguous = true;
+  sdCard.files[_file].size = size;
+  memset(sdCard.blocks[firstBlock(_file)], 0, size);
+
+  _open = true;
+  _position = 0;
+  return true;
+}
+
+// HiveSetup.cpp and DeviceDispatch.cpp
+uint8_t SettingsOffset = SystemSettingsSize;
+char StorageFileName[16] = "settings.bin";
+byte hivemac[6] = { 0x90, 0xA2, 0xDA, 0x01, 0x02, 0x03 };
+
+void useDevice(uint8_t deviceId) {}
+uint8_t getDeviceClockDivisor(uint8_t deviceId) { return 2; }
+
+// HiveStorage.cpp EEPROM ring
+extern uint16_t eepromNextSlot;
+int eepromSlotAddress(uint16_t slot);
+uint16_t eepromSlotCount();
+
+// Restart the board, returns what initStorage() tells the modules
+static uint8_t boot() {
+  writesLeft = -1;
+  SettingsOffset = SystemSettingsSize;
+
+  return initStorage();
+}
+
+static void erase() {
+  memset(cells, 0xFF, sizeof(cells));
+  memset(cellWrites, 0, sizeof(cellWrites));
+  memset(&storageStats, 0, sizeof(storageStats));
+  worn = -1;
+}
+
+// Writes the settings like the modules do and waits for them to be written back
+static void save(int position, uint8_t value) {
+  writeStorage(position, value);
+  simMillis += StorageFlushDelay;
+  storageLoopDo();
+}
+
+static uint8_t load(int position) {
+  uint8_t value = 0;
+
+  CHECK(readStorage(position, value) == 1);
+  return value;
+}
+
+// First boot, then a year of switching the light 20 times a day
+static void testWear() {
+  const unsigned long switches = 20 * 365UL;
+  unsigned long maxWrites = 0;
+
+  erase();
+  CHECK(boot() == 0);
+  saveSystemSettings();
+
+  for (uint16_t i = 0; i < ModulesStorageSize; i++) {
+    save(SettingsOffset + i, 0);
+  }
+
+  memset(cellWrites, 0, sizeof(cellWrites));
+  unsigned long flushes = storageStats.flushes;
+
+  for (unsigned long i = 0; i < switches; i++) {
+    save(LightModePosition, (i & 1) ? 1 : 2);
+    simMillis += 3600000UL;
+  }
+
+  for (int i = 0; i <= E2END; i++) {
+    if (cellWrites[i] > maxWrites) {
+      maxWrites = cellWrites[i];
+    }
+  }
+
+  flushes = storageStats.flushes - flushes;
+  uint16_t slots = (E2END + 1 - SystemSettingsSize) / (4 + ModulesStorageSize);
+
+  printf("%lu flushes a year, %u slots of %u bytes: the most worn cell takes %lu writes a year (%lu years), "
+         "%lu in place (%.1f years)\n", flushes, slots, ModulesStorageSize + 4, maxWrites,
+         CellEndurance / maxWrites, switches, (double) CellEndurance / switches);
+
+  CHECK(flushes == switches);
+  CHECK(storageStats.flushFailures == 0);
+
+  // A cell is written once per ring turn, the sequence number
+  // high byte and the CRC don't change every time either
+  CHECK(maxWrites <= switches / slots + 1);
+
+  CHECK(boot() == 1);
+  CHECK(load(LightModePosition) == ((switches - 1) & 1 ? 1 : 2));
+  CHECK(load(SensorPosition) == 0);
+}
+
+// Settings written by an older firmware in place after the system settings
+static void testOldLayout() {
+  erase();
+  cells[0] = StorageCheckByte;
+
+  for (uint16_t i = 0; i < ModulesStorageSize; i++) {
+    cells[SystemSettingsSize + i] = 10 + i;
+  }
+
+  CHECK(boot() == 1);
+  CHECK(load(LightModePosition) == 10);
+  CHECK(load(SensorPosition) == 12);
+
+  // The power goes off in the middle of the first flush
+  writeStorage(LightModePosition, (uint8_t) 1);
+  writesLeft = 3;
+  flushStorage();
+
+  CHECK(boot() == 1);
+  CHECK(load(LightModePosition) == 10);
+
+  // The first slot is written after the old image
+  save(LightModePosition, 1);
+  CHECK(storageStats.flushFailures == 1);
+
+  for (uint16_t i = 0; i < ModulesStorageSize; i++) {
+    CHECK(cells[SystemSettingsSize + i] == (uint8_t)(10 + i));
+  }
+
+  CHECK(boot() == 1);
+  CHECK(load(LightModePosition) == 1);
+  CHECK(load(SensorPosition) == 12);
+  CHECK(load(SensorPosition + 9) == 21);
+}
+
+// A cell of the next slot doesn't take writes, or the power goes off
+// in the middle of a flush: the last saved settings are kept
+static void testFailures() {
+  erase();
+  CHECK(boot() == 0);
+  saveSystemSettings();
+  save(LightModePosition, 1);
+  save(SensorPosition, 5);
+
+  // The first data byte of the next slot
+  worn = eepromSlotAddress(eepromNextSlot) + 4;
+
+  writeStorage(LightModePosition, (uint8_t) 2);
+  flushStorage();
+
+  CHECK(storageStats.flushFailures == 1);
+  CHECK(boot() == 1);
+  CHECK(load(LightModePosition) == 1);
+
+  // The boot picks the worn slot again. With two slots it's the only one
+  // left to write, so the rest runs on good cells then.
+  unsigned long failures = 2;
+
+  if (eepromSlotCount() < 3) {
+    worn = -1;
+    failures = 1;
+  }
+
+  // The changes are kept in the mirror and written to the slot after
+  writeStorage(LightModePosition, (uint8_t) 2);
+  flushStorage();
+  CHECK(storageStats.flushFailures == failures);
+  flushStorage();
+  CHECK(storageStats.flushFailures == failures);
+
+  CHECK(boot() == 1);
+  CHECK(load(LightModePosition) == 2);
+  CHECK(load(SensorPosition) == 5);
+
+  // The power goes off in the middle of a flush
+  writeStorage(SensorPosition, (uint8_t) 6);
+  writesLeft = 2;
+  flushStorage();
+
+  CHECK(boot() == 1);
+  CHECK(load(SensorPosition) == 5);
+
+  save(SensorPosition, 6);
+  CHECK(boot() == 1);
+  CHECK(load(SensorPosition) == 6);
+  CHECK(load(LightModePosition) == 2);
+}
+
+// Settings sizes of the modules: the board in HiveSetup.h (a light switch and a
+// temperature sensor), or a house of a floor heater, three light switches,
+// two temperature sensors, a motion sensor and a humidity sensor per 8 modules
+static std::vector<uint16_t> moduleSizes() {
+  static const uint16_t house[8] = { 149, 2, 2, 2, 10, 10, 3, 3 };
+  std::vector<uint16_t> sizes;
+
+  if (STORAGE_TEST_MODULES == 2) {
+    sizes.push_back(2);
+    sizes.push_back(10);
+  } else {
+    for (uint8_t i = 0; i < STORAGE_TEST_MODULES; i++) {
+      sizes.push_back(house[i % 8]);
+    }
+  }
+
+  return sizes;
+}
+
+static uint8_t settingsByte(int position, uint8_t version) {
+  return position * 7 + version;
+}
+
+// Restart the board with the card in
+static uint8_t bootSD() {
+  sdCard.present = true;
+  sdCard.commands = 0;
+  sdCard.reads = 0;
+  sdCard.blocksRead = 0;
+  sdCard.blocksWritten = 0;
+
+  return boot();
+}
+
+static void eraseSD() {
+  erase();
+  memset(&sdCard, 0, sizeof(sdCard));
+}
+
+// A plain settings file of an older firmware
+static void putPlainFile(uint8_t version) {
+  uint8_t *data = putSettingsFile(ModulesStorageSize, false);
+
+  for (int i = 0; i < ModulesStorageSize; i++) {
+    data[i] = settingsByte(i, version);
+  }
+}
+
+static boolean preallocated() {
+  cardFile_t *file = settingsFile();
+
+  return file && file->contiguous && (file->size == StorageCacheSize);
+}
+
+// Every module reads its settings, from the mirror
+static void checkModules(uint8_t version) {
+  std::vector<uint16_t> sizes = moduleSizes();
+  unsigned long commands = sdCard.commands;
+  int position = 0;
+  uint8_t data[512];
+
+  for (size_t i = 0; i < sizes.size(); i++) {
+    CHECK(readStorageBytes(position, data, sizes[i]) == sizes[i]);
+
+    for (uint16_t j = 0; j < sizes[i]; j++, position++) {
+      CHECK(data[j] == settingsByte(position, version));
+    }
+  }
+
+  CHECK(sdCard.commands == commands);
+}
+
+// The settings file is created at the first boot and read with one
+// multi-block read at the next ones, then a change is written back
+static void testSDBoot() {
+  std::vector<uint16_t> sizes = moduleSizes();
+  int total = 0;
+
+  for (size_t i = 0; i < sizes.size(); i++) {
+    total += sizes[i];
+  }
+
+  CHECK(total == ModulesStorageSize);
+
+  eraseSD();
+  CHECK(bootSD() == 0);
+  CHECK(StorageType == SDStorage);
+  CHECK(preallocated());
+
+  sdCard.blocksWritten = 0;
+  beginStorageBatch();
+
+  for (int i = 0; i < ModulesStorageSize; i++) {
+    writeStorage(i, settingsByte(i, 1));
+  }
+
+  endStorageBatch();
+  CHECK(storageStats.flushFailures == 0);
+  CHECK(sdCard.blocksWritten == StorageCacheSize / 512);
+
+  CHECK(bootSD() == 1);
+  CHECK(StorageType == SDStorage);
+
+  unsigned long commands = sdCard.commands;
+  unsigned long reads = sdCard.reads;
+  unsigned long blocks = sdCard.blocksRead;
+
+  checkModules(1);
+
+  // The directory lookup, then the whole file
+  CHECK(commands == 3);
+  CHECK(reads == 2);
+  CHECK(blocks == 1 + StorageCacheSize / 512);
+
+  // Each module used to open the file, which looked it up in the directory, and read its block
+  unsigned long before = 2 * sizes.size();
+  double bootTime = cardTime(commands, reads, blocks);
+  double beforeTime = cardTime(before, before, before);
+
+  printf("%u modules\t%u bytes\t%u blocks\tboot %lu commands, %.1f ms\tper-module open and read %lu commands, %.1f ms\n",
+         (unsigned) sizes.size(), ModulesStorageSize, StorageCacheSize / 512, commands, bootTime, before, beforeTime);
+
+  CHECK(bootTime < beforeTime);
+
+  // Only the block of a change is written
+  save(ModulesStorageSize - 1, (uint8_t) 0);
+  CHECK(sdCard.blocksWritten == 1);
+  CHECK(bootSD() == 1);
+  CHECK(load(ModulesStorageSize - 1) == 0);
+  CHECK(load(0) == settingsByte(0, 1));
+}
+
+// A preallocated file of one block written before the file was sized
+// for the modules, and a plain file of an older firmware
+static void testSDConversion() {
+  sdStorageTail_t tail;
+  int length = min((int) ModulesStorageSize, 512 - (int) sizeof(tail));
+
+  eraseSD();
+  uint8_t *data = putSettingsFile(512, true);
+
+  for (int i = 0; i < length; i++) {
+    data[i] = settingsByte(i, 2);
+  }
+
+  tail.length = length;
+  tail.checkByte = StorageCheckByte;
+  memcpy(data + 512 - sizeof(tail), &tail, sizeof(tail));
+
+  CHECK(bootSD() == 1);
+  CHECK(preallocated());
+
+  for (int i = 0; i < length; i++) {
+    CHECK(load(i) == settingsByte(i, 2));
+  }
+
+  // Nothing was saved beyond, the modules keep their defaults
+  uint8_t value;
+  CHECK(readStorage(length, value) == -1);
+
+  CHECK(bootSD() == 1);
+  CHECK(sdCard.reads == 2);
+  CHECK(load(length - 1) == settingsByte(length - 1, 2));
+
+  eraseSD();
+  putPlainFile(3);
+
+  CHECK(bootSD() == 1);
+  CHECK(preallocated());
+  checkModules(3);
+
+  CHECK(bootSD() == 1);
+  CHECK(sdCard.reads == 2);
+  checkModules(3);
+}
+
+// The old file is kept until the settings are in the new one. A card
+// without room for the new file leaves it as it is, and the new file
+// is picked up if the power goes off before it's renamed.
+static void testSDConversionFailures() {
+  eraseSD();
+  putPlainFile(4);
+
+  sdCard.full = true;
+  CHECK(bootSD() == 0);
+  CHECK(StorageType == EEPROMStorage);
+  CHECK(settingsFile() && !settingsFile()->contiguous && (settingsFile()->size == ModulesStorageSize));
+
+  sdCard.full = false;
+  sdCard.failRename = true;
+  CHECK(bootSD() == 0);
+  CHECK(StorageType == EEPROMStorage);
+  CHECK(settingsFile() == NULL);
+
+  sdCard.failRename = false;
+  CHECK(bootSD() == 1);
+  CHECK(StorageType == SDStorage);
+  CHECK(preallocated());
+  checkModules(4);
+
+  CHECK(bootSD() == 1);
+  CHECK(sdCard.reads == 2);
+  checkModules(4);
+}
+
+// Settings which can't be read from the card come from EEPROM
+static void testSDFailure() {
+  eraseSD();
+  CHECK(bootSD() == 0);
+
+  sdCard.failReads = true;
+  CHECK(bootSD() == 0);
+  CHECK(StorageType == EEPROMStorage);
+  CHECK(sdCard.readBlock == 0);
+}
+
+int main() {
+  testWear();
+  testOldLayout();
+  testFailures();
+  testSDBoot();
+  testSDConversion();
+  testSDConversionFailures();
+  testSDFailure();
+
+  return checkResult();
+}
@@ -0,0 +1,193 @@
+/*
+  JSONReaderTest.cpp - Decodes requests with JSONReader from a string
+  stream: field tables with nested objects, numbers and their ranges,
+  string escapes, and malformed or cut off input, which has to fail
+  instead of leaving half parsed values behind.
+*/
+
+#include <string>
+#include "Check.h"
+#include "JSONReader.h"
+
+class StringStream : public Stream
+{
+  public:
+    StringStream(const char *text) : _text(text), _position(0) {}
+
+    int available() { return _text.size() - _position; }
+    int read() { return _position < _text.size() ? (unsigned char) _text[_position++] : -1; }
+    int peek() { return _position < _text.size() ? (unsigned char) _text[_position] : -1; }
+    size_t write(uint8_t ch) { return 0; }
+
+  private:
+    std::string _text;
+    size_t _position;
+};
+
+struct period_t
+{
+  int16_t start;
+  int16_t end;
+};
+
+struct request_t
+{
+  char moduleType[12];
+  int8_t moduleState;
+  uint16_t interval;
+  int32_t counter;
+  float setpoint;
+  period_t schedule[4];
+};
+
+static const JSONField periodFields[] PROGMEM = {
+  JSON_FIELD("start", JSONTypeInt, period_t, start),
+  JSON_FIELD("end", JSONTypeInt, period_t, end)
+};
+
+static const JSONField requestFields[] PROGMEM = {
+  JSON_FIELD("moduleType", JSONTypeString, request_t, moduleType),
+  JSON_FIELD("moduleState", JSONTypeInt, request_t, moduleState),
+  JSON_FIELD("interval", JSONTypeUInt, request_t, interval),
+  JSON_FIELD("counter", JSONTypeInt, request_t, counter),
+  JSON_FIELD("setpoint", JSONTypeFloat, request_t, setpoint),
+  JSON_OBJECTS("schedule", request_t, schedule, sizeof(period_t), 4, periodFields)
+};
+
+static boolean readRequest(const char *text, request_t *request) {
+  StringStream in(text);
+  JSONReader reader(&in);
+
+  memset(request, 0, sizeof(*request));
+  request->moduleState = -1;
+  request->interval = 7;
+
+  return reader.beginObject() &&
+         reader.readFields(requestFields, sizeof(requestFields) / sizeof(*requestFields), request);
+}
+
+static boolean readNumber(const char *text, long *value) {
+  StringStream in(text);
+  JSONReader reader(&in);
+
+  return reader.readNumber(value);
+}
+
+// Reads a string value, false if the reader fails
+static boolean readString(const char *text, char *value, uint8_t size) {
+  StringStream in(text);
+  JSONReader reader(&in);
+
+  return reader.readString(value, size);
+}
+
+static void testFields() {
+  request_t request;
+
+  CHECK(readRequest(
+    "{ \"moduleType\": \"FloorHeater\", \"unknown\": {\"a\": [1, \"}\", {}]},\n"
+    "  \"moduleState\": 1, \"interval\": null, \"counter\": -100000, \"setpoint\": 24.5,\n"
+    "  \"schedule\": [[{\"start\": 1536, \"end\": 2048}], [{\"end\": 5}, {}], [], {\"start\": 9}] }",
+    &request));
+
+  CHECK(strcmp(request.moduleType, "FloorHeater") == 0);
+  CHECK(request.moduleState == 1);
+  CHECK(request.interval == 7);
+  CHECK(request.counter == -100000);
+  CHECK_NEAR(request.setpoint, 24.5, 1e-6);
+  CHECK(request.schedule[0].start == 1536 && request.schedule[0].end == 2048);
+  CHECK(request.schedule[1].start == 0 && request.schedule[1].end == 5);
+  CHECK(request.schedule[3].start == 9);
+
+  // Extra objects are skipped, long strings truncated
+  CHECK(readRequest("{\"schedule\": [{}, {}, {}, {}, {\"start\": 1}], \"moduleType\": \"FloorHeaterModule\"}", &request));
+  CHECK(strcmp(request.moduleType, "FloorHeater") == 0);
+
+  // Out of range and malformed values
+  CHECK(!readRequest("{\"moduleState\": 128}", &request));
+  CHECK(readRequest("{\"moduleState\": -128}", &request));
+  CHECK(!readRequest("{\"interval\": -1}", &request));
+  CHECK(!readRequest("{\"interval\": 65536}", &request));
+  CHECK(!readRequest("{\"setpoint\": 24.5.1}", &request));
+  CHECK(!readRequest("{\"moduleState\": 1", &request));
+  CHECK(!readRequest("{\"moduleState\" 1}", &request));
+  CHECK(!readRequest("{\"moduleType\": \"Floor", &request));
+
+  // A fraction isn't silently truncated into an integer field
+  CHECK(!readRequest("{\"moduleState\": 0.5}", &request));
+  CHECK(!readRequest("{\"interval\": 2.5}", &request));
+  CHECK(readRequest("{\"interval\": 2.0}", &request));
+  CHECK(request.interval == 2);
+}
+
+static void testNumbers() {
+  long value;
+
+  CHECK(readNumber("42", &value) && value == 42);
+  CHECK(readNumber("-7,", &value) && value == -7);
+  CHECK(readNumber("true", &value) && value == 1);
+  CHECK(readNumber("false}", &value) && value == 0);
+
+  // Integers written as floats
+  CHECK(readNumber("2.0", &value) && value == 2);
+  CHECK(readNumber("-3e2", &value) && value == -300);
+  CHECK(readNumber("1.5E1", &value) && value == 15);
+
+  // Fractions and garbage
+  CHECK(!readNumber("2.5", &value));
+  CHECK(!readNumber("-0.1", &value));
+  CHECK(!readNumber("1e-1", &value));
+  CHECK(!readNumber("1e30", &value));
+  CHECK(!readNumber("12a", &value));
+  CHECK(!readNumber("", &value));
+  CHECK(!readNumber("123456789012345678901", &value));
+}
+
+static void testStrings() {
+  char value[16];
+
+  CHECK(readString("\"a\\\"b\\\\c\\/\\n\\t\"", value, sizeof(value)));
+  CHECK(strcmp(value, "a\"b\\c/\n\t") == 0);
+
+  CHECK(readString("\"\\u0041\\u00e9\\u007A\"", value, sizeof(value)));
+  CHECK(strcmp(value, "A?z") == 0);
+
+  // Cut off in the middle of a \u escape, or a short escape
+  CHECK(!readString("\"\\u00", value, sizeof(value)));
+  CHECK(!readString("\"\\u", value, sizeof(value)));
+  CHECK(!readString("\"\\u41\"}", value, sizeof(value)));
+  CHECK(!readString("\"\\u41\", \"x\"", value, sizeof(value)));
+  CHECK(!readString("\"\\uzzzz\"", value, sizeof(value)));
+
+  // Cut off after a backslash or before the closing quote
+  CHECK(!readString("\"abc\\", value, sizeof(value)));
+  CHECK(!readString("\"abc", value, sizeof(value)));
+}
+
+static void testSkip() {
+  StringStream in("{\"a\": {\"b\": [1, 2, {\"c\": \"]\"}]}, \"d\": 3}");
+  JSONReader reader(&in);
+  char key[JSONREADER_KEY_LENGTH];
+  long value;
+
+  CHECK(reader.beginObject());
+  CHECK(reader.nextKey(key, sizeof(key)) && strcmp(key, "a") == 0);
+  CHECK(reader.beginObject());
+  CHECK(reader.getDepth() == 2);
+
+  // Leave the invalid item behind and go on with the next key
+  CHECK(reader.skipTo(1));
+  CHECK(reader.nextKey(key, sizeof(key)) && strcmp(key, "d") == 0);
+  CHECK(reader.readNumber(&value) && value == 3);
+  CHECK(!reader.nextKey(key, sizeof(key)));
+  CHECK(reader.getDepth() == 0);
+}
+
+int main() {
+  testFields();
+  testNumbers();
+  testStrings();
+  testSkip();
+
+  return checkResult();
+}
@@ -0,0 +1,683 @@
+/*
+  JSONWriterTest.cpp - JSONWriter has to print exactly what aJson printed
+  for the same values, the clients parse the old output. Random trees are
+  printed by JSONWriter and by a reference printer which follows the
+  aJsonStream print code (printObject, printArray, printStringPtr,
+  printFloat), and the bytes are compared. A few literal outputs are
+  checked too, so a change to both printers is noticed. --bench prints
+  the GET /modules response of floor heaters both ways: the old aJson
+  tree kept on the heap, updated and printed, against JSONWriter, and
+  reports the peak heap and the bytes per second on the PC.
+*/
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include "Check.h"
+#include "JSONWriter.h"
+
+class StringPrint : public Print
+{
+  public:
+    std::string text;
+
+    size_t write(uint8_t ch) {
+      text += (char) ch;
+      return 1;
+    }
+};
+
+// An aJsonObject: one of the value types below, named if it's an object member
+struct node_t
+{
+  enum { Number, Float, String, Boolean, Array, Object } type;
+  std::string name;
+  long number;
+  double real;
+  std::string text;
+  std::vector<node_t> children;
+};
+
+// Reference, the aJsonStream printing rules
+
+static void refString(std::string *out, const std::string &text) {
+  *out += '"';
+
+  for (size_t i = 0; i < text.size(); i++) {
+    unsigned char ch = text[i];
+
+    if (ch > 31 && ch != '"' && ch != '\\') {
+      *out += ch;
+      continue;
+    }
+
+    *out += '\\';
+
+    switch (ch) {
+      case '\\': *out += '\\'; break;
+      case '"': *out += '"'; break;
+      case '\b': *out += 'b'; break;
+      case '\f': *out += 'f'; break;
+      case '\n': *out += 'n'; break;
+      case '\r': *out += 'r'; break;
+      case '\t': *out += 't'; break;
+      default:
+      {
+        char buffer[6];
+        snprintf(buffer, sizeof(buffer), "u%04x", (unsigned int) ch);
+        *out += buffer;
+      }
+    }
+  }
+
+  *out += '"';
+}
+
+static void refFloat(std::string *out, double d) {
+  char buffer[16];
+
+  if (d < 0.0) {
+    *out += '-';
+    d = -d;
+  }
+
+  unsigned long integer = (unsigned long) d;
+  snprintf(buffer, sizeof(buffer), "%lu.", integer);
+  *out += buffer;
+
+  double fractional = d - (double) integer;
+  int n = 5;
+  fractional += 0.5 / pow(10.0, 5);
+
+  do {
+    fractional *= 10.0;
+    unsigned int digit = (unsigned int) fractional;
+    snprintf(buffer, sizeof(buffer), "%u", digit);
+    *out += buffer;
+    fractional -= (double) digit;
+    n--;
+  } while ((fractional != 0) && (n > 0));
+}
+
+static void refValue(std::string *out, const node_t &node) {
+  char buffer[16];
+
+  switch (node.type) {
+    case node_t::Number:
+      snprintf(buffer, sizeof(buffer), "%ld", node.number);
+      *out += buffer;
+      break;
+    case node_t::Float:
+      refFloat(out, node.real);
+      break;
+    case node_t::String:
+      refString(out, node.text);
+      break;
+    case node_t::Boolean:
+      *out += node.number ? "true" : "false";
+      break;
+    case node_t::Array:
+    case node_t::Object:
+      *out += node.type == node_t::Array ? '[' : '{';
+
+      for (size_t i = 0; i < node.children.size(); i++) {
+        if (node.type == node_t::Object) {
+          refString(out, node.children[i].name);
+          *out += ':';
+        }
+
+        refValue(out, node.children[i]);
+
+        if (i + 1 < node.children.size()) {
+          *out += ',';
+        }
+      }
+
+      *out += node.type == node_t::Array ? ']' : '}';
+      break;
+  }
+}
+
+// The same tree through JSONWriter, the way the modules print their settings
+static void writeValue(JSONWriter *writer, const node_t &node, const char *name) {
+  const __FlashStringHelper *key = name ? F(name) : NULL;
+
+  switch (node.type) {
+    case node_t::Number:
+      writer->addNumber(key, node.number);
+      break;
+    case node_t::Float:
+      writer->addFloat(key, node.real);
+      break;
+    case node_t::String:
+      writer->addString(key, node.text.c_str());
+      break;
+    case node_t::Boolean:
+      writer->addBoolean(key, node.number);
+      break;
+    case node_t::Array:
+    case node_t::Object:
+      if (node.type == node_t::Array) {
+        writer->beginArray(key);
+      } else {
+        writer->beginObject(key);
+      }
+
+      for (size_t i = 0; i < node.children.size(); i++) {
+        writeValue(writer, node.children[i], node.type == node_t::Object ? node.children[i].name.c_str() : NULL);
+      }
+
+      if (node.type == node_t::Array) {
+        writer->endArray();
+      } else {
+        writer->endObject();
+      }
+      break;
+  }
+}
+
+static node_t randomNode(int depth) {
+  node_t node;
+  int type = rand() % (depth < 4 ? 6 : 4);
+
+  // Names are identifiers like the F() names of the modules
+  node.name = "k";
+  node.name += (char) ('a' + rand() % 26);
+  node.name += std::to_string(rand() % 100);
+
+  switch (type) {
+    case 0:
+      node.type = node_t::Number;
+      // aJson keeps an int, so numbers are in the AVR int range
+      node.number = rand() % 65536 - 32768;
+      break;
+    case 1:
+      node.type = node_t::Float;
+      node.real = (rand() % 2 ? -1 : 1) * (rand() % 100000) / pow(10.0, rand() % 6);
+      if (rand() % 4 == 0) {
+        node.real = (float) node.real;
+      }
+      break;
+    case 2:
+      node.type = node_t::String;
+      for (int i = rand() % 12; i > 0; i--) {
+        node.text += (char) (rand() % 4 ? ' ' + rand() % 95 : 1 + rand() % 255);
+      }
+      break;
+    case 3:
+      node.type = node_t::Boolean;
+      node.number = rand() % 2;
+      break;
+    default:
+      node.type = type == 4 ? node_t::Array : node_t::Object;
+      for (int i = rand() % 5; i > 0; i--) {
+        node.children.push_back(randomNode(depth + 1));
+      }
+  }
+
+  return node;
+}
+
+static std::string written(const node_t &node) {
+  StringPrint out;
+  JSONWriter writer(&out);
+
+  writeValue(&writer, node, NULL);
+
+  return out.text;
+}
+
+static void testReference() {
+  srand(1);
+
+  for (int i = 0; i < 2000; i++) {
+    node_t root;
+    std::string expected;
+
+    root.type = node_t::Object;
+
+    for (int j = rand() % 6; j > 0; j--) {
+      root.children.push_back(randomNode(1));
+    }
+
+    refValue(&expected, root);
+    std::string actual = written(root);
+
+    CHECK(actual == expected);
+
+    if (actual != expected) {
+      printf("  expected %s\n  written  %s\n", expected.c_str(), actual.c_str());
+      break;
+    }
+  }
+}
+
+static void testLiterals() {
+  StringPrint out;
+  JSONWriter writer(&out);
+
+  // A FloorHeater-like settings object
+  writer.beginObject();
+  writer.addString(F("moduleType"), F("FloorHeater"));
+  writer.addNumber(F("moduleState"), 1);
+  writer.addFloat(F("setpoint"), 25.0);
+  writer.addFloat(F("t"), -3.14159265);
+  writer.addFloat(F("tMin"), 0.1f);
+  writer.addBoolean(F("on"), false);
+  writer.beginArray(F("schedule"));
+  writer.beginArray();
+  writer.beginObject();
+  writer.addNumber(F("start"), 1536);
+  writer.endObject();
+  writer.beginObject();
+  writer.endObject();
+  writer.endArray();
+  writer.beginArray();
+  writer.endArray();
+  writer.endArray();
+  writer.addString(F("name"), "a\"b\\c\n\x01");
+  writer.endObject();
+
+  CHECK(out.text ==
+    "{\"moduleType\":\"FloorHeater\",\"moduleState\":1,\"setpoint\":25.00000,\"t\":-3.14159,"
+    "\"tMin\":0.10000,\"on\":false,\"schedule\":[[{\"start\":1536},{}],[]],\"name\":\"a\\\"b\\\\c\\n\\u0001\"}");
+
+  // 5 digits after the point, rounded. aJson doesn't carry the rounding
+  // into the integer part, so 99.999999 comes out as 99.100000.
+  StringPrint floats;
+  JSONWriter floatWriter(&floats);
+
+  floatWriter.beginArray();
+  floatWriter.addFloat(NULL, 0.5);
+  floatWriter.addFloat(NULL, 0);
+  floatWriter.addFloat(NULL, 99.999999);
+  floatWriter.addFloat(NULL, -0.000001);
+  floatWriter.endArray();
+
+  CHECK(floats.text == "[0.50000,0.00000,99.100000,-0.00000]");
+}
+
+// aJson before JSONWriter. Each module built its settings as a tree of
+// aJsonObject nodes on the first request and kept it on the heap for good,
+// every request updated the values through getObjectItem() and printed the
+// whole collection. Heap use is counted as on the AVR: a node is 4 pointers,
+// the type and a 4 byte value, each block takes a 2 byte malloc header too.
+struct aJsonObject
+{
+  char *name;
+  aJsonObject *next, *prev, *child;
+  char type;
+  union
+  {
+    char *valuestring;
+    int valueint;
+    double valuefloat;
+  };
+};
+
+static const char aJson_Int = 0;
+static const char aJson_Float = 1;
+static const char aJson_String = 2;
+static const char aJson_Array = 3;
+static const char aJson_Object = 4;
+
+static const unsigned AVRNodeSize = 4 * 2 + 1 + 4;
+static const unsigned AVRMallocHeader = 2;
+static long avrHeap;
+static long avrHeapPeak;
+
+static void avrAllocated(long size) {
+  avrHeap += size + AVRMallocHeader;
+
+  if (avrHeap > avrHeapPeak) {
+    avrHeapPeak = avrHeap;
+  }
+}
+
+static char *ajStrdup(const char *text) {
+  avrAllocated(strlen(text) + 1);
+  return strdup(text);
+}
+
+static aJsonObject *ajCreate(char type) {
+  aJsonObject *item = (aJsonObject *) calloc(1, sizeof(aJsonObject));
+
+  avrAllocated(AVRNodeSize);
+  item->type = type;
+  return item;
+}
+
+static void ajDelete(aJsonObject *item) {
+  while (item) {
+    aJsonObject *next = item->next;
+
+    ajDelete(item->child);
+
+    if (item->name) {
+      avrHeap -= strlen(item->name) + 1 + AVRMallocHeader;
+      free(item->name);
+    }
+
+    if (item->type == aJson_String) {
+      avrHeap -= strlen(item->valuestring) + 1 + AVRMallocHeader;
+      free(item->valuestring);
+    }
+
+    avrHeap -= AVRNodeSize + AVRMallocHeader;
+    free(item);
+    item = next;
+  }
+}
+
+// aJson walks the list to its end on every add
+static void ajAdd(aJsonObject *parent, const char *name, aJsonObject *item) {
+  if (name) {
+    item->name = ajStrdup(name);
+  }
+
+  if (!parent->child) {
+    parent->child = item;
+    return;
+  }
+
+  aJsonObject *last = parent->child;
+
+  while (last->next) {
+    last = last->next;
+  }
+
+  last->next = item;
+  item->prev = last;
+}
+
+static void ajAddInt(aJsonObject *parent, const char *name, int value) {
+  aJsonObject *item = ajCreate(aJson_Int);
+
+  item->valueint = value;
+  ajAdd(parent, name, item);
+}
+
+static void ajAddFloat(aJsonObject *parent, const char *name, double value) {
+  aJsonObject *item = ajCreate(aJson_Float);
+
+  item->valuefloat = value;
+  ajAdd(parent, name, item);
+}
+
+static void ajAddString(aJsonObject *parent, const char *name, const char *value) {
+  aJsonObject *item = ajCreate(aJson_String);
+
+  item->valuestring = ajStrdup(value);
+  ajAdd(parent, name, item);
+}
+
+static aJsonObject *ajGet(aJsonObject *object, const char *name) {
+  aJsonObject *item = object->child;
+
+  while (item && strcasecmp(item->name, name)) {
+    item = item->next;
+  }
+
+  return item;
+}
+
+// The aJsonStream printing rules, a character at a time
+static void ajPrint(Print *out, aJsonObject *item) {
+  std::string text;
+  char buffer[16];
+
+  switch (item->type) {
+    case aJson_Int:
+      snprintf(buffer, sizeof(buffer), "%d", item->valueint);
+      text = buffer;
+      break;
+    case aJson_Float:
+      refFloat(&text, item->valuefloat);
+      break;
+    case aJson_String:
+      refString(&text, item->valuestring);
+      break;
+    default:
+      out->write(item->type == aJson_Array ? '[' : '{');
+
+      for (aJsonObject *child = item->child; child; child = child->next) {
+        if (item->type == aJson_Object) {
+          std::string name;
+
+          refString(&name, child->name);
+
+          for (size_t i = 0; i < name.size(); i++) {
+            out->write(name[i]);
+          }
+
+          out->write(':');
+        }
+
+        ajPrint(out, child);
+
+        if (child->next) {
+          out->write(',');
+        }
+      }
+
+      out->write(item->type == aJson_Array ? ']' : '}');
+      return;
+  }
+
+  for (size_t i = 0; i < text.size(); i++) {
+    out->write(text[i]);
+  }
+}
+
+// FloorHeater::getJSONSettings() with aJson: the first call builds the
+// item, the next ones update the values which change
+static void ajFloorHeater(aJsonObject *collection, uint8_t id, double t) {
+  aJsonObject *item = collection->child;
+
+  for (uint8_t i = 1; item && (i < id); i++) {
+    item = item->next;
+  }
+
+  if (!item) {
+    item = ajCreate(aJson_Object);
+    ajAdd(collection, NULL, item);
+  }
+
+  if (!ajGet(item, "moduleType")) {
+    ajAddInt(item, "id", id);
+    ajAddString(item, "moduleType", "FloorHeater");
+    ajAddInt(item, "moduleState", 1);
+    ajAddInt(item, "zoneId", id);
+    ajAddInt(item, "driveMode", 2);
+    ajAddInt(item, "deviceState", 0);
+    ajAddFloat(item, "setpoint", 25.5);
+    ajAddFloat(item, "t", t);
+    ajAddFloat(item, "tMin", 18);
+    ajAddFloat(item, "tMax", 29);
+    ajAddString(item, "lastTuning", "1792224000");
+    ajAddInt(item, "tuningTimedOut", 0);
+
+    aJsonObject *schedule = ajCreate(aJson_Array);
+
+    for (uint8_t i = 0; i < 7; i++) {
+      aJsonObject *day = ajCreate(aJson_Array);
+
+      ajAdd(schedule, NULL, day);
+
+      for (uint8_t j = 0; j < 3; j++) {
+        aJsonObject *period = ajCreate(aJson_Object);
+
+        ajAdd(day, NULL, period);
+        ajAddInt(period, "start", 600 + j * 480);
+        ajAddInt(period, "end", 900 + j * 480);
+        ajAddInt(period, "t", 22 + j);
+      }
+    }
+
+    ajAdd(item, "schedule", schedule);
+    return;
+  }
+
+  ajGet(item, "moduleState")->valueint = 1;
+  ajGet(item, "driveMode")->valueint = 2;
+  ajGet(item, "deviceState")->valueint = 0;
+  ajGet(item, "setpoint")->valuefloat = 25.5;
+  ajGet(item, "t")->valuefloat = t;
+
+  aJsonObject *lastTuning = ajGet(item, "lastTuning");
+  avrHeap -= strlen(lastTuning->valuestring) + 1 + AVRMallocHeader;
+  free(lastTuning->valuestring);
+  lastTuning->valuestring = ajStrdup("1792224000");
+
+  aJsonObject *day = ajGet(item, "schedule")->child;
+
+  for (uint8_t i = 0; day; i++, day = day->next) {
+    aJsonObject *period = day->child;
+
+    for (uint8_t j = 0; period; j++, period = period->next) {
+      ajGet(period, "start")->valueint = 600 + j * 480;
+      ajGet(period, "end")->valueint = 900 + j * 480;
+      ajGet(period, "t")->valueint = 22 + j;
+    }
+  }
+}
+
+// The same module through JSONWriter, FloorHeater::printJSONSettings()
+static void printFloorHeater(JSONWriter *writer, uint8_t id, double t) {
+  writer->beginObject();
+  writer->addNumber(F("id"), id);
+  writer->addString(F("moduleType"), "FloorHeater");
+  writer->addNumber(F("moduleState"), 1);
+  writer->addNumber(F("zoneId"), id);
+  writer->addNumber(F("driveMode"), 2);
+  writer->addNumber(F("deviceState"), 0);
+  writer->addFloat(F("setpoint"), 25.5);
+  writer->addFloat(F("t"), t);
+  writer->addFloat(F("tMin"), 18);
+  writer->addFloat(F("tMax"), 29);
+  writer->addString(F("lastTuning"), "1792224000");
+  writer->addNumber(F("tuningTimedOut"), 0);
+
+  writer->beginArray(F("schedule"));
+
+  for (uint8_t i = 0; i < 7; i++) {
+    writer->beginArray();
+
+    for (uint8_t j = 0; j < 3; j++) {
+      writer->beginObject();
+      writer->addNumber(F("start"), 600 + j * 480);
+      writer->addNumber(F("end"), 900 + j * 480);
+      writer->addNumber(F("t"), 22 + j);
+      writer->endObject();
+    }
+
+    writer->endArray();
+  }
+
+  writer->endArray();
+  writer->endObject();
+}
+
+// Counts the bytes like the socket would take them
+class CountingPrint : public Print
+{
+  public:
+    CountingPrint() : length(0) {}
+
+    size_t write(uint8_t ch) {
+      length++;
+      return 1;
+    }
+
+    unsigned long length;
+};
+
+static const uint8_t BenchModules = 8;
+static const unsigned long BenchRequests = 20000;
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void bench() {
+  aJsonObject *collection;
+  CountingPrint ajOut;
+  CountingPrint writerOut;
+  StringPrint ajText;
+  StringPrint writerText;
+
+  avrHeap = 0;
+  avrHeapPeak = 0;
+  collection = ajCreate(aJson_Array);
+
+  // Both print the same bytes
+  for (uint8_t id = 1; id <= BenchModules; id++) {
+    ajFloorHeater(collection, id, 23.1875);
+  }
+
+  ajPrint(&ajText, collection);
+
+  {
+    JSONWriter writer(&writerText);
+
+    writer.beginArray();
+
+    for (uint8_t id = 1; id <= BenchModules; id++) {
+      printFloorHeater(&writer, id, 23.1875);
+    }
+
+    writer.endArray();
+  }
+
+  CHECK(ajText.text == writerText.text);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (unsigned long i = 0; i < BenchRequests; i++) {
+    for (uint8_t id = 1; id <= BenchModules; id++) {
+      ajFloorHeater(collection, id, 20 + (i % 100) / 10.0);
+    }
+
+    ajPrint(&ajOut, collection);
+  }
+
+  double ajSeconds = secondsSince(start);
+
+  start = std::chrono::steady_clock::now();
+
+  for (unsigned long i = 0; i < BenchRequests; i++) {
+    JSONWriter writer(&writerOut);
+
+    writer.beginArray();
+
+    for (uint8_t id = 1; id <= BenchModules; id++) {
+      printFloorHeater(&writer, id, 20 + (i % 100) / 10.0);
+    }
+
+    writer.endArray();
+  }
+
+  double writerSeconds = secondsSince(start);
+
+  printf("%u floor heaters, %u bytes a response\n", BenchModules, (unsigned) writerText.text.size());
+  printf("aJson\tpeak heap %ld bytes (%ld per module)\t%.1f MB/s\n", avrHeapPeak, avrHeapPeak / BenchModules,
+         ajOut.length / ajSeconds / 1e6);
+  printf("JSONWriter\tpeak heap 0 bytes\t%.1f MB/s\n", writerOut.length / writerSeconds / 1e6);
+
+  CHECK(ajOut.length == writerOut.length);
+
+  ajDelete(collection);
+  CHECK(avrHeap == 0);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && !strcmp(argv[1], "--bench")) {
+    bench();
+    return checkResult();
+  }
+
+  testReference();
+  testLiterals();
+
+  return checkResult();
+}
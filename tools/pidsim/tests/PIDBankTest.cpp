@@ -0,0 +1,141 @@
+/*
+  PIDBankTest.cpp - Runs PIDBank lanes and separate PID controllers with
+  the same gains on the same readings, the outputs have to be the same.
+  Built once per lane count, --bench times an update of all the loops:
+  one run() of the bank against a doControl() call per PID object.
+*/
+
+#include <chrono>
+#include "Check.h"
+#include "PID.h"
+#include "PIDBank.h"
+
+static const uint16_t TimeStep = 1000;
+static const unsigned long Steps = 2000;
+static const unsigned long BenchSteps = 200000;
+
+static float input[PIDBANK_MAX_LANES];
+static float setpoint[PIDBANK_MAX_LANES];
+static float bankOutput[PIDBANK_MAX_LANES];
+static float pidOutput[PIDBANK_MAX_LANES];
+static PID *pids[PIDBANK_MAX_LANES];
+
+// Gains and limits of the FloorHeater loops, a bit different per lane
+static void setUp(PIDBank *bank) {
+  for (uint8_t i = 0; i < PIDBANK_MAX_LANES; i++) {
+    float kP = 400 + 50 * (i % 4);
+    float kI = 0.001 + 0.0002 * (i % 3);
+    float kD = (i % 2) ? 20000 : 0;
+
+    input[i] = 20;
+    setpoint[i] = 24 + (i % 5) * 0.5;
+    bankOutput[i] = 0;
+    pidOutput[i] = 0;
+
+    CHECK(bank->addLane(&input[i], &bankOutput[i], &setpoint[i], 0, 10000) == i);
+    bank->setKs(i, kP, kI, kD);
+    bank->setActive(i, true);
+
+    pids[i] = new PID(kP, kI, kD, &input[i], &pidOutput[i], 0, 10000, &setpoint[i], TimeStep, true);
+  }
+
+  CHECK(bank->getLaneCount() == PIDBANK_MAX_LANES);
+}
+
+static void tearDown() {
+  for (uint8_t i = 0; i < PIDBANK_MAX_LANES; i++) {
+    delete pids[i];
+  }
+}
+
+// Readings move towards the output, like a slow floor, plus a wobble
+static void updateInputs(unsigned long step) {
+  for (uint8_t i = 0; i < PIDBANK_MAX_LANES; i++) {
+    input[i] += (bankOutput[i] / 10000 * 10 + 18 - input[i]) * 0.01 + ((step + i) % 7 - 3) * 0.01;
+  }
+}
+
+static void testSameOutput() {
+  PIDBank bank(TimeStep);
+  float maxDifference = 0;
+
+  simMillis = 1000000;
+  setUp(&bank);
+
+  for (unsigned long step = 0; step < Steps; step++) {
+    simMillis += TimeStep;
+    updateInputs(step);
+
+    bank.run();
+
+    for (uint8_t i = 0; i < PIDBANK_MAX_LANES; i++) {
+      CHECK(pids[i]->doControl());
+      maxDifference = max(maxDifference, fabsf(bankOutput[i] - pidOutput[i]));
+    }
+  }
+
+  // Only the order of the float operations differs
+  CHECK(maxDifference < 0.01);
+
+  // An inactive lane keeps its output
+  float output = bankOutput[0];
+  bank.setActive(0, false);
+  simMillis += TimeStep;
+  updateInputs(0);
+  bank.run();
+  CHECK(bankOutput[0] == output);
+
+  tearDown();
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void bench() {
+  PIDBank bank(TimeStep);
+
+  simMillis = 1000000;
+  setUp(&bank);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (unsigned long step = 0; step < BenchSteps; step++) {
+    simMillis += TimeStep;
+    input[step % PIDBANK_MAX_LANES] += 0.001;
+    bank.run();
+  }
+
+  double bankTime = secondsSince(start);
+
+  start = std::chrono::steady_clock::now();
+
+  for (unsigned long step = 0; step < BenchSteps; step++) {
+    simMillis += TimeStep;
+    input[step % PIDBANK_MAX_LANES] += 0.001;
+
+    for (uint8_t i = 0; i < PIDBANK_MAX_LANES; i++) {
+      pids[i]->doControl();
+    }
+  }
+
+  double pidTime = secondsSince(start);
+
+  printf("lanes %u\tPIDBank %.1f ns\tPID objects %.1f ns\tper update of all the loops\n", PIDBANK_MAX_LANES,
+         bankTime * 1e9 / BenchSteps, pidTime * 1e9 / BenchSteps);
+
+  tearDown();
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && !strcmp(argv[1], "--bench")) {
+    bench();
+    return 0;
+  }
+
+  printf("lanes %u\n", PIDBANK_MAX_LANES);
+
+  testSameOutput();
+
+  return checkResult();
+}
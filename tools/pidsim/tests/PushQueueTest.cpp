@@ -0,0 +1,387 @@
+/*
+  PushQueueTest.cpp - Runs PushQueue against a stand-in notification
+  server behind simulated W5200 sockets with a fixed network latency.
+  Measures notifications per second, connections and sockets in use with
+  a keep-alive server and with a server which closes every connection
+  (one connection per notification, as before pipelining), and checks
+  chunked responses, retries and connections closed by the server.
+*/
+
+#include <algorithm>
+#include <string>
+#include <deque>
+#include <vector>
+#include "Check.h"
+#include "PushQueue.h"
+#include "utility/socket.h"
+
+// Server behaviour
+static const uint8_t ServerKeepAlive = 0;   // HTTP/1.1, Content-Length
+static const uint8_t ServerChunked = 1;     // HTTP/1.1, chunked body
+static const uint8_t ServerClose = 2;       // HTTP/1.0, body until the connection is closed
+static const uint8_t ServerError = 3;       // 500 to every request
+static const uint8_t ServerRefused = 4;     // Connections are reset
+
+struct server_t
+{
+  uint8_t mode;
+  unsigned long rtt;            // Network round trip (ms)
+  unsigned long processTime;    // Server time per request (ms)
+  unsigned long closeAfter;     // Keep-alive server closes the connection after this many responses, 0 never
+};
+
+struct event_t
+{
+  unsigned long time;
+  uint8_t status;               // New socket status, or data if it's 0xFF
+  std::string data;
+};
+
+static const uint8_t DataEvent = 0xFF;
+
+struct simSocket_t
+{
+  uint8_t status;
+  std::deque<event_t> events;   // Waiting to happen, in time order
+  std::string received;         // Arrived and not read yet
+  std::string request;          // Sent and not parsed yet
+  unsigned long responses;      // Responses sent on the connection
+  unsigned long serverTime;     // Time the server is done with the last request
+  boolean serverClosed;
+};
+
+static server_t server;
+static simSocket_t sockets[MAX_SOCK_NUM];
+static std::vector<int> requests;           // Module ids in the order the server got them
+static unsigned long connections;
+static uint8_t socketsUsed;
+static uint8_t socketsUsedMax;
+
+W5100Class W5100;
+
+void useDevice(uint8_t deviceId) {}
+
+// Apply the events which are due
+static void update(SOCKET sock) {
+  simSocket_t *s = &sockets[sock];
+
+  while (!s->events.empty() && (s->events.front().time <= simMillis)) {
+    event_t *event = &s->events.front();
+
+    if (event->status == DataEvent) {
+      s->received += event->data;
+    } else {
+      s->status = event->status;
+    }
+
+    s->events.pop_front();
+  }
+}
+
+static void schedule(SOCKET sock, unsigned long time, uint8_t status, const std::string &data = "") {
+  event_t event;
+  event.time = time;
+  event.status = status;
+  event.data = data;
+
+  std::deque<event_t> *events = &sockets[sock].events;
+  std::deque<event_t>::iterator i = events->end();
+
+  while ((i != events->begin()) && ((i - 1)->time > time)) {
+    i--;
+  }
+
+  events->insert(i, event);
+}
+
+static std::string response() {
+  switch (server.mode) {
+    case ServerChunked:
+      return "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nsuc\r\n4\r\ncess\r\n0\r\n\r\n";
+    case ServerClose:
+      return "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\nsuccess";
+    case ServerError:
+      return "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 5\r\n\r\nerror";
+  }
+
+  return "HTTP/1.1 200 OK\r\nContent-Length: 7\r\n\r\nsuccess";
+}
+
+// The server answers complete requests one by one in the order they come
+static void serve(SOCKET sock) {
+  simSocket_t *s = &sockets[sock];
+  size_t end;
+
+  while (!s->serverClosed && ((end = s->request.find("\r\n\r\n")) != std::string::npos)) {
+    std::string request = s->request.substr(0, end + 4);
+    s->request.erase(0, end + 4);
+
+    int moduleId = -1;
+    sscanf(request.c_str(), "GET /push/1/%d HTTP/1.1\r\nHost: ", &moduleId);
+    CHECK(request.find("\r\nHost: 192.168.1.2\r\n") != std::string::npos);
+    requests.push_back(moduleId);
+
+    unsigned long arrival = simMillis + server.rtt / 2;
+    s->serverTime = ((s->serverTime > arrival) ? s->serverTime : arrival) + server.processTime;
+    unsigned long time = s->serverTime + server.rtt / 2;
+
+    schedule(sock, time, DataEvent, response());
+    s->responses++;
+
+    if ((server.mode == ServerClose) || (server.closeAfter && (s->responses >= server.closeAfter))) {
+      schedule(sock, time, SnSR::CLOSE_WAIT);
+      s->serverClosed = true;
+    }
+  }
+}
+
+uint8_t W5100Class::readSnSR(SOCKET sock) {
+  update(sock);
+  return sockets[sock].status;
+}
+
+int EthernetClient::available() {
+  update(_sock);
+  return sockets[_sock].received.size();
+}
+
+int EthernetClient::read() {
+  update(_sock);
+
+  if (sockets[_sock].received.empty()) {
+    return -1;
+  }
+
+  uint8_t ch = sockets[_sock].received[0];
+  sockets[_sock].received.erase(0, 1);
+  return ch;
+}
+
+uint8_t socket(SOCKET sock, uint8_t protocol, uint16_t port, uint8_t flag) {
+  simSocket_t *s = &sockets[sock];
+
+  s->status = SnSR::INIT;
+  s->events.clear();
+  s->received.clear();
+  s->request.clear();
+  s->responses = 0;
+  s->serverTime = 0;
+  s->serverClosed = false;
+  return 1;
+}
+
+uint8_t connect(SOCKET sock, uint8_t *addr, uint16_t port) {
+  CHECK((addr[0] == 192) && (addr[3] == 2) && (port == 8080));
+
+  sockets[sock].status = SnSR::SYNSENT;
+  schedule(sock, simMillis + server.rtt, (server.mode == ServerRefused) ? SnSR::CLOSED : SnSR::ESTABLISHED);
+  connections++;
+  return 1;
+}
+
+void disconnect(SOCKET sock) {
+  simSocket_t *s = &sockets[sock];
+
+  update(sock);
+  s->events.clear();
+  s->status = (s->status == SnSR::CLOSE_WAIT) ? SnSR::LAST_ACK : SnSR::FIN_WAIT;
+  schedule(sock, simMillis + server.rtt, SnSR::CLOSED);
+}
+
+void close(SOCKET sock) {
+  sockets[sock].status = SnSR::CLOSED;
+  sockets[sock].events.clear();
+}
+
+uint16_t send(SOCKET sock, const uint8_t *buffer, uint16_t length) {
+  update(sock);
+
+  if (sockets[sock].status == SnSR::ESTABLISHED) {
+    sockets[sock].request.append((const char *)buffer, length);
+    serve(sock);
+  }
+
+  return length;
+}
+
+static void reset(uint8_t mode, unsigned long closeAfter = 0) {
+  server.mode = mode;
+  server.rtt = 20;
+  server.processTime = 5;
+  server.closeAfter = closeAfter;
+
+  for (uint8_t i = 0; i < MAX_SOCK_NUM; i++) {
+    sockets[i].status = SnSR::CLOSED;
+    sockets[i].events.clear();
+  }
+
+  requests.clear();
+  connections = 0;
+  socketsUsedMax = 0;
+  simMillis = 1000;
+}
+
+// Calls run() the way the scheduler does. push() wakes the task up,
+// so it never sleeps longer than the polling interval here.
+static void step(PushQueue *queue) {
+  unsigned long wait = queue->run();
+
+  socketsUsed = 0;
+
+  for (uint8_t i = 0; i < MAX_SOCK_NUM; i++) {
+    if (sockets[i].status != SnSR::CLOSED) {
+      socketsUsed++;
+    }
+  }
+
+  if (socketsUsed > socketsUsedMax) {
+    socketsUsedMax = socketsUsed;
+  }
+
+  simMillis += (wait < PushPollTime) ? wait : PushPollTime;
+}
+
+static void runFor(PushQueue *queue, unsigned long time) {
+  unsigned long start = simMillis;
+
+  while (simMillis - start < time) {
+    step(queue);
+  }
+}
+
+static void begin(PushQueue *queue) {
+  queue->setServer(IPAddress(192, 168, 1, 2), 8080, "/push", "");
+}
+
+// Keeps notifications for 32 modules queued for a minute, returns
+// notifications sent per second. Room is left for the requests which
+// are put back when a server turns out to close connections.
+static double measure(uint8_t mode, const char *name, pushStats_t *stats) {
+  PushQueue queue;
+  unsigned long pushed = 0;
+  unsigned long duration = 60000;
+  unsigned long start;
+
+  reset(mode);
+  begin(&queue);
+  start = simMillis;
+
+  while (simMillis - start < duration) {
+    while (queue.getDepth() < PushQueueSize - PushPipelineDepth) {
+      CHECK(queue.push(pushed++ % 32));
+    }
+    step(&queue);
+  }
+
+  double rate = queue.stats.sent * 1000.0 / duration;
+
+  printf("%s\t%.1f notifications/s\t%lu connections\t%u sockets max\trtt %lu ms max\n", name,
+         rate, connections, socketsUsedMax, queue.stats.rttMax);
+
+  CHECK(queue.stats.failures == 0);
+  CHECK(queue.stats.drops == 0);
+  CHECK(queue.stats.coalesced == 0);
+  CHECK(socketsUsedMax == 1);
+
+  // Every response the queue has read is a notification the server got
+  CHECK(requests.size() >= queue.stats.sent);
+
+  *stats = queue.stats;
+  return rate;
+}
+
+static void testThroughput() {
+  pushStats_t stats;
+  double keepAlive = measure(ServerKeepAlive, "keep-alive", &stats);
+
+  CHECK(connections == 1);
+  CHECK(stats.connects == 1);
+
+  // A connection per notification: 3 round trips (connect, request, close)
+  // instead of a round trip per PushPipelineDepth notifications
+  double close = measure(ServerClose, "close", &stats);
+
+  CHECK(connections >= stats.sent);
+  CHECK(keepAlive > close * 4);
+}
+
+// Pushes the modules once and runs until the queue is idle
+static void sendAll(PushQueue *queue, uint8_t count, unsigned long time = 20000) {
+  for (uint8_t i = 0; i < count; i++) {
+    CHECK(queue->push(i));
+  }
+
+  runFor(queue, time);
+}
+
+static void testChunked() {
+  PushQueue queue;
+
+  reset(ServerChunked);
+  begin(&queue);
+  sendAll(&queue, 6);
+
+  CHECK(queue.stats.sent == 6);
+  CHECK(requests.size() == 6);
+  CHECK(connections == 1);
+  CHECK(queue.getDepth() == 0);
+}
+
+// The connection is closed by the server in the middle of a pipeline,
+// the requests left unanswered are sent again on a new one
+static void testServerClose() {
+  PushQueue queue;
+
+  reset(ServerKeepAlive, 3);
+  begin(&queue);
+  sendAll(&queue, 8, 60000);
+
+  CHECK(queue.stats.sent == 8);
+  CHECK(queue.stats.failures == 0);
+  CHECK(connections >= 3);
+
+  // Resent requests may reach the server twice, but none is lost
+  for (int moduleId = 0; moduleId < 8; moduleId++) {
+    CHECK(std::find(requests.begin(), requests.end(), moduleId) != requests.end());
+  }
+
+  // The idle connection is closed by the server too
+  reset(ServerKeepAlive, 1);
+  sendAll(&queue, 1);
+  sendAll(&queue, 1);
+  CHECK(queue.stats.sent == 10);
+  CHECK(connections == 2);
+}
+
+// Notifications the server rejects are retried PushMaxRetries times,
+// then dropped, other modules get through meanwhile
+static void testRetries() {
+  PushQueue queue;
+
+  reset(ServerError);
+  begin(&queue);
+  sendAll(&queue, 1, 120000);
+
+  CHECK(queue.stats.sent == 0);
+  CHECK(queue.stats.failures == 1);
+  CHECK(requests.size() == PushMaxRetries + 1u);
+  CHECK(queue.getDepth() == 0);
+
+  // The retry delay doubles up to 32 s, so both take 2.5 minutes
+  reset(ServerRefused);
+  begin(&queue);
+  sendAll(&queue, 2, 240000);
+
+  CHECK(queue.stats.failures == 3);
+  CHECK(queue.getDepth() == 0);
+  CHECK(socketsUsed == 0);
+}
+
+int main() {
+  testThroughput();
+  testChunked();
+  testServerClose();
+  testRetries();
+
+  return checkResult();
+}
@@ -0,0 +1,535 @@
+/*
+  SensorLogTest.cpp - Runs SensorLog on a stand-in SD card which holds the
+  log file and counts the block reads. Readings are logged round the ring a
+  few times with restarts on the way: each restart has to find the end of
+  the log with the binary search over the block headers, and the records
+  kept on the card have to follow on from each other. Time lookups have to
+  give the blocks a scan of the whole log gives, with a few block reads.
+  Blocks not written yet have to come from RAM, records have to be dropped
+  when the staging blocks are full and kept when a card write fails.
+  Built once per number of staging blocks, with a small log file.
+*/
+
+#include "Check.h"
+#include "CRC.h"
+#include "SensorLog.h"
+
+// The log file comes after the directory and the FAT
+static const uint32_t FileStart = 8;
+static const uint32_t CardBlocks = FileStart + SENSORLOG_FILE_BLOCKS;
+static const uint16_t IndexStep = SENSORLOG_FILE_BLOCKS / SENSORLOG_INDEX_SIZE;
+
+struct card_t
+{
+  boolean hasFile;
+  uint32_t fileSize;
+  uint8_t blocks[CardBlocks][512];
+  boolean canErase;             // Some cards can't erase a range, the log clears it with writes
+  boolean failWrites;
+  uint32_t writeBlock;          // Next block of a multi-block write, 0 if none
+  uint32_t writeEnd;
+  unsigned long reads;
+  unsigned long writes;         // Write commands, a multi-block write is one
+  unsigned long blocksWritten;
+};
+
+static card_t sdCard;
+
+// HiveStorage.cpp and DeviceDispatch.cpp
+uint8_t StorageType = SDStorage;
+SdFat sd;
+
+void useDevice(uint8_t deviceId) {}
+
+static boolean inFile(uint32_t block) {
+  return sdCard.hasFile && (block >= FileStart) && (block < FileStart + sdCard.fileSize / 512);
+}
+
+bool Sd2Card::readBlock(uint32_t block, uint8_t *dst) {
+  CHECK(inFile(block));
+  sdCard.reads++;
+  memcpy(dst, sdCard.blocks[block], 512);
+  return true;
+}
+
+bool Sd2Card::writeBlock(uint32_t block, const uint8_t *src) {
+  CHECK(inFile(block) && (sdCard.writeBlock == 0));
+
+  if (sdCard.failWrites) {
+    return false;
+  }
+
+  sdCard.writes++;
+  sdCard.blocksWritten++;
+  memcpy(sdCard.blocks[block], src, 512);
+  return true;
+}
+
+bool Sd2Card::writeStart(uint32_t blockNumber, uint32_t eraseCount) {
+  CHECK(inFile(blockNumber) && inFile(blockNumber + eraseCount - 1) && (sdCard.writeBlock == 0));
+
+  if (sdCard.failWrites) {
+    return false;
+  }
+
+  sdCard.writes++;
+  sdCard.writeBlock = blockNumber;
+  sdCard.writeEnd = blockNumber + eraseCount;
+  return true;
+}
+
+bool Sd2Card::writeData(const uint8_t *src) {
+  CHECK((sdCard.writeBlock > 0) && (sdCard.writeBlock < sdCard.writeEnd));
+  sdCard.blocksWritten++;
+  memcpy(sdCard.blocks[sdCard.writeBlock++], src, 512);
+  return true;
+}
+
+bool Sd2Card::writeStop() {
+  sdCard.writeBlock = 0;
+  return true;
+}
+
+// Erased blocks read as all ones
+bool Sd2Card::erase(uint32_t firstBlock, uint32_t lastBlock) {
+  CHECK(inFile(firstBlock) && inFile(lastBlock));
+
+  if (!sdCard.canErase) {
+    return false;
+  }
+
+  memset(sdCard.blocks[firstBlock], 0xFF, (lastBlock - firstBlock + 1) * 512);
+  return true;
+}
+
+bool SdBaseFile::open(const char *path, uint8_t oflag) {
+  CHECK(!strcmp(path, SENSORLOG_FILE_NAME));
+  _open = sdCard.hasFile;
+  return _open;
+}
+
+bool SdBaseFile::close() {
+  _open = false;
+  return true;
+}
+
+bool SdBaseFile::remove() {
+  CHECK(_open);
+  sdCard.hasFile = false;
+  _open = false;
+  return true;
+}
+
+uint32_t SdBaseFile::fileSize() const { return sdCard.fileSize; }
+
+bool SdBaseFile::contiguousRange(uint32_t *bgnBlock, uint32_t *endBlock) {
+  *bgnBlock = FileStart;
+  *endBlock = FileStart + sdCard.fileSize / 512 - 1;
+  return _open;
+}
+
+// A new file gets the blocks of the deleted one, with their old data
+bool SdBaseFile::createContiguous(SdBaseFile *dirFile, const char *path, uint32_t size) {
+  CHECK(!sdCard.hasFile && (size <= SENSORLOG_FILE_BLOCKS * 512));
+  sdCard.hasFile = true;
+  sdCard.fileSize = size;
+  _open = true;
+  return true;
+}
+
+// Every restart gets a new log object, like the RAM of a node after a reset
+static const uint8_t MaxBoots = 64;
+static SensorLog logs[MaxBoots];
+static uint8_t bootCount = 0;
+
+static unsigned long wakes = 0;
+static unsigned long logDue = 0;
+
+// Records carry their number as the value, so lost records can be told
+static unsigned long appended = 0;
+
+static void wakeLog() {
+  wakes++;
+}
+
+static SensorLog *restart() {
+  CHECK(bootCount < MaxBoots);
+
+  SensorLog *log = &logs[bootCount++ % MaxBoots];
+
+  CHECK(log->begin());
+  log->setWakeHandler(&wakeLog);
+  logDue = simMillis;
+  return log;
+}
+
+// The log task runs when a filled block wakes it or when its delay is over
+static void runLog(SensorLog *log) {
+  if (wakes || ((long) (simMillis - logDue) >= 0)) {
+    wakes = 0;
+    logDue = simMillis + log->run();
+  }
+}
+
+// A reading from one of a few modules every interval (ms)
+static void logReadings(SensorLog *log, unsigned long count, unsigned long interval) {
+  for (unsigned long i = 0; i < count; i++) {
+    simMillis += interval;
+    CHECK(log->append(appended % 4 + 1, SENSORLOG_TEMPERATURE, appended));
+    appended++;
+    runLog(log);
+  }
+}
+
+// Let the last records go to the card before the power goes off
+static void flush(SensorLog *log) {
+  simMillis += SENSORLOG_FLUSH_DELAY;
+  runLog(log);
+}
+
+// Log time of a record (ms)
+static unsigned long long recordTime(const sensorLogBlock_t *block, uint8_t i) {
+  return block->header.time * 1000ULL + block->records[i].time;
+}
+
+// Oldest and newest blocks on the card, scanned over the whole ring.
+// The head block has to be written, or the block it's going to be
+// written over would still be found.
+static boolean scanLog(SensorLog *log, uint32_t *oldest, uint32_t *newest) {
+  sensorLogBlock_t buffer;
+  boolean found = false;
+
+  for (uint32_t position = 0; position < SENSORLOG_FILE_BLOCKS; position++) {
+    const sensorLogBlock_t *block = (const sensorLogBlock_t *)sdCard.blocks[FileStart + position];
+
+    if ((block->header.magic != SENSORLOG_MAGIC) || (log->getBlock(block->header.seq, &buffer) == NULL)) {
+      continue;
+    }
+
+    if (!found || (block->header.seq < *oldest)) {
+      *oldest = block->header.seq;
+    }
+
+    if (!found || (block->header.seq > *newest)) {
+      *newest = block->header.seq;
+    }
+
+    found = true;
+  }
+
+  return found;
+}
+
+// Block reads of a binary search over count blocks
+static unsigned long searchReads(uint32_t count) {
+  unsigned long reads = 0;
+
+  while ((1UL << reads) < count) {
+    reads++;
+  }
+
+  return reads;
+}
+
+static void erase() {
+  memset(&sdCard, 0xA5, sizeof(sdCard));
+  sdCard.hasFile = false;
+  sdCard.fileSize = 0;
+  sdCard.canErase = true;
+  sdCard.failWrites = false;
+  sdCard.writeBlock = 0;
+  sdCard.reads = 0;
+  sdCard.writes = 0;
+  sdCard.blocksWritten = 0;
+  appended = 0;
+  simMillis = 1000;
+}
+
+// A new log on a card with old data in its blocks, whether the card erases them or not
+static void testCreate(boolean canErase) {
+  sensorLogBlock_t buffer;
+  uint32_t first, last;
+
+  erase();
+  sdCard.canErase = canErase;
+
+  SensorLog *log = restart();
+
+  CHECK(log->isActive());
+  CHECK(sdCard.fileSize == SENSORLOG_FILE_BLOCKS * 512);
+  CHECK(sdCard.blocksWritten == (canErase ? 0 : SENSORLOG_FILE_BLOCKS));
+  CHECK(!log->findBlocks(0, 100, &first, &last, &buffer));
+
+  logReadings(log, 10, 100);
+
+  // The head block comes from RAM until the flush delay is over
+  const sensorLogBlock_t *block = log->getBlock(0, &buffer);
+
+  CHECK(block && (block != &buffer) && (block->header.count == 10) && (block->header.boot == 0));
+  CHECK(block && crc8Check((const uint8_t *)&block->header, sizeof(sensorLogHeader_t)));
+  CHECK(sdCard.writes == (canErase ? 0 : 1));
+
+  // The head block stays in RAM after it's written, as records go on into it
+  flush(log);
+  block = (const sensorLogBlock_t *)sdCard.blocks[FileStart];
+
+  CHECK(sdCard.writes == (canErase ? 1 : 2));
+  CHECK((block->header.count == 10) && (block->records[9].value == 9));
+  CHECK(log->findBlocks(0, log->getTime(), &first, &last, &buffer) && (first == 0) && (last == 0));
+}
+
+// A log with a block from a restart, the old log blocks left on the card
+// when the file was deleted don't count
+static void testStartOver() {
+  sensorLogBlock_t buffer;
+  uint32_t first, last;
+
+  erase();
+
+  SensorLog *log = restart();
+
+  logReadings(log, SENSORLOG_RECORDS * 5, 100);
+  flush(log);
+
+  // The file is deleted, then made again, the card can't erase it
+  sdCard.hasFile = false;
+  sdCard.canErase = false;
+  log = restart();
+
+  CHECK(!log->findBlocks(0, log->getTime(), &first, &last, &buffer));
+
+  logReadings(log, SENSORLOG_RECORDS * 2 + 5, 100);
+  flush(log);
+
+  CHECK(log->findBlocks(0, log->getTime(), &first, &last, &buffer) && (first == 0) && (last == 2));
+
+  // A file of another size is started over too
+  sdCard.fileSize = SENSORLOG_FILE_BLOCKS * 256;
+  log = restart();
+
+  CHECK(sdCard.fileSize == SENSORLOG_FILE_BLOCKS * 512);
+  CHECK(!log->findBlocks(0, log->getTime(), &first, &last, &buffer));
+}
+
+// Three passes round the ring with restarts in the middle of blocks. After
+// each restart the log has to go on from the block after the last one with
+// a later time, and all the records kept have to follow on from each other.
+static void testRecover() {
+  sensorLogBlock_t buffer;
+  uint32_t first, last, oldest, newest;
+  unsigned long maxReads = 0;
+
+  erase();
+
+  SensorLog *log = restart();
+  uint16_t boots = 0;
+
+  newest = 0;
+
+  while (newest < SENSORLOG_FILE_BLOCKS * 3) {
+    logReadings(log, SENSORLOG_RECORDS * 7 + 13, 300);
+    flush(log);
+    CHECK(scanLog(log, &oldest, &newest));
+
+    const sensorLogBlock_t *block = log->getBlock(newest, &buffer);
+    unsigned long long lastTime = block ? recordTime(block, block->header.count - 1) / 1000 : 0;
+
+    sdCard.reads = 0;
+    log = restart();
+    boots++;
+    maxReads = max(maxReads, sdCard.reads);
+
+    // The head is the block after the last one, and it's started with the next record
+    CHECK(log->getTime() > lastTime);
+
+    logReadings(log, 1, 300);
+
+
+    block = log->getBlock(newest + 1, &buffer);
+
+    CHECK(block && (block->header.boot == boots) && (block->header.count == 1));
+    CHECK(block && (recordTime(block, 0) / 1000 > lastTime));
+  }
+
+  flush(log);
+
+  // The first block, the search, the last block and the index
+  printf("restart reads %lu\n", maxReads);
+  CHECK(maxReads <= 2 + searchReads(SENSORLOG_FILE_BLOCKS) + SENSORLOG_INDEX_SIZE);
+
+  CHECK(scanLog(log, &oldest, &newest));
+  CHECK(newest >= SENSORLOG_FILE_BLOCKS * 3);
+  CHECK(log->findBlocks(0, log->getTime(), &first, &last, &buffer));
+  CHECK((first == oldest) && (last == newest));
+
+  // Blocks written over are lost
+  CHECK(log->getBlock(oldest - 1, &buffer) == NULL);
+
+  const sensorLogBlock_t *block = log->getBlock(oldest, &buffer);
+  float value = block ? block->records[0].value : 0;
+  unsigned long long time = 0;
+
+  for (uint32_t seq = oldest; seq <= newest; seq++) {
+    block = log->getBlock(seq, &buffer);
+    CHECK(block && (block->header.seq == seq));
+
+    if (!block) {
+      continue;
+    }
+
+    for (uint8_t i = 0; i < block->header.count; i++) {
+      CHECK(block->records[i].value == value);
+      CHECK(recordTime(block, i) > time);
+      value++;
+      time = recordTime(block, i);
+    }
+  }
+
+  CHECK(value == appended);
+}
+
+// Time lookups against a scan of the blocks kept. The records of each
+// second in the range have to be in the blocks found.
+static void testFind() {
+  sensorLogBlock_t buffer;
+  uint32_t first, last, oldest, newest;
+  uint32_t times[SENSORLOG_FILE_BLOCKS * 4];
+  unsigned long maxReads = 0;
+
+  erase();
+
+  SensorLog *log = restart();
+
+  // Readings come slower and faster, so blocks cover different times
+  for (uint8_t pass = 0; pass < 10; pass++) {
+    logReadings(log, SENSORLOG_RECORDS * 8 + 7, (pass % 3 + 1) * 450);
+  }
+
+  flush(log);
+  CHECK(scanLog(log, &oldest, &newest));
+  CHECK(newest - oldest == SENSORLOG_FILE_BLOCKS - 1);
+
+  for (uint32_t seq = oldest; seq <= newest; seq++) {
+    const sensorLogBlock_t *block = log->getBlock(seq, &buffer);
+
+    times[seq - oldest] = block ? block->header.time : 0;
+  }
+
+  uint32_t now = log->getTime();
+
+  for (uint32_t from = 0; from <= now + 2; from += 7) {
+    for (uint32_t to = from; to <= now + 2; to += 23) {
+      // The last block starting before the range, or the oldest one
+      uint32_t expectFirst = oldest;
+      uint32_t expectLast;
+
+      for (uint32_t seq = oldest; seq <= newest; seq++) {
+        if ((from > 0) && (times[seq - oldest] <= from - 1)) {
+          expectFirst = seq;
+        }
+      }
+
+      expectLast = expectFirst;
+
+      for (uint32_t seq = expectFirst; seq <= newest; seq++) {
+        if (times[seq - oldest] <= to) {
+          expectLast = seq;
+        }
+      }
+
+      sdCard.reads = 0;
+      boolean found = log->findBlocks(from, to, &first, &last, &buffer);
+      maxReads = max(maxReads, sdCard.reads);
+
+      CHECK(found == (times[expectLast - oldest] <= to));
+      CHECK((first == expectFirst) && (last == expectLast));
+
+      if (!found) {
+        continue;
+      }
+
+      // No record of the range is left out
+      boolean covered = true;
+
+      for (uint32_t seq = oldest; seq <= newest; seq++) {
+        const sensorLogBlock_t *block = log->getBlock(seq, &buffer);
+
+        for (uint8_t i = 0; block && (i < block->header.count); i++) {
+          unsigned long long time = recordTime(block, i) / 1000;
+
+          if ((time >= from) && (time <= to) && ((seq < first) || (seq > last))) {
+            covered = false;
+          }
+        }
+      }
+
+      CHECK(covered);
+    }
+  }
+
+  // Two searches between index entries, and the last block time
+  printf("find reads %lu\n", maxReads);
+  CHECK(maxReads <= 2 * searchReads(IndexStep) + 1);
+}
+
+// Readings which come while the staging blocks wait for the card are dropped.
+// A failed write keeps the blocks for the next try.
+static void testDrops() {
+  sensorLogBlock_t buffer;
+  uint32_t first, last;
+
+  erase();
+
+  SensorLog *log = restart();
+
+  wakes = 0;
+
+  for (unsigned long i = 0; i < SENSORLOG_RECORDS * SENSORLOG_BUFFER_BLOCKS; i++) {
+    simMillis += 10;
+    CHECK(log->append(1, SENSORLOG_HUMIDITY, appended++));
+  }
+
+  CHECK(wakes == SENSORLOG_BUFFER_BLOCKS);
+  CHECK(!log->append(1, SENSORLOG_HUMIDITY, appended));
+  CHECK(log->stats.drops == 1);
+
+  // Both blocks are still in RAM
+  const sensorLogBlock_t *block = log->getBlock(SENSORLOG_BUFFER_BLOCKS - 1, &buffer);
+
+  CHECK(block && (block != &buffer) && (block->header.count == SENSORLOG_RECORDS));
+
+  sdCard.failWrites = true;
+  CHECK(log->run() == 1000);
+  CHECK(log->stats.errors == 1);
+  CHECK(!log->append(1, SENSORLOG_HUMIDITY, appended));
+
+  sdCard.failWrites = false;
+  log->run();
+
+  // All the filled blocks go in one write
+  CHECK(sdCard.writes == 1);
+  CHECK(log->stats.blocks == SENSORLOG_BUFFER_BLOCKS);
+  CHECK(log->append(1, SENSORLOG_HUMIDITY, appended++));
+  flush(log);
+
+  log = restart();
+
+  CHECK(log->findBlocks(0, log->getTime(), &first, &last, &buffer));
+  CHECK((first == 0) && (last == SENSORLOG_BUFFER_BLOCKS));
+
+  block = log->getBlock(last, &buffer);
+  CHECK(block && (block->header.count == 1) && (block->records[0].value == appended - 1));
+}
+
+int main() {
+  printf("staging blocks %u\n", SENSORLOG_BUFFER_BLOCKS);
+
+  testCreate(true);
+  testCreate(false);
+  testStartOver();
+  testRecover();
+  testFind();
+  testDrops();
+
+  return checkResult();
+}
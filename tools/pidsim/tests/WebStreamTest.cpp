@@ -0,0 +1,187 @@
+/*
+  WebStreamTest.cpp - Prints the GET /modules response of two floor
+  heaters through WebStream and through the old unbuffered stream, which
+  sent every character on its own. The bytes have to be the same and the
+  buffered stream has to send them in blocks. Reading a request body
+  through the input buffer is checked too. Built once per output buffer
+  size, --bench prints the socket writes and a model of the SPI time.
+*/
+
+#include <string>
+#include "Check.h"
+#include "JSONWriter.h"
+#include "JSONReader.h"
+#include "WebStream.h"
+
+// The W5200 takes a 4 byte header per register access and data block.
+// A send() of the Ethernet library reads the free size twice (4 register
+// reads), reads and writes the write pointer (4), writes the data, writes
+// and checks the SEND command (2), then reads the status and reads and
+// clears the interrupt flag (3). That's 13 x 5 + 4 SPI bytes besides the data.
+static const unsigned SendOverhead = 13 * 5 + 4;
+
+// A byte takes 1 us on the 8 MHz SPI clock, about as long again is spent
+// in the library loop around SPDR (us)
+static const double SPIByteTime = 2.0;
+
+// WebStream before the output buffer
+class UnbufferedStream : public Print
+{
+  public:
+    UnbufferedStream(WebServer *server) : _server(server) {}
+
+    size_t write(uint8_t ch) { return _server->write(ch); }
+
+  private:
+    WebServer *_server;
+};
+
+// Same fields and values FloorHeater::printJSONSettings() prints
+static void printFloorHeater(JSONWriter *writer, uint8_t id) {
+  writer->beginObject();
+  writer->addNumber(F("id"), id);
+  writer->addString(F("moduleType"), "FloorHeater");
+  writer->addNumber(F("moduleState"), 1);
+  writer->addNumber(F("zoneId"), id);
+  writer->addNumber(F("driveMode"), 2);
+  writer->addNumber(F("deviceState"), 0);
+  writer->addFloat(F("setpoint"), 25.5);
+  writer->addFloat(F("t"), 23.1875);
+  writer->addFloat(F("tMin"), 18);
+  writer->addFloat(F("tMax"), 29);
+  writer->addString(F("lastTuning"), "1792224000");
+  writer->addNumber(F("tuningTimedOut"), 0);
+
+  writer->beginArray(F("schedule"));
+
+  for (uint8_t i = 0; i < 7; i++) {
+    writer->beginArray();
+
+    for (uint8_t j = 0; j < 3; j++) {
+      writer->beginObject();
+      writer->addNumber(F("start"), 600 + j * 480);
+      writer->addNumber(F("end"), 900 + j * 480);
+      writer->addNumber(F("t"), 22 + j);
+      writer->endObject();
+    }
+
+    writer->endArray();
+  }
+
+  writer->endArray();
+  writer->endObject();
+}
+
+static void printModules(Print *out) {
+  JSONWriter writer(out);
+
+  writer.beginArray();
+  printFloorHeater(&writer, 1);
+  printFloorHeater(&writer, 2);
+  writer.endArray();
+}
+
+static double modelTime(WebServer *server) {
+  return (server->writes * SendOverhead + server->length) * SPIByteTime / 1000;
+}
+
+static void testOutput(boolean bench) {
+  WebServer before;
+  WebServer after;
+
+  UnbufferedStream unbuffered(&before);
+  printModules(&unbuffered);
+
+  {
+    // The stream sends the rest when it goes out of scope
+    WebStream webStream(&after);
+    printModules(&webStream);
+  }
+
+  CHECK(before.length > 1000);
+  CHECK(before.writes == before.length);
+  CHECK(after.length == before.length);
+  CHECK(memcmp(after.output, before.output, before.length) == 0);
+
+  // Numbers and strings are written as blocks of up to 11 bytes,
+  // so a flushed buffer is at least half full
+  CHECK(after.writes <= 2 * after.length / WEBSTREAM_OUTPUT_BUFFER_SIZE + 1);
+
+  if (bench) {
+    printf("buffer %u\t%u bytes\twrites %lu -> %lu\tSPI model %.1f -> %.1f ms\n", WEBSTREAM_OUTPUT_BUFFER_SIZE,
+           (unsigned) after.length, before.writes, after.writes, modelTime(&before), modelTime(&after));
+  }
+}
+
+// Blocks bigger than the buffer go straight out, after what's buffered
+static void testBlocks() {
+  WebServer server;
+  std::string block(WEBSTREAM_OUTPUT_BUFFER_SIZE + 5, 'x');
+
+  {
+    WebStream webStream(&server);
+    webStream.print("ab");
+    webStream.write((const uint8_t *) block.data(), block.size());
+    webStream.print('c');
+    webStream.flush();
+    CHECK(server.writes == 3);
+    webStream.flush();
+    CHECK(server.writes == 3);
+  }
+
+  CHECK(server.writes == 3);
+  CHECK(server.length == block.size() + 3);
+  CHECK(std::string(server.output, server.length) == "ab" + block + "c");
+}
+
+struct settings_t
+{
+  int8_t moduleState;
+  float setpoint;
+  char moduleType[12];
+};
+
+static const JSONField settingsFields[] PROGMEM = {
+  JSON_FIELD("moduleState", JSONTypeInt, settings_t, moduleState),
+  JSON_FIELD("setpoint", JSONTypeFloat, settings_t, setpoint),
+  JSON_FIELD("moduleType", JSONTypeString, settings_t, moduleType)
+};
+
+// A PUT body longer than the input buffer, read through it
+static void testInput() {
+  WebServer server;
+  settings_t settings;
+  std::string body = "{ \"moduleState\": 0, \"comment\": \"" + std::string(100, '-') +
+                     "\", \"setpoint\": 21.5, \"moduleType\": \"FloorHeater\" }";
+
+  memset(&settings, 0, sizeof(settings));
+  server.setBody(body.c_str());
+
+  WebStream webStream(&server);
+  JSONReader reader(&webStream);
+
+  CHECK(webStream.available() == (int) body.size());
+  CHECK(webStream.peek() == '{');
+  CHECK(reader.beginObject());
+  CHECK(reader.readFields(settingsFields, 3, &settings));
+  CHECK(settings.moduleState == 0);
+  CHECK_NEAR(settings.setpoint, 21.5, 0.001);
+  CHECK(strcmp(settings.moduleType, "FloorHeater") == 0);
+  CHECK(webStream.available() == 0);
+  CHECK(webStream.read() == -1);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && !strcmp(argv[1], "--bench")) {
+    testOutput(true);
+    return 0;
+  }
+
+  printf("buffer %u\n", WEBSTREAM_OUTPUT_BUFFER_SIZE);
+
+  testOutput(false);
+  testBlocks();
+  testInput();
+
+  return checkResult();
+}